@@ -0,0 +1,486 @@
+//
+//  Bench_Couch.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchBenchmarkCase.h"
+#import "CouchStandIn.h"
+#import "CouchInternal.h"
+#import "CouchChangeTracker.h"
+#import <malloc/malloc.h>
+
+
+static const NSUInteger kNumDocs = 1000;
+static const NSUInteger kBatchSize = 100;
+static const NSUInteger kNumQueries = 50;
+
+
+@interface BenchModel : CouchModel
+@property (copy) NSString* name;
+@property int index;
+@property (retain) NSArray* tags;
+@end
+
+@implementation BenchModel
+@dynamic name, index, tags;
+@end
+
+
+// Remembers the IDs of the documents a change tracker reports.
+@interface BenchChangeClient : NSObject <CouchChangeTrackerClient>
+@property (readonly) NSMutableSet* docIDs;
+@end
+
+@implementation BenchChangeClient
+@synthesize docIDs=_docIDs;
+- (id) init {
+    self = [super init];
+    if (self)
+        _docIDs = [[NSMutableSet alloc] init];
+    return self;
+}
+- (void) dealloc {
+    [_docIDs release];
+    [super dealloc];
+}
+- (void) changeTrackerReceivedChange: (NSDictionary*)change {
+    [_docIDs addObject: [change objectForKey: @"id"]];
+}
+@end
+
+
+@interface Bench_Couch : CouchBenchmarkCase
+@end
+
+
+@implementation Bench_Couch
+
+
+static NSDictionary* docProperties(NSUInteger i) {
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSString stringWithFormat: @"Document number %lu", (unsigned long)i], @"name",
+            [NSNumber numberWithUnsignedLong: i], @"index",
+            [NSNumber numberWithBool: (i % 2 == 0)], @"even",
+            [NSArray arrayWithObjects: @"bench", @"mark", nil], @"tags",
+            nil];
+}
+
+
+// Creates kNumDocs documents with _bulk_docs; returns their IDs.
+- (NSArray*) createDocuments {
+    NSMutableArray* docIDs = [NSMutableArray arrayWithCapacity: kNumDocs];
+    for (NSUInteger start = 0; start < kNumDocs; start += kBatchSize) {
+        NSMutableArray* batch = [NSMutableArray arrayWithCapacity: kBatchSize];
+        for (NSUInteger i = start; i < start + kBatchSize; i++)
+            [batch addObject: docProperties(i)];
+        RESTOperation* op = AssertWait([_db putChanges: batch]);
+        for (CouchDocument* doc in op.resultObject)
+            [docIDs addObject: doc.documentID];
+    }
+    return docIDs;
+}
+
+
+- (void) test01_CreateDocuments {
+    [self measure: @"doc.create" count: kNumDocs block: ^(NSUInteger i) {
+        CouchDocument* doc = [_db untitledDocument];
+        AssertWait([doc putProperties: docProperties(i)]);
+    }];
+}
+
+
+- (void) test02_ReadDocuments {
+    NSArray* docIDs = [self createDocuments];
+    [_db clearDocumentCache];
+    [self measure: @"doc.read" count: docIDs.count block: ^(NSUInteger i) {
+        CouchDocument* doc = [_db documentWithID: [docIDs objectAtIndex: i]];
+        STAssertNotNil(doc.properties, @"Couldn't read doc %@", doc);
+    }];
+}
+
+
+- (void) test03_UpdateDocuments {
+    NSArray* docIDs = [self createDocuments];
+    [self measure: @"doc.update" count: docIDs.count block: ^(NSUInteger i) {
+        CouchDocument* doc = [_db documentWithID: [docIDs objectAtIndex: i]];
+        NSMutableDictionary* props = [[doc.properties mutableCopy] autorelease];
+        [props setObject: @"updated" forKey: @"status"];
+        AssertWait([doc putProperties: props]);
+    }];
+}
+
+
+- (void) test04_DeleteDocuments {
+    NSArray* docIDs = [self createDocuments];
+    [self measure: @"doc.delete" count: docIDs.count block: ^(NSUInteger i) {
+        CouchDocument* doc = [_db documentWithID: [docIDs objectAtIndex: i]];
+        AssertWait([doc DELETE]);
+    }];
+}
+
+
+- (void) test05_BulkSave {
+    NSUInteger batches = kNumDocs / kBatchSize;
+    [self measure: @"bulk.save" count: batches block: ^(NSUInteger b) {
+        NSMutableArray* batch = [NSMutableArray arrayWithCapacity: kBatchSize];
+        for (NSUInteger i = 0; i < kBatchSize; i++)
+            [batch addObject: docProperties(b * kBatchSize + i)];
+        AssertWait([_db putChanges: batch]);
+    }];
+}
+
+
+- (void) test06_AllDocsQuery {
+    [self createDocuments];
+    __block NSUInteger rowCount = 0;
+    [self measure: @"query.all_docs" count: kNumQueries block: ^(NSUInteger i) {
+        [_db clearDocumentCache];
+        CouchQuery* query = [_db getAllDocuments];
+        query.prefetch = YES;
+        for (CouchQueryRow* row in query.rows) {
+            if (row.document.properties)
+                ++rowCount;
+        }
+    }];
+    STAssertEquals(rowCount, kNumDocs * kNumQueries, nil);
+}
+
+
+- (void) test07_ViewQuery {
+    [_standIn defineViewNamed: @"bench/byIndex" inDatabase: @"benchdb"
+                          map: ^(NSDictionary* doc, CouchEmitBlock emit) {
+                              if ([[doc objectForKey: @"even"] boolValue])
+                                  emit([doc objectForKey: @"index"], [doc objectForKey: @"name"]);
+                          }
+                       reduce: nil];
+    [self createDocuments];
+    CouchDesignDocument* design = [_db designDocumentWithName: @"bench"];
+    __block NSUInteger rowCount = 0;
+    [self measure: @"query.view" count: kNumQueries block: ^(NSUInteger i) {
+        CouchQuery* query = [design queryViewNamed: @"byIndex"];
+        query.startKey = [NSNumber numberWithInt: 100];
+        query.limit = 250;
+        for (CouchQueryRow* row in query.rows) {
+            if (row.value)
+                ++rowCount;
+        }
+    }];
+    STAssertEquals(rowCount, (NSUInteger)250 * kNumQueries, nil);
+}
+
+
+- (void) test08_ChangeFeed {
+    // A second server object with its own document cache plays the role of another client:
+    CouchServer* otherServer = [[CouchServer alloc] initWithURL: _standIn.serverURL];
+    CouchDatabase* otherDB = [otherServer databaseNamed: @"benchdb"];
+    __block NSUInteger changeCount = 0;
+    [otherDB onChange: ^(CouchDocument* doc, BOOL externalChange) {
+        ++changeCount;
+    }];
+    otherDB.tracksChanges = YES;
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    [self createDocuments];
+    BOOL done = [self waitFor: ^BOOL{ return changeCount >= kNumDocs; } timeout: 60.0];
+    NSTimeInterval elapsed = CFAbsoluteTimeGetCurrent() - start;
+    STAssertTrue(done, @"Only received %lu of %lu changes", (unsigned long)changeCount,
+                 (unsigned long)kNumDocs);
+    [self reportBenchmark: @"changes.ingest" ops: changeCount seconds: elapsed latency: nil];
+
+    otherDB.tracksChanges = NO;
+    [otherServer close];
+    [otherServer release];
+}
+
+
+- (void) test09_ModelSave {
+    NSMutableArray* models = [NSMutableArray arrayWithCapacity: kNumDocs];
+    for (NSUInteger i = 0; i < kNumDocs; i++) {
+        BenchModel* model = [[BenchModel alloc] initWithNewDocumentInDatabase: _db];
+        model.name = [NSString stringWithFormat: @"Model number %lu", (unsigned long)i];
+        model.index = (int)i;
+        model.tags = [NSArray arrayWithObjects: @"bench", @"mark", nil];
+        [models addObject: model];
+        [model release];
+    }
+    NSUInteger batches = kNumDocs / kBatchSize;
+    [self measure: @"model.save_batch" count: batches block: ^(NSUInteger b) {
+        NSArray* batch = [models subarrayWithRange: NSMakeRange(b * kBatchSize, kBatchSize)];
+        AssertWait([CouchModel saveModels: batch]);
+    }];
+
+    [self measure: @"model.save" count: kNumDocs block: ^(NSUInteger i) {
+        BenchModel* model = [models objectAtIndex: i];
+        model.name = @"renamed";
+        AssertWait([model save]);
+    }];
+}
+
+
+- (void) test10_Attachments {
+    NSMutableData* content = [NSMutableData dataWithLength: 64 * 1024];
+    memset(content.mutableBytes, 'x', content.length);
+    NSArray* docIDs = [self createDocuments];
+    NSUInteger count = 200;
+    [self measure: @"attachment.put" count: count block: ^(NSUInteger i) {
+        CouchDocument* doc = [_db documentWithID: [docIDs objectAtIndex: i]];
+        CouchAttachment* att = [doc.currentRevision createAttachmentWithName: @"blob"
+                                                                        type: @"application/octet-stream"];
+        AssertWait([att PUT: content]);
+    }];
+    [self measure: @"attachment.get" count: count block: ^(NSUInteger i) {
+        CouchDocument* doc = [_db documentWithID: [docIDs objectAtIndex: i]];
+        [doc refresh];
+        CouchAttachment* att = [doc.currentRevision attachmentNamed: @"blob"];
+        STAssertEquals(att.body.length, content.length, nil);
+    }];
+}
+
+
+// Same document operations as tests 01-03, over the URL protocol and then with the stand-in
+// acting as an in-process RESTBackend, which skips NSURLConnection and JSON altogether.
+- (void) test11_BackendVersusHTTP {
+    for (int pass = 0; pass < 2; pass++) {
+        NSString* prefix = pass ? @"backend" : @"http";
+        _server.backend = pass ? _standIn : nil;
+        NSMutableArray* docs = [NSMutableArray arrayWithCapacity: kNumDocs];
+        [self measure: [prefix stringByAppendingString: @".doc.create"] count: kNumDocs
+                block: ^(NSUInteger i) {
+            CouchDocument* doc = [_db untitledDocument];
+            AssertWait([doc putProperties: docProperties(i)]);
+            [docs addObject: doc.documentID];
+        }];
+        [_db clearDocumentCache];
+        [self measure: [prefix stringByAppendingString: @".doc.read"] count: kNumDocs
+                block: ^(NSUInteger i) {
+            CouchDocument* doc = [_db documentWithID: [docs objectAtIndex: i]];
+            STAssertNotNil(doc.properties, @"Couldn't read doc %@", doc);
+        }];
+    }
+    _server.backend = nil;
+}
+
+
+// Number of heap blocks currently allocated, in all malloc zones.
+static size_t heapBlocksInUse(void) {
+    malloc_statistics_t stats;
+    malloc_zone_statistics(NULL, &stats);
+    return stats.blocks_in_use;
+}
+
+
+// Encodes a _bulk_docs body the way -putChanges: used to (an overlay per document with _id
+// added, an enclosing dictionary, then NSJSONSerialization) and with the streaming
+// RESTJSONWriter it uses now. Allocations are counted as the heap blocks still live at the end
+// of each iteration, i.e. before its autorelease pool drains.
+- (void) test12_JSONEncoding {
+    NSMutableArray* docs = [NSMutableArray arrayWithCapacity: kBatchSize];
+    for (NSUInteger i = 0; i < kBatchSize; i++)
+        [docs addObject: docProperties(i)];
+    NSUInteger count = kNumDocs;
+    __block long blocks = 0;
+    __block NSUInteger bytes = 0;
+
+    [self measure: @"json.bulk_docs.nsjson" count: count block: ^(NSUInteger n) {
+        size_t before = heapBlocksInUse();
+        NSMutableArray* entries = [NSMutableArray arrayWithCapacity: kBatchSize];
+        NSUInteger i = 0;
+        for (NSDictionary* doc in docs) {
+            NSMutableDictionary* contents = [CouchPropertyOverlay overlayWithBase: doc];
+            [contents setObject: [NSString stringWithFormat: @"doc-%lu", (unsigned long)i++]
+                         forKey: @"_id"];
+            [entries addObject: contents];
+        }
+        NSDictionary* body = [NSDictionary dictionaryWithObject: entries forKey: @"docs"];
+        NSData* json = [NSJSONSerialization dataWithJSONObject: body options: 0 error: NULL];
+        bytes += json.length;
+        blocks += (long)heapBlocksInUse() - (long)before;
+    }];
+    [self reportMetric: @"json.bulk_docs.nsjson.allocs" value: (double)blocks / count
+                 units: @"blocks/op"];
+    NSUInteger nsjsonBytes = bytes;
+
+    blocks = bytes = 0;
+    NSUInteger buffersBefore = [RESTJSONWriter bufferAllocationCount];
+    NSSet* skip = [NSSet setWithObject: @"_id"];
+    [self measure: @"json.bulk_docs.writer" count: count block: ^(NSUInteger n) {
+        size_t before = heapBlocksInUse();
+        RESTJSONWriter* writer = [[RESTJSONWriter alloc] init];
+        [writer beginDictionary];
+        [writer writeKey: @"docs"];
+        [writer beginArray];
+        NSUInteger i = 0;
+        for (NSDictionary* doc in docs) {
+            [writer beginDictionary];
+            [writer writeKey: @"_id"
+                       value: [NSString stringWithFormat: @"doc-%lu", (unsigned long)i++]];
+            [writer writeContentsOfDictionary: doc skippingKeys: skip];
+            [writer endDictionary];
+        }
+        [writer endArray];
+        [writer endDictionary];
+        NSData* json = [writer data];
+        [writer release];
+        bytes += json.length;
+        blocks += (long)heapBlocksInUse() - (long)before;
+    }];
+    [self reportMetric: @"json.bulk_docs.writer.allocs" value: (double)blocks / count
+                 units: @"blocks/op"];
+    [self reportMetric: @"json.bulk_docs.writer.buffers"
+                 value: [RESTJSONWriter bufferAllocationCount] - buffersBefore
+                 units: @"buffers"];
+    STAssertEquals(bytes, nsjsonBytes, @"Encoders produced different amounts of JSON");
+}
+
+
+// Builds NSURLRequests without sending them: the document URL alone, a plain document GET, and
+// a view-style GET with several query parameters. This is per-request overhead that every
+// operation pays before it reaches the network.
+- (void) test13_RequestConstruction {
+    CouchDocument* doc = [_db documentWithID: @"request-construction"];
+    NSDictionary* params = [NSDictionary dictionaryWithObjectsAndKeys:
+                            @"true", @"?include_docs",
+                            @"100", @"?limit",
+                            @"\"doc-0001\"", @"?startkey",
+                            @"\"doc-0100\"", @"?endkey",
+                            nil];
+    NSUInteger count = 10 * kNumDocs;
+    __block NSUInteger total = 0;
+    [self measure: @"resource.url" count: count block: ^(NSUInteger i) {
+        total += doc.URL.hash & 1;
+    }];
+    [self measure: @"request.build.doc" count: count block: ^(NSUInteger i) {
+        total += [doc requestWithMethod: @"GET" parameters: nil].URL.hash & 1;
+    }];
+    [self measure: @"request.build.query" count: count block: ^(NSUInteger i) {
+        total += [_db requestWithMethod: @"GET" parameters: params].URL.hash & 1;
+    }];
+    STAssertTrue(total <= 3 * count, nil);
+}
+
+
+// Document reads while bulk uploads are in flight: first with no per-host limit, so the reads
+// compete with the uploads, then with the default RESTScheduler, which holds most of the uploads
+// back so that each read gets a slot as soon as it's made.
+- (void) test14_InteractiveUnderLoad {
+    NSArray* docIDs = [self createDocuments];
+    NSUInteger numUploads = 2 * kNumDocs / kBatchSize;
+    for (int pass = 0; pass < 2; pass++) {
+        RESTScheduler* scheduler = [[[RESTScheduler alloc] init] autorelease];
+        if (pass == 0)
+            scheduler.maxInFlightPerHost = scheduler.maxBackgroundInFlightPerHost = 0;
+        _server.scheduler = scheduler;
+
+        NSMutableSet* uploads = [NSMutableSet setWithCapacity: numUploads];
+        for (NSUInteger b = 0; b < numUploads; b++) {
+            NSMutableArray* batch = [NSMutableArray arrayWithCapacity: kBatchSize];
+            for (NSUInteger i = 0; i < kBatchSize; i++)
+                [batch addObject: docProperties(b * kBatchSize + i)];
+            [uploads addObject: [[_db putChanges: batch] start]];
+        }
+        NSString* prefix = pass ? @"scheduled" : @"unscheduled";
+        [self measure: [prefix stringByAppendingString: @".doc.read.under_load"] count: kNumQueries
+                block: ^(NSUInteger i) {
+            [_db clearDocumentCache];
+            CouchDocument* doc = [_db documentWithID: [docIDs objectAtIndex: i]];
+            STAssertNotNil(doc.properties, @"Couldn't read doc %@", doc);
+        }];
+        STAssertTrue([RESTOperation wait: uploads], @"Uploads failed");
+        [self reportMetric: [prefix stringByAppendingString: @".background.max_queued"]
+                     value: [scheduler maxQueuedCountForPriority: kRESTPriorityBackground]
+                     units: @"ops"];
+        [self reportMetric: [prefix stringByAppendingString: @".interactive.wait_p99"]
+                     value: [[scheduler waitTimeForPriority: kRESTPriorityInteractive]
+                                valueAtPercentile: 99.0] * 1000.0
+                     units: @"ms"];
+    }
+    _server.scheduler = nil;
+}
+
+
+// Document saves, and how many times each one's response was parsed as JSON. The second part
+// replays the saves' responses through the four lookups of the completion chain (CouchDocument's
+// hook and onCompletion, CouchRevision's, and the caller's), first with a fresh RESTBody per
+// lookup as -responseBody used to return, then with the operation's single cached body.
+- (void) test15_DocumentSave {
+    NSMutableArray* responses = [NSMutableArray arrayWithCapacity: kNumDocs];
+    __block unsigned parses = 0;
+    [self measure: @"doc.save" count: kNumDocs block: ^(NSUInteger i) {
+        CouchDocument* doc = [_db untitledDocument];
+        RESTOperation* op = AssertWait([doc putProperties: docProperties(i)]);
+        parses += op.timings.parseCount;
+        [responses addObject: op.responseBody];
+    }];
+    [self reportMetric: @"doc.save.parses_per_op" value: parses / (double)kNumDocs units: @"parses"];
+
+    static const int kLookups = 4;
+    __block NSUInteger total = 0;
+    [self measure: @"doc.save.completion.uncached" count: kNumDocs block: ^(NSUInteger i) {
+        RESTBody* response = [responses objectAtIndex: i];
+        for (int n = 0; n < kLookups; n++) {
+            RESTBody* body = [[RESTBody alloc] initWithContent: response.content
+                                                       headers: response.headers
+                                                      resource: nil];
+            total += [body.fromJSON count];
+            [body release];
+        }
+    }];
+    [self measure: @"doc.save.completion.cached" count: kNumDocs block: ^(NSUInteger i) {
+        RESTBody* response = [responses objectAtIndex: i];
+        RESTBody* body = [[RESTBody alloc] initWithContent: response.content
+                                                   headers: response.headers
+                                                  resource: nil];
+        for (int n = 0; n < kLookups; n++)
+            total += [body.fromJSON count];
+        [body release];
+    }];
+    STAssertTrue(total > 0, nil);
+}
+
+
+// For each change-feed mode: time from saving a document until the tracker reports the change,
+// and how many bytes of feed each change costs. (The stand-in isn't reachable over a socket, so
+// continuous mode, which needs the socket tracker, can't be measured.)
+- (void) test16_ChangeFeedModes {
+    static const CouchChangeTrackerMode kModes[2] = {kEventSource, kLongPoll};
+    static NSString* const kModeNames[2] = {@"eventsource", @"longpoll"};
+    for (int m = 0; m < 2; m++) {
+        BenchChangeClient* client = [[[BenchChangeClient alloc] init] autorelease];
+        CouchChangeTracker* tracker = [[CouchChangeTracker alloc]
+                                            initWithDatabaseURL: _db.URL
+                                                           mode: kModes[m]
+                                                   lastSequence: _db.lastSequenceNumber
+                                                         client: client];
+        STAssertTrue([tracker start], nil);
+        NSString* prefix = [@"changes." stringByAppendingString: kModeNames[m]];
+        [self measure: [prefix stringByAppendingString: @".latency"] count: kNumQueries
+                block: ^(NSUInteger i) {
+            CouchDocument* doc = [_db untitledDocument];
+            AssertWait([doc putProperties: docProperties(i)]);
+            NSDate* timeout = [NSDate dateWithTimeIntervalSinceNow: 10.0];
+            while (![client.docIDs containsObject: doc.documentID] && timeout.timeIntervalSinceNow > 0)
+                [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode beforeDate: timeout];
+            STAssertTrue([client.docIDs containsObject: doc.documentID],
+                         @"%@ feed didn't report %@", kModeNames[m], doc);
+        }];
+        STAssertEquals(tracker.mode, kModes[m], @"Tracker fell back from %@ mode", kModeNames[m]);
+        [self reportMetric: [prefix stringByAppendingString: @".bytes_per_change"]
+                     value: tracker.bytesReceived / (double)MAX(tracker.changeCount, 1u)
+                     units: @"bytes"];
+        [tracker stop];
+        [tracker release];
+        [_db clearDocumentCache];
+    }
+}
+
+
+@end
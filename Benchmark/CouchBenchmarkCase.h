@@ -0,0 +1,61 @@
+//
+//  CouchBenchmarkCase.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <SenTestingKit/SenTestingKit.h>
+@class CouchServer, CouchDatabase, CouchStandIn, RESTHistogram;
+
+
+/** Base class of benchmarks. Each test runs against a fresh database on the in-process CouchStandIn server, so results don't depend on the network or on a real CouchDB's disk.
+    Every benchmark's result is appended to a JSON report, written to the path in the environment variable COUCHCOCOA_BENCH_RESULTS (default: $TMPDIR/CouchCocoaBenchmarks.json). If COUCHCOCOA_BENCH_COMMIT is set, its value is recorded in the report too, so results can be compared across commits. */
+@interface CouchBenchmarkCase : SenTestCase
+{
+    CouchStandIn* _standIn;
+    CouchServer* _server;
+    CouchDatabase* _db;
+}
+
+@property (readonly) CouchStandIn* standIn;
+@property (readonly) CouchDatabase* db;
+
+/** Runs the block `count` times, timing each call, and reports the result under the given name. */
+- (void) measure: (NSString*)name
+           count: (NSUInteger)count
+           block: (void (^)(NSUInteger i))block;
+
+/** Reports a benchmark that was timed by the caller.
+    @param name  The benchmark name; should be unique within the report.
+    @param ops  The number of operations performed.
+    @param seconds  The total elapsed time.
+    @param latency  Per-operation latencies, or nil if they weren't measured. */
+- (void) reportBenchmark: (NSString*)name
+                     ops: (NSUInteger)ops
+                 seconds: (NSTimeInterval)seconds
+                 latency: (RESTHistogram*)latency;
+
+/** Reports a single measured value that isn't a rate, such as an allocation count. */
+- (void) reportMetric: (NSString*)name
+                value: (double)value
+                units: (NSString*)units;
+
+/** Runs the current runloop until the block returns YES, or the timeout expires.
+    Returns NO on timeout. */
+- (BOOL) waitFor: (BOOL (^)(void))condition timeout: (NSTimeInterval)timeout;
+
+@end
+
+
+// Waits for a RESTOperation to complete and raises an assertion failure if it got an error.
+#define AssertWait(OP) ({RESTOperation* i_op = (OP);\
+                        STAssertTrue([i_op wait], @"%@ failed: %@", i_op, i_op.error);\
+                        i_op = i_op;})
@@ -0,0 +1,161 @@
+//
+//  CouchBenchmarkCase.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchBenchmarkCase.h"
+#import "CouchStandIn.h"
+#import "CouchInternal.h"
+
+
+static NSMutableArray* sResults;
+
+
+static NSString* reportPath(void) {
+    NSString* path = [[[NSProcessInfo processInfo] environment]
+                                objectForKey: @"COUCHCOCOA_BENCH_RESULTS"];
+    if (!path.length)
+        path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"CouchCocoaBenchmarks.json"];
+    return path;
+}
+
+
+static NSNumber* milliseconds(NSTimeInterval t) {
+    return [NSNumber numberWithDouble: round(t * 1.0e6) / 1.0e3];
+}
+
+
+// Adds a result to the report, and rewrites the report file.
+static void addResult(NSDictionary* result) {
+    // Rewrite the whole report each time, since there's no hook that runs after the last test:
+    if (!sResults)
+        sResults = [[NSMutableArray alloc] init];
+    [sResults addObject: result];
+    NSDictionary* env = [[NSProcessInfo processInfo] environment];
+    NSMutableDictionary* report = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                   [RESTBody JSONObjectWithDate: [NSDate date]], @"date",
+                                   sResults, @"benchmarks",
+                                   nil];
+    NSString* commit = [env objectForKey: @"COUCHCOCOA_BENCH_COMMIT"];
+    if (commit)
+        [report setObject: commit forKey: @"commit"];
+    NSData* json = [[RESTBody prettyStringWithJSONObject: report] dataUsingEncoding: NSUTF8StringEncoding];
+    if (![json writeToFile: reportPath() atomically: YES])
+        NSLog(@"WARNING: Couldn't write benchmark report to %@", reportPath());
+}
+
+
+@implementation CouchBenchmarkCase
+
+
+- (void) setUp {
+    gRESTWarnRaisesException = YES;
+    gRESTLogLevel = kRESTLogNothing;
+    [self raiseAfterFailure];
+
+    _standIn = [[CouchStandIn sharedInstance] retain];
+    [_standIn reset];
+    _server = [[CouchServer alloc] initWithURL: _standIn.serverURL];
+    _server.tracksActiveOperations = YES;
+    _db = [[_server databaseNamed: @"benchdb"] retain];
+    AssertWait([_db create]);
+}
+
+
+- (void) tearDown {
+    _db.tracksChanges = NO;
+    AssertWait([_db DELETE]);
+    [_db release];
+    _db = nil;
+    [_server close];
+    [_server release];
+    _server = nil;
+    [_standIn release];
+    _standIn = nil;
+}
+
+
+@synthesize standIn=_standIn, db=_db;
+
+
+- (void) measure: (NSString*)name
+           count: (NSUInteger)count
+           block: (void (^)(NSUInteger i))block
+{
+    RESTHistogram* latency = [[RESTHistogram alloc] init];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for (NSUInteger i = 0; i < count; i++) {
+        NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+        CFAbsoluteTime opStart = CFAbsoluteTimeGetCurrent();
+        block(i);
+        [latency recordTime: CFAbsoluteTimeGetCurrent() - opStart];
+        [pool drain];
+    }
+    [self reportBenchmark: name ops: count seconds: CFAbsoluteTimeGetCurrent() - start
+                  latency: latency];
+    [latency release];
+}
+
+
+- (void) reportBenchmark: (NSString*)name
+                     ops: (NSUInteger)ops
+                 seconds: (NSTimeInterval)seconds
+                 latency: (RESTHistogram*)latency
+{
+    NSMutableDictionary* result = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                   name, @"name",
+                                   [NSNumber numberWithUnsignedLong: ops], @"ops",
+                                   [NSNumber numberWithDouble: seconds], @"seconds",
+                                   [NSNumber numberWithDouble: (seconds > 0 ? ops / seconds : 0)], @"ops_per_sec",
+                                   nil];
+    if (latency.count > 0) {
+        NSDictionary* ms = [NSDictionary dictionaryWithObjectsAndKeys:
+                            milliseconds([latency valueAtPercentile: 50]), @"p50",
+                            milliseconds([latency valueAtPercentile: 90]), @"p90",
+                            milliseconds([latency valueAtPercentile: 99]), @"p99",
+                            milliseconds(latency.max), @"max",
+                            nil];
+        [result setObject: ms forKey: @"latency_ms"];
+    }
+    NSLog(@"BENCHMARK %@: %lu ops in %.3f sec = %.1f ops/sec  %@",
+          name, (unsigned long)ops, seconds, (seconds > 0 ? ops / seconds : 0), latency ?: @"");
+    addResult(result);
+}
+
+
+- (void) reportMetric: (NSString*)name
+                value: (double)value
+                units: (NSString*)units
+{
+    NSDictionary* result = [NSDictionary dictionaryWithObjectsAndKeys:
+                            name, @"name",
+                            [NSNumber numberWithDouble: value], @"value",
+                            units, @"units",
+                            nil];
+    NSLog(@"BENCHMARK %@: %.1f %@", name, value, units);
+    addResult(result);
+}
+
+
+- (BOOL) waitFor: (BOOL (^)(void))condition timeout: (NSTimeInterval)timeout {
+    NSDate* deadline = [NSDate dateWithTimeIntervalSinceNow: timeout];
+    while (!condition()) {
+        if (deadline.timeIntervalSinceNow <= 0)
+            return NO;
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.01]];
+    }
+    return YES;
+}
+
+
+@end
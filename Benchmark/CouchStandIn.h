@@ -0,0 +1,61 @@
+//
+//  CouchStandIn.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+#import "CouchbaseCallbacks.h"
+#import "RESTBackend.h"
+
+
+/** URL scheme handled by CouchStandIn. */
+extern NSString* const kCouchStandInScheme;
+
+
+/** An in-process, in-memory stand-in for a CouchDB server, used for benchmarking the client library without network or server noise.
+    It's implemented as an NSURLProtocol that handles URLs with the "couchstandin" scheme, and implements the subset of the CouchDB API that CouchCocoa uses: databases, documents, _bulk_docs, _all_docs, views, _changes (normal, longpoll, continuous and eventsource) and attachments, both inline and standalone.
+    Because the scheme isn't "http", change tracking always goes through CouchConnectionChangeTracker, as an EventSource feed (or longpoll, if asked for); the socket tracker's continuous mode can't be used. Streaming feeds end after each batch of changes, and the tracker reconnects.
+    JavaScript views aren't supported; define views natively with -defineViewNamed:inDatabase:map:reduce: instead.
+    It's also a RESTBackend: set it as a CouchServer's backend and requests skip the URL loading system and JSON entirely, with documents passed in and out as Foundation objects. (Change tracking still goes through the URL protocol, since CouchChangeTracker talks to NSURLConnection directly.) Comparing the two modes shows what the HTTP path costs.
+    This class is thread-safe. */
+@interface CouchStandIn : NSObject <RESTBackend>
+{
+    @private
+    NSMutableDictionary* _databases;
+    NSMutableDictionary* _views;
+    NSMutableArray* _longPolls;
+    UInt64 _requestCount;
+}
+
+/** The shared instance. The first call registers the URL protocol. */
++ (CouchStandIn*) sharedInstance;
+
+/** The root URL of the stand-in server; pass this to -[CouchServer initWithURL:]. */
+@property (readonly) NSURL* serverURL;
+
+/** The number of HTTP requests handled so far. */
+@property (readonly) UInt64 requestCount;
+
+/** Defines a view that will be used to answer queries of _design/DESIGNDOC/_view/VIEW.
+    @param viewName  The view name, qualified by its design document name, e.g. "bench/byDate".
+    @param dbName  The database name.
+    @param map  The map block. Will be called with the lock held, so it must not call back into the stand-in.
+    @param reduce  The reduce block, or nil. */
+- (void) defineViewNamed: (NSString*)viewName
+              inDatabase: (NSString*)dbName
+                     map: (CouchMapBlock)map
+                  reduce: (CouchReduceBlock)reduce;
+
+/** Deletes all databases and views. */
+- (void) reset;
+
+@end
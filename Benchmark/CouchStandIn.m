@@ -0,0 +1,1145 @@
+//
+//  CouchStandIn.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchStandIn.h"
+#import "RESTBody.h"
+#import "RESTInternal.h"
+#import "RESTBackend.h"
+
+
+NSString* const kCouchStandInScheme = @"couchstandin";
+
+
+// Dictionary literals, as in CollectionUtils: $dict({key, value}, ...). Nil values are skipped.
+typedef struct { id key; id value; } StandInPair;
+
+static NSMutableDictionary* dictOf(const StandInPair* pairs, size_t count) {
+    NSMutableDictionary* dict = [NSMutableDictionary dictionaryWithCapacity: count];
+    for (size_t i = 0; i < count; i++) {
+        if (pairs[i].value)
+            [dict setObject: pairs[i].value forKey: pairs[i].key];
+    }
+    return dict;
+}
+
+#define $mdict(PAIRS...) ({StandInPair _pairs[] = {PAIRS}; \
+                           dictOf(_pairs, sizeof(_pairs)/sizeof(StandInPair));})
+#define $dict(PAIRS...) ((NSDictionary*)$mdict(PAIRS))
+#define $true ((id)kCFBooleanTrue)
+
+static NSString* createUUID(void) {
+    CFUUIDRef uuid = CFUUIDCreate(NULL);
+    NSString* str = [(NSString*)CFUUIDCreateString(NULL, uuid) autorelease];
+    CFRelease(uuid);
+    return [[str stringByReplacingOccurrencesOfString: @"-" withString: @""] lowercaseString];
+}
+
+
+/** A response to be sent by a CouchStandInProtocol. */
+typedef struct {
+    int status;
+    id body;            // JSON object, NSData, or nil
+    NSString* contentType;
+} StandInResponse;
+
+static StandInResponse respond(int status, id body) {
+    StandInResponse r = {status, body, nil};
+    return r;
+}
+
+static StandInResponse respondError(int status, NSString* error, NSString* reason) {
+    return respond(status, $dict({@"error", error}, {@"reason", reason}));
+}
+
+#define kNotFound       respondError(404, @"not_found", @"missing")
+#define kConflict       respondError(409, @"conflict", @"Document update conflict.")
+#define kBadRequest     respondError(400, @"bad_request", @"Invalid request")
+#define kBadMethod      respondError(405, @"method_not_allowed", @"Method not allowed")
+
+
+#pragma mark - COLLATION:
+
+
+// Ranks JSON types in CouchDB view collation order.
+static int typeRank(id obj) {
+    if (!obj || obj == [NSNull null])
+        return 0;
+    if ([obj isKindOfClass: [NSNumber class]]) {
+        if (obj == (id)kCFBooleanTrue || obj == (id)kCFBooleanFalse)
+            return [obj boolValue] ? 2 : 1;
+        return 3;
+    }
+    if ([obj isKindOfClass: [NSString class]])
+        return 4;
+    if ([obj isKindOfClass: [NSArray class]])
+        return 5;
+    return 6;
+}
+
+// Compares two JSON values in (approximately) CouchDB view collation order. Strings are
+// compared case-insensitively first, which is close enough to ICU collation for benchmarking.
+static NSComparisonResult collate(id a, id b) {
+    int ra = typeRank(a), rb = typeRank(b);
+    if (ra != rb)
+        return ra < rb ? NSOrderedAscending : NSOrderedDescending;
+    switch (ra) {
+        case 3:
+            return [a compare: b];
+        case 4: {
+            NSComparisonResult c = [a caseInsensitiveCompare: b];
+            return c ? c : [a compare: b];
+        }
+        case 5: {
+            NSUInteger na = [a count], nb = [b count];
+            for (NSUInteger i = 0; i < MIN(na, nb); i++) {
+                NSComparisonResult c = collate([a objectAtIndex: i], [b objectAtIndex: i]);
+                if (c)
+                    return c;
+            }
+            return na < nb ? NSOrderedAscending : (na > nb ? NSOrderedDescending : NSOrderedSame);
+        }
+        case 6: {
+            NSArray* ka = [[a allKeys] sortedArrayUsingSelector: @selector(compare:)];
+            NSArray* kb = [[b allKeys] sortedArrayUsingSelector: @selector(compare:)];
+            NSComparisonResult c = collate(ka, kb);
+            if (c)
+                return c;
+            for (NSString* key in ka) {
+                c = collate([a objectForKey: key], [b objectForKey: key]);
+                if (c)
+                    return c;
+            }
+            return NSOrderedSame;
+        }
+        default:
+            return NSOrderedSame;
+    }
+}
+
+
+#pragma mark - DATA MODEL:
+
+
+@interface CouchStandInDoc : NSObject
+{
+    @public
+    NSString* _docID;
+    NSString* _revID;
+    unsigned _generation;
+    UInt64 _sequence;
+    BOOL _deleted;
+    NSDictionary* _body;                    // without any "_"-prefixed properties
+    NSMutableDictionary* _attachments;      // name -> {content_type, data, revpos}
+}
+@end
+
+@implementation CouchStandInDoc
+
+- (void)dealloc {
+    [_docID release];
+    [_revID release];
+    [_body release];
+    [_attachments release];
+    [super dealloc];
+}
+
+- (NSDictionary*) JSONWithAttachmentBodies: (BOOL)withBodies {
+    NSMutableDictionary* json = [NSMutableDictionary dictionaryWithDictionary: _body];
+    [json setObject: _docID forKey: @"_id"];
+    [json setObject: _revID forKey: @"_rev"];
+    if (_deleted)
+        [json setObject: (id)kCFBooleanTrue forKey: @"_deleted"];
+    if (_attachments.count) {
+        NSMutableDictionary* atts = [NSMutableDictionary dictionary];
+        for (NSString* name in _attachments) {
+            NSDictionary* att = [_attachments objectForKey: name];
+            NSData* data = [att objectForKey: @"data"];
+            NSMutableDictionary* meta = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                         [att objectForKey: @"content_type"], @"content_type",
+                                         [att objectForKey: @"revpos"], @"revpos",
+                                         [NSNumber numberWithUnsignedLong: data.length], @"length",
+                                         nil];
+            if (withBodies)
+                [meta setObject: [RESTBody base64WithData: data] forKey: @"data"];
+            else
+                [meta setObject: (id)kCFBooleanTrue forKey: @"stub"];
+            [atts setObject: meta forKey: name];
+        }
+        [json setObject: atts forKey: @"_attachments"];
+    }
+    return json;
+}
+
+@end
+
+
+@interface CouchStandInView : NSObject
+{
+    @public
+    CouchMapBlock _map;
+    CouchReduceBlock _reduce;
+}
+@end
+
+@implementation CouchStandInView
+
+- (void)dealloc {
+    [_map release];
+    [_reduce release];
+    [super dealloc];
+}
+
+@end
+
+
+@interface CouchStandInDatabase : NSObject
+{
+    @public
+    NSMutableDictionary* _docs;             // docID -> CouchStandInDoc
+    UInt64 _lastSequence;
+}
+@end
+
+@implementation CouchStandInDatabase
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        _docs = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [_docs release];
+    [super dealloc];
+}
+
+// Docs in sequence order, starting after the given sequence.
+- (NSArray*) docsSince: (UInt64)since {
+    NSMutableArray* docs = [NSMutableArray array];
+    for (CouchStandInDoc* doc in _docs.objectEnumerator) {
+        if (doc->_sequence > since)
+            [docs addObject: doc];
+    }
+    [docs sortUsingComparator: ^NSComparisonResult(CouchStandInDoc* a, CouchStandInDoc* b) {
+        return a->_sequence < b->_sequence ? NSOrderedAscending : NSOrderedDescending;
+    }];
+    return docs;
+}
+
+@end
+
+
+#pragma mark - URL PROTOCOL:
+
+
+/** The NSURLProtocol that routes requests to the shared CouchStandIn. */
+@interface CouchStandInProtocol : NSURLProtocol
+{
+    @private
+    NSThread* _thread;
+    BOOL _stopped;
+}
+@end
+
+
+/** A RESTOperation handed to the CouchStandIn as a RESTBackend, while it's parked as a longpoll. */
+@interface CouchStandInBackendRequest : NSObject
+{
+    @private
+    RESTOperation* _op;
+    NSThread* _thread;
+}
+@end
+
+
+@interface CouchStandIn ()
+- (void) handleRequestFrom: (CouchStandInProtocol*)protocol;
+- (void) cancelRequestFrom: (id)requester;
+- (StandInResponse) respondToRequest: (NSURLRequest*)request
+                                body: (id)body
+                            bodyData: (NSData*)bodyData
+                           requester: (id)requester
+                            deferred: (BOOL*)outDeferred;
+@end
+
+
+@implementation CouchStandInProtocol
+
++ (BOOL) canInitWithRequest: (NSURLRequest*)request {
+    return [request.URL.scheme caseInsensitiveCompare: kCouchStandInScheme] == 0;
+}
+
++ (NSURLRequest*) canonicalRequestForRequest: (NSURLRequest*)request {
+    return request;
+}
+
+- (void)dealloc {
+    [_thread release];
+    [super dealloc];
+}
+
+- (void) startLoading {
+    _thread = [[NSThread currentThread] retain];
+    [[CouchStandIn sharedInstance] handleRequestFrom: self];
+}
+
+- (void) stopLoading {
+    _stopped = YES;
+    [[CouchStandIn sharedInstance] cancelRequestFrom: self];
+}
+
+// Called on the loading thread when a pending longpoll may now be satisfiable.
+- (void) retry {
+    if (!_stopped)
+        [[CouchStandIn sharedInstance] handleRequestFrom: self];
+}
+
+- (void) wakeUp {
+    [self performSelector: @selector(retry) onThread: _thread withObject: nil waitUntilDone: NO];
+}
+
+- (NSData*) requestBody {
+    NSURLRequest* request = self.request;
+    NSData* body = request.HTTPBody;
+    if (!body && request.HTTPBodyStream) {
+        NSInputStream* stream = request.HTTPBodyStream;
+        NSMutableData* data = [NSMutableData data];
+        uint8_t buffer[8192];
+        [stream open];
+        NSInteger n;
+        while ((n = [stream read: buffer maxLength: sizeof(buffer)]) > 0)
+            [data appendBytes: buffer length: n];
+        [stream close];
+        body = data;
+    }
+    return body;
+}
+
+- (void) sendResponse: (StandInResponse)r {
+    if (_stopped)
+        return;
+    NSData* body;
+    NSString* contentType = r.contentType;
+    if (!r.body || [r.body isKindOfClass: [NSData class]]) {
+        body = r.body;
+    } else {
+        body = [RESTBody dataWithJSONObject: r.body];
+        contentType = @"application/json";
+    }
+    NSMutableDictionary* headers = [NSMutableDictionary dictionary];
+    if (contentType)
+        [headers setObject: contentType forKey: @"Content-Type"];
+    [headers setObject: [NSString stringWithFormat: @"%lu", (unsigned long)body.length]
+                forKey: @"Content-Length"];
+    [headers setObject: @"CouchDB/1.2.0 (CouchCocoa stand-in)" forKey: @"Server"];
+    NSHTTPURLResponse* response = [[NSHTTPURLResponse alloc] initWithURL: self.request.URL
+                                                              statusCode: r.status
+                                                             HTTPVersion: @"HTTP/1.1"
+                                                            headerFields: headers];
+    id<NSURLProtocolClient> client = self.client;
+    [client URLProtocol: self didReceiveResponse: response
+     cacheStoragePolicy: NSURLCacheStorageNotAllowed];
+    [response release];
+    if (body.length)
+        [client URLProtocol: self didLoadData: body];
+    [client URLProtocolDidFinishLoading: self];
+}
+
+@end
+
+
+@implementation CouchStandInBackendRequest
+
+- (id) initWithOperation: (RESTOperation*)op {
+    self = [super init];
+    if (self) {
+        _op = [op retain];
+        _thread = [[NSThread currentThread] retain];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [_op release];
+    [_thread release];
+    [super dealloc];
+}
+
+- (RESTOperation*) operation {
+    return _op;
+}
+
+// Called on the operation's thread when a pending longpoll may now be satisfiable.
+- (void) retry {
+    if (!_op.isComplete)
+        [[CouchStandIn sharedInstance] handleOperation: _op];
+}
+
+- (void) wakeUp {
+    [self performSelector: @selector(retry) onThread: _thread withObject: nil waitUntilDone: NO
+                    modes: [RESTOperation backendRunLoopModes]];
+}
+
+@end
+
+
+#pragma mark - SERVER:
+
+
+@implementation CouchStandIn
+
+
++ (CouchStandIn*) sharedInstance {
+    static CouchStandIn* sInstance;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sInstance = [[self alloc] init];
+        [NSURLProtocol registerClass: [CouchStandInProtocol class]];
+    });
+    return sInstance;
+}
+
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        _databases = [[NSMutableDictionary alloc] init];
+        _views = [[NSMutableDictionary alloc] init];
+        _longPolls = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_databases release];
+    [_views release];
+    [_longPolls release];
+    [super dealloc];
+}
+
+
+- (NSURL*) serverURL {
+    return [NSURL URLWithString: [kCouchStandInScheme stringByAppendingString: @"://localhost/"]];
+}
+
+
+- (UInt64) requestCount {
+    @synchronized(self) {
+        return _requestCount;
+    }
+}
+
+
+- (void) defineViewNamed: (NSString*)viewName
+              inDatabase: (NSString*)dbName
+                     map: (CouchMapBlock)map
+                  reduce: (CouchReduceBlock)reduce
+{
+    NSParameterAssert(map);
+    CouchStandInView* view = [[CouchStandInView alloc] init];
+    view->_map = [map copy];
+    view->_reduce = [reduce copy];
+    @synchronized(self) {
+        [_views setObject: view forKey: [NSString stringWithFormat: @"%@/%@", dbName, viewName]];
+    }
+    [view release];
+}
+
+
+- (void) reset {
+    @synchronized(self) {
+        [_databases removeAllObjects];
+        [_views removeAllObjects];
+        for (id poll in _longPolls)
+            [poll wakeUp];
+        [_longPolls removeAllObjects];
+    }
+}
+
+
+#pragma mark - REQUEST PARSING:
+
+
+static NSDictionary* parseQuery(NSString* query) {
+    NSMutableDictionary* params = [NSMutableDictionary dictionary];
+    for (NSString* pair in [query componentsSeparatedByString: @"&"]) {
+        NSRange eq = [pair rangeOfString: @"="];
+        if (eq.length == 0)
+            continue;
+        NSString* key = [pair substringToIndex: eq.location];
+        NSString* value = [[pair substringFromIndex: NSMaxRange(eq)]
+                                stringByReplacingOccurrencesOfString: @"+" withString: @" "];
+        value = [value stringByReplacingPercentEscapesUsingEncoding: NSUTF8StringEncoding];
+        if (value)
+            [params setObject: value forKey: key];
+    }
+    return params;
+}
+
+static BOOL boolParam(NSDictionary* params, NSString* key) {
+    return [[params objectForKey: key] isEqualToString: @"true"];
+}
+
+static id JSONParam(NSDictionary* params, NSString* key) {
+    NSString* value = [params objectForKey: key];
+    return value ? [RESTBody JSONObjectWithString: value] : nil;
+}
+
+// Splits the URL path into unescaped components, keeping "_design/x" and "_local/x" together.
+static NSArray* pathComponents(NSURL* url) {
+    NSString* rawPath = [(NSString*)CFURLCopyPath((CFURLRef)url) autorelease];
+    NSMutableArray* components = [NSMutableArray array];
+    for (NSString* comp in [rawPath componentsSeparatedByString: @"/"]) {
+        if (comp.length == 0)
+            continue;
+        comp = [comp stringByReplacingPercentEscapesUsingEncoding: NSUTF8StringEncoding];
+        NSString* prev = components.lastObject;
+        if (components.count == 2 && ([prev isEqualToString: @"_design"]
+                                      || [prev isEqualToString: @"_local"])) {
+            [components removeLastObject];
+            comp = [NSString stringWithFormat: @"%@/%@", prev, comp];
+        }
+        [components addObject: comp];
+    }
+    return components;
+}
+
+
+// Returns a deep, immutable copy of a JSON-compatible object, so that a request object handed
+// over by a RESTBackend client can be stored without sharing anything mutable with the client.
+static id deepCopy(id obj) {
+    if ([obj isKindOfClass: [NSDictionary class]]) {
+        NSMutableDictionary* copy = [NSMutableDictionary dictionaryWithCapacity: [obj count]];
+        for (id key in obj)
+            [copy setObject: deepCopy([obj objectForKey: key]) forKey: key];
+        return [[copy copy] autorelease];
+    } else if ([obj isKindOfClass: [NSArray class]]) {
+        NSMutableArray* copy = [NSMutableArray arrayWithCapacity: [obj count]];
+        for (id item in obj)
+            [copy addObject: deepCopy(item)];
+        return [[copy copy] autorelease];
+    } else {
+        return [[obj copy] autorelease];
+    }
+}
+
+
+- (StandInResponse) respondToRequest: (NSURLRequest*)request
+                                body: (id)body
+                            bodyData: (NSData*)bodyData
+                           requester: (id)requester
+                            deferred: (BOOL*)outDeferred
+{
+    NSString* method = request.HTTPMethod;
+    NSArray* path = pathComponents(request.URL);
+    NSDictionary* params = parseQuery(request.URL.query);
+    @synchronized(self) {
+        ++_requestCount;
+        if (!body && bodyData.length) {
+            NSString* type = [request valueForHTTPHeaderField: @"Content-Type"];
+            body = ([type hasPrefix: @"application/json"] || !type)
+                        ? [RESTBody JSONObjectWithData: bodyData] : bodyData;
+        }
+        return [self respondTo: method path: path params: params body: body
+                      bodyData: bodyData request: request requester: requester
+                      deferred: outDeferred];
+    }
+}
+
+
+- (void) handleRequestFrom: (CouchStandInProtocol*)protocol {
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    BOOL deferred = NO;
+    StandInResponse r = [self respondToRequest: protocol.request body: nil
+                                      bodyData: [protocol requestBody]
+                                     requester: protocol deferred: &deferred];
+    if (!deferred)
+        [protocol sendResponse: r];
+    [pool drain];
+}
+
+
+- (void) cancelRequestFrom: (id)requester {
+    @synchronized(self) {
+        [_longPolls removeObjectIdenticalTo: requester];
+    }
+}
+
+
+- (void) databaseChanged {
+    for (id poll in _longPolls)
+        [poll wakeUp];
+    [_longPolls removeAllObjects];
+}
+
+
+#pragma mark - BACKEND:
+
+
+- (void) handleOperation: (RESTOperation*)op {
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    CouchStandInBackendRequest* requester = [[[CouchStandInBackendRequest alloc]
+                                                    initWithOperation: op] autorelease];
+    id body = deepCopy(op.requestObject);
+    NSData* bodyData = body ? nil : op.requestBody;
+    BOOL deferred = NO;
+    StandInResponse r = [self respondToRequest: op.request body: body bodyData: bodyData
+                                     requester: requester deferred: &deferred];
+    if (!deferred) {
+        NSString* contentType = r.contentType;
+        id object = nil;
+        NSData* data = nil;
+        if (!r.body || [r.body isKindOfClass: [NSData class]]) {
+            data = r.body;
+        } else {
+            object = r.body;
+            contentType = @"application/json";
+        }
+        NSMutableDictionary* headers = [NSMutableDictionary dictionary];
+        if (contentType)
+            [headers setObject: contentType forKey: @"Content-Type"];
+        [headers setObject: @"CouchDB/1.2.0 (CouchCocoa stand-in)" forKey: @"Server"];
+        [op backendRespondedWithStatus: r.status headers: headers object: object data: data];
+    }
+    [pool drain];
+}
+
+
+- (void) cancelOperation: (RESTOperation*)op {
+    @synchronized(self) {
+        for (id poll in [[_longPolls copy] autorelease]) {
+            if ([poll isKindOfClass: [CouchStandInBackendRequest class]]
+                    && [poll operation] == op)
+                [_longPolls removeObjectIdenticalTo: poll];
+        }
+    }
+}
+
+
+#pragma mark - ROUTING:
+
+
+- (StandInResponse) respondTo: (NSString*)method
+                         path: (NSArray*)path
+                       params: (NSDictionary*)params
+                         body: (id)body
+                     bodyData: (NSData*)bodyData
+                      request: (NSURLRequest*)request
+                    requester: (id)requester
+                     deferred: (BOOL*)outDeferred
+{
+    NSUInteger n = path.count;
+    if (n == 0)
+        return respond(200, $dict({@"couchdb", @"Welcome"}, {@"version", @"1.2.0"}));
+
+    NSString* first = [path objectAtIndex: 0];
+    if ([first hasPrefix: @"_"]) {
+        if ([first isEqualToString: @"_uuids"]) {
+            NSUInteger count = MAX([[params objectForKey: @"count"] intValue], 1);
+            NSMutableArray* uuids = [NSMutableArray arrayWithCapacity: count];
+            for (NSUInteger i = 0; i < count; i++)
+                [uuids addObject: createUUID()];
+            return respond(200, $dict({@"uuids", uuids}));
+        } else if ([first isEqualToString: @"_all_dbs"]) {
+            NSArray* names = [_databases.allKeys sortedArrayUsingSelector: @selector(compare:)];
+            return respond(200, names);
+        } else if ([first isEqualToString: @"_active_tasks"]) {
+            return respond(200, [NSArray array]);
+        }
+        return kNotFound;
+    }
+
+    CouchStandInDatabase* db = [_databases objectForKey: first];
+    if (n == 1) {
+        if ([method isEqualToString: @"PUT"]) {
+            if (db)
+                return respondError(412, @"file_exists", @"The database could not be created, the file already exists.");
+            db = [[CouchStandInDatabase alloc] init];
+            [_databases setObject: db forKey: first];
+            [db release];
+            return respond(201, $dict({@"ok", $true}));
+        }
+        if (!db)
+            return respondError(404, @"not_found", @"no_db_file");
+        if ([method isEqualToString: @"DELETE"]) {
+            [_databases removeObjectForKey: first];
+            [self databaseChanged];
+            return respond(200, $dict({@"ok", $true}));
+        } else if ([method isEqualToString: @"GET"]) {
+            NSUInteger docCount = 0;
+            for (CouchStandInDoc* doc in db->_docs.objectEnumerator)
+                if (!doc->_deleted)
+                    ++docCount;
+            return respond(200, $dict({@"db_name", first},
+                                      {@"doc_count", [NSNumber numberWithUnsignedLong: docCount]},
+                                      {@"update_seq", [NSNumber numberWithUnsignedLongLong: db->_lastSequence]}));
+        } else if ([method isEqualToString: @"POST"]) {
+            NSDictionary* props = $castIf(NSDictionary, body);
+            if (!props)
+                return kBadRequest;
+            NSString* docID = [props objectForKey: @"_id"] ?: createUUID();
+            return [self putDocument: props withID: docID inDatabase: db];
+        }
+        return kBadMethod;
+    }
+    if (!db)
+        return respondError(404, @"not_found", @"no_db_file");
+
+    NSString* second = [path objectAtIndex: 1];
+    if (n == 2) {
+        if ([second isEqualToString: @"_bulk_docs"])
+            return [self bulkDocs: body inDatabase: db];
+        if ([second isEqualToString: @"_all_docs"])
+            return [self allDocsIn: db params: params body: body];
+        if ([second isEqualToString: @"_changes"])
+            return [self changesIn: db params: params requester: requester deferred: outDeferred];
+        if ([second isEqualToString: @"_compact"] || [second isEqualToString: @"_ensure_full_commit"])
+            return respond(202, $dict({@"ok", $true}));
+        if ([second isEqualToString: @"_temp_view"])
+            return respondError(501, @"not_implemented", @"The stand-in can't run JavaScript");
+    }
+    if (n == 4 && [second hasPrefix: @"_design/"] && [[path objectAtIndex: 2] isEqualToString: @"_view"]) {
+        NSString* viewName = [NSString stringWithFormat: @"%@/%@/%@",
+                              first, [second substringFromIndex: 8], [path objectAtIndex: 3]];
+        CouchStandInView* view = [_views objectForKey: viewName];
+        if (!view)
+            return respondError(404, @"not_found", @"missing_named_view");
+        return [self queryView: view inDatabase: db params: params body: body];
+    }
+
+    // Document or attachment:
+    CouchStandInDoc* doc = [db->_docs objectForKey: second];
+    if (n == 2) {
+        if ([method isEqualToString: @"GET"]) {
+            if (!doc)
+                return kNotFound;
+            NSString* rev = [params objectForKey: @"rev"];
+            if (rev && ![rev isEqualToString: doc->_revID])
+                return kNotFound;
+            if (doc->_deleted && !rev)
+                return respondError(404, @"not_found", @"deleted");
+            return respond(200, [doc JSONWithAttachmentBodies: boolParam(params, @"attachments")]);
+        } else if ([method isEqualToString: @"PUT"]) {
+            NSDictionary* props = $castIf(NSDictionary, body);
+            if (!props)
+                return kBadRequest;
+            return [self putDocument: props withID: second inDatabase: db];
+        } else if ([method isEqualToString: @"DELETE"]) {
+            NSString* rev = [params objectForKey: @"rev"];
+            if (!rev)
+                return kConflict;
+            NSDictionary* props = $dict({@"_rev", rev}, {@"_deleted", $true});
+            return [self putDocument: props withID: second inDatabase: db];
+        }
+        return kBadMethod;
+    }
+
+    NSString* attName = [[path subarrayWithRange: NSMakeRange(2, n - 2)]
+                                componentsJoinedByString: @"/"];
+    if ([method isEqualToString: @"GET"]) {
+        NSDictionary* att = (doc && !doc->_deleted) ? [doc->_attachments objectForKey: attName]
+                                                    : nil;
+        if (!att)
+            return kNotFound;
+        StandInResponse r = respond(200, [att objectForKey: @"data"]);
+        r.contentType = [att objectForKey: @"content_type"];
+        return r;
+    } else if ([method isEqualToString: @"PUT"] || [method isEqualToString: @"DELETE"]) {
+        NSString* rev = [params objectForKey: @"rev"];
+        BOOL live = doc && !doc->_deleted;
+        if (live && ![rev isEqualToString: doc->_revID])
+            return kConflict;
+        NSMutableDictionary* props = [NSMutableDictionary dictionary];
+        NSMutableDictionary* atts = [NSMutableDictionary dictionary];
+        if (live) {
+            [props addEntriesFromDictionary: doc->_body];
+            [props setObject: doc->_revID forKey: @"_rev"];
+            for (NSString* name in doc->_attachments)
+                [atts setObject: $dict({@"stub", $true}) forKey: name];
+        }
+        if ([method isEqualToString: @"PUT"]) {
+            NSString* type = [request valueForHTTPHeaderField: @"Content-Type"];
+            [atts setObject: $dict({@"content_type", type ?: @"application/octet-stream"},
+                                   {@"data", bodyData ?: [NSData data]})
+                     forKey: attName];
+        } else {
+            if (![atts objectForKey: attName])
+                return kNotFound;
+            [atts removeObjectForKey: attName];
+        }
+        [props setObject: atts forKey: @"_attachments"];
+        return [self putDocument: props withID: second inDatabase: db];
+    }
+    return kBadMethod;
+}
+
+
+#pragma mark - DOCUMENTS:
+
+
+static NSString* newRevID(unsigned generation) {
+    return [NSString stringWithFormat: @"%u-%08x%08x%08x%08x", generation,
+            arc4random(), arc4random(), arc4random(), arc4random()];
+}
+
+
+// Saves a new revision of a document, checking its _rev against the current one.
+// Attachments in the "_attachments" property can be stubs, or inline with base64 "data"
+// (or raw NSData "data", as used by standalone attachment PUTs.)
+- (StandInResponse) putDocument: (NSDictionary*)props
+                         withID: (NSString*)docID
+                     inDatabase: (CouchStandInDatabase*)db
+{
+    CouchStandInDoc* doc = [db->_docs objectForKey: docID];
+    NSString* rev = $castIf(NSString, [props objectForKey: @"_rev"]);
+    BOOL live = doc && !doc->_deleted;
+    if (live ? ![rev isEqualToString: doc->_revID]
+             : (rev && !(doc && [rev isEqualToString: doc->_revID])))
+        return kConflict;
+    BOOL deleting = [[props objectForKey: @"_deleted"] boolValue];
+    if (deleting && !live)
+        return kNotFound;
+
+    NSMutableDictionary* attachments = nil;
+    NSDictionary* attsJSON = $castIf(NSDictionary, [props objectForKey: @"_attachments"]);
+    unsigned generation = doc ? doc->_generation + 1 : 1;
+    if (attsJSON.count && !deleting) {
+        attachments = [NSMutableDictionary dictionaryWithCapacity: attsJSON.count];
+        for (NSString* name in attsJSON) {
+            NSDictionary* att = $castIf(NSDictionary, [attsJSON objectForKey: name]);
+            if ([[att objectForKey: @"stub"] boolValue]) {
+                NSDictionary* existing = doc ? [doc->_attachments objectForKey: name] : nil;
+                if (!existing)
+                    return respondError(412, @"missing_stub", name);
+                [attachments setObject: existing forKey: name];
+            } else {
+                id data = [att objectForKey: @"data"];
+                if ([data isKindOfClass: [NSString class]])
+                    data = [RESTBody dataWithBase64: data];
+                if (![data isKindOfClass: [NSData class]])
+                    return kBadRequest;
+                NSString* type = [att objectForKey: @"content_type"] ?: @"application/octet-stream";
+                [attachments setObject: $dict({@"content_type", type},
+                                              {@"data", data},
+                                              {@"revpos", [NSNumber numberWithUnsignedInt: generation]})
+                                forKey: name];
+            }
+        }
+    }
+
+    NSMutableDictionary* userProps = [NSMutableDictionary dictionaryWithCapacity: props.count];
+    if (!deleting) {
+        for (NSString* key in props) {
+            if (![key hasPrefix: @"_"])
+                [userProps setObject: [props objectForKey: key] forKey: key];
+        }
+    }
+
+    if (!doc) {
+        doc = [[[CouchStandInDoc alloc] init] autorelease];
+        doc->_docID = [docID copy];
+        [db->_docs setObject: doc forKey: docID];
+    }
+    doc->_generation = generation;
+    [doc->_revID release];
+    doc->_revID = [newRevID(generation) retain];
+    doc->_deleted = deleting;
+    [doc->_body release];
+    doc->_body = [userProps copy];
+    [doc->_attachments release];
+    doc->_attachments = [attachments retain];
+    doc->_sequence = ++db->_lastSequence;
+    [self databaseChanged];
+    return respond(201, $dict({@"ok", $true}, {@"id", docID}, {@"rev", doc->_revID}));
+}
+
+
+- (StandInResponse) bulkDocs: (id)body inDatabase: (CouchStandInDatabase*)db {
+    NSArray* docs = $castIf(NSArray, [$castIf(NSDictionary, body) objectForKey: @"docs"]);
+    if (!docs)
+        return kBadRequest;
+    NSMutableArray* results = [NSMutableArray arrayWithCapacity: docs.count];
+    for (NSDictionary* props in docs) {
+        if (![props isKindOfClass: [NSDictionary class]])
+            return kBadRequest;
+        NSString* docID = [props objectForKey: @"_id"] ?: createUUID();
+        StandInResponse r = [self putDocument: props withID: docID inDatabase: db];
+        if (r.status < 300) {
+            [results addObject: $dict({@"id", docID}, {@"rev", [r.body objectForKey: @"rev"]})];
+        } else {
+            [results addObject: $dict({@"id", docID},
+                                      {@"error", [r.body objectForKey: @"error"]},
+                                      {@"reason", [r.body objectForKey: @"reason"]})];
+        }
+    }
+    return respond(201, results);
+}
+
+
+#pragma mark - QUERIES:
+
+
+// Applies the descending/startkey/endkey/skip/limit parameters to rows sorted by ascending
+// key; the "key" of each row is found with keyOf.
+static NSArray* selectRows(NSArray* rows, NSDictionary* params, id (^keyOf)(NSDictionary* row))
+{
+    BOOL descending = boolParam(params, @"descending");
+    id startKey = JSONParam(params, @"startkey");
+    id endKey = JSONParam(params, @"endkey");
+    id key = JSONParam(params, @"key");
+    BOOL inclusiveEnd = ![[params objectForKey: @"inclusive_end"] isEqualToString: @"false"];
+    if (key)
+        startKey = endKey = key;
+    NSEnumerator* e = descending ? rows.reverseObjectEnumerator : rows.objectEnumerator;
+    NSMutableArray* selected = [NSMutableArray array];
+    for (NSDictionary* row in e) {
+        id rowKey = keyOf(row);
+        if (startKey) {
+            NSComparisonResult c = collate(rowKey, startKey);
+            if (descending ? c > 0 : c < 0)
+                continue;
+        }
+        if (endKey) {
+            NSComparisonResult c = collate(rowKey, endKey);
+            if (descending ? (c < 0 || (c == 0 && !inclusiveEnd))
+                           : (c > 0 || (c == 0 && !inclusiveEnd)))
+                break;
+        }
+        [selected addObject: row];
+    }
+    NSUInteger skip = MIN((NSUInteger)[[params objectForKey: @"skip"] intValue], selected.count);
+    NSUInteger limit = selected.count - skip;
+    if ([params objectForKey: @"limit"])
+        limit = MIN((NSUInteger)[[params objectForKey: @"limit"] intValue], limit);
+    return [selected subarrayWithRange: NSMakeRange(skip, limit)];
+}
+
+
+- (StandInResponse) allDocsIn: (CouchStandInDatabase*)db
+                       params: (NSDictionary*)params
+                         body: (id)body
+{
+    BOOL includeDocs = boolParam(params, @"include_docs");
+    NSArray* keys = $castIf(NSArray, [$castIf(NSDictionary, body) objectForKey: @"keys"]);
+    NSMutableArray* rows = [NSMutableArray array];
+    if (keys) {
+        for (NSString* docID in keys) {
+            CouchStandInDoc* doc = [db->_docs objectForKey: docID];
+            if (!doc) {
+                [rows addObject: $dict({@"key", docID}, {@"error", @"not_found"})];
+                continue;
+            }
+            NSMutableDictionary* value = $mdict({@"rev", doc->_revID});
+            if (doc->_deleted)
+                [value setObject: $true forKey: @"deleted"];
+            id docJSON = (includeDocs && !doc->_deleted) ? [doc JSONWithAttachmentBodies: NO]
+                                                         : nil;
+            [rows addObject: $dict({@"id", docID}, {@"key", docID}, {@"value", value},
+                                   {@"doc", docJSON})];
+        }
+    } else {
+        NSArray* docIDs = [db->_docs.allKeys sortedArrayUsingSelector: @selector(compare:)];
+        for (NSString* docID in docIDs) {
+            CouchStandInDoc* doc = [db->_docs objectForKey: docID];
+            if (doc->_deleted)
+                continue;
+            id docJSON = includeDocs ? [doc JSONWithAttachmentBodies: NO] : nil;
+            [rows addObject: $dict({@"id", docID}, {@"key", docID},
+                                   {@"value", $dict({@"rev", doc->_revID})},
+                                   {@"doc", docJSON})];
+        }
+        NSUInteger total = rows.count;
+        NSArray* selected = selectRows(rows, params, ^id(NSDictionary* row) {
+            return [row objectForKey: @"key"];
+        });
+        return respond(200, $dict({@"total_rows", [NSNumber numberWithUnsignedLong: total]},
+                                  {@"offset", [NSNumber numberWithInt: 0]},
+                                  {@"rows", selected},
+                                  {@"update_seq", [NSNumber numberWithUnsignedLongLong: db->_lastSequence]}));
+    }
+    return respond(200, $dict({@"total_rows", [NSNumber numberWithUnsignedLong: db->_docs.count]},
+                              {@"offset", [NSNumber numberWithInt: 0]},
+                              {@"rows", rows},
+                              {@"update_seq", [NSNumber numberWithUnsignedLongLong: db->_lastSequence]}));
+}
+
+
+- (StandInResponse) queryView: (CouchStandInView*)view
+                   inDatabase: (CouchStandInDatabase*)db
+                       params: (NSDictionary*)params
+                         body: (id)body
+{
+    // Run the map function over every live document:
+    NSMutableArray* rows = [NSMutableArray array];
+    for (CouchStandInDoc* doc in db->_docs.objectEnumerator) {
+        if (doc->_deleted)
+            continue;
+        NSDictionary* docJSON = [doc JSONWithAttachmentBodies: NO];
+        NSString* docID = doc->_docID;
+        view->_map(docJSON, ^(id key, id value) {
+            [rows addObject: $dict({@"id", docID}, {@"key", key ?: [NSNull null]},
+                                   {@"value", value ?: [NSNull null]})];
+        });
+    }
+    [rows sortUsingComparator: ^NSComparisonResult(NSDictionary* a, NSDictionary* b) {
+        NSComparisonResult c = collate([a objectForKey: @"key"], [b objectForKey: @"key"]);
+        return c ? c : [[a objectForKey: @"id"] compare: [b objectForKey: @"id"]];
+    }];
+    NSUInteger total = rows.count;
+
+    NSArray* keys = $castIf(NSArray, [$castIf(NSDictionary, body) objectForKey: @"keys"]);
+    NSArray* selected;
+    if (keys) {
+        NSMutableArray* matches = [NSMutableArray array];
+        for (id key in keys) {
+            for (NSDictionary* row in rows)
+                if (collate([row objectForKey: @"key"], key) == 0)
+                    [matches addObject: row];
+        }
+        selected = matches;
+    } else {
+        selected = selectRows(rows, params, ^id(NSDictionary* row) {
+            return [row objectForKey: @"key"];
+        });
+    }
+
+    BOOL reduce = view->_reduce && ![[params objectForKey: @"reduce"] isEqualToString: @"false"];
+    if (reduce) {
+        NSUInteger groupLevel = [[params objectForKey: @"group_level"] intValue];
+        if (boolParam(params, @"group"))
+            groupLevel = NSUIntegerMax;
+        NSMutableArray* reduced = [NSMutableArray array];
+        NSMutableArray* groupKeys = [NSMutableArray array];
+        NSMutableArray* groupValues = [NSMutableArray array];
+        id groupKey = nil;
+        for (NSDictionary* row in [selected arrayByAddingObject: [NSNull null]]) {
+            id key = nil;
+            if (row != (id)[NSNull null]) {
+                key = [row objectForKey: @"key"];
+                if (groupLevel == 0)
+                    key = [NSNull null];
+                else if (groupLevel != NSUIntegerMax && [key isKindOfClass: [NSArray class]]
+                         && [key count] > groupLevel)
+                    key = [key subarrayWithRange: NSMakeRange(0, groupLevel)];
+            }
+            if (groupKeys.count && (!key || collate(key, groupKey) != 0)) {
+                id value = view->_reduce(groupKeys, groupValues, NO);
+                [reduced addObject: $dict({@"key", groupKey}, {@"value", value ?: [NSNull null]})];
+                [groupKeys removeAllObjects];
+                [groupValues removeAllObjects];
+            }
+            if (!key)
+                break;
+            groupKey = key;
+            [groupKeys addObject: [row objectForKey: @"key"]];
+            [groupValues addObject: [row objectForKey: @"value"]];
+        }
+        selected = reduced;
+    } else if (boolParam(params, @"include_docs")) {
+        NSMutableArray* withDocs = [NSMutableArray arrayWithCapacity: selected.count];
+        for (NSDictionary* row in selected) {
+            CouchStandInDoc* doc = [db->_docs objectForKey: [row objectForKey: @"id"]];
+            NSMutableDictionary* newRow = [[row mutableCopy] autorelease];
+            [newRow setObject: [doc JSONWithAttachmentBodies: NO] forKey: @"doc"];
+            [withDocs addObject: newRow];
+        }
+        selected = withDocs;
+    }
+
+    NSMutableDictionary* result = $mdict({@"rows", selected});
+    if (!reduce) {
+        [result setObject: [NSNumber numberWithUnsignedLong: total] forKey: @"total_rows"];
+        [result setObject: [NSNumber numberWithUnsignedLong: [[params objectForKey: @"skip"] intValue]]
+                   forKey: @"offset"];
+    }
+    if (boolParam(params, @"update_seq"))
+        [result setObject: [NSNumber numberWithUnsignedLongLong: db->_lastSequence]
+                   forKey: @"update_seq"];
+    return respond(200, result);
+}
+
+
+#pragma mark - CHANGES:
+
+
+- (StandInResponse) changesIn: (CouchStandInDatabase*)db
+                       params: (NSDictionary*)params
+                    requester: (id)requester
+                     deferred: (BOOL*)outDeferred
+{
+    UInt64 since = [[params objectForKey: @"since"] longLongValue];
+    NSString* feed = [params objectForKey: @"feed"];
+    BOOL includeDocs = boolParam(params, @"include_docs");
+    NSArray* docs = [db docsSince: since];
+    if ([params objectForKey: @"limit"]) {
+        NSUInteger limit = [[params objectForKey: @"limit"] intValue];
+        if (docs.count > limit)
+            docs = [docs subarrayWithRange: NSMakeRange(0, limit)];
+    }
+
+    if (docs.count == 0 && ([feed isEqualToString: @"longpoll"]
+                                || [feed isEqualToString: @"continuous"]
+                                || [feed isEqualToString: @"eventsource"])) {
+        // Park the request until something changes:
+        [_longPolls addObject: requester];
+        *outDeferred = YES;
+        return respond(0, nil);
+    }
+
+    NSMutableArray* results = [NSMutableArray arrayWithCapacity: docs.count];
+    for (CouchStandInDoc* doc in docs) {
+        NSMutableDictionary* change = $mdict({@"seq", [NSNumber numberWithUnsignedLongLong: doc->_sequence]},
+                                             {@"id", doc->_docID},
+                                             {@"changes", [NSArray arrayWithObject: $dict({@"rev", doc->_revID})]});
+        if (doc->_deleted)
+            [change setObject: $true forKey: @"deleted"];
+        if (includeDocs)
+            [change setObject: [doc JSONWithAttachmentBodies: NO] forKey: @"doc"];
+        [results addObject: change];
+    }
+    UInt64 lastSeq = docs.count ? ((CouchStandInDoc*)docs.lastObject)->_sequence : since;
+
+    if ([feed isEqualToString: @"continuous"]) {
+        // Send the pending changes as lines, then end the feed; the client reconnects.
+        NSMutableData* lines = [NSMutableData data];
+        for (NSDictionary* change in results) {
+            [lines appendData: [RESTBody dataWithJSONObject: change]];
+            [lines appendBytes: "\n" length: 1];
+        }
+        StandInResponse r = respond(200, lines);
+        r.contentType = @"application/json";
+        return r;
+    } else if ([feed isEqualToString: @"eventsource"]) {
+        // Likewise, as text/event-stream events:
+        NSMutableData* events = [NSMutableData data];
+        for (NSDictionary* change in results) {
+            [events appendBytes: "data: " length: 6];
+            [events appendData: [RESTBody dataWithJSONObject: change]];
+            [events appendData: [[NSString stringWithFormat: @"\nid: %@\n\n",
+                                  [change objectForKey: @"seq"]]
+                                        dataUsingEncoding: NSUTF8StringEncoding]];
+        }
+        StandInResponse r = respond(200, events);
+        r.contentType = @"text/event-stream";
+        return r;
+    }
+    return respond(200, $dict({@"results", results},
+                              {@"last_seq", [NSNumber numberWithUnsignedLongLong: lastSeq]}));
+}
+
+
+@end
@@ -14,7 +14,7 @@
 //  and limitations under the License.
 
 #import "CouchResource.h"
-@class CouchDocument, CouchRevision;
+@class CouchDocument, CouchRevision, CouchAttachmentReader;
 
 
 /** A binary attachment to a document.
@@ -40,6 +40,9 @@
 /** The length in bytes of the contents. */
 @property (readonly) UInt64 length;
 
+/** The server's digest of the contents, e.g. "md5-7Dtn1TIwkAsdMZ9dTTHy0w==". May be nil if the metadata didn't come from the server. */
+@property (readonly) NSString* digest;
+
 /** The CouchDB metadata about the attachment, that lives in the document. */
 @property (readonly) NSDictionary* metadata;
 
@@ -57,4 +60,16 @@
 /** Asynchronous setter for the body. (Use inherited -GET to get it.) */
 - (RESTOperation*) PUT: (NSData*)body;
 
+#pragma mark RANGES:
+
+/** Starts a GET of just part of the body, using an HTTP Range request. On success the operation's resultObject is an NSData of the bytes in the range (fewer, if the range extends past the end.)
+    The digest is sent as the If-Range validator. If the attachment has changed on the server since this object's metadata was read (or the server doesn't support ranges) the server sends the whole body instead, with status 200; the result is still the requested bytes, taken from that body. */
+- (RESTOperation*) GETRange: (NSRange)range;
+
+/** Synchronous version of -GETRange:. Returns nil on error. */
+- (NSData*) bodyInRange: (NSRange)range;
+
+/** A new reader for random access into the body, that caches the parts it's fetched. (See CouchAttachmentReader.h.) */
+- (CouchAttachmentReader*) reader;
+
 @end
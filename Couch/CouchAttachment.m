@@ -14,6 +14,7 @@
 //  and limitations under the License.
 
 #import "CouchAttachment.h"
+#import "CouchAttachmentReader.h"
 #import "CouchInternal.h"
 
 
@@ -80,6 +81,11 @@
 }
 
 
+- (NSString*) digest {
+    return $castIf(NSString, [_metadata objectForKey: @"digest"]);
+}
+
+
 #pragma mark -
 #pragma mark BODY
 
@@ -87,7 +93,9 @@
 - (RESTOperation*) PUT: (NSData*)body contentType: (NSString*)contentType {
     NSDictionary* params = [NSDictionary dictionaryWithObject: contentType
                                                        forKey: @"Content-Type"];
-    return [self PUT: body parameters: params];
+    RESTOperation* op = [self PUT: body parameters: params];
+    op.priority = kRESTPriorityBackground;
+    return op;
 }
 
 
@@ -117,6 +125,85 @@
         Warn(@"Synchronous CouchAttachment.body setter failed: %@", op.error);
 }
 
+
+#pragma mark -
+#pragma mark RANGES
+
+
+// The If-Range validator: CouchDB's ETag for an attachment is its quoted base64 MD5 digest.
+- (NSString*) rangeValidator {
+    NSString* digest = self.digest;
+    if (!digest)
+        return nil;
+    if ([digest hasPrefix: @"md5-"])
+        digest = [digest substringFromIndex: 4];
+    return [NSString stringWithFormat: @"\"%@\"", digest];
+}
+
+
+- (RESTOperation*) GETRange: (NSRange)range {
+    NSParameterAssert(range.length > 0);
+    NSString* rangeStr = [NSString stringWithFormat: @"bytes=%llu-%llu",
+                          (UInt64)range.location, (UInt64)NSMaxRange(range) - 1];
+    NSMutableDictionary* params = [NSMutableDictionary dictionaryWithObject: rangeStr
+                                                                     forKey: @"Range"];
+    NSString* validator = self.rangeValidator;
+    if (validator)
+        [params setObject: validator forKey: @"If-Range"];
+    // Not -sendHTTP:, which would make it conditional on the cached full body's ETag:
+    return [self sendRequest: [self requestWithMethod: @"GET" parameters: params]];
+}
+
+
+- (NSData*) bodyInRange: (NSRange)range {
+    NSData* body = [RESTBody dataWithBase64: $castIf(NSString, [_metadata objectForKey: @"data"])];
+    if (body) {
+        if (range.location >= body.length)
+            return [NSData data];
+        range.length = MIN(range.length, body.length - range.location);
+        return [body subdataWithRange: range];
+    }
+
+    RESTOperation* op = [self GETRange: range];
+    if ([op wait])
+        return op.resultObject;
+    else {
+        Warn(@"Synchronous CouchAttachment.bodyInRange: failed: %@", op.error);
+        return nil;
+    }
+}
+
+
+- (CouchAttachmentReader*) reader {
+    return [[[CouchAttachmentReader alloc] initWithAttachment: self] autorelease];
+}
+
+
+// Sets the result of a completed GETRange: operation.
+- (NSError*) rangeOperationCompleted: (RESTOperation*)op {
+    unsigned long long first, last;
+    NSString* rangeStr = [op.request valueForHTTPHeaderField: @"Range"];
+    if (sscanf(rangeStr.UTF8String, "bytes=%llu-%llu", &first, &last) != 2)
+        return nil;
+    NSData* content = op.responseBody.content ?: [NSData data];
+    if (op.httpStatus == 206) {
+        // Make sure the server sent the range that was asked for:
+        unsigned long long sentFirst;
+        NSString* contentRange = [op.responseHeaders objectForKey: @"Content-Range"];
+        if (sscanf(contentRange.UTF8String, "bytes %llu-", &sentFirst) != 1 || sentFirst != first)
+            return [NSError errorWithDomain: NSURLErrorDomain
+                                       code: NSURLErrorBadServerResponse
+                                   userInfo: nil];
+        op.resultObject = content;
+    } else {
+        // The server sent the whole body, so pick out the range:
+        NSUInteger start = (NSUInteger)MIN(first, content.length);
+        NSUInteger end = (NSUInteger)MIN(last + 1, content.length);
+        op.resultObject = [content subdataWithRange: NSMakeRange(start, end - start)];
+    }
+    return nil;
+}
+
 /*
 - (NSMutableURLRequest*) requestWithMethod: (NSString*)method
                                 parameters: (NSDictionary*)parameters {
@@ -139,7 +226,9 @@
     error = [super operation: op willCompleteWithError: error];
     
     if (!error && op.isSuccessful) {
-        if (op.isPUT) {
+        if (op.isGET && [op.request valueForHTTPHeaderField: @"Range"]) {
+            error = [self rangeOperationCompleted: op];
+        } else if (op.isPUT) {
             NSString* revisionID = $castIf(NSString, [op.responseBody.fromJSON objectForKey: @"rev"]);
             if (revisionID)
                 self.document.currentRevisionID = revisionID;
@@ -0,0 +1,76 @@
+//
+//  CouchAttachmentReader.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+@class CouchAttachment;
+
+
+/** Random access to the body of a CouchAttachment, without downloading all of it.
+    The body is read in fixed-size blocks, using HTTP Range requests (see -[CouchAttachment GETRange:]). Each read fetches only the blocks it needs that aren't already cached, with one request per run of adjacent missing blocks, and blocks already being fetched are waited for rather than requested again. Fetched blocks are kept in a cache of limited size; the least recently used ones are dropped first. So seeking back and forth through a large media attachment only ever downloads the parts that are looked at.
+    If the server ever responds with the whole body instead of a range (because the attachment has changed, or the server doesn't support ranges), the cached blocks are discarded, since they may be stale.
+    A reader should only be used on one thread. */
+@interface CouchAttachmentReader : NSObject
+{
+    @private
+    CouchAttachment* _attachment;
+    UInt64 _length;
+    NSUInteger _blockSize, _maxCachedBytes, _cachedBytes;
+    NSMutableDictionary* _blocks;
+    NSMutableArray* _recency;
+    NSMutableDictionary* _fetches;
+    NSUInteger _fetchCount, _hitCount, _missCount;
+    UInt64 _bytesFetched;
+}
+
+- (id) initWithAttachment: (CouchAttachment*)attachment;
+
+@property (readonly) CouchAttachment* attachment;
+
+/** The length of the body, as given by the attachment's metadata (or, after a full-body response, by that response.) Zero if unknown. */
+@property (readonly) UInt64 length;
+
+/** The size of the blocks fetched and cached. Changing it discards the cache. Defaults to 256KB. */
+@property NSUInteger blockSize;
+
+/** The total size of blocks kept in the cache. Defaults to 8MB. */
+@property NSUInteger maxCachedBytes;
+
+/** Synchronously reads the bytes in a range. The result is shorter than the range if it extends past the end of the body. */
+- (NSData*) readDataInRange: (NSRange)range error: (NSError**)outError;
+
+/** Starts fetching any blocks in the range that aren't cached, without waiting. A later read of the range will wait for them instead of fetching them again. */
+- (void) prefetchDataInRange: (NSRange)range;
+
+/** Reads the bytes in a range a piece at a time, calling the block with each piece in order. The next piece is fetched while the block is handling the current one, so a long range streams without all of it ever being in memory. The block can set *stop to YES to end early.
+    @return  YES on success, NO if a fetch failed. */
+- (BOOL) streamDataInRange: (NSRange)range
+                     error: (NSError**)outError
+                   toBlock: (void (^)(NSData* data, BOOL* stop))block;
+
+/** Discards all cached blocks. */
+- (void) flushCache;
+
+/** The number of bytes of blocks currently cached. */
+@property (readonly) NSUInteger cachedBytes;
+
+/** The number of range requests sent. */
+@property (readonly) NSUInteger fetchCount;
+
+/** The number of response bytes received. */
+@property (readonly) UInt64 bytesFetched;
+
+/** The number of blocks that reads found in, and didn't find in, the cache. */
+@property (readonly) NSUInteger hitCount, missCount;
+
+@end
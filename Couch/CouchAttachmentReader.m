@@ -0,0 +1,316 @@
+//
+//  CouchAttachmentReader.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchAttachmentReader.h"
+#import "CouchInternal.h"
+
+
+// Number of blocks in each piece handed out by -streamDataInRange:.
+static const NSUInteger kStreamPieceBlocks = 4;
+
+
+// A range request for a run of blocks.
+@interface CouchAttachmentFetch : NSObject
+{
+    @public
+    RESTOperation* _op;
+    NSUInteger _firstBlock, _blockSize;
+}
+@end
+
+@implementation CouchAttachmentFetch
+- (void) dealloc {
+    [_op release];
+    [super dealloc];
+}
+
+// The part of the response that belongs to a block; nil if the fetch failed.
+- (NSData*) dataForBlock: (NSUInteger)index {
+    NSData* data = _op.error ? nil : _op.resultObject;
+    if (!data)
+        return nil;
+    NSUInteger start = MIN((index - _firstBlock) * _blockSize, data.length);
+    return [data subdataWithRange: NSMakeRange(start, MIN(_blockSize, data.length - start))];
+}
+@end
+
+
+@interface CouchAttachmentReader ()
+- (void) trimCache;
+- (void) fetchCompleted: (CouchAttachmentFetch*)fetch;
+@end
+
+
+@implementation CouchAttachmentReader
+
+
+- (id) initWithAttachment: (CouchAttachment*)attachment {
+    NSParameterAssert(attachment);
+    self = [super init];
+    if (self) {
+        _attachment = [attachment retain];
+        _length = attachment.length;
+        _blockSize = 256 * 1024;
+        _maxCachedBytes = 8 * 1024 * 1024;
+        _blocks = [[NSMutableDictionary alloc] init];
+        _recency = [[NSMutableArray alloc] init];
+        _fetches = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_attachment release];
+    [_blocks release];
+    [_recency release];
+    [_fetches release];
+    [super dealloc];
+}
+
+
+@synthesize attachment=_attachment, length=_length, blockSize=_blockSize,
+            maxCachedBytes=_maxCachedBytes, cachedBytes=_cachedBytes, fetchCount=_fetchCount,
+            bytesFetched=_bytesFetched, hitCount=_hitCount, missCount=_missCount;
+
+
+- (void) setBlockSize: (NSUInteger)blockSize {
+    NSParameterAssert(blockSize > 0);
+    if (blockSize != _blockSize) {
+        [self flushCache];
+        [_fetches removeAllObjects];    // their completions will see the block size changed
+        _blockSize = blockSize;
+    }
+}
+
+
+- (void) setMaxCachedBytes: (NSUInteger)maxCachedBytes {
+    _maxCachedBytes = maxCachedBytes;
+    [self trimCache];
+}
+
+
+#pragma mark - CACHE:
+
+
+- (void) flushCache {
+    [_blocks removeAllObjects];
+    [_recency removeAllObjects];
+    _cachedBytes = 0;
+}
+
+
+- (void) trimCache {
+    while (_cachedBytes > _maxCachedBytes && _recency.count > 0) {
+        NSNumber* key = [_recency objectAtIndex: 0];
+        _cachedBytes -= [[_blocks objectForKey: key] length];
+        [_blocks removeObjectForKey: key];
+        [_recency removeObjectAtIndex: 0];
+    }
+}
+
+
+// Returns a cached block, marking it as recently used.
+- (NSData*) cachedBlock: (NSUInteger)index {
+    NSNumber* key = [NSNumber numberWithUnsignedInteger: index];
+    NSData* block = [_blocks objectForKey: key];
+    if (block) {
+        [_recency removeObject: key];
+        [_recency addObject: key];
+    }
+    return block;
+}
+
+
+- (void) cacheBlock: (NSData*)block atIndex: (NSUInteger)index {
+    NSNumber* key = [NSNumber numberWithUnsignedInteger: index];
+    NSData* old = [_blocks objectForKey: key];
+    if (old) {
+        _cachedBytes -= old.length;
+        [_recency removeObject: key];
+    }
+    [_blocks setObject: block forKey: key];
+    [_recency addObject: key];
+    _cachedBytes += block.length;
+}
+
+
+#pragma mark - FETCHING:
+
+
+// Clips a range to the end of the body, if the length is known.
+- (NSRange) clipRange: (NSRange)range {
+    if (_length > 0) {
+        if (range.location >= _length)
+            return NSMakeRange(range.location, 0);
+        range.length = (NSUInteger)MIN((UInt64)range.length, _length - range.location);
+    }
+    return range;
+}
+
+
+- (NSRange) blocksForRange: (NSRange)range {
+    NSUInteger first = range.location / _blockSize;
+    NSUInteger last = (NSMaxRange(range) - 1) / _blockSize;
+    return NSMakeRange(first, last - first + 1);
+}
+
+
+- (CouchAttachmentFetch*) startFetchOfBlocks: (NSRange)blocks {
+    NSRange bytes = [self clipRange: NSMakeRange(blocks.location * _blockSize,
+                                                 blocks.length * _blockSize)];
+    CouchAttachmentFetch* fetch = [[[CouchAttachmentFetch alloc] init] autorelease];
+    fetch->_op = [[_attachment GETRange: bytes] retain];
+    fetch->_firstBlock = blocks.location;
+    fetch->_blockSize = _blockSize;
+    for (NSUInteger i = blocks.location; i < NSMaxRange(blocks); i++)
+        [_fetches setObject: fetch forKey: [NSNumber numberWithUnsignedInteger: i]];
+    ++_fetchCount;
+    COUCHLOG2(@"%@: Fetching bytes %lu-%lu", self,
+              (unsigned long)bytes.location, (unsigned long)NSMaxRange(bytes) - 1);
+    [fetch->_op onCompletion: ^{
+        [self fetchCompleted: fetch];
+    }];
+    return fetch;
+}
+
+
+- (void) fetchCompleted: (CouchAttachmentFetch*)fetch {
+    RESTOperation* op = fetch->_op;
+    for (NSNumber* key in _fetches.allKeys) {
+        if ([_fetches objectForKey: key] == fetch)
+            [_fetches removeObjectForKey: key];
+    }
+    if (op.error || fetch->_blockSize != _blockSize)
+        return;
+
+    _bytesFetched += op.responseBody.content.length;
+    if (op.httpStatus != 206) {
+        // The server sent the whole body; maybe the attachment changed, so nothing cached is
+        // trustworthy anymore:
+        COUCHLOG(@"%@: Got the entire body; flushing cache", self);
+        [self flushCache];
+        _length = op.responseBody.content.length;
+    }
+    NSData* data = op.resultObject;
+    NSUInteger nBlocks = (data.length + fetch->_blockSize - 1) / fetch->_blockSize;
+    for (NSUInteger i = fetch->_firstBlock; i < fetch->_firstBlock + nBlocks; i++)
+        [self cacheBlock: [fetch dataForBlock: i] atIndex: i];
+    [self trimCache];
+}
+
+
+// Looks up each block in the range: cached blocks are added to 'parts' as NSData; for the rest,
+// the fetch that will produce them, starting new fetches for runs of blocks not already pending.
+- (void) findBlocks: (NSRange)blocks parts: (NSMutableDictionary*)parts {
+    NSUInteger runStart = NSNotFound;
+    for (NSUInteger i = blocks.location; i <= NSMaxRange(blocks); i++) {
+        NSNumber* key = [NSNumber numberWithUnsignedInteger: i];
+        id part = nil;
+        if (i < NSMaxRange(blocks)) {
+            part = [self cachedBlock: i] ?: [_fetches objectForKey: key];
+            if (part)
+                [parts setObject: part forKey: key];
+        }
+        if (part || i == NSMaxRange(blocks)) {
+            if (runStart != NSNotFound) {
+                CouchAttachmentFetch* fetch = [self startFetchOfBlocks:
+                                                        NSMakeRange(runStart, i - runStart)];
+                for (NSUInteger j = runStart; j < i; j++)
+                    [parts setObject: fetch forKey: [NSNumber numberWithUnsignedInteger: j]];
+                runStart = NSNotFound;
+            }
+        } else if (runStart == NSNotFound) {
+            runStart = i;
+        }
+    }
+}
+
+
+- (void) prefetchDataInRange: (NSRange)range {
+    range = [self clipRange: range];
+    if (range.length > 0)
+        [self findBlocks: [self blocksForRange: range] parts: [NSMutableDictionary dictionary]];
+}
+
+
+- (NSData*) readDataInRange: (NSRange)range error: (NSError**)outError {
+    range = [self clipRange: range];
+    if (range.length == 0)
+        return [NSData data];
+    NSRange blocks = [self blocksForRange: range];
+    NSMutableDictionary* parts = [NSMutableDictionary dictionaryWithCapacity: blocks.length];
+    [self findBlocks: blocks parts: parts];
+    for (id part in parts.objectEnumerator) {
+        if ([part isKindOfClass: [CouchAttachmentFetch class]])
+            ++_missCount;
+        else
+            ++_hitCount;
+    }
+
+    NSMutableData* result = [NSMutableData dataWithCapacity: range.length];
+    for (NSUInteger i = blocks.location; i < NSMaxRange(blocks); i++) {
+        id part = [parts objectForKey: [NSNumber numberWithUnsignedInteger: i]];
+        NSData* block;
+        if ([part isKindOfClass: [CouchAttachmentFetch class]]) {
+            CouchAttachmentFetch* fetch = part;
+            if (![fetch->_op wait: outError])
+                return nil;
+            block = [fetch dataForBlock: i];
+        } else {
+            block = part;
+        }
+        // Append the part of the block that's within the range:
+        UInt64 blockStart = (UInt64)i * _blockSize;
+        NSUInteger from = (NSUInteger)(range.location > blockStart ? range.location - blockStart : 0);
+        NSUInteger to = (NSUInteger)MIN((UInt64)block.length, NSMaxRange(range) - blockStart);
+        if (from < to)
+            [result appendBytes: (const char*)block.bytes + from length: to - from];
+        if (block.length < _blockSize)
+            break;      // reached the end of the body
+    }
+    return result;
+}
+
+
+- (BOOL) streamDataInRange: (NSRange)range
+                     error: (NSError**)outError
+                   toBlock: (void (^)(NSData* data, BOOL* stop))block
+{
+    NSUInteger pieceSize = kStreamPieceBlocks * _blockSize;
+    range = [self clipRange: range];
+    BOOL stop = NO;
+    while (range.length > 0 && !stop) {
+        NSRange piece = NSMakeRange(range.location, MIN(range.length, pieceSize));
+        range = NSMakeRange(NSMaxRange(piece), range.length - piece.length);
+        // Start on the next piece, so it downloads while the client handles this one:
+        if (range.length > 0)
+            [self prefetchDataInRange: NSMakeRange(range.location, MIN(range.length, pieceSize))];
+        NSData* data = [self readDataInRange: piece error: outError];
+        if (!data)
+            return NO;
+        if (data.length == 0)
+            break;
+        block(data, &stop);
+    }
+    return YES;
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%@]", [self class], _attachment.name];
+}
+
+
+@end
@@ -0,0 +1,59 @@
+//
+//  CouchChangeMultiplexer.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+@class CouchDatabase, CouchServer, CouchEventSourceParser;
+
+
+/** Tracks changes of many databases on one server without a connection per database.
+    It follows the server's global _db_updates feed, streamed as an EventSource over one connection that stays open, and only when a database is reported updated does it read that database's _changes (a one-shot request starting at the database's lastSequenceNumber) and pass the entries to the database's -changeTrackerReceivedChange:. If the server has no _db_updates feed (CouchDB before 1.4), or doesn't let this user read it (it's admin-only), it instead polls the databases' _changes periodically.
+    Either way, at most maxConcurrentFetches _changes requests are open at once.
+    This class is used internally by CouchServer and CouchDatabase when the server's multiplexesChanges property is set; you shouldn't need to use it yourself. */
+@interface CouchChangeMultiplexer : NSObject
+{
+    @private
+    CouchServer* _server;
+    NSMutableDictionary* _databases;
+    NSMutableArray* _queue;
+    NSMutableSet* _fetching, *_dirty;
+    NSURLConnection* _updatesConnection;
+    CouchEventSourceParser* _updatesParser;
+    int _updatesStatus;
+    unsigned _updatesFailures;
+    BOOL _polling;
+    NSUInteger _maxConcurrentFetches;
+    NSTimeInterval _pollInterval;
+}
+
+- (id) initWithServer: (CouchServer*)server;
+
+/** Starts tracking a database's changes. */
+- (void) addDatabase: (CouchDatabase*)database;
+
+/** Stops tracking a database's changes. */
+- (void) removeDatabase: (CouchDatabase*)database;
+
+/** Stops tracking all databases. Each is told it's no longer tracking changes. */
+- (void) stop;
+
+/** The maximum number of _changes requests in flight at once. Defaults to 4. */
+@property NSUInteger maxConcurrentFetches;
+
+/** How often to poll each database, if the server has no _db_updates feed. Also the shortest delay before reconnecting to _db_updates after an error; repeated errors back off further, as set by the server's retryPolicy. Defaults to 5 seconds. */
+@property NSTimeInterval pollInterval;
+
+/** YES if the server has no _db_updates feed, so databases are being polled. */
+@property (readonly) BOOL polling;
+
+@end
@@ -0,0 +1,292 @@
+//
+//  CouchChangeMultiplexer.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+//
+// <http://wiki.apache.org/couchdb/HTTP_database_API#Changes>
+
+#import "CouchChangeMultiplexer.h"
+#import "CouchEventSourceParser.h"
+#import "CouchInternal.h"
+
+
+// How often the server should send a heartbeat on an idle _db_updates feed, in milliseconds.
+#define kUpdatesHeartbeat 60000
+
+
+@interface CouchChangeMultiplexer ()
+- (void) databaseUpdated: (NSString*)name;
+- (void) pump;
+- (void) followUpdates;
+- (void) clearUpdatesConnection;
+- (void) poll;
+@end
+
+
+@implementation CouchChangeMultiplexer
+
+
+- (id) initWithServer: (CouchServer*)server {
+    NSParameterAssert(server);
+    self = [super init];
+    if (self) {
+        _server = server;   // not retained; the server owns me
+        _databases = [[NSMutableDictionary alloc] init];
+        _queue = [[NSMutableArray alloc] init];
+        _fetching = [[NSMutableSet alloc] init];
+        _dirty = [[NSMutableSet alloc] init];
+        _maxConcurrentFetches = 4;
+        _pollInterval = 5.0;
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [self stop];
+    [_databases release];
+    [_queue release];
+    [_fetching release];
+    [_dirty release];
+    [super dealloc];
+}
+
+
+@synthesize maxConcurrentFetches=_maxConcurrentFetches, pollInterval=_pollInterval,
+            polling=_polling;
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%u dbs%@]", [self class],
+            (unsigned)_databases.count, (_polling ? @", polling" : @"")];
+}
+
+
+- (void) addDatabase: (CouchDatabase*)database {
+    NSString* name = database.relativePath;
+    if ([_databases objectForKey: name])
+        return;
+    [_databases setObject: database forKey: name];
+    [self databaseUpdated: name];     // catch up from its lastSequenceNumber
+    if (_polling) {
+        if (_databases.count == 1)
+            [self performSelector: @selector(poll) withObject: nil afterDelay: _pollInterval];
+    } else if (!_updatesConnection)
+        [self followUpdates];
+}
+
+
+- (void) removeDatabase: (CouchDatabase*)database {
+    NSString* name = database.relativePath;
+    if ([_databases objectForKey: name] != database)
+        return;
+    [_databases removeObjectForKey: name];
+    [_queue removeObject: name];
+    [_dirty removeObject: name];
+    if (_databases.count == 0)
+        [self stop];
+}
+
+
+- (void) stop {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    [_updatesConnection cancel];
+    [self clearUpdatesConnection];
+    NSArray* databases = [[_databases.allValues retain] autorelease];
+    [_databases removeAllObjects];
+    for (CouchDatabase* db in databases)
+        [db changeMultiplexerStopped: self];
+    [_queue removeAllObjects];
+    [_dirty removeAllObjects];
+}
+
+
+#pragma mark - FETCHING CHANGES:
+
+
+- (void) fetchChangesOf: (NSString*)name {
+    CouchDatabase* db = [_databases objectForKey: name];
+    [_fetching addObject: name];
+    NSDictionary* params = [NSDictionary dictionaryWithObject:
+                                [NSNumber numberWithUnsignedLong: db.lastSequenceNumber]
+                                                       forKey: @"?since"];
+    RESTOperation* op = [[db childWithPath: @"_changes"] sendHTTP: @"GET" parameters: params];
+    [op onCompletion: ^{
+        [_fetching removeObject: name];
+        CouchDatabase* db = [_databases objectForKey: name];   // may have been removed meanwhile
+        if (db) {
+            if (op.isSuccessful) {
+                NSArray* results = $castIf(NSArray, [op.responseBody.fromJSON objectForKey: @"results"]);
+                for (NSDictionary* change in results) {
+                    if ([change isKindOfClass: [NSDictionary class]])
+                        [db changeTrackerReceivedChange: change];
+                }
+            } else {
+                COUCHLOG(@"%@: Couldn't get changes of %@: %@", self, name, op.error);
+            }
+            if ([_dirty containsObject: name]) {
+                // It was updated again while I was fetching:
+                [_dirty removeObject: name];
+                [self databaseUpdated: name];
+            }
+        }
+        [self pump];
+    }];
+}
+
+
+// Starts queued fetches, up to the concurrency limit.
+- (void) pump {
+    while (_queue.count > 0 && _fetching.count < MAX(_maxConcurrentFetches, 1u)) {
+        NSString* name = [[[_queue objectAtIndex: 0] retain] autorelease];
+        [_queue removeObjectAtIndex: 0];
+        [self fetchChangesOf: name];
+    }
+}
+
+
+- (void) databaseUpdated: (NSString*)name {
+    if (![_databases objectForKey: name])
+        return;   // not one I'm tracking
+    if ([_fetching containsObject: name])
+        [_dirty addObject: name];
+    else if (![_queue containsObject: name])
+        [_queue addObject: name];
+    [self pump];
+}
+
+
+#pragma mark - FOLLOWING _db_updates:
+
+
+- (void) followUpdates {
+    if (_databases.count == 0 || _updatesConnection)
+        return;
+    // The feed streams every update over one connection, so none are missed between requests
+    // (1.x _db_updates has no 'since' to catch up with.) It never times out on its own; while
+    // it's idle the server sends heartbeats, which the parser skips.
+    NSString* urlStr = [NSString stringWithFormat: @"%@?feed=eventsource&heartbeat=%d",
+                        [_server childWithPath: @"_db_updates"].URL.absoluteString,
+                        kUpdatesHeartbeat];
+    NSMutableURLRequest* request = [NSMutableURLRequest requestWithURL:
+                                                            [NSURL URLWithString: urlStr]];
+    request.cachePolicy = NSURLRequestReloadIgnoringCacheData;
+    request.timeoutInterval = 6.02e23;
+    _updatesParser = [[CouchEventSourceParser alloc] init];
+    _updatesConnection = [[NSURLConnection alloc] initWithRequest: request delegate: self];
+    COUCHLOG2(@"%@: Following <%@>", self, request.URL);
+}
+
+
+- (void) clearUpdatesConnection {
+    [_updatesConnection autorelease];
+    _updatesConnection = nil;
+    [_updatesParser release];
+    _updatesParser = nil;
+    _updatesStatus = 0;
+}
+
+
+// Since updates may have been missed while disconnected, checks all the databases and then
+// follows the feed again.
+- (void) reconnect {
+    for (NSString* name in _databases.allKeys)
+        [self databaseUpdated: name];
+    [self followUpdates];
+}
+
+
+// Reconnects after a delay that backs off with each consecutive failure, since every reconnect
+// also fetches the changes of every database.
+- (void) updatesFailedWithError: (NSError*)error {
+    [self clearUpdatesConnection];
+    RESTRetryPolicy* policy = _server.retryPolicy;
+    [policy recordResultForURL: _server.URL error: error latency: 0.0];
+    NSTimeInterval delay = MAX(_pollInterval, [policy delayBeforeRetry: ++_updatesFailures]);
+    COUCHLOG(@"%@: _db_updates failed: %@; reconnecting in %.1f sec", self, error, delay);
+    [self performSelector: @selector(reconnect) withObject: nil afterDelay: delay];
+}
+
+
+- (void)connection:(NSURLConnection *)connection
+        didReceiveAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge
+{
+    if (challenge.previousFailureCount == 0) {
+        NSURLCredential* credential = [_server credentialForOperation: nil];
+        if (credential) {
+            [challenge.sender useCredential: credential forAuthenticationChallenge: challenge];
+            return;
+        }
+    }
+    // Let the 401 response through, so it's handled like a 403:
+    [challenge.sender continueWithoutCredentialForAuthenticationChallenge: challenge];
+}
+
+
+- (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSURLResponse *)response {
+    _updatesStatus = (int) ((NSHTTPURLResponse*)response).statusCode;
+    if (_updatesStatus == 400 || _updatesStatus == 404 || _updatesStatus == 405
+            || _updatesStatus == 401 || _updatesStatus == 403
+            || (_updatesStatus < 300 && ![response.MIMEType isEqualToString: @"text/event-stream"])) {
+        // Server doesn't have _db_updates (or an EventSource feed of it), or it's admin-only and
+        // this user isn't an admin; either way, fall back to polling:
+        COUCHLOG(@"%@: Can't follow _db_updates (status %d); polling instead",
+                 self, _updatesStatus);
+        [_updatesConnection cancel];
+        [self clearUpdatesConnection];
+        _polling = YES;
+        [self poll];
+    } else if (_updatesStatus >= 300) {
+        [_updatesConnection cancel];
+        [self updatesFailedWithError: [NSError errorWithDomain: CouchHTTPErrorDomain
+                                                          code: _updatesStatus userInfo: nil]];
+    } else {
+        _updatesFailures = 0;
+        [_server.retryPolicy recordResultForURL: _server.URL error: nil latency: 0.0];
+    }
+}
+
+
+- (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data {
+    for (NSData* event in [_updatesParser eventsFromData: data]) {
+        NSDictionary* update = $castIf(NSDictionary, [RESTBody JSONObjectWithData: event]);
+        NSString* name = $castIf(NSString, [update objectForKey: @"db_name"]);
+        if (name)
+            [self databaseUpdated: name];
+    }
+}
+
+
+- (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error {
+    [self updatesFailedWithError: error];
+}
+
+
+- (void)connectionDidFinishLoading:(NSURLConnection *)connection {
+    // The server closed the feed; follow it again:
+    COUCHLOG(@"%@: _db_updates feed ended; reconnecting", self);
+    [self clearUpdatesConnection];
+    [self reconnect];
+}
+
+
+- (void) poll {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self selector: @selector(poll) object: nil];
+    if (_databases.count == 0)
+        return;
+    for (NSString* name in _databases.allKeys)
+        [self databaseUpdated: name];
+    [self performSelector: @selector(poll) withObject: nil afterDelay: _pollInterval];
+}
+
+
+@end
@@ -14,7 +14,7 @@
 //  and limitations under the License.
 
 #import <Foundation/Foundation.h>
-@class CouchChangeTracker;
+@class CouchChangeTracker, RESTRetryPolicy;
 
 
 @protocol CouchChangeTrackerClient <NSObject>
@@ -27,12 +27,23 @@
 
 typedef enum CouchChangeTrackerMode {
     kOneShot,
-    kLongPoll,
-    kContinuous
+    kLongPoll,      /**< Repeated requests, each returning a batch of changes */
+    kContinuous,    /**< One streaming request, a line of JSON per change */
+    kEventSource,   /**< One streaming request in text/event-stream format (CouchDB 1.3+) */
+    kAutomatic      /**< Picks one of the above; see +automaticModeForDatabaseURL: */
 } CouchChangeTrackerMode;
 
 
-/** Reads the continuous-mode _changes feed of a database, and sends the individual change entries to its client's -changeTrackerReceivedChange:.
+// How many times in a row a tracker reconnects after an error before giving up. A feed is
+// long-lived, so it's retried more persistently than a single request; the delays come from the
+// retryPolicy.
+#define kChangeTrackerMaxRetries 7
+
+
+/** Reads the _changes feed of a database, and sends the individual change entries to its client's -changeTrackerReceivedChange:.
+    Changes that have been read wait in a bounded queue, and are passed to the client a batch per run-loop cycle. When the queue fills up (because the client is slow, or has set -deliveryPaused) the tracker stops reading the feed, leaving the rest of it in the socket, until the queue is half empty again.
+    In longpoll mode each request asks for at most -pollLimit changes. The limit adapts to how many are arriving: it grows while polls come back full, and shrinks when they don't, so a busy database is read in large batches and an idle one doesn't ask for more than it needs. The next poll is sent before the changes from the last one are passed to the client (unless the queue is full.)
+    The input buffer and the queue count toward +[RESTMemoryBudget sharedBudget], as memory that can't be freed on demand.
     This class is used internally by CouchDatabase and you shouldn't need to use it yourself. */
 @interface CouchChangeTracker : NSObject <NSStreamDelegate>
 {
@@ -41,8 +52,22 @@ typedef enum CouchChangeTrackerMode {
     id<CouchChangeTrackerClient> _client;
     CouchChangeTrackerMode _mode;
     NSUInteger _lastSequenceNumber;
+    RESTRetryPolicy* _retryPolicy;
+    NSUInteger _pollLimit;
+    NSUInteger _changeCount;
+    UInt64 _bytesReceived;
+    NSMutableArray* _pendingChanges;
+    NSUInteger _maxPendingChanges, _latestSequenceNumber, _readPauseCount;
+    BOOL _deliveryScheduled, _deliveryPaused, _readingPaused;
+    UInt64 _budgetedBytes;
 }
 
+/** The mode kAutomatic resolves to for a database:
+    - Plain HTTP uses continuous mode over a socket: one connection, and the least framing per change.
+    - HTTPS uses the EventSource feed, since the socket tracker can't do TLS and NSURLConnection can't read continuous mode.
+    - Servers that have rejected an EventSource feed (older than CouchDB 1.3) fall back to longpoll. */
++ (CouchChangeTrackerMode) automaticModeForDatabaseURL: (NSURL*)databaseURL;
+
 - (id)initWithDatabaseURL: (NSURL*)databaseURL
                      mode: (CouchChangeTrackerMode)mode
              lastSequence: (NSUInteger)lastSequence
@@ -53,6 +78,39 @@ typedef enum CouchChangeTrackerMode {
 @property (readonly, nonatomic) CouchChangeTrackerMode mode;
 @property (readonly, nonatomic) NSUInteger lastSequenceNumber;
 
+/** The limit on the number of changes the next longpoll request will ask for. */
+@property (readonly, nonatomic) NSUInteger pollLimit;
+
+/** Number of changes passed to the client so far. */
+@property (readonly, nonatomic) NSUInteger changeCount;
+
+/** Number of bytes of the feed received so far, including framing (and HTTP headers, in continuous mode.) Divided by -changeCount, gives the cost per change of the mode. */
+@property (readonly, nonatomic) UInt64 bytesReceived;
+
+/** Maximum number of changes read from the feed but not yet passed to the client, before the tracker stops reading. Defaults to 200. */
+@property (nonatomic) NSUInteger maxPendingChanges;
+
+/** A client can set this to YES to stop receiving changes for a while; they queue up (and then stay unread in the feed) until it's set back to NO. */
+@property (nonatomic) BOOL deliveryPaused;
+
+/** YES while reading is stopped because the queue of changes is full. */
+@property (readonly, nonatomic) BOOL readingPaused;
+
+/** Number of times reading has been stopped because the queue was full. */
+@property (readonly, nonatomic) NSUInteger readPauseCount;
+
+/** Number of changes read from the feed but not yet passed to the client. */
+@property (readonly, nonatomic) NSUInteger pendingChangeCount;
+
+/** How far the client is behind the feed: the latest sequence read, minus the last one passed to the client. */
+@property (readonly, nonatomic) NSUInteger sequencesBehind;
+
+/** Number of bytes of the feed received but not yet parsed into changes. */
+@property (readonly, nonatomic) NSUInteger bytesBuffered;
+
+/** Determines how long to wait before reconnecting after an error. Defaults to +[RESTRetryPolicy sharedPolicy]. Connection failures are also reported to it, so they count towards the host's health. */
+@property (retain) RESTRetryPolicy* retryPolicy;
+
 - (BOOL) start;
 - (void) stop;
 
@@ -62,6 +120,13 @@ typedef enum CouchChangeTrackerMode {
 @property (readonly) NSString* changesFeedPath;
 - (void) receivedChunk: (NSData*)chunk;
 - (BOOL) receivedPollResponse: (NSData*)body;
+- (NSArray*) changesFromPollResponse: (NSData*)body lastSequence: (NSUInteger*)outLastSequence;
+- (BOOL) receivedChanges: (NSArray*)changes;
+- (void) adaptPollLimitToCount: (NSUInteger)count;
+- (void) reportBufferedBytes;   // call after reading or consuming input
++ (void) eventSourceUnsupportedAtURL: (NSURL*)url;
+- (void) pauseReading;  // override this
+- (void) resumeReading; // override this
 - (void) stopped; // override this
 
 @end
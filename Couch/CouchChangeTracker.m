@@ -21,9 +21,53 @@
 #import "CouchInternal.h"
 
 
+// Bounds of the longpoll batch size.
+#define kMinPollLimit 25
+#define kMaxPollLimit 1000
+
+// Most changes passed to the client in one run-loop cycle.
+#define kMaxChangesPerDelivery 50
+
+// Rough size in bytes of a queued change, as reported to the memory budget.
+#define kEstimatedChangeCost 256
+
+
+// Hosts (see RESTHostKey) whose servers have rejected feed=eventsource.
+static NSMutableSet* sNoEventSourceHosts;
+
+
 @implementation CouchChangeTracker
 
-@synthesize lastSequenceNumber=_lastSequenceNumber, databaseURL=_databaseURL, mode=_mode;
+@synthesize lastSequenceNumber=_lastSequenceNumber, databaseURL=_databaseURL, mode=_mode,
+            retryPolicy=_retryPolicy, pollLimit=_pollLimit, changeCount=_changeCount,
+            bytesReceived=_bytesReceived, maxPendingChanges=_maxPendingChanges,
+            deliveryPaused=_deliveryPaused, readingPaused=_readingPaused,
+            readPauseCount=_readPauseCount;
+
+
++ (CouchChangeTrackerMode) automaticModeForDatabaseURL: (NSURL*)databaseURL {
+    NSString* scheme = databaseURL.scheme.lowercaseString;
+    if ([scheme isEqualToString: @"http"])
+        return kContinuous;
+    @synchronized([CouchChangeTracker class]) {
+        if ([sNoEventSourceHosts containsObject: RESTHostKey(databaseURL)])
+            return kLongPoll;
+    }
+    return kEventSource;
+}
+
+
++ (void) eventSourceUnsupportedAtURL: (NSURL*)url {
+    NSString* host = RESTHostKey(url);
+    if (!host)
+        return;
+    @synchronized([CouchChangeTracker class]) {
+        if (!sNoEventSourceHosts)
+            sNoEventSourceHosts = [[NSMutableSet alloc] init];
+        [sNoEventSourceHosts addObject: host];
+    }
+}
+
 
 - (id)initWithDatabaseURL: (NSURL*)databaseURL
                      mode: (CouchChangeTrackerMode)mode
@@ -33,9 +77,11 @@
     NSParameterAssert(client);
     self = [super init];
     if (self) {
+        if (mode == kAutomatic)
+            mode = [CouchChangeTracker automaticModeForDatabaseURL: databaseURL];
         if ([self class] == [CouchChangeTracker class]) {
             [self release];
-            if (mode == kContinuous && [databaseURL.scheme.lowercaseString hasPrefix: @"http"]) {
+            if (mode == kContinuous && [databaseURL.scheme.lowercaseString isEqualToString: @"http"]) {
                 return (id) [[CouchSocketChangeTracker alloc] initWithDatabaseURL: databaseURL
                                                                              mode: mode
                                                                      lastSequence: lastSequence
@@ -51,7 +97,11 @@
         _databaseURL = [databaseURL retain];
         _client = client;
         _mode = mode;
-        _lastSequenceNumber = lastSequence;
+        _lastSequenceNumber = _latestSequenceNumber = lastSequence;
+        _retryPolicy = [[RESTRetryPolicy sharedPolicy] retain];
+        _pollLimit = kMinPollLimit * 2;
+        _pendingChanges = [[NSMutableArray alloc] init];
+        _maxPendingChanges = 200;
     }
     return self;
 }
@@ -61,10 +111,14 @@
 }
 
 - (NSString*) changesFeedPath {
-    static NSString* const kModeNames[3] = {@"normal", @"longpoll", @"continuous"};
-    return [NSString stringWithFormat: @"_changes?feed=%@&heartbeat=300000&since=%lu",
-            kModeNames[_mode],
-            (unsigned long)_lastSequenceNumber];
+    static NSString* const kModeNames[4] = {@"normal", @"longpoll", @"continuous", @"eventsource"};
+    NSAssert(_mode < 4, @"Invalid mode %d", _mode);
+    NSString* path = [NSString stringWithFormat: @"_changes?feed=%@&heartbeat=300000&since=%lu",
+                      kModeNames[_mode],
+                      (unsigned long)_latestSequenceNumber];
+    if (_mode == kLongPoll)
+        path = [path stringByAppendingFormat: @"&limit=%lu", (unsigned long)_pollLimit];
+    return path;
 }
 
 - (NSURL*) changesFeedURL {
@@ -79,6 +133,8 @@
 - (void)dealloc {
     [self stop];
     [_databaseURL release];
+    [_retryPolicy release];
+    [_pendingChanges release];
     [super dealloc];
 }
 
@@ -94,7 +150,18 @@
 }
 
 - (void) stop {
+    // Cancel any pending reconnect:
+    [NSObject cancelPreviousPerformRequestsWithTarget: self selector: @selector(start) object: nil];
+    // Drop changes the client hasn't seen yet; the next start will read them again:
+    [NSObject cancelPreviousPerformRequestsWithTarget: self
+                                             selector: @selector(deliverPendingChanges)
+                                               object: nil];
+    _deliveryScheduled = NO;
+    [_pendingChanges removeAllObjects];
+    _latestSequenceNumber = _lastSequenceNumber;
+    _readingPaused = NO;
     [self stopped];
+    [self reportBufferedBytes];
 }
 
 - (void) stopped {
@@ -102,14 +169,88 @@
         [_client changeTrackerStopped: self];
 }
 
+- (void) pauseReading {
+}
+
+- (void) resumeReading {
+}
+
+#pragma mark - QUEUE:
+
+- (NSUInteger) pendingChangeCount {
+    return _pendingChanges.count;
+}
+
+- (NSUInteger) sequencesBehind {
+    return _latestSequenceNumber - MIN(_lastSequenceNumber, _latestSequenceNumber);
+}
+
+- (NSUInteger) bytesBuffered {
+    return 0;
+}
+
+- (void) reportBufferedBytes {
+    UInt64 bytes = self.bytesBuffered + _pendingChanges.count * kEstimatedChangeCost;
+    if (bytes != _budgetedBytes) {
+        [[RESTMemoryBudget sharedBudget] addBufferedBytes: (SInt64)bytes - (SInt64)_budgetedBytes];
+        _budgetedBytes = bytes;
+    }
+}
+
+- (void) scheduleDelivery {
+    if (_deliveryScheduled || _deliveryPaused || _pendingChanges.count == 0)
+        return;
+    _deliveryScheduled = YES;
+    [self performSelector: @selector(deliverPendingChanges) withObject: nil afterDelay: 0.0
+                  inModes: [NSArray arrayWithObject: NSRunLoopCommonModes]];
+}
+
+- (void) setDeliveryPaused: (BOOL)paused {
+    _deliveryPaused = paused;
+    [self scheduleDelivery];
+}
+
+// Passes a batch of queued changes to the client, then lets the run loop get on with other
+// things before the next batch.
+- (void) deliverPendingChanges {
+    _deliveryScheduled = NO;
+    [[self retain] autorelease];    // my client may release me
+    for (NSUInteger n = 0; n < kMaxChangesPerDelivery; n++) {
+        if (_pendingChanges.count == 0 || _deliveryPaused)
+            break;
+        NSDictionary* change = [[[_pendingChanges objectAtIndex: 0] retain] autorelease];
+        [_pendingChanges removeObjectAtIndex: 0];
+        [_client changeTrackerReceivedChange: change];
+        // (The next longpoll may already have been sent with a later sequence; don't go backwards.)
+        _lastSequenceNumber = MAX(_lastSequenceNumber,
+                                  (NSUInteger)[[change objectForKey: @"seq"] intValue]);
+        ++_changeCount;
+    }
+    if (_readingPaused && _pendingChanges.count <= _maxPendingChanges / 2) {
+        COUCHLOG2(@"%@: Queue drained; resuming reading", self);
+        _readingPaused = NO;
+        [self resumeReading];
+    }
+    [self reportBufferedBytes];
+    [self scheduleDelivery];
+}
+
 - (BOOL) receivedChange: (NSDictionary*)change {
     if (![change isKindOfClass: [NSDictionary class]])
         return NO;
     id seq = [change objectForKey: @"seq"];
     if (!seq)
         return NO;
-    [_client changeTrackerReceivedChange: change];
-    _lastSequenceNumber = [seq intValue];
+    [_pendingChanges addObject: change];
+    _latestSequenceNumber = MAX(_latestSequenceNumber, (NSUInteger)[seq intValue]);
+    if (!_readingPaused && _pendingChanges.count >= _maxPendingChanges) {
+        COUCHLOG2(@"%@: %lu changes queued; pausing reading",
+                  self, (unsigned long)_pendingChanges.count);
+        _readingPaused = YES;
+        ++_readPauseCount;
+        [self pauseReading];
+    }
+    [self scheduleDelivery];
     return YES;
 }
 
@@ -130,12 +271,22 @@
     }
 }
 
-- (BOOL) receivedPollResponse: (NSData*)body {
+- (NSArray*) changesFromPollResponse: (NSData*)body lastSequence: (NSUInteger*)outLastSequence {
     if (!body)
-        return NO;
+        return nil;
     NSDictionary* changeDict = $castIf(NSDictionary,
                                        [RESTBody JSONObjectWithData: body]);
     NSArray* changes = $castIf(NSArray, [changeDict objectForKey: @"results"]);
+    if (changes && outLastSequence) {
+        id lastSeq = [changeDict objectForKey: @"last_seq"];
+        if (!lastSeq)
+            lastSeq = [$castIf(NSDictionary, changes.lastObject) objectForKey: @"seq"];
+        *outLastSequence = MAX(_latestSequenceNumber, (NSUInteger)[lastSeq intValue]);
+    }
+    return changes;
+}
+
+- (BOOL) receivedChanges: (NSArray*)changes {
     if (!changes)
         return NO;
     for (NSDictionary* change in changes) {
@@ -145,4 +296,18 @@
     return YES;
 }
 
+- (BOOL) receivedPollResponse: (NSData*)body {
+    return [self receivedChanges: [self changesFromPollResponse: body lastSequence: NULL]];
+}
+
+- (void) adaptPollLimitToCount: (NSUInteger)count {
+    if (count >= _pollLimit) {
+        // A full batch means more are waiting; fetch more at a time:
+        _pollLimit = MIN(2 * _pollLimit, (NSUInteger)kMaxPollLimit);
+    } else {
+        // Shrink gradually towards what's actually arriving:
+        _pollLimit = MAX(MAX(2 * count, _pollLimit / 2), (NSUInteger)kMinPollLimit);
+    }
+}
+
 @end
@@ -15,13 +15,20 @@
 
 #import "REST.h"
 #import "CouchAttachment.h"
+#import "CouchAttachmentReader.h"
+#import "CouchConflictResolver.h"
 #import "CouchDatabase.h"
 #import "CouchDesignDocument.h"
 #import "CouchDocument.h"
+#import "CouchLocalView.h"
+#import "CouchDocumentMirror.h"
 #import "CouchModel.h"
 #import "CouchPersistentReplication.h"
 #import "CouchQuery.h"
+#import "CouchReplicationProgress.h"
+#import "CouchReplicationScheduler.h"
 #import "CouchRevision.h"
+#import "CouchRevisionTree.h"
 #import "CouchServer.h"
 
 #import "CouchTouchDBServer.h"
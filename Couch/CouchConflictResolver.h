@@ -0,0 +1,79 @@
+//
+//  CouchConflictResolver.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+@class CouchDatabase, CouchQuery, CouchRevision;
+
+
+/** A merge policy decides how to resolve a conflicted document.
+    @param current  The revision CouchDB chose as the document's current revision.
+    @param conflicts  All the document's live (non-deleted) leaf revisions, including 'current'. Their properties are already loaded.
+    @return  The properties of the new revision that will replace all the conflicting ones, or nil to leave the document unresolved. */
+typedef NSDictionary* (^CouchMergePolicy)(CouchRevision* current, NSArray* conflicts);
+
+
+/** Finds and resolves conflicted documents throughout a database.
+    Instead of checking documents one at a time with -[CouchDocument getConflictingRevisions], this scans the whole database in a few large requests, fetches the conflicting revisions of many documents at once, and saves the resolutions in large _bulk_docs batches. Each resolution writes the merged properties as a new revision on top of the current one, and deletes all the other leaf revisions. */
+@interface CouchConflictResolver : NSObject
+{
+    @private
+    CouchDatabase* _database;
+    CouchQuery* _conflictsQuery;
+    CouchMergePolicy _mergePolicy;
+    NSUInteger _batchSize, _maxConcurrentFetches;
+}
+
+- (id) initWithDatabase: (CouchDatabase*)database;
+
+@property (readonly) CouchDatabase* database;
+
+/** The policy used by -resolveConflicts:. Defaults to +currentRevisionWins. */
+@property (copy) CouchMergePolicy mergePolicy;
+
+/** An optional query whose rows are exactly the database's conflicted documents, e.g. a view whose map function is "function(doc) {if (doc._conflicts) emit(doc._id, null);}".
+    If this isn't set, the resolver finds conflicts by scanning _all_docs, which requires reading every document in the database. */
+@property (retain) CouchQuery* conflictsQuery;
+
+/** The number of documents fetched or resolved per batch. Defaults to 100. */
+@property NSUInteger batchSize;
+
+/** The maximum number of conflicting-revision fetches in progress at once. Defaults to 8. */
+@property NSUInteger maxConcurrentFetches;
+
+/** Returns the IDs of all documents that have conflicts. (Synchronous)
+    @return  An array of document ID strings, or nil on error. */
+- (NSArray*) findConflictedDocumentIDs: (NSError**)outError;
+
+/** Fetches the live leaf revisions of the given documents, with their properties. (Synchronous)
+    Requests for different documents are sent concurrently.
+    @param documentIDs  The IDs of the documents.
+    @return  An array with an entry for each document, in the same order. Each entry is an array of CouchRevisions, the first of which is the current revision; or an NSError if that document couldn't be fetched. */
+- (NSArray*) getConflictingRevisionsOfDocuments: (NSArray*)documentIDs;
+
+/** Finds all conflicted documents and resolves them using the mergePolicy. (Synchronous)
+    Documents for which the merge policy returns nil, or whose resolution fails to save (for example because they changed again in the meantime), are left conflicted.
+    @return  The number of documents resolved, or NSNotFound if the scan failed. */
+- (NSUInteger) resolveConflicts: (NSError**)outError;
+
+
+/** A merge policy that keeps the current revision's properties. */
++ (CouchMergePolicy) currentRevisionWins;
+
+/** A merge policy that picks the revision with the greatest value of the given property (compared with -compare:), such as a modification timestamp. Revisions lacking the property lose. */
++ (CouchMergePolicy) revisionWithGreatestValueOf: (NSString*)property;
+
+/** A merge policy that combines the revisions' properties: each property is taken from the current revision if it has it, otherwise from the first other revision that does. */
++ (CouchMergePolicy) mergeProperties;
+
+@end
@@ -0,0 +1,273 @@
+//
+//  CouchConflictResolver.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchConflictResolver.h"
+#import "CouchInternal.h"
+
+
+// Number of rows per request when scanning _all_docs.
+static const NSUInteger kScanPageSize = 1000;
+
+
+@implementation CouchConflictResolver
+
+
+- (id) initWithDatabase: (CouchDatabase*)database {
+    NSParameterAssert(database);
+    self = [super init];
+    if (self) {
+        _database = [database retain];
+        _batchSize = 100;
+        _maxConcurrentFetches = 8;
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [_database release];
+    [_conflictsQuery release];
+    [_mergePolicy release];
+    [super dealloc];
+}
+
+
+@synthesize database=_database, mergePolicy=_mergePolicy, conflictsQuery=_conflictsQuery,
+            batchSize=_batchSize, maxConcurrentFetches=_maxConcurrentFetches;
+
+
+#pragma mark - FINDING CONFLICTS:
+
+
+- (NSArray*) findConflictedDocumentIDs: (NSError**)outError {
+    NSMutableArray* docIDs = [NSMutableArray array];
+    if (_conflictsQuery) {
+        CouchQueryEnumerator* rows = _conflictsQuery.rows;
+        if (!rows) {
+            if (outError)
+                *outError = _conflictsQuery.error;
+            return nil;
+        }
+        for (CouchQueryRow* row in rows) {
+            NSString* docID = row.documentID;
+            if (docID)
+                [docIDs addObject: docID];
+        }
+        return docIDs;
+    }
+
+    // Page through _all_docs, asking for each doc's _conflicts property:
+    RESTResource* allDocs = [_database childWithPath: @"_all_docs"];
+    NSString* lastDocID = nil;
+    for (;;) {
+        NSMutableDictionary* params = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                    @"true", @"?include_docs",
+                                    @"true", @"?conflicts",
+                                    [NSNumber numberWithUnsignedLong: kScanPageSize], @"?limit",
+                                    nil];
+        if (lastDocID) {
+            [params setObject: [RESTBody stringWithJSONObject: lastDocID] forKey: @"?startkey"];
+            [params setObject: @"1" forKey: @"?skip"];
+        }
+        RESTOperation* op = [allDocs sendHTTP: @"GET" parameters: params];
+        if (![op wait]) {
+            if (outError)
+                *outError = op.error;
+            return nil;
+        }
+        NSArray* rows = $castIf(NSArray, [op.responseBody.fromJSON objectForKey: @"rows"]);
+        for (NSDictionary* row in rows) {
+            NSDictionary* doc = $castIf(NSDictionary, [row objectForKey: @"doc"]);
+            if ([[doc objectForKey: @"_conflicts"] count] > 0)
+                [docIDs addObject: [doc objectForKey: @"_id"]];
+        }
+        if (rows.count < kScanPageSize)
+            break;
+        lastDocID = [rows.lastObject objectForKey: @"id"];
+    }
+    return docIDs;
+}
+
+
+#pragma mark - FETCHING REVISIONS:
+
+
+// Sorts live leaf revisions the way CouchDB picks the current one.
+static NSComparisonResult compareLeaves(CouchRevision* rev1, CouchRevision* rev2, void* context) {
+    return CouchCompareLeaves(rev1.revisionID, NO, rev2.revisionID, NO);
+}
+
+
+// Returns an array of the live leaf revisions from an ?open_revs=all response, with the
+// current revision first; or an NSError.
+- (id) leafRevisionsFromOperation: (RESTOperation*)op {
+    if (!op.isSuccessful)
+        return op.error;
+    CouchDocument* doc = (CouchDocument*)op.resource;
+    NSArray* items = $castIf(NSArray, op.responseBody.fromJSON);
+    NSMutableArray* revisions = [NSMutableArray arrayWithCapacity: items.count];
+    for (NSDictionary* item in items) {
+        NSDictionary* contents = $castIf(NSDictionary, [item objectForKey: @"ok"]);
+        if ([[contents objectForKey: @"_deleted"] boolValue])
+            continue;
+        NSString* revisionID = $castIf(NSString, [contents objectForKey: @"_rev"]);
+        if (!revisionID)
+            continue;
+        CouchRevision* revision = [doc revisionWithID: revisionID];
+        if (!revision.propertiesAreLoaded)
+            revision.properties = contents;
+        [revisions addObject: revision];
+    }
+    [revisions sortUsingFunction: compareLeaves context: NULL];
+    return revisions;
+}
+
+
+- (NSArray*) getConflictingRevisionsOfDocuments: (NSArray*)documentIDs {
+    NSUInteger count = documentIDs.count;
+    NSMutableArray* results = [NSMutableArray arrayWithCapacity: count];
+    NSMutableArray* inFlight = [NSMutableArray arrayWithCapacity: _maxConcurrentFetches];
+    NSDictionary* params = [NSDictionary dictionaryWithObjectsAndKeys:
+                            @"all", @"?open_revs",
+                            @"application/json", @"Accept",
+                            nil];
+    NSUInteger next = 0;
+    while (results.count < count) {
+        // Keep up to _maxConcurrentFetches requests going, and collect their results in order:
+        while (next < count && inFlight.count < MAX(_maxConcurrentFetches, 1u)) {
+            CouchDocument* doc = [_database documentWithID: [documentIDs objectAtIndex: next++]];
+            [inFlight addObject: [[doc sendHTTP: @"GET" parameters: params] start]];
+        }
+        RESTOperation* op = [inFlight objectAtIndex: 0];
+        [op wait];
+        [results addObject: [self leafRevisionsFromOperation: op]];
+        [inFlight removeObjectAtIndex: 0];
+    }
+    return results;
+}
+
+
+#pragma mark - RESOLVING:
+
+
+- (NSUInteger) resolveConflicts: (NSError**)outError {
+    NSArray* docIDs = [self findConflictedDocumentIDs: outError];
+    if (!docIDs)
+        return NSNotFound;
+    CouchMergePolicy policy = _mergePolicy;
+    if (!policy)
+        policy = [[self class] currentRevisionWins];
+    COUCHLOG(@"%@: Resolving %u conflicted documents", self, (unsigned)docIDs.count);
+
+    __block NSUInteger resolved = 0;
+    NSUInteger batchSize = MAX(_batchSize, 1u);
+    for (NSUInteger start = 0; start < docIDs.count; start += batchSize) {
+        NSRange range = NSMakeRange(start, MIN(batchSize, docIDs.count - start));
+        NSArray* leaves = [self getConflictingRevisionsOfDocuments:
+                                                        [docIDs subarrayWithRange: range]];
+
+        // Each resolution puts the merged properties on top of the current revision and
+        // deletes all the others:
+        NSMutableArray* changes = [NSMutableArray array];
+        NSMutableArray* revisions = [NSMutableArray array];
+        NSMutableIndexSet* currentIndexes = [NSMutableIndexSet indexSet];
+        for (id item in leaves) {
+            if (![item isKindOfClass: [NSArray class]] || [item count] < 2)
+                continue;   // fetch failed, or conflict was already resolved
+            CouchRevision* current = [item objectAtIndex: 0];
+            NSDictionary* merged = policy(current, item);
+            if (!merged)
+                continue;
+            [currentIndexes addIndex: changes.count];
+            for (CouchRevision* rev in item) {
+                [changes addObject: (rev == current) ? merged : (id)[NSNull null]];
+                [revisions addObject: rev];
+            }
+        }
+        if (changes.count == 0)
+            continue;
+
+        RESTOperation* op = [_database putChanges: changes toRevisions: revisions];
+        if (![op wait]) {
+            if (outError)
+                *outError = op.error;
+            return resolved;
+        }
+        NSArray* responses = $castIf(NSArray, op.responseBody.fromJSON);
+        [currentIndexes enumerateIndexesUsingBlock: ^(NSUInteger i, BOOL *stop) {
+            if (i < responses.count && ![[responses objectAtIndex: i] objectForKey: @"error"])
+                ++resolved;
+        }];
+    }
+    if (outError)
+        *outError = nil;
+    return resolved;
+}
+
+
+#pragma mark - MERGE POLICIES:
+
+
+// Returns the given user properties, plus the current revision's attachments. (Attachment
+// stubs from other revisions can't be saved on top of the current one.)
+static NSDictionary* propertiesForResolution(NSDictionary* userProperties,
+                                             CouchRevision* current) {
+    NSDictionary* attachments = [current.properties objectForKey: @"_attachments"];
+    if (!attachments)
+        return userProperties;
+    NSMutableDictionary* properties = [[userProperties mutableCopy] autorelease];
+    [properties setObject: attachments forKey: @"_attachments"];
+    return properties;
+}
+
+
++ (CouchMergePolicy) currentRevisionWins {
+    return [[^NSDictionary*(CouchRevision* current, NSArray* conflicts) {
+        return current.properties;
+    } copy] autorelease];
+}
+
+
++ (CouchMergePolicy) revisionWithGreatestValueOf: (NSString*)property {
+    NSParameterAssert(property);
+    property = [[property copy] autorelease];
+    return [[^NSDictionary*(CouchRevision* current, NSArray* conflicts) {
+        CouchRevision* winner = current;
+        id greatest = [current propertyForKey: property];
+        for (CouchRevision* rev in conflicts) {
+            id value = [rev propertyForKey: property];
+            if (value && (!greatest || [value compare: greatest] > 0)) {
+                winner = rev;
+                greatest = value;
+            }
+        }
+        if (winner == current)
+            return current.properties;
+        return propertiesForResolution(winner.userProperties, current);
+    } copy] autorelease];
+}
+
+
++ (CouchMergePolicy) mergeProperties {
+    return [[^NSDictionary*(CouchRevision* current, NSArray* conflicts) {
+        NSMutableDictionary* merged = [NSMutableDictionary dictionary];
+        for (CouchRevision* rev in conflicts.reverseObjectEnumerator)
+            [merged addEntriesFromDictionary: rev.userProperties];
+        [merged addEntriesFromDictionary: current.userProperties];
+        return propertiesForResolution(merged, current);
+    } copy] autorelease];
+}
+
+
+@end
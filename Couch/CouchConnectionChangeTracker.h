@@ -7,16 +7,20 @@
 //
 
 #import "CouchChangeTracker.h"
+@class CouchEventSourceParser;
 
 
 /** CouchChangeTracker that uses a regular NSURLConnection.
-    This unfortunately doesn't work with regular CouchDB in continuous mode, apparently due to some bug in CFNetwork. */
+    This unfortunately doesn't work with regular CouchDB in continuous mode, apparently due to some bug in CFNetwork, so in that mode it reads the equivalent EventSource feed instead. If the server doesn't support that either, it falls back to longpoll. */
 @interface CouchConnectionChangeTracker : CouchChangeTracker
 {
     @private
     NSURLConnection* _connection;
     int _status;
     NSMutableData* _inputBuffer;
+    CouchEventSourceParser* _eventParser;
+    int _retryCount;
+    BOOL _startDeferred;
 }
 
 @end
@@ -8,17 +8,29 @@
 // <http://wiki.apache.org/couchdb/HTTP_database_API#Changes>
 
 #import "CouchConnectionChangeTracker.h"
+#import "CouchEventSourceParser.h"
 #import "CouchInternal.h"
 
 
 @implementation CouchConnectionChangeTracker
 
 - (BOOL) start {
-    // For some reason continuous mode doesn't work with CFNetwork.
+    if (_readingPaused) {
+        // The queue is full, so don't read any more yet; -resumeReading will connect:
+        COUCHLOG2(@"%@: Queue is full; deferring connection", self);
+        _startDeferred = YES;
+        return YES;
+    }
+
+    // For some reason continuous mode doesn't work with CFNetwork, but the same changes can be
+    // streamed as an EventSource feed:
     if (_mode == kContinuous)
-        _mode = kLongPoll;
+        _mode = kEventSource;
     
-    _inputBuffer = [[NSMutableData alloc] init];
+    if (_mode == kEventSource)
+        _eventParser = [[CouchEventSourceParser alloc] init];
+    else
+        _inputBuffer = [[NSMutableData alloc] init];
     
     NSMutableURLRequest* request = [NSMutableURLRequest requestWithURL: self.changesFeedURL];
     request.cachePolicy = NSURLRequestReloadIgnoringCacheData;
@@ -36,6 +48,8 @@
     _connection = nil;
     [_inputBuffer release];
     _inputBuffer = nil;
+    [_eventParser release];
+    _eventParser = nil;
     _status = 0;
 }
 
@@ -49,6 +63,7 @@
 
 - (void) stop {
     [_connection cancel];
+    _startDeferred = NO;
     [super stop];
 }
 
@@ -71,7 +86,20 @@
 - (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSURLResponse *)response {
     _status = (int) ((NSHTTPURLResponse*)response).statusCode;
     COUCHLOG3(@"%@: Got response, status %d", self, _status);
-    if (_status >= 300) {
+    if (_mode == kEventSource && (_status == 400 || (_status < 300 &&
+                                    ![response.MIMEType isEqualToString: @"text/event-stream"]))) {
+        // Server is older than CouchDB 1.3 and rejected feed=eventsource (or ignored it and sent
+        // something else); poll instead:
+        COUCHLOG(@"%@: Server doesn't support EventSource feed; switching to longpoll", self);
+        [CouchChangeTracker eventSourceUnsupportedAtURL: _databaseURL];
+        [_connection cancel];
+        [self clearConnection];
+        _mode = kLongPoll;
+        [self start];
+    } else if (_status < 300) {
+        _retryCount = 0;  // successful connection
+        [_retryPolicy recordResultForURL: _databaseURL error: nil latency: 0.0];
+    } else {
         Warn(@"%@: Got status %i", self, _status);
         [self stop];
     }
@@ -79,47 +107,89 @@
 
 - (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data {
     COUCHLOG3(@"%@: Got %lu bytes", self, (unsigned long)data.length);
-    [_inputBuffer appendData: data];
-    
-    if (_mode == kContinuous) {
-        // In continuous mode, break input into lines and parse each as JSON:
-        for (;;) {
-            const char* start = _inputBuffer.bytes;
-            const char* eol = strnstr(start, "\n", _inputBuffer.length);
-            if (!eol)
-                break;  // Wait till we have a complete line
-            ptrdiff_t lineLength = eol - start;
-            NSData* chunk = [[[NSData alloc] initWithBytes: start
-                                                       length: lineLength] autorelease];
-            [_inputBuffer replaceBytesInRange: NSMakeRange(0, lineLength + 1)
-                                    withBytes: NULL length: 0];
-            // Finally! Send the line to the database to parse:
-            [self receivedChunk: chunk];
-        }
+    _bytesReceived += data.length;
+    if (_mode == kEventSource) {
+        // Each event's data is one change, as JSON:
+        for (NSData* event in [_eventParser eventsFromData: data])
+            [self receivedChunk: event];
+    } else {
+        [_inputBuffer appendData: data];
     }
+    [self reportBufferedBytes];
 }
 
 - (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error {
-    Warn(@"%@: Got error %@", self, error);
-    [self stopped];
+    [self clearConnection];
+    [_retryPolicy recordResultForURL: _databaseURL error: error latency: 0.0];
+    if (++_retryCount <= kChangeTrackerMaxRetries) {
+        NSTimeInterval retryDelay = [_retryPolicy delayBeforeRetry: _retryCount];
+        COUCHLOG(@"%@: Got error %@; reconnecting in %.1f sec", self, error, retryDelay);
+        [self performSelector: @selector(start) withObject: nil afterDelay: retryDelay];
+    } else {
+        Warn(@"%@: Got error %@", self, error);
+        [self stopped];
+    }
 }
 
 - (void)connectionDidFinishLoading:(NSURLConnection *)connection {
-    if (_mode != kContinuous) {
-        int status = _status;
-        NSData* input = [_inputBuffer retain];
-        COUCHLOG3(@"%@: Got entire body, %u bytes", self, (unsigned)input.length);
-        BOOL responseOK = [self receivedPollResponse: input];
-        [input release];
-        
-        [self clearConnection];
-        if (_mode == kLongPoll && status == 200 && responseOK)
-            [self start];       // Next poll...
-        else
+    [[self retain] autorelease];    // my client may release me when I stop
+    int status = _status;
+    NSData* input = [[_inputBuffer retain] autorelease];
+    [self clearConnection];
+    [self reportBufferedBytes];
+    if (_mode == kEventSource) {
+        // The server closed the stream; pick up where it left off, after the same delay as for
+        // an error, so a server that keeps closing it isn't asked again in a tight loop:
+        if (status == 200) {
+            NSTimeInterval retryDelay = [_retryPolicy delayBeforeRetry: ++_retryCount];
+            COUCHLOG(@"%@: EventSource feed ended; reconnecting in %.1f sec", self, retryDelay);
+            [self performSelector: @selector(start) withObject: nil afterDelay: retryDelay];
+        } else {
             [self stopped];
+        }
+        return;
+    }
+
+    COUCHLOG3(@"%@: Got entire body, %u bytes", self, (unsigned)input.length);
+    NSUInteger lastSequence = _latestSequenceNumber;
+    NSArray* changes = nil;
+    if (status == 200)
+        changes = [self changesFromPollResponse: input lastSequence: &lastSequence];
+    if (![self receivedChanges: changes]) {
+        [self stop];
+    } else if (_mode == kLongPoll) {
+        [self adaptPollLimitToCount: changes.count];
+        _latestSequenceNumber = lastSequence;
+        // Send the next poll now, so the server can answer it while my client processes this
+        // batch -- unless the client is too far behind already, in which case -start waits:
+        [self start];
     } else {
         [self stopped];
     }
 }
 
+
+- (void) pauseReading {
+    // An NSURLConnection can't be told to stop reading, but while it's not scheduled it doesn't
+    // call me, and what the server sends backs up in the socket. In longpoll mode (or if the
+    // connection has to be reopened) -start waits until reading resumes.
+    if (_mode == kEventSource)
+        [_connection unscheduleFromRunLoop: [NSRunLoop currentRunLoop] forMode: NSDefaultRunLoopMode];
+}
+
+
+- (void) resumeReading {
+    if (_startDeferred) {
+        _startDeferred = NO;
+        [self start];
+    } else if (_mode == kEventSource) {
+        [_connection scheduleInRunLoop: [NSRunLoop currentRunLoop] forMode: NSDefaultRunLoopMode];
+    }
+}
+
+
+- (NSUInteger) bytesBuffered {
+    return _inputBuffer.length + _eventParser.bufferedLength;
+}
+
 @end
@@ -15,8 +15,8 @@
 
 #import "CouchResource.h"
 #import "CouchReplication.h"
-@class RESTCache, CouchChangeTracker, CouchDocument, CouchDesignDocument, CouchModelFactory,
-        CouchPersistentReplication, CouchQuery, CouchServer;
+@class RESTCache, CouchAutosaver, CouchChangeTracker, CouchDocument, CouchDocumentMirror,
+        CouchDesignDocument, CouchModelFactory, CouchPersistentReplication, CouchQuery, CouchServer;
 
 typedef NSString* (^CouchDocumentPathMap)(NSString* documentID);
 
@@ -28,12 +28,17 @@ typedef NSString* (^CouchDocumentPathMap)(NSString* documentID);
     RESTCache* _docCache;
     NSCountedSet* _busyDocuments;
     CouchChangeTracker* _tracker;
-    NSUInteger _lastSequenceNumber;
+    BOOL _multiplexed;
+    NSUInteger _lastSequenceNumber, _highestProcessedSequence;
     BOOL _lastSequenceNumberKnown;
     id _onChangeBlock;
-    NSMutableArray* _deferredChanges;
+    NSMutableDictionary* _deferredChanges;
+    NSUInteger _deferredChangeCount;
     CouchDocumentPathMap _documentPathMap;
     CouchModelFactory* _modelFactory;
+    CouchAutosaver* _autosaver;
+    NSMutableDictionary* _localViews;
+    CouchDocumentMirror* _documentMirror;
 }
 
 /** A convenience to instantiate a CouchDatabase directly from a URL, without having to first instantiate a CouchServer.
@@ -98,7 +103,7 @@ typedef NSString* (^CouchDocumentPathMap)(NSString* documentID);
     @param properties  Array of NSDictionaries, each one the properties of a document. */
 - (RESTOperation*) putChanges: (NSArray*)properties;
 
-/** Deletes the given revisions. */
+/** Deletes the given revisions. Deleting a conflicting revision, other than a document's current one, leaves the document's current revision as it was. */
 - (RESTOperation*) deleteRevisions: (NSArray*)revisions;
 
 /** Deletes the given documents. */
@@ -112,6 +117,10 @@ typedef NSString* (^CouchDocumentPathMap)(NSString* documentID);
     API calls will now instantiate and return new instances. */
 - (void) clearDocumentCache;
 
+/** An optional persistent copy of document bodies, used to avoid re-fetching documents after a relaunch. (See CouchDocumentMirror.)
+    Setting this attaches the mirror to the database, which starts validating it against the changes made since it was last used. Setting it to nil, or closing the database, detaches and closes the mirror. If the database is deleted, the mirror is emptied. */
+@property (retain) CouchDocumentMirror* documentMirror;
+
 #pragma mark QUERIES & DESIGN DOCUMENTS:
 
 /** Returns a query that runs custom map/reduce functions.
@@ -136,7 +145,7 @@ typedef NSString* (^CouchDocumentPathMap)(NSString* documentID);
 /** Controls whether document change-tracking is enabled.
     It's off by default.
     Only external changes are tracked, not ones made through this database object and its children. This is useful in handling synchronization, or multi-client access to the same database, or on application relaunch to detect changes made after it last quit.
-    Turning tracking on creates a persistent socket connection to the database, and will post potentially a lot of notifications, so don't turn it on unless you're actually going to use the notifications. */
+    Turning tracking on creates a persistent socket connection to the database (unless the server's multiplexesChanges is set), and will post potentially a lot of notifications, so don't turn it on unless you're actually going to use the notifications. */
 @property BOOL tracksChanges;
 
 /** The last change sequence number received from the database.
@@ -15,6 +15,7 @@
 
 #import "CouchDatabase.h"
 #import "RESTCache.h"
+#import "CouchChangeMultiplexer.h"
 #import "CouchChangeTracker.h"
 #import "CouchInternal.h"
 
@@ -25,9 +26,16 @@ NSString* const kCouchDatabaseChangeNotification = @"CouchDatabaseChange";
 /** Number of CouchDocument objects to cache in memory */
 static const NSUInteger kDocRetainLimit = 50;
 
+/** Number of changes held for documents being saved, before the change tracker is paused */
+static const NSUInteger kMaxDeferredChanges = 100;
+
 
 @interface CouchDatabase () <CouchChangeTrackerClient>
+- (void) processChange: (NSDictionary*)change sequence: (NSUInteger)sequence;
+- (BOOL) isDocumentBusy: (NSString*)docID;
+- (void) deferChange: (NSDictionary*)change forDocument: (NSString*)docID;
 - (void) processDeferredChanges;
+- (NSUInteger) lowestDeferredSequence;
 @end
 
 
@@ -49,8 +57,13 @@ static const NSUInteger kDocRetainLimit = 50;
 
 
 - (void) close {
+    for (CouchLocalView* view in _localViews.allValues)
+        [view databaseClosed];
+    [_localViews release];
+    _localViews = nil;
+    self.documentMirror = nil;
     self.tracksChanges = NO;
-    _lastSequenceNumber = 0;
+    _lastSequenceNumber = _highestProcessedSequence = 0;
     _lastSequenceNumberKnown = NO;
     [_busyDocuments release];
     _busyDocuments = nil;
@@ -65,6 +78,7 @@ static const NSUInteger kDocRetainLimit = 50;
     [self close];
     [_onChangeBlock release];
     [_modelFactory release];
+    [_autosaver release];
     [super dealloc];
 }
 
@@ -120,6 +134,7 @@ static const NSUInteger kDocRetainLimit = 50;
     error = [super operation: op willCompleteWithError: error];
     if (op.isDELETE && !error) {
         // Database deleted!
+        [_documentMirror removeAllDocuments];
         [self close];
     }
     return error;
@@ -188,6 +203,20 @@ static const NSUInteger kDocRetainLimit = 50;
     [_docCache forgetAllResources];
 }
 
+
+- (CouchDocumentMirror*) documentMirror {
+    return _documentMirror;
+}
+
+- (void) setDocumentMirror: (CouchDocumentMirror*)mirror {
+    if (mirror == _documentMirror)
+        return;
+    [_documentMirror attachToDatabase: nil];
+    [_documentMirror release];
+    _documentMirror = [mirror retain];
+    [_documentMirror attachToDatabase: self];
+}
+
 - (void) unretainDocumentCache {
     [_docCache unretainResources];
 }
@@ -205,34 +234,61 @@ static const NSUInteger kDocRetainLimit = 50;
     // http://wiki.apache.org/couchdb/HTTP_Bulk_Document_API
     NSUInteger nChanges = properties.count;
     NSAssert(revisions==nil || revisions.count == nChanges, @"Mismatched array counts");
+    static NSDictionary* sDeletedProperties;
+    static NSSet* sIDKey, *sIDAndRevKeys;
+    if (!sDeletedProperties) {
+        sDeletedProperties = [[NSDictionary alloc] initWithObjectsAndKeys:
+                              (id)kCFBooleanTrue, @"_deleted", nil];
+        sIDKey = [[NSSet alloc] initWithObjects: @"_id", nil];
+        sIDAndRevKeys = [[NSSet alloc] initWithObjects: @"_id", @"_rev", nil];
+    }
+
+    // Write the body straight to JSON one document at a time, instead of first building a copy
+    // of every document with its _id and _rev added, and a dictionary to hold them all:
+    RESTJSONWriter* writer = [[RESTJSONWriter alloc] init];
+    [writer beginDictionary];
+    [writer writeKey: @"docs"];
+    [writer beginArray];
     NSMutableArray* entries = [NSMutableArray arrayWithCapacity: nChanges];
     for (NSUInteger i=0; i<nChanges; i++) {
         id props = [properties objectAtIndex: i];
-        NSMutableDictionary* contents;
         if ([props isEqual: [NSNull null]]) {
             NSAssert(revisions, @"Can't pass null properties without specifying a revision");
-            contents = [NSMutableDictionary dictionaryWithObject: (id)kCFBooleanTrue
-                                                          forKey: @"_deleted"];
+            props = sDeletedProperties;
         } else {
             NSAssert([props isKindOfClass:[NSDictionary class]], @"invalid property dict");
-            contents = [[props mutableCopy] autorelease];
         }
+        [entries addObject: props];
+
+        [writer beginDictionary];
+        NSSet* skip = nil;
         if (revisions) {
             // Elements of 'revisions' may be CouchRevisions or CouchDocuments.
             id revOrDoc = [revisions objectAtIndex: i];
             NSString* docID = [revOrDoc documentID];
             if (docID) {
-                [contents setObject: docID forKey: @"_id"];
-                if ([revOrDoc isKindOfClass: [CouchRevision class]])
-                    [contents setObject: [revOrDoc revisionID] forKey: @"_rev"];
+                [writer writeKey: @"_id" value: docID];
+                skip = sIDKey;
+                if ([revOrDoc isKindOfClass: [CouchRevision class]]) {
+                    [writer writeKey: @"_rev" value: [revOrDoc revisionID]];
+                    skip = sIDAndRevKeys;
+                }
             }
         }
-        [entries addObject: contents];
+        [writer writeContentsOfDictionary: props skippingKeys: skip];
+        [writer endDictionary];
     }
-    NSDictionary* body = [NSDictionary dictionaryWithObject: entries forKey: @"docs"];
+    [writer endArray];
+    [writer endDictionary];
+    NSData* body = [writer data];
+    [writer release];
+    NSAssert(body, @"Couldn't encode documents as JSON");
     
     [self beginDocumentOperation: self];
-    RESTOperation* op = [[self childWithPath: @"_bulk_docs"] POSTJSON: body parameters: nil];
+    NSDictionary* params = [NSDictionary dictionaryWithObject: @"application/json"
+                                                       forKey: @"Content-Type"];
+    RESTOperation* op = [[self childWithPath: @"_bulk_docs"] POST: body parameters: params];
+    op.priority = kRESTPriorityBackground;
     [op onCompletion: ^{
         if (op.isSuccessful) {
             NSArray* responses = $castIf(NSArray, op.responseBody.fromJSON);
@@ -240,17 +296,23 @@ static const NSUInteger kDocRetainLimit = 50;
             int i = 0;
             for (id response in responses) {
                 NSDictionary* responseDict = $castIf(NSDictionary, response);
+                NSDictionary* entry = [entries objectAtIndex: i];
                 CouchDocument* document;
+                BOOL deletesOtherLeaf = NO;
                 if (revisions) {
                     id revOrDoc = [revisions objectAtIndex: i];
-                    if ([revOrDoc isKindOfClass: [CouchRevision class]])
+                    if ([revOrDoc isKindOfClass: [CouchRevision class]]) {
                         document = [revOrDoc document];
-                    else
+                        // Deleting a conflicting leaf doesn't change the current revision:
+                        NSString* currentID = document.currentRevisionID;
+                        deletesOtherLeaf = (entry == sDeletedProperties && currentID &&
+                                            ![[revOrDoc revisionID] isEqualToString: currentID]);
+                    } else
                         document = revOrDoc;
                 } else
                     document = [self documentWithID: [responseDict objectForKey: @"id"]];
-                [document bulkSaveCompleted: responseDict
-                              forProperties: [entries objectAtIndex: i]];
+                if (!deletesOtherLeaf)
+                    [document bulkSaveCompleted: responseDict forProperties: entry];
                 [op.resultObject addObject: document];
                 ++i;
             }
@@ -295,11 +357,22 @@ static const NSUInteger kDocRetainLimit = 50;
 }
 
 
+- (void) operationDidComplete: (RESTOperation*)op {
+    [super operationDidComplete: op];
+    // A write may have changed what local views would emit. (Queries aren't writes, even when
+    // they're POSTs.)
+    if (_localViews.count && !op.isReadOnly && ![op.resource isKindOfClass: [CouchQuery class]]) {
+        for (CouchLocalView* view in _localViews.allValues)
+            [view databaseChanged];
+    }
+}
+
+
 - (void) endDocumentOperation: (CouchResource*)resource {
     NSAssert([_busyDocuments containsObject: resource], @"unbalanced endDocumentOperation call: %p %@", resource, resource);
     [_busyDocuments removeObject: resource];
     COUCHLOG(@"<<<<<< %lu docs being updated", (unsigned long)_busyDocuments.count);
-    if (_busyDocuments.count == 0)
+    if (_deferredChanges.count)
         [self processDeferredChanges];
 }
 
@@ -308,6 +381,13 @@ static const NSUInteger kDocRetainLimit = 50;
 #pragma mark QUERIES
 
 
+- (NSMutableDictionary*) localViews {
+    if (!_localViews)
+        _localViews = [[NSMutableDictionary alloc] init];
+    return _localViews;
+}
+
+
 - (CouchQuery*) getAllDocuments {
     CouchQuery *query = [[[CouchQuery alloc] initWithParent: self relativePath: @"_all_docs"] autorelease];
     query.prefetch = YES;
@@ -432,7 +512,7 @@ static const NSUInteger kDocRetainLimit = 50;
 
 
 - (void) setLastSequenceNumber:(NSUInteger)lastSequenceNumber {
-    _lastSequenceNumber = lastSequenceNumber;
+    _lastSequenceNumber = _highestProcessedSequence = lastSequenceNumber;
     _lastSequenceNumberKnown = YES;
 }
 
@@ -454,21 +534,33 @@ static const NSUInteger kDocRetainLimit = 50;
     if (!sequenceObj)
         return;
     NSUInteger sequence = [sequenceObj intValue];
-    if (sequence <= _lastSequenceNumber)
-        return;
-    
-    if (_busyDocuments.count) {
-        // Don't process changes while I have pending PUT/POST/DELETEs out. Wait till they finish,
-        // so I don't think the change is external.
-        COUCHLOG2(@"CouchDatabase deferring change (seq %lu) till operations finish", 
-              (unsigned long)sequence);
-        if (!_deferredChanges)
-            _deferredChanges = [[NSMutableArray alloc] init];
-        [_deferredChanges addObject: change];
+    if (sequence <= MAX(_lastSequenceNumber, _highestProcessedSequence))
+        return;     // already processed (or, if it's below a held change, maybe held)
+
+    NSString* docID = $castIf(NSString, [change objectForKey: @"id"]);
+    if (docID && ([_deferredChanges objectForKey: docID] || [self isDocumentBusy: docID])) {
+        // Don't process changes to a document while I have a PUT/POST/DELETE of it out. Wait till
+        // it finishes, so I don't think the change is external. (And once one change to a document
+        // is held, hold later ones too, so they stay in order.)
+        COUCHLOG2(@"CouchDatabase deferring change (seq %lu) to '%@' till operations finish",
+              (unsigned long)sequence, docID);
+        [self deferChange: change forDocument: docID];
         return;
     }
-    
-    self.lastSequenceNumber = sequence;
+    [self processChange: change sequence: sequence];
+}
+
+
+- (void) processChange: (NSDictionary*)change sequence: (NSUInteger)sequence {
+    // Don't count the sequence as reached while there are earlier changes still held:
+    _highestProcessedSequence = MAX(_highestProcessedSequence, sequence);
+    NSUInteger lowestDeferred = self.lowestDeferredSequence;
+    _lastSequenceNumber = MAX(_lastSequenceNumber,
+                              lowestDeferred ? MIN(_highestProcessedSequence, lowestDeferred - 1)
+                                             : _highestProcessedSequence);
+    _lastSequenceNumberKnown = YES;
+    for (CouchLocalView* view in _localViews.allValues)
+        [view databaseChanged];
     
     // Get document:
     NSString* docID = [change objectForKey: @"id"];
@@ -477,6 +569,7 @@ static const NSUInteger kDocRetainLimit = 50;
     // Notify!
     NSDictionary* userInfo = nil;
     BOOL isExternalChange = [document notifyChanged: change];
+    [_documentMirror databaseReachedSequence: _lastSequenceNumber];
     if (isExternalChange) {
         COUCHLOG(@"CouchDatabase: External change with seq=%lu", (unsigned long)sequence);
         userInfo = [NSDictionary dictionaryWithObject: (id)kCFBooleanTrue forKey: @"external"];
@@ -501,13 +594,92 @@ static const NSUInteger kDocRetainLimit = 50;
 }
 
 
+
+// Is a write to this document in progress?
+- (BOOL) isDocumentBusy: (NSString*)docID {
+    for (CouchResource* resource in _busyDocuments) {
+        if (resource == self)
+            return YES;     // a _bulk_docs write, which may touch any document
+        NSString* busyID = [(CouchDocument*)resource documentID];
+        if (busyID) {
+            if ([busyID isEqualToString: docID])
+                return YES;
+        } else {
+            // A document being created by a POST doesn't know its ID yet, so it might be any
+            // document I haven't heard of:
+            NSString* path = _documentPathMap ? _documentPathMap(docID) : docID;
+            if (![_docCache resourceWithRelativePath: path])
+                return YES;
+        }
+    }
+    return NO;
+}
+
+
+- (void) deferChange: (NSDictionary*)change forDocument: (NSString*)docID {
+    if (!_deferredChanges)
+        _deferredChanges = [[NSMutableDictionary alloc] init];
+    NSMutableArray* changes = [_deferredChanges objectForKey: docID];
+    if (!changes) {
+        changes = [NSMutableArray array];
+        [_deferredChanges setObject: changes forKey: docID];
+    } else {
+        // If the tracker restarted, it may be delivering a change I'm already holding:
+        id sequence = [change objectForKey: @"seq"];
+        for (NSDictionary* held in changes) {
+            if ([[held objectForKey: @"seq"] isEqual: sequence])
+                return;
+        }
+    }
+    [changes addObject: change];
+    if (++_deferredChangeCount >= kMaxDeferredChanges && !_tracker.deliveryPaused) {
+        // Enough; let the rest wait in the tracker's queue, and then in the socket:
+        COUCHLOG(@"CouchDatabase: %lu changes deferred; pausing change tracker",
+                 (unsigned long)_deferredChangeCount);
+        _tracker.deliveryPaused = YES;
+    }
+}
+
+
+// The sequence of the earliest held change, or 0 if none are held.
+- (NSUInteger) lowestDeferredSequence {
+    NSUInteger lowest = 0;
+    for (NSArray* changes in _deferredChanges.objectEnumerator) {
+        // Each document's changes are in sequence order, so the first is its lowest:
+        NSUInteger sequence = [[[changes objectAtIndex: 0] objectForKey: @"seq"] intValue];
+        if (lowest == 0 || sequence < lowest)
+            lowest = sequence;
+    }
+    return lowest;
+}
+
+
+static NSInteger compareSequences(id change1, id change2, void* context) {
+    NSUInteger seq1 = [[change1 objectForKey: @"seq"] intValue];
+    NSUInteger seq2 = [[change2 objectForKey: @"seq"] intValue];
+    return seq1 < seq2 ? NSOrderedAscending : (seq1 > seq2 ? NSOrderedDescending : NSOrderedSame);
+}
+
+
+// Processes the held changes of documents that are no longer being written, in sequence order.
 - (void) processDeferredChanges {
-    NSArray* changes = [_deferredChanges autorelease];
-    _deferredChanges = nil;
-    
-    for (NSDictionary* change in changes) {
-        [self changeTrackerReceivedChange: change];
+    NSMutableArray* ready = nil;
+    for (NSString* docID in _deferredChanges.allKeys) {
+        if (![self isDocumentBusy: docID]) {
+            NSArray* changes = [_deferredChanges objectForKey: docID];
+            if (!ready)
+                ready = [NSMutableArray arrayWithArray: changes];
+            else
+                [ready addObjectsFromArray: changes];
+            _deferredChangeCount -= changes.count;
+            [_deferredChanges removeObjectForKey: docID];
+        }
     }
+    [ready sortUsingFunction: compareSequences context: NULL];
+    for (NSDictionary* change in ready)
+        [self processChange: change sequence: [[change objectForKey: @"seq"] intValue]];
+    if (_deferredChangeCount < kMaxDeferredChanges)
+        _tracker.deliveryPaused = NO;
 }
 
 
@@ -518,16 +690,32 @@ static const NSUInteger kDocRetainLimit = 50;
 
 
 - (BOOL) tracksChanges {
-    return _tracker != nil;
+    return _tracker != nil || _multiplexed;
+}
+
+
+// Called when the server's multiplexer stops (as when the server is closed.)
+- (void) changeMultiplexerStopped: (CouchChangeMultiplexer*)multiplexer {
+    _multiplexed = NO;
 }
 
 
 - (void) setTracksChanges: (BOOL)track {
-    if (track && !_tracker) {
+    if (track == self.tracksChanges)
+        return;
+    if (track && self.server.multiplexesChanges) {
+        // Share the server's feed instead of opening my own connection:
+        _multiplexed = YES;
+        [self.server.changeMultiplexer addDatabase: self];
+    } else if (!track && _multiplexed) {
+        [self.server.changeMultiplexer removeDatabase: self];
+        _multiplexed = NO;
+    } else if (track && !_tracker) {
         _tracker = [[CouchChangeTracker alloc] initWithDatabaseURL: self.URL
-                                                              mode: kContinuous
+                                                              mode: kAutomatic
                                                       lastSequence: self.lastSequenceNumber
                                                             client: self];
+        _tracker.retryPolicy = self.retryPolicy;
         [_tracker start];
     } else if (!track && _tracker) {
         [_tracker stop];
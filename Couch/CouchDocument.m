@@ -86,6 +86,7 @@ NSString* const kCouchDocumentChangeNotification = @"CouchDocumentChange";
         _currentRevisionID = [revisionID copy];
         [_currentRevision autorelease];
         _currentRevision = nil;
+        [self.database.documentMirror documentChanged: self.documentID revision: revisionID];
     }
 }
 
@@ -104,7 +105,16 @@ NSString* const kCouchDocumentChangeNotification = @"CouchDocumentChange";
             _currentRevision = [[CouchRevision alloc] initWithDocument: self
                                                             revisionID: _currentRevisionID];
         else if (self.relativePath) {
-            _currentRevision = [[CouchRevision alloc] initWithOperation: [self GET]];
+            CouchDocumentMirror* mirror = self.database.documentMirror;
+            NSDictionary* mirrored = [mirror propertiesOfDocument: self.documentID];
+            if (mirrored) {
+                _currentRevision = [[CouchRevision alloc] initWithDocument: self
+                                                                properties: mirrored];
+            } else {
+                _currentRevision = [[CouchRevision alloc] initWithOperation: [self GET]];
+                if (_currentRevision.propertiesAreLoaded && !_currentRevision.isDeleted)
+                    [mirror storeProperties: _currentRevision.properties];
+            }
             _currentRevisionID = [_currentRevision.revisionID copy];
         }
     }
@@ -147,6 +157,7 @@ NSString* const kCouchDocumentChangeNotification = @"CouchDocumentChange";
     _currentRevision = [[CouchRevision alloc] initWithOperation: op];
     [_currentRevisionID autorelease];
     _currentRevisionID = [_currentRevision.revisionID copy];
+    [self.database.documentMirror storeProperties: _currentRevision.properties];
 }
 
 
@@ -285,9 +296,10 @@ NSString* const kCouchDocumentChangeNotification = @"CouchDocumentChange";
 
 
 - (RESTOperation*) PUT: (NSData*)body
+                object: (id)object
             parameters: (NSDictionary*)parameters
 {
-    RESTOperation* op = [super PUT: body parameters: parameters];
+    RESTOperation* op = [super PUT: body object: object parameters: parameters];
     if (op.isPOST)                                          // I'm being created via a POST
         [self.database beginDocumentOperation: self];       // balanced in -createdByPOST:
     return op;
@@ -307,6 +319,7 @@ NSString* const kCouchDocumentChangeNotification = @"CouchDocumentChange";
     NSString* rev = $castIf(NSString, [changeDict objectForKey: @"rev"]);
     if (!rev)
         return NO;
+    [self.database.documentMirror documentChanged: self.documentID revision: rev];
     
     if ([_currentRevisionID isEqualToString: rev])
         return NO;
@@ -0,0 +1,77 @@
+//
+//  CouchDocumentMirror.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+@class CouchDatabase, RESTOperation;
+
+
+/** A persistent on-disk copy of document bodies, which survives relaunches so that documents read in an earlier session don't have to be fetched from the server again.
+    Attach one to a database by setting its documentMirror property. From then on, every current revision whose properties the database loads or saves is appended to the mirror, and a CouchDocument whose current revision isn't yet known looks in the mirror before GETting it from the server.
+    The mirror stores one revision per document, in an append-only log file, with a separate index (document ID -> revision and log position) that is rewritten periodically. When more than half the log is stale, it's compacted.
+    The mirror remembers the database sequence number it's known to be consistent with. When attached, it reads the database's _changes feed since that checkpoint (revision IDs only, no bodies) and forgets every document that changed; until that check has finished, lookups of documents by ID alone wait for it. Afterwards, changes reported by the database's change tracker keep it consistent and advance the checkpoint. Lookups of a specific revision ID never need validation, since a revision's contents never change.
+    If change tracking isn't enabled, external changes made during a session aren't noticed until the next launch, just as they aren't noticed by in-memory CouchRevisions. */
+@interface CouchDocumentMirror : NSObject
+{
+    @private
+    NSString* _path;
+    CouchDatabase* _database;
+    NSFileHandle* _log;
+    NSUInteger _generation;
+    unsigned long long _logLength, _liveLength;
+    NSMutableDictionary* _index;
+    NSUInteger _checkpoint;
+    BOOL _validated, _indexDirty;
+    RESTOperation* _validateOp;
+    NSUInteger _hitCount, _missCount;
+}
+
+/** Opens (or creates) a mirror stored in the directory at the given path.
+    Use a different directory for each database. */
+- (id) initWithPath: (NSString*)path error: (NSError**)outError;
+
+/** The directory the mirror is stored in. */
+@property (readonly) NSString* path;
+
+/** The database this mirror is attached to, if any. */
+@property (readonly) CouchDatabase* database;
+
+/** The database sequence number that the mirror is known to be up to date with. */
+@property (readonly) NSUInteger checkpoint;
+
+/** YES once the mirror has been checked against the database's changes since its checkpoint. */
+@property (readonly) BOOL validated;
+
+/** The number of documents stored. */
+@property (readonly) NSUInteger documentCount;
+
+/** The number of lookups answered from, and not found in, the mirror since it was opened. */
+@property (readonly) NSUInteger hitCount, missCount;
+
+/** Returns the stored properties of a document, if the mirror has its current revision.
+    This may block while the mirror is being validated. Returns nil if the mirror couldn't be validated. */
+- (NSDictionary*) propertiesOfDocument: (NSString*)docID;
+
+/** Returns the stored properties of a specific revision of a document, or nil. */
+- (NSDictionary*) propertiesOfDocument: (NSString*)docID revision: (NSString*)revisionID;
+
+/** Rewrites the log file without obsolete entries, and saves the index. */
+- (BOOL) compact: (NSError**)outError;
+
+/** Saves the index and closes the files. The database does this when the mirror is detached from it. */
+- (void) close;
+
+/** Forgets every document and resets the checkpoint. */
+- (void) removeAllDocuments;
+
+@end
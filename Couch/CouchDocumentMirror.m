@@ -0,0 +1,545 @@
+//
+//  CouchDocumentMirror.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+//
+// Log file format: a sequence of records, each a 4-byte big-endian length followed by that many
+// bytes of JSON. A record is either a document body (with "_id" and "_rev"), or a removal marker
+// {"_id": ..., "_removed": true}. CouchDB doesn't allow unknown top-level properties starting with
+// "_", so the marker can't be confused with a real document.
+//
+// Index file format: a binary property list with the log generation and length it covers, the
+// checkpoint, and a dictionary mapping each document ID to [revID, record offset, JSON length].
+// Any records past the indexed log length are replayed when the mirror is opened.
+//
+// Compaction writes a new log under the next generation's filename ("docs.log" is generation 0,
+// then "docs-1.log" and so on), and then saves an index naming it. Until that index is saved, the
+// old index and log are still a consistent pair; a crash at any point leaves one log that the
+// index doesn't name, which is deleted when the mirror is next opened.
+
+#import "CouchDocumentMirror.h"
+#import "CouchInternal.h"
+
+
+#define kIndexFormatVersion 1
+
+// How long to wait after a change before saving the index.
+static const NSTimeInterval kSaveIndexDelay = 5.0;
+
+// How long to wait before retrying a failed validation.
+static const NSTimeInterval kRetryValidateDelay = 30.0;
+
+// The log isn't compacted until it's at least this big.
+static const unsigned long long kMinCompactLength = 256 * 1024;
+
+
+@interface CouchDocumentMirror ()
+- (BOOL) replayLogFrom: (unsigned long long)offset;
+- (void) indexChanged;
+- (void) saveIndex;
+- (void) validate;
+@end
+
+
+@implementation CouchDocumentMirror
+
+
+- (NSString*) logPathForGeneration: (NSUInteger)generation {
+    NSString* name = generation ? [NSString stringWithFormat: @"docs-%lu.log",
+                                                            (unsigned long)generation]
+                                : @"docs.log";
+    return [_path stringByAppendingPathComponent: name];
+}
+
+- (NSString*) logPath {
+    return [self logPathForGeneration: _generation];
+}
+
+
+// Returns the generations of all the log files in the directory, in ascending order.
+- (NSArray*) logGenerations {
+    NSMutableArray* generations = [NSMutableArray array];
+    NSArray* names = [[NSFileManager defaultManager] contentsOfDirectoryAtPath: _path error: NULL];
+    for (NSString* name in names) {
+        if ([name isEqualToString: @"docs.log"])
+            [generations addObject: [NSNumber numberWithUnsignedInteger: 0]];
+        else if ([name hasPrefix: @"docs-"] && [name hasSuffix: @".log"]) {
+            NSInteger generation = [[name substringFromIndex: 5] integerValue];
+            if (generation > 0)
+                [generations addObject: [NSNumber numberWithInteger: generation]];
+        }
+    }
+    [generations sortUsingSelector: @selector(compare:)];
+    return generations;
+}
+
+- (NSString*) indexPath {
+    return [_path stringByAppendingPathComponent: @"docs.index"];
+}
+
+
+- (id) initWithPath: (NSString*)path error: (NSError**)outError {
+    NSParameterAssert(path);
+    self = [super init];
+    if (self) {
+        _path = [path copy];
+        _index = [[NSMutableDictionary alloc] init];
+        NSFileManager* fmgr = [NSFileManager defaultManager];
+        if (![fmgr createDirectoryAtPath: path withIntermediateDirectories: YES
+                              attributes: nil error: outError]) {
+            [self release];
+            return nil;
+        }
+        // Load the index, which names the current log file:
+        NSData* data = [NSData dataWithContentsOfFile: self.indexPath];
+        NSDictionary* plist = nil;
+        if (data)
+            plist = $castIf(NSDictionary, [NSPropertyListSerialization propertyListWithData: data
+                                                                                    options: 0
+                                                                                     format: NULL
+                                                                                      error: NULL]);
+        NSDictionary* docs = $castIf(NSDictionary, [plist objectForKey: @"docs"]);
+        NSArray* generations = self.logGenerations;
+        NSNumber* generation = [plist objectForKey: @"generation"] ?: [NSNumber numberWithInt: 0];
+        if (!docs || ![generations containsObject: generation]) {
+            // Without a usable index, the oldest log is the one that was in use; any newer one
+            // is from an interrupted compaction.
+            docs = nil;
+            generation = generations.count ? [generations objectAtIndex: 0] : generation;
+        }
+        _generation = generation.unsignedIntegerValue;
+        for (NSNumber* other in generations) {
+            if (![other isEqual: generation]) {
+                COUCHLOG(@"%@: Deleting stale log generation %@", self, other);
+                [fmgr removeItemAtPath: [self logPathForGeneration: other.unsignedIntegerValue]
+                                 error: NULL];
+            }
+        }
+
+        NSString* logPath = self.logPath;
+        if (![fmgr fileExistsAtPath: logPath])
+            [fmgr createFileAtPath: logPath contents: nil attributes: nil];
+        _log = [[NSFileHandle fileHandleForUpdatingAtPath: logPath] retain];
+        if (!_log) {
+            if (outError)
+                *outError = [NSError errorWithDomain: NSCocoaErrorDomain
+                                                code: NSFileReadNoPermissionError
+                                            userInfo: [NSDictionary dictionaryWithObject: logPath
+                                                                        forKey: NSFilePathErrorKey]];
+            [self release];
+            return nil;
+        }
+        unsigned long long fileLength = [_log seekToEndOfFile];
+
+        // Catch up with any records logged after the index was saved:
+        unsigned long long indexedLength = [[plist objectForKey: @"logLength"] unsignedLongLongValue];
+        if (docs && [[plist objectForKey: @"version"] intValue] == kIndexFormatVersion
+                 && indexedLength <= fileLength) {
+            [_index setDictionary: docs];
+            _checkpoint = [[plist objectForKey: @"checkpoint"] unsignedIntegerValue];
+            for (NSArray* entry in _index.allValues)
+                _liveLength += 4 + [[entry objectAtIndex: 2] unsignedLongLongValue];
+        } else {
+            // Index is missing or doesn't match the log; rebuild it, and since the checkpoint
+            // is lost, the whole database has to be checked again.
+            indexedLength = 0;
+        }
+        _logLength = indexedLength;
+        if (![self replayLogFrom: indexedLength])
+            _indexDirty = YES;
+        COUCHLOG(@"%@: Opened with %lu docs, checkpoint %lu",
+                 self, (unsigned long)_index.count, (unsigned long)_checkpoint);
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [self close];
+    [_path release];
+    [_index release];
+    [super dealloc];
+}
+
+
+@synthesize path=_path, database=_database, checkpoint=_checkpoint, validated=_validated,
+            hitCount=_hitCount, missCount=_missCount;
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%@]", [self class], _path.lastPathComponent];
+}
+
+
+- (NSUInteger) documentCount {
+    return _index.count;
+}
+
+
+- (void) close {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    RESTOperation* op = [_validateOp autorelease];
+    _validateOp = nil;
+    [op cancel];
+    _database = nil;
+    _validated = NO;
+    if (_log) {
+        [self saveIndex];
+        [_log closeFile];
+        [_log release];
+        _log = nil;
+    }
+}
+
+
+#pragma mark - LOG:
+
+
+// Reads log records starting at 'offset', applying them to the index. If the log ends with a
+// partial or corrupt record (probably from a crash in mid-write), truncates it and returns NO.
+- (BOOL) replayLogFrom: (unsigned long long)offset {
+    [_log seekToFileOffset: offset];
+    for (;;) {
+        NSData* header = [_log readDataOfLength: 4];
+        if (header.length == 0)
+            return YES;
+        NSDictionary* record = nil;
+        uint32_t length = 0;
+        if (header.length == 4) {
+            length = CFSwapInt32BigToHost(*(const uint32_t*)header.bytes);
+            NSData* json = [_log readDataOfLength: length];
+            if (json.length == length)
+                record = $castIf(NSDictionary, [RESTBody JSONObjectWithData: json]);
+        }
+        NSString* docID = $castIf(NSString, [record objectForKey: @"_id"]);
+        NSString* revID = $castIf(NSString, [record objectForKey: @"_rev"]);
+        BOOL removed = [[record objectForKey: @"_removed"] isEqual: (id)kCFBooleanTrue];
+        if (!docID || !(revID || removed)) {
+            Warn(@"%@: Truncating log after bad record at offset %llu", self, offset);
+            [_log truncateFileAtOffset: offset];
+            _logLength = offset;
+            return NO;
+        }
+        NSArray* old = [_index objectForKey: docID];
+        if (old)
+            _liveLength -= 4 + [[old objectAtIndex: 2] unsignedLongLongValue];
+        if (removed) {
+            [_index removeObjectForKey: docID];
+        } else {
+            [_index setObject: [NSArray arrayWithObjects: revID,
+                                [NSNumber numberWithUnsignedLongLong: offset],
+                                [NSNumber numberWithUnsignedInt: length], nil]
+                       forKey: docID];
+            _liveLength += 4 + length;
+        }
+        offset += 4 + length;
+        _logLength = offset;
+    }
+}
+
+
+- (unsigned long long) appendRecord: (NSDictionary*)record {
+    NSData* json = [RESTBody dataWithJSONObject: record];
+    if (!json || !_log)
+        return NSNotFound;
+    uint32_t header = CFSwapInt32HostToBig((uint32_t)json.length);
+    unsigned long long offset = _logLength;
+    [_log seekToFileOffset: offset];
+    [_log writeData: [NSData dataWithBytes: &header length: 4]];
+    [_log writeData: json];
+    _logLength += 4 + json.length;
+    [self indexChanged];
+    return offset;
+}
+
+
+// Schedules the index to be saved soon, if it isn't already.
+- (void) indexChanged {
+    if (!_indexDirty) {
+        _indexDirty = YES;
+        [self performSelector: @selector(saveIndex) withObject: nil afterDelay: kSaveIndexDelay];
+    }
+}
+
+
+- (void) saveIndex {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self selector: @selector(saveIndex)
+                                               object: nil];
+    if (!_indexDirty || !_log)
+        return;
+    // The index mustn't refer to log data that isn't safely on disk yet:
+    [_log synchronizeFile];
+    NSDictionary* plist = [NSDictionary dictionaryWithObjectsAndKeys:
+                           [NSNumber numberWithInt: kIndexFormatVersion], @"version",
+                           [NSNumber numberWithUnsignedInteger: _generation], @"generation",
+                           [NSNumber numberWithUnsignedLongLong: _logLength], @"logLength",
+                           [NSNumber numberWithUnsignedInteger: _checkpoint], @"checkpoint",
+                           _index, @"docs",
+                           nil];
+    NSError* error;
+    NSData* data = [NSPropertyListSerialization dataWithPropertyList: plist
+                                                              format: NSPropertyListBinaryFormat_v1_0
+                                                             options: 0
+                                                               error: &error];
+    if (![data writeToFile: self.indexPath options: NSDataWritingAtomic error: &error]) {
+        Warn(@"%@: Couldn't save index: %@", self, error);
+        return;
+    }
+    _indexDirty = NO;
+
+    if (_logLength > kMinCompactLength && _logLength > 2 * _liveLength)
+        [self compact: NULL];
+}
+
+
+- (BOOL) compact: (NSError**)outError {
+    if (!_log)
+        return NO;
+    // The new log gets the next generation's name; the old index and log stay untouched, and
+    // remain a consistent pair, until an index naming the new log has been saved.
+    NSString* oldLogPath = self.logPath;
+    NSString* newLogPath = [self logPathForGeneration: _generation + 1];
+    [[NSFileManager defaultManager] createFileAtPath: newLogPath contents: nil attributes: nil];
+    NSFileHandle* newLog = [NSFileHandle fileHandleForUpdatingAtPath: newLogPath];
+    if (!newLog) {
+        if (outError)
+            *outError = [NSError errorWithDomain: NSCocoaErrorDomain
+                                            code: NSFileWriteUnknownError
+                                        userInfo: [NSDictionary dictionaryWithObject: newLogPath
+                                                                    forKey: NSFilePathErrorKey]];
+        return NO;
+    }
+
+    // Copy the live records, in log order so related writes stay close together:
+    NSArray* docIDs = [_index keysSortedByValueUsingComparator: ^(id a, id b) {
+        return [[a objectAtIndex: 1] compare: [b objectAtIndex: 1]];
+    }];
+    NSMutableDictionary* newIndex = [NSMutableDictionary dictionaryWithCapacity: _index.count];
+    unsigned long long offset = 0;
+    for (NSString* docID in docIDs) {
+        NSArray* entry = [_index objectForKey: docID];
+        unsigned long long length = 4 + [[entry objectAtIndex: 2] unsignedLongLongValue];
+        [_log seekToFileOffset: [[entry objectAtIndex: 1] unsignedLongLongValue]];
+        [newLog writeData: [_log readDataOfLength: (NSUInteger)length]];
+        [newIndex setObject: [NSArray arrayWithObjects: [entry objectAtIndex: 0],
+                              [NSNumber numberWithUnsignedLongLong: offset],
+                              [entry objectAtIndex: 2], nil]
+                     forKey: docID];
+        offset += length;
+    }
+
+    COUCHLOG(@"%@: Compacted log from %llu to %llu bytes", self, _logLength, offset);
+    [_log closeFile];
+    [_log release];
+    _log = [newLog retain];
+    ++_generation;
+    [_index setDictionary: newIndex];
+    _logLength = _liveLength = offset;
+    _indexDirty = YES;
+    [self saveIndex];       // syncs the new log first
+    if (_indexDirty) {
+        // The saved index still names the old log, so keep it; whichever log the saved index
+        // doesn't name is deleted when the mirror is next opened.
+        if (outError)
+            *outError = [NSError errorWithDomain: NSCocoaErrorDomain
+                                            code: NSFileWriteUnknownError
+                                        userInfo: [NSDictionary dictionaryWithObject: self.indexPath
+                                                                    forKey: NSFilePathErrorKey]];
+        return NO;
+    }
+    [[NSFileManager defaultManager] removeItemAtPath: oldLogPath error: NULL];
+    return YES;
+}
+
+
+- (void) removeAllDocuments {
+    [_index removeAllObjects];
+    [_log truncateFileAtOffset: 0];
+    _logLength = _liveLength = 0;
+    _checkpoint = 0;
+    _indexDirty = YES;
+    [self saveIndex];
+}
+
+
+#pragma mark - LOOKUP:
+
+
+// Reads the record an index entry points to. If it isn't the revision the entry says it is (the
+// index and log don't match, perhaps after a crash) the entry is dropped, and it's a miss.
+- (NSDictionary*) readEntry: (NSArray*)entry ofDocument: (NSString*)docID {
+    [_log seekToFileOffset: [[entry objectAtIndex: 1] unsignedLongLongValue] + 4];
+    NSData* json = [_log readDataOfLength: [[entry objectAtIndex: 2] unsignedIntValue]];
+    NSDictionary* properties = $castIf(NSDictionary, [RESTBody JSONObjectWithData: json]);
+    if (!$equal([properties objectForKey: @"_id"], docID)
+            || !$equal([properties objectForKey: @"_rev"], [entry objectAtIndex: 0])) {
+        COUCHLOG(@"%@: Log record for %@ at offset %@ doesn't match the index; dropping it",
+                 self, docID, [entry objectAtIndex: 1]);
+        _liveLength -= 4 + [[entry objectAtIndex: 2] unsignedLongLongValue];
+        [_index removeObjectForKey: docID];
+        [self indexChanged];
+        return nil;
+    }
+    return properties;
+}
+
+
+- (NSDictionary*) propertiesOfDocument: (NSString*)docID {
+    if (!_validated && _validateOp)
+        [[[_validateOp retain] autorelease] wait];
+    NSArray* entry = _validated ? [_index objectForKey: docID] : nil;
+    NSDictionary* properties = entry ? [self readEntry: entry ofDocument: docID] : nil;
+    if (properties)
+        ++_hitCount;
+    else
+        ++_missCount;
+    return properties;
+}
+
+
+- (NSDictionary*) propertiesOfDocument: (NSString*)docID revision: (NSString*)revisionID {
+    NSArray* entry = [_index objectForKey: docID];
+    NSDictionary* properties = nil;
+    if ([[entry objectAtIndex: 0] isEqualToString: revisionID])
+        properties = [self readEntry: entry ofDocument: docID];
+    if (properties)
+        ++_hitCount;
+    else
+        ++_missCount;
+    return properties;
+}
+
+
+#pragma mark - UPDATING:
+
+
+- (void) storeProperties: (NSDictionary*)properties {
+    // Until validated, I can't tell whether a body is newer than my checkpoint, so don't keep it.
+    if (!_validated)
+        return;
+    NSString* docID = $castIf(NSString, [properties objectForKey: @"_id"]);
+    NSString* revID = $castIf(NSString, [properties objectForKey: @"_rev"]);
+    if (!docID || !revID)
+        return;
+    if ([[properties objectForKey: @"_deleted"] isEqual: (id)kCFBooleanTrue]) {
+        [self documentChanged: docID revision: revID];
+        return;
+    }
+    NSArray* old = [_index objectForKey: docID];
+    if ([[old objectAtIndex: 0] isEqualToString: revID])
+        return;
+    unsigned long long offset = [self appendRecord: properties];
+    if (offset == NSNotFound)
+        return;
+    if (old)
+        _liveLength -= 4 + [[old objectAtIndex: 2] unsignedLongLongValue];
+    unsigned long long length = _logLength - offset - 4;
+    [_index setObject: [NSArray arrayWithObjects: revID,
+                        [NSNumber numberWithUnsignedLongLong: offset],
+                        [NSNumber numberWithUnsignedLongLong: length], nil]
+               forKey: docID];
+    _liveLength += 4 + length;
+}
+
+
+- (void) documentChanged: (NSString*)docID revision: (NSString*)revisionID {
+    NSArray* old = [_index objectForKey: docID];
+    if (!old || [[old objectAtIndex: 0] isEqualToString: revisionID])
+        return;
+    [self appendRecord: [NSDictionary dictionaryWithObjectsAndKeys:
+                         docID, @"_id", (id)kCFBooleanTrue, @"_removed", nil]];
+    _liveLength -= 4 + [[old objectAtIndex: 2] unsignedLongLongValue];
+    [_index removeObjectForKey: docID];
+}
+
+
+- (void) databaseReachedSequence: (NSUInteger)sequence {
+    // Before validation, the changes between my checkpoint and this one haven't been checked.
+    if (_validated && sequence > _checkpoint) {
+        _checkpoint = sequence;
+        [self indexChanged];
+    }
+}
+
+
+#pragma mark - VALIDATION:
+
+
+- (void) attachToDatabase: (CouchDatabase*)database {
+    if (database == _database)
+        return;
+    NSAssert(!_database || !database, @"%@ is already attached to %@", self, _database);
+    if (!database) {
+        [self close];
+        return;
+    }
+    _database = database;   // not retained; the database owns me
+    [self validate];
+}
+
+
+// Checks the database's changes since my checkpoint, forgetting documents that changed.
+- (void) validate {
+    if (!_database || _validateOp)
+        return;
+    RESTOperation* op;
+    BOOL empty = (_index.count == 0);
+    if (empty) {
+        // Nothing to check; just find out the current sequence number:
+        op = [_database sendHTTP: @"GET" parameters: nil];
+    } else {
+        NSDictionary* params = [NSDictionary dictionaryWithObject:
+                                    [NSNumber numberWithUnsignedLong: _checkpoint]
+                                                           forKey: @"?since"];
+        op = [[_database childWithPath: @"_changes"] sendHTTP: @"GET" parameters: params];
+    }
+    _validateOp = [op retain];
+    [op onCompletion: ^{
+        if (op != _validateOp)
+            return;     // I was closed
+        [_validateOp autorelease];
+        _validateOp = nil;
+        NSDictionary* response = $castIf(NSDictionary, op.responseBody.fromJSON);
+        NSNumber* lastSeq = $castIf(NSNumber, [response objectForKey: empty ? @"update_seq"
+                                                                            : @"last_seq"]);
+        if (!op.isSuccessful || !lastSeq) {
+            COUCHLOG(@"%@: Couldn't validate: %@", self, op.error);
+            [self performSelector: @selector(validate) withObject: nil
+                       afterDelay: kRetryValidateDelay];
+            return;
+        }
+        NSUInteger sequence = lastSeq.unsignedIntegerValue;
+        if (sequence < _checkpoint) {
+            // The database must have been deleted and recreated:
+            COUCHLOG(@"%@: Database is older than my checkpoint; discarding all docs", self);
+            [self removeAllDocuments];
+        } else {
+            NSUInteger before = _index.count;
+            for (NSDictionary* change in $castIf(NSArray, [response objectForKey: @"results"])) {
+                NSString* docID = $castIf(NSString, [change objectForKey: @"id"]);
+                NSDictionary* changeDict = $castIf(NSDictionary,
+                                        [$castIf(NSArray, [change objectForKey: @"changes"]) lastObject]);
+                NSString* revID = $castIf(NSString, [changeDict objectForKey: @"rev"]);
+                if (docID && revID)
+                    [self documentChanged: docID revision: revID];
+            }
+            COUCHLOG(@"%@: Validated through seq %lu; %lu of %lu docs changed",
+                     self, (unsigned long)sequence, (unsigned long)(before - _index.count),
+                     (unsigned long)before);
+        }
+        _validated = YES;
+        [self databaseReachedSequence: sequence];
+    }];
+}
+
+
+@end
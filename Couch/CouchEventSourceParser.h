@@ -0,0 +1,42 @@
+//
+//  CouchEventSourceParser.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+
+/** Incremental parser for a "text/event-stream" response, as sent by CouchDB's _changes?feed=eventsource.
+    Feed it the response body in whatever pieces it arrives in; it returns the payloads of the events completed so far. Comments and events other than the default "message" type (like CouchDB's heartbeats) are skipped.
+    <http://www.w3.org/TR/eventsource/#parsing-an-event-stream> */
+@interface CouchEventSourceParser : NSObject
+{
+    @private
+    NSMutableData* _buffer;
+    NSMutableData* _data;
+    NSString* _eventType;
+    NSString* _lastEventID;
+}
+
+/** Parses more of the stream. Returns the "data" of each event that was completed, as NSData (multiple data lines are joined with newlines), or nil if none were. */
+- (NSArray*) eventsFromData: (NSData*)data;
+
+/** The "id" field of the most recent event, or nil. */
+@property (readonly) NSString* lastEventID;
+
+/** Number of bytes received but not yet returned as part of an event. */
+@property (readonly) NSUInteger bufferedLength;
+
+/** Discards any partial event, e.g. after the connection is lost. */
+- (void) reset;
+
+@end
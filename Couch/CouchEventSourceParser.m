@@ -0,0 +1,123 @@
+//
+//  CouchEventSourceParser.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchEventSourceParser.h"
+
+
+@implementation CouchEventSourceParser
+
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _buffer = [[NSMutableData alloc] init];
+        _data = [[NSMutableData alloc] init];
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_buffer release];
+    [_data release];
+    [_eventType release];
+    [_lastEventID release];
+    [super dealloc];
+}
+
+
+@synthesize lastEventID=_lastEventID;
+
+
+- (NSUInteger) bufferedLength {
+    return _buffer.length + _data.length;
+}
+
+
+- (void) reset {
+    [_buffer setLength: 0];
+    [_data setLength: 0];
+    [_eventType release];
+    _eventType = nil;
+}
+
+
+// A blank line ends the event being built up.
+- (void) dispatchEventTo: (NSMutableArray*)events {
+    BOOL isMessage = !_eventType || [_eventType isEqualToString: @"message"];
+    if (_data.length > 0 && isMessage) {
+        // Remove the newline appended after the last data line:
+        NSData* data = [NSData dataWithBytes: _data.bytes length: _data.length - 1];
+        [events addObject: data];
+    }
+    [_data setLength: 0];
+    [_eventType release];
+    _eventType = nil;
+}
+
+
+- (void) processLine: (const char*)line length: (size_t)length {
+    if (length > 0 && line[0] == ':')
+        return;     // comment
+    const char* colon = memchr(line, ':', length);
+    size_t nameLength = colon ? (size_t)(colon - line) : length;
+    const char* value = colon ? colon + 1 : line + length;
+    if (value < line + length && *value == ' ')
+        ++value;
+    size_t valueLength = line + length - value;
+
+    if (nameLength == 4 && memcmp(line, "data", 4) == 0) {
+        [_data appendBytes: value length: valueLength];
+        [_data appendBytes: "\n" length: 1];
+    } else {
+        NSString* str = [[[NSString alloc] initWithBytes: value length: valueLength
+                                                encoding: NSUTF8StringEncoding] autorelease];
+        if (nameLength == 5 && memcmp(line, "event", 5) == 0) {
+            [_eventType release];
+            _eventType = [str copy];
+        } else if (nameLength == 2 && memcmp(line, "id", 2) == 0) {
+            [_lastEventID release];
+            _lastEventID = [str copy];
+        }
+        // Other fields, including "retry", are ignored; the tracker has its own retry policy.
+    }
+}
+
+
+- (NSArray*) eventsFromData: (NSData*)data {
+    [_buffer appendData: data];
+    NSMutableArray* events = nil;
+    const char* start = _buffer.bytes;
+    const char* end = start + _buffer.length;
+    const char* line = start;
+    const char* eol;
+    while (NULL != (eol = memchr(line, '\n', end - line))) {
+        size_t length = eol - line;
+        if (length > 0 && line[length - 1] == '\r')
+            --length;
+        if (length == 0) {
+            if (!events)
+                events = [NSMutableArray array];
+            [self dispatchEventTo: events];
+        } else {
+            [self processLine: line length: length];
+        }
+        line = eol + 1;
+    }
+    [_buffer replaceBytesInRange: NSMakeRange(0, line - start) withBytes: NULL length: 0];
+    return events.count ? events : nil;
+}
+
+
+@end
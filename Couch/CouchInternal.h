@@ -15,6 +15,9 @@
 
 #import "CouchCocoa.h"
 #import "RESTInternal.h"
+#import "CouchPropertyStore.h"
+#import "CouchModelFactory.h"
+@class CouchChangeMultiplexer;
 
 
 #define COUCHLOG  if(gCouchLogLevel < 1) ; else NSLog
@@ -26,6 +29,11 @@
 typedef void (^OnDatabaseChangeBlock)(CouchDocument*, BOOL externalChange);
 
 
+/** Orders leaf revisions the way CouchDB picks the current one: live before deleted, then highest generation first, with ties broken by comparing the revision IDs. (Defined in CouchRevisionTree.m) */
+NSComparisonResult CouchCompareLeaves(NSString* revID1, BOOL deleted1,
+                                      NSString* revID2, BOOL deleted2);
+
+
 @interface CouchAttachment ()
 - (id) initWithParent: (CouchResource*)parent       // must be CouchDocument or CouchRevision
                  name: (NSString*)name
@@ -40,6 +48,26 @@ typedef void (^OnDatabaseChangeBlock)(CouchDocument*, BOOL externalChange);
 - (void) onChange: (OnDatabaseChangeBlock)block;  // convenience for unit tests
 - (void) unretainDocumentCache;
 - (void) changeTrackerReceivedChange: (NSDictionary*)change;
+- (void) changeMultiplexerStopped: (CouchChangeMultiplexer*)multiplexer;
+@property (readonly) NSMutableDictionary* localViews;
+@end
+
+
+@interface CouchLocalView ()
+- (id) initWithDatabase: (CouchDatabase*)database
+                   name: (NSString*)name
+                    map: (CouchMapBlock)map
+                 reduce: (CouchReduceBlock)reduce;
+- (void) databaseChanged;
+- (void) databaseClosed;
+@end
+
+
+@interface CouchDocumentMirror ()
+- (void) attachToDatabase: (CouchDatabase*)database;
+- (void) storeProperties: (NSDictionary*)properties;
+- (void) documentChanged: (NSString*)docID revision: (NSString*)revisionID;
+- (void) databaseReachedSequence: (NSUInteger)sequence;
 @end
 
 
@@ -67,6 +95,7 @@ typedef void (^OnDatabaseChangeBlock)(CouchDocument*, BOOL externalChange);
 - (id) initWithOperation: (RESTOperation*)operation;
 @property (readwrite) BOOL isDeleted;
 @property (readwrite, copy) NSDictionary* properties;
+@property (readonly) CouchPropertyStore* propertyStore;
 @end
 
 
@@ -86,10 +115,24 @@ typedef void (^OnDatabaseChangeBlock)(CouchDocument*, BOOL externalChange);
 
 @interface CouchServer ()
 @property (readonly) CouchDatabase* replicatorDatabase;
+@property (readonly) CouchChangeMultiplexer* changeMultiplexer;
 @property (readonly) BOOL isEmbeddedServer;
 - (CouchPersistentReplication*) replicationWithSource: (NSString*)source
                                                target: (NSString*)target;
 - (void) registerActiveTask: (NSDictionary*)activeTask;
+- (NSDictionary*) activeReplicationTaskWithID: (NSString*)replicationID;
+- (void) replicationStateChanged;
+@end
+
+
+@interface CouchModel ()
+- (void) forgetUnchangedProperties;
+@end
+
+
+@interface CouchModelFactory () <RESTMemoryConsumer>
+- (void) model: (CouchModel*)model cachedValueCountChangedFrom: (NSUInteger)oldCount
+            to: (NSUInteger)newCount;
 @end
 
 
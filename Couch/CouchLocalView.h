@@ -0,0 +1,83 @@
+//
+//  CouchLocalView.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchDatabase.h"
+#import "CouchbaseCallbacks.h"
+#import "RESTBackend.h"
+@class RESTOperation;
+
+
+/** A view whose index is built and kept in memory on the client, from native map/reduce blocks.
+    This works with any server, not just an embedded one. The index is built from the database's _changes feed (with document bodies), and then kept up to date incrementally: only documents that changed since the last update are re-mapped. The view turns on its database's change tracking, so it hears about external changes; changes made through this CouchDatabase mark it out of date immediately.
+    Query it like any other view, through the CouchQuery returned by -query (or a CouchLiveQuery made from that.) The query is answered from memory, without a round trip, unless the index first needs to catch up. The query options supported are startKey/endKey (with startKeyDocID/endKeyDocID), keys, descending, skip, limit, prefetch, mapOnly, groupLevel and stale.
+    Keys are sorted in CouchDB's collation order, except that strings are compared with a simple case-insensitive comparison (lowercase before uppercase) rather than full ICU collation. */
+@interface CouchLocalView : NSObject <RESTBackend>
+{
+    @private
+    CouchDatabase* _database;
+    NSString* _name;
+    CouchMapBlock _map;
+    CouchReduceBlock _reduce;
+    NSMutableArray* _rows;
+    NSMutableDictionary* _rowsByDocID;
+    NSMutableDictionary* _docs;
+    NSUInteger _lastSequence;
+    BOOL _built, _stale;
+    RESTOperation* _updateOp;
+    NSMutableArray* _waitingOps;
+}
+
+/** The database being indexed. */
+@property (readonly) CouchDatabase* database;
+
+/** The view's name. */
+@property (readonly) NSString* name;
+
+/** The sequence number of the last change that has been indexed. */
+@property (readonly) NSUInteger lastSequence;
+
+/** The number of rows in the index (before any reduce.) */
+@property (readonly) NSUInteger rowCount;
+
+/** Returns a new query of this view. */
+- (CouchQuery*) query;
+
+/** Brings the index up to date, asynchronously. Queries do this automatically when necessary, so you'd only need to call it to build the index ahead of time. */
+- (void) update;
+
+/** Throws away the index; it'll be rebuilt from scratch when next queried. Call this if you change the behavior of the map block. */
+- (void) invalidate;
+
+@end
+
+
+@interface CouchDatabase (LocalViews)
+
+/** Defines a view with native map/reduce blocks, indexed locally by a CouchLocalView.
+    Like other native views, the blocks aren't stored anywhere, so define the view on every launch. Redefining an existing view name replaces it, and its index.
+    @param name  The view name; unique within this database object.
+    @param map  The map block. It must be a pure function of the document, as with any view.
+    @param reduce  The reduce block, or nil.
+    @return  The new view. */
+- (CouchLocalView*) defineLocalViewNamed: (NSString*)name
+                                     map: (CouchMapBlock)map
+                                  reduce: (CouchReduceBlock)reduce;
+
+/** Returns the local view with the given name, or nil if it hasn't been defined. */
+- (CouchLocalView*) localViewNamed: (NSString*)name;
+
+/** Deletes a local view, and its index. */
+- (void) deleteLocalViewNamed: (NSString*)name;
+
+@end
@@ -0,0 +1,537 @@
+//
+//  CouchLocalView.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+//
+// <http://wiki.apache.org/couchdb/View_collation>
+
+#import "CouchLocalView.h"
+#import "CouchInternal.h"
+
+
+// Maximum number of changes to read per _changes request while updating the index.
+#define kChangesBatchSize 1000
+
+
+#pragma mark - COLLATION:
+
+
+// Ranks JSON types in CouchDB view collation order.
+static int typeRank(id obj) {
+    if (!obj || obj == [NSNull null])
+        return 0;
+    if ([obj isKindOfClass: [NSNumber class]]) {
+        if (obj == (id)kCFBooleanFalse)
+            return 1;
+        if (obj == (id)kCFBooleanTrue)
+            return 2;
+        return 3;
+    }
+    if ([obj isKindOfClass: [NSString class]])
+        return 4;
+    if ([obj isKindOfClass: [NSArray class]])
+        return 5;
+    return 6;
+}
+
+
+// Compares two JSON values in CouchDB view collation order. Strings are compared
+// case-insensitively, then with lowercase first, which approximates ICU collation.
+static NSComparisonResult collate(id a, id b) {
+    int ra = typeRank(a), rb = typeRank(b);
+    if (ra != rb)
+        return ra < rb ? NSOrderedAscending : NSOrderedDescending;
+    switch (ra) {
+        case 3: {
+            double da = [a doubleValue], db = [b doubleValue];
+            return da < db ? NSOrderedAscending : (da > db ? NSOrderedDescending : NSOrderedSame);
+        }
+        case 4: {
+            NSComparisonResult c = [a caseInsensitiveCompare: b];
+            return c ? c : [b compare: a];
+        }
+        case 5: {
+            NSUInteger na = [a count], nb = [b count];
+            for (NSUInteger i = 0; i < MIN(na, nb); i++) {
+                NSComparisonResult c = collate([a objectAtIndex: i], [b objectAtIndex: i]);
+                if (c)
+                    return c;
+            }
+            return na < nb ? NSOrderedAscending : (na > nb ? NSOrderedDescending : NSOrderedSame);
+        }
+        case 6: {
+            // JSON objects compare by their key/value pairs; take the keys in sorted order,
+            // since dictionaries don't remember the order they were written in.
+            NSArray* ka = [[a allKeys] sortedArrayUsingSelector: @selector(compare:)];
+            NSArray* kb = [[b allKeys] sortedArrayUsingSelector: @selector(compare:)];
+            for (NSUInteger i = 0; i < MIN(ka.count, kb.count); i++) {
+                NSString* key = [ka objectAtIndex: i];
+                NSComparisonResult c = collate(key, [kb objectAtIndex: i]);
+                if (!c)
+                    c = collate([a objectForKey: key], [b objectForKey: key]);
+                if (c)
+                    return c;
+            }
+            return ka.count < kb.count ? NSOrderedAscending
+                 : (ka.count > kb.count ? NSOrderedDescending : NSOrderedSame);
+        }
+        default:
+            return NSOrderedSame;
+    }
+}
+
+
+// Compares a row to a key and (optionally) document ID.
+static NSComparisonResult compareRow(NSDictionary* row, id key, NSString* docID) {
+    NSComparisonResult c = collate([row objectForKey: @"key"], key);
+    if (c == NSOrderedSame && docID)
+        c = [[row objectForKey: @"id"] compare: docID];
+    return c;
+}
+
+
+// The key a row is grouped under, at a given group level.
+static id groupKey(id key, NSUInteger groupLevel) {
+    if ([key isKindOfClass: [NSArray class]] && [key count] > groupLevel)
+        return [key subarrayWithRange: NSMakeRange(0, groupLevel)];
+    return key;
+}
+
+
+@interface CouchLocalView ()
+- (void) answer: (RESTOperation*)op;
+@end
+
+
+@implementation CouchLocalView
+
+
+- (id) initWithDatabase: (CouchDatabase*)database
+                   name: (NSString*)name
+                    map: (CouchMapBlock)map
+                 reduce: (CouchReduceBlock)reduce
+{
+    NSParameterAssert(database);
+    NSParameterAssert(name);
+    NSParameterAssert(map);
+    self = [super init];
+    if (self) {
+        _database = database;   // not retained; the database owns me
+        _name = [name copy];
+        _map = [map copy];
+        _reduce = [reduce copy];
+        _rows = [[NSMutableArray alloc] init];
+        _rowsByDocID = [[NSMutableDictionary alloc] init];
+        _docs = [[NSMutableDictionary alloc] init];
+        _waitingOps = [[NSMutableArray alloc] init];
+        _stale = YES;
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [self databaseClosed];
+    [_name release];
+    [_map release];
+    [_reduce release];
+    [_rows release];
+    [_rowsByDocID release];
+    [_docs release];
+    [_waitingOps release];
+    [super dealloc];
+}
+
+
+@synthesize database=_database, name=_name, lastSequence=_lastSequence;
+
+
+- (NSUInteger) rowCount {
+    return _rows.count;
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%@/%@]", [self class], _database.relativePath, _name];
+}
+
+
+- (CouchQuery*) query {
+    NSString* path = [@"_local_view/" stringByAppendingString: _name];
+    CouchQuery* query = [[[CouchQuery alloc] initWithParent: _database relativePath: path]
+                                autorelease];
+    query.backend = self;
+    return query;
+}
+
+
+- (void) invalidate {
+    [_updateOp autorelease];
+    _updateOp = nil;
+    [_rows removeAllObjects];
+    [_rowsByDocID removeAllObjects];
+    [_docs removeAllObjects];
+    _lastSequence = 0;
+    _built = NO;
+    _stale = YES;
+    if (_waitingOps.count)
+        [self update];
+}
+
+
+- (void) failWaitingOps {
+    NSArray* waiting = [[_waitingOps copy] autorelease];
+    [_waitingOps removeAllObjects];
+    NSDictionary* body = [NSDictionary dictionaryWithObjectsAndKeys:
+                          @"not_found", @"error", @"Database closed", @"reason", nil];
+    for (RESTOperation* waitingOp in waiting)
+        [waitingOp backendRespondedWithStatus: 404 headers: nil object: body data: nil];
+}
+
+
+// Called by the database when it's closed or deallocated.
+- (void) databaseClosed {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    _database = nil;
+    RESTOperation* op = [_updateOp autorelease];
+    _updateOp = nil;
+    [op cancel];
+    [self failWaitingOps];
+}
+
+
+// Called by the database when a change arrives from its tracker, or when one of its write
+// operations completes.
+- (void) databaseChanged {
+    _stale = YES;
+    if (_built) {
+        // Catch up soon, but only once per runloop cycle however many changes arrive:
+        [NSObject cancelPreviousPerformRequestsWithTarget: self selector: @selector(update)
+                                                   object: nil];
+        [self performSelector: @selector(update) withObject: nil afterDelay: 0.0];
+    }
+}
+
+
+#pragma mark - INDEXING:
+
+
+- (void) removeRowsOfDocument: (NSString*)docID {
+    NSArray* oldRows = [_rowsByDocID objectForKey: docID];
+    for (NSDictionary* row in oldRows) {
+        NSUInteger i = [_rows indexOfObject: row
+                              inSortedRange: NSMakeRange(0, _rows.count)
+                                    options: NSBinarySearchingFirstEqual
+                            usingComparator: ^NSComparisonResult(id r1, id r2) {
+                                return compareRow(r1, [r2 objectForKey: @"key"],
+                                                  [r2 objectForKey: @"id"]);
+                            }];
+        // There may be several equal rows (if the doc emitted the same key twice):
+        for (; i < _rows.count; i++) {
+            if ([_rows objectAtIndex: i] == row) {
+                [_rows removeObjectAtIndex: i];
+                break;
+            }
+        }
+    }
+    [_rowsByDocID removeObjectForKey: docID];
+    [_docs removeObjectForKey: docID];
+}
+
+
+- (void) indexChange: (NSDictionary*)change {
+    NSString* docID = $castIf(NSString, [change objectForKey: @"id"]);
+    if (!docID)
+        return;
+    [self removeRowsOfDocument: docID];
+    NSDictionary* doc = $castIf(NSDictionary, [change objectForKey: @"doc"]);
+    if (!doc || [[change objectForKey: @"deleted"] boolValue] || [docID hasPrefix: @"_design/"])
+        return;
+
+    NSMutableArray* emitted = [NSMutableArray array];
+    _map(doc, ^(id key, id value) {
+        NSDictionary* row = [NSDictionary dictionaryWithObjectsAndKeys:
+                             (key ?: [NSNull null]), @"key",
+                             (value ?: [NSNull null]), @"value",
+                             docID, @"id", nil];
+        [emitted addObject: row];
+    });
+    if (emitted.count == 0)
+        return;
+    for (NSDictionary* row in emitted) {
+        NSUInteger i = [_rows indexOfObject: row
+                              inSortedRange: NSMakeRange(0, _rows.count)
+                                    options: NSBinarySearchingInsertionIndex
+                                             | NSBinarySearchingLastEqual
+                            usingComparator: ^NSComparisonResult(id r1, id r2) {
+                                return compareRow(r1, [r2 objectForKey: @"key"],
+                                                  [r2 objectForKey: @"id"]);
+                            }];
+        [_rows insertObject: row atIndex: i];
+    }
+    [_rowsByDocID setObject: emitted forKey: docID];
+    [_docs setObject: doc forKey: docID];
+}
+
+
+- (void) update {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self selector: @selector(update) object: nil];
+    if (_updateOp || !_database)
+        return;
+    // The queries waiting now will be answered when this request finishes; any that arrive
+    // meanwhile have to wait for the next one, since they may need changes it doesn't include.
+    NSArray* batch = [[_waitingOps copy] autorelease];
+    [_waitingOps removeAllObjects];
+    _stale = NO;
+
+    NSDictionary* params = [NSDictionary dictionaryWithObjectsAndKeys:
+                            [NSNumber numberWithUnsignedLong: _lastSequence], @"?since",
+                            @"true", @"?include_docs",
+                            [NSNumber numberWithInt: kChangesBatchSize], @"?limit",
+                            nil];
+    RESTOperation* op = [[_database childWithPath: @"_changes"] sendHTTP: @"GET"
+                                                               parameters: params];
+    _updateOp = [op retain];
+    [op onCompletion: ^{
+        if (op != _updateOp) {
+            // I was invalidated or closed meanwhile; put the queries back in line:
+            [_waitingOps replaceObjectsInRange: NSMakeRange(0, 0) withObjectsFromArray: batch];
+            if (!_database)
+                [self failWaitingOps];
+            else if (!_updateOp)
+                [self update];
+            return;
+        }
+        [_updateOp autorelease];
+        _updateOp = nil;
+
+        NSDictionary* result = $castIf(NSDictionary, op.responseBody.fromJSON);
+        NSArray* changes = $castIf(NSArray, [result objectForKey: @"results"]);
+        if (!changes) {
+            COUCHLOG(@"%@: Couldn't update index: %@", self, op.error);
+            _stale = YES;
+            NSDictionary* body = [NSDictionary dictionaryWithObjectsAndKeys:
+                                  @"error", @"error",
+                                  (op.error.localizedDescription ?: @"Couldn't read _changes"), @"reason",
+                                  nil];
+            int status = op.httpStatus >= 300 ? op.httpStatus : 502;
+            for (RESTOperation* waitingOp in batch)
+                [waitingOp backendRespondedWithStatus: status headers: nil object: body data: nil];
+            return;
+        }
+
+        for (NSDictionary* change in changes) {
+            if ([change isKindOfClass: [NSDictionary class]])
+                [self indexChange: change];
+        }
+        NSNumber* lastSeq = $castIf(NSNumber, [result objectForKey: @"last_seq"]);
+        if (lastSeq)
+            _lastSequence = MAX(_lastSequence, lastSeq.unsignedLongValue);
+        COUCHLOG2(@"%@: Indexed %u changes, now at seq %lu (%u rows)", self,
+                  (unsigned)changes.count, (unsigned long)_lastSequence, (unsigned)_rows.count);
+
+        if (changes.count >= kChangesBatchSize) {
+            // There are more changes to read before these queries can be answered:
+            [_waitingOps replaceObjectsInRange: NSMakeRange(0, 0) withObjectsFromArray: batch];
+            _stale = YES;
+            [self update];
+            return;
+        }
+        _built = YES;
+        for (RESTOperation* waitingOp in batch)
+            [self answer: waitingOp];
+        if (_waitingOps.count)
+            [self update];
+    }];
+}
+
+
+#pragma mark - QUERYING:
+
+
+// Returns the index of the first row that sorts after (or, if 'after' is NO, at or after)
+// the given key and optional document ID.
+- (NSUInteger) indexOfKey: (id)key docID: (NSString*)docID after: (BOOL)after {
+    NSUInteger lo = 0, hi = _rows.count;
+    while (lo < hi) {
+        NSUInteger mid = (lo + hi) / 2;
+        NSComparisonResult c = compareRow([_rows objectAtIndex: mid], key, docID);
+        if (after ? (c <= 0) : (c < 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+- (NSArray*) mapRowsForQuery: (CouchQuery*)query {
+    NSArray* keys = query.keys;
+    if (keys) {
+        NSMutableArray* rows = [NSMutableArray array];
+        for (id key in keys) {
+            NSUInteger start = [self indexOfKey: key docID: nil after: NO];
+            NSUInteger end = [self indexOfKey: key docID: nil after: YES];
+            [rows addObjectsFromArray: [_rows subarrayWithRange: NSMakeRange(start, end - start)]];
+        }
+        return rows;
+    }
+
+    id lowKey = query.startKey, highKey = query.endKey;
+    NSString* lowDocID = query.startKeyDocID, *highDocID = query.endKeyDocID;
+    if (query.descending) {
+        lowKey = query.endKey;
+        highKey = query.startKey;
+        lowDocID = query.endKeyDocID;
+        highDocID = query.startKeyDocID;
+    }
+    NSUInteger start = lowKey ? [self indexOfKey: lowKey docID: lowDocID after: NO] : 0;
+    NSUInteger end = highKey ? [self indexOfKey: highKey docID: highDocID after: YES] : _rows.count;
+    if (end <= start)
+        return [NSArray array];
+    NSArray* rows = [_rows subarrayWithRange: NSMakeRange(start, end - start)];
+    if (query.descending)
+        rows = rows.reverseObjectEnumerator.allObjects;
+    return rows;
+}
+
+
+- (NSArray*) reduceRows: (NSArray*)rows groupLevel: (NSUInteger)groupLevel {
+    NSMutableArray* result = [NSMutableArray array];
+    NSMutableArray* keys = [NSMutableArray array];
+    NSMutableArray* values = [NSMutableArray array];
+    id currentGroup = nil;
+    NSUInteger n = rows.count;
+    for (NSUInteger i = 0; i <= n; i++) {
+        NSDictionary* row = (i < n) ? [rows objectAtIndex: i] : nil;
+        id group = nil;
+        if (row && groupLevel > 0)
+            group = groupKey([row objectForKey: @"key"], groupLevel);
+        if (keys.count > 0 && (!row || (groupLevel > 0 && collate(group, currentGroup) != 0))) {
+            id value = _reduce(keys, values, NO);
+            [result addObject: [NSDictionary dictionaryWithObjectsAndKeys:
+                                (currentGroup ?: [NSNull null]), @"key",
+                                (value ?: [NSNull null]), @"value", nil]];
+            [keys removeAllObjects];
+            [values removeAllObjects];
+        }
+        if (row) {
+            currentGroup = group;
+            [keys addObject: [row objectForKey: @"key"]];
+            [values addObject: [row objectForKey: @"value"]];
+        }
+    }
+    return result;
+}
+
+
+- (void) answer: (RESTOperation*)op {
+    CouchQuery* query = (CouchQuery*)op.resource;
+    NSArray* rows = [self mapRowsForQuery: query];
+    BOOL reduced = (_reduce && !query.mapOnly);
+    if (reduced)
+        rows = [self reduceRows: rows groupLevel: query.groupLevel];
+
+    NSUInteger skip = MIN(query.skip, rows.count);
+    NSUInteger count = rows.count - skip;
+    if (query.limit > 0)
+        count = MIN(count, query.limit);
+    if (skip > 0 || count < rows.count)
+        rows = [rows subarrayWithRange: NSMakeRange(skip, count)];
+
+    if (query.prefetch && !reduced) {
+        rows = [rows rest_map: ^id(NSDictionary* row) {
+            NSDictionary* doc = [_docs objectForKey: [row objectForKey: @"id"]];
+            if (!doc)
+                return row;
+            NSMutableDictionary* prefetched = [[row mutableCopy] autorelease];
+            [prefetched setObject: doc forKey: @"doc"];
+            return prefetched;
+        }];
+    }
+
+    NSDictionary* result = [NSDictionary dictionaryWithObjectsAndKeys:
+                            rows, @"rows",
+                            [NSNumber numberWithUnsignedLong: _rows.count], @"total_rows",
+                            [NSNumber numberWithUnsignedLong: _lastSequence], @"update_seq",
+                            nil];
+    NSDictionary* headers = [NSDictionary dictionaryWithObject: @"application/json"
+                                                        forKey: @"Content-Type"];
+    [op backendRespondedWithStatus: 200 headers: headers object: result data: nil];
+}
+
+
+#pragma mark - BACKEND:
+
+
+- (void) handleOperation: (RESTOperation*)op {
+    CouchQuery* query = $castIf(CouchQuery, op.resource);
+    if (!query || !_database) {
+        NSDictionary* body = [NSDictionary dictionaryWithObjectsAndKeys:
+                              @"not_found", @"error", @"missing", @"reason", nil];
+        [op backendRespondedWithStatus: 404 headers: nil object: body data: nil];
+        return;
+    }
+    BOOL current = _built && !_stale && !_updateOp;
+    if (!_built || (!current && query.stale == kCouchStaleNever)) {
+        [_waitingOps addObject: op];
+        [self update];
+        return;
+    }
+    [self answer: op];
+    if (!current && query.stale == kCouchStaleUpdateAfter)
+        [self update];
+}
+
+
+- (void) cancelOperation: (RESTOperation*)op {
+    [_waitingOps removeObjectIdenticalTo: op];
+}
+
+
+@end
+
+
+
+
+@implementation CouchDatabase (LocalViews)
+
+
+- (CouchLocalView*) defineLocalViewNamed: (NSString*)name
+                                     map: (CouchMapBlock)map
+                                  reduce: (CouchReduceBlock)reduce
+{
+    [self deleteLocalViewNamed: name];
+    CouchLocalView* view = [[CouchLocalView alloc] initWithDatabase: self name: name
+                                                                map: map reduce: reduce];
+    [self.localViews setObject: view forKey: name];
+    [view release];
+    self.tracksChanges = YES;     // so I hear about external changes
+    return view;
+}
+
+
+- (CouchLocalView*) localViewNamed: (NSString*)name {
+    return [self.localViews objectForKey: name];
+}
+
+
+- (void) deleteLocalViewNamed: (NSString*)name {
+    CouchLocalView* view = [self.localViews objectForKey: name];
+    if (view) {
+        [view databaseClosed];
+        [self.localViews removeObjectForKey: name];
+    }
+}
+
+
+@end
@@ -27,6 +27,7 @@ typedef enum {
     @private
     CouchReplicationState _state;
     unsigned _completed, _total;
+    CouchReplicationProgress* _progress;
     NSString* _statusString;
     NSError* _error;
     CouchReplicationMode _mode;
@@ -90,6 +91,9 @@ typedef enum {
 /** The total number of changes to be processed, if the task is active, else 0 (observable). */
 @property (nonatomic, readonly) unsigned total;
 
+/** Detailed progress, including throughput and estimated time remaining, if the task is active, else nil (observable). */
+@property (nonatomic, readonly, retain) CouchReplicationProgress* progress;
+
 @property (nonatomic, readonly, retain) NSError* error;
 
 @property (nonatomic, readonly) CouchReplicationMode mode;
@@ -11,6 +11,7 @@
 //  https://gist.github.com/832610
 
 #import "CouchPersistentReplication.h"
+#import "CouchReplicationProgress.h"
 #import "CouchInternal.h"
 
 
@@ -23,6 +24,7 @@
 @property (readwrite) CouchReplicationState state;
 @property (nonatomic, readwrite, retain) NSError* error;
 @property (nonatomic, readwrite) CouchReplicationMode mode;
+@property (nonatomic, readwrite, retain) CouchReplicationProgress* progress;
 - (void) setStatusString: (NSString*)status;
 @end
 
@@ -31,7 +33,8 @@
 
 
 @dynamic source, target, create_target, continuous, filter, query_params, doc_ids;
-@synthesize state=_state, completed=_completed, total=_total, error=_error, mode=_mode;
+@synthesize state=_state, completed=_completed, total=_total, error=_error, mode=_mode,
+            progress=_progress;
 
 
 + (CouchPersistentReplication*) createWithReplicatorDatabase: (CouchDatabase*)replicatorDB
@@ -57,6 +60,7 @@
 - (void)dealloc {
     self.state = kReplicationIdle;  // turns off observing
     [_statusString release];
+    [_progress release];
     [super dealloc];
 }
 
@@ -182,6 +186,7 @@ static inline BOOL isLocalDBName(NSString* url) {
     } else {
         if (_state == kReplicationTriggered) {
             [server removeObserver: self forKeyPath: @"activeTasks"];
+            self.progress = nil;
             [self setStatusString: nil];
         }
     }
@@ -203,6 +208,10 @@ static inline BOOL isLocalDBName(NSString* url) {
         COUCHLOG(@"%@: state := %@", self, stateStr);
         self.state = (CouchReplicationState) state;
     }
+    // The replicator updates this document when it starts or finishes a replication, so this is
+    // a good time to check the server's tasks instead of waiting for the next poll:
+    if (state == kReplicationTriggered)
+        [self.database.server replicationStateChanged];
 }
 
 
@@ -258,7 +267,6 @@ static inline BOOL isLocalDBName(NSString* url) {
     [_statusString autorelease];
     _statusString = [status copy];
     CouchReplicationMode mode = _mode;
-    int completed = _completed, total = _total;
     
     if ([status isEqualToString: @"Stopped"]) {
         // TouchDB only
@@ -268,24 +276,22 @@ static inline BOOL isLocalDBName(NSString* url) {
         mode = kCouchReplicationOffline;
     } else if ([status isEqualToString: @"Idle"]) {
         mode = kCouchReplicationIdle;
-        completed = total = 0;
-    } else {
-        if (status) {
-            // Current format of status is "Processed \d+ / \d+ changes".
-            NSScanner* scanner = [NSScanner scannerWithString: status];
-            if ([scanner scanString: @"Processed" intoString:NULL]
-                    && [scanner scanInt: &completed]
-                    && [scanner scanString: @"/" intoString:NULL]
-                    && [scanner scanInt: &total]
-                    && [scanner scanString: @"changes" intoString:NULL]) {
-                mode = kCouchReplicationActive;
-            } else {
-                completed = total = 0;
-                Warn(@"CouchReplication: Unable to parse status string \"%@\"", _statusString);
-            }
-        }
+        self.progress = nil;
+    } else if (_progress) {
+        mode = kCouchReplicationActive;
+    } else if (status) {
+        Warn(@"CouchReplication: Unable to parse status string \"%@\"", _statusString);
     }
     
+    if (mode != _mode)
+        self.mode = mode;
+}
+
+
+- (void) setProgress: (CouchReplicationProgress*)progress {
+    [_progress autorelease];
+    _progress = [progress retain];
+    unsigned completed = progress.completed, total = progress.total;
     if (completed != _completed || total != _total) {
         [self willChangeValueForKey: @"completed"];
         [self willChangeValueForKey: @"total"];
@@ -294,8 +300,6 @@ static inline BOOL isLocalDBName(NSString* url) {
         [self didChangeValueForKey: @"total"];
         [self didChangeValueForKey: @"completed"];
     }
-    if (mode != _mode)
-        self.mode = mode;
 }
 
 
@@ -306,19 +310,9 @@ static inline BOOL isLocalDBName(NSString* url) {
     if ([keyPath isEqualToString: @"activeTasks"] && object == server) {
         // Server's activeTasks changed:
         NSString* myReplicationID = [self getValueOfProperty: @"_replication_id"];
-        NSString* status = nil;
-        NSArray* errorInfo = nil;
-        for (NSDictionary* task in server.activeTasks) {
-            if ([[task objectForKey:@"type"] isEqualToString:@"Replication"]) {
-                // Can't look up the task ID directly because it's part of a longer string like
-                // "`6390525ac52bd8b5437ab0a118993d0a+continuous`: ..."
-                if ([[task objectForKey: @"task"] rangeOfString: myReplicationID].length > 0) {
-                    status = [task objectForKey: @"status"];
-                    errorInfo = $castIf(NSArray, [task objectForKey: @"error"]);
-                    break;
-                }
-            }
-        }
+        NSDictionary* task = [server activeReplicationTaskWithID: myReplicationID];
+        NSString* status = $castIf(NSString, [task objectForKey: @"status"]);
+        NSArray* errorInfo = $castIf(NSArray, [task objectForKey: @"error"]);
 
         // Interpret .error property. This is nonstandard; only TouchDB supports it.
         NSError *error = nil;
@@ -337,8 +331,11 @@ static inline BOOL isLocalDBName(NSString* url) {
         // Update my properties, triggering KVO notifications, if the values changed:
         if (!$equal(error, _error))
             self.error = error;
+        self.progress = [CouchReplicationProgress progressWithTask: task previous: _progress];
         if (!$equal(status, _statusString))
             [self setStatusString: status];
+        else if (!status && _progress && _mode != kCouchReplicationActive)
+            self.mode = kCouchReplicationActive;    // CouchDB 1.2+ has no status string
     } else {
         [super observeValueForKeyPath: keyPath ofObject: object change: change context: context];
     }
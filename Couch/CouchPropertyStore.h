@@ -0,0 +1,65 @@
+//
+//  CouchPropertyStore.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+
+/** Immutable storage for the properties of a single document revision.
+    The split between user properties and CouchDB-reserved ("_"-prefixed) properties is computed once, on first access, and cached; after that all reads are allocation-free. */
+@interface CouchPropertyStore : NSObject
+{
+    @private
+    NSDictionary* _properties;
+    NSDictionary* _userProperties;
+    NSDictionary* _systemProperties;
+}
+
+- (id) initWithProperties: (NSDictionary*)properties;
+
+/** All the properties, including reserved ones like "_id" and "_rev". */
+@property (readonly) NSDictionary* properties;
+
+/** The properties whose keys don't start with "_". If there are no reserved keys, this is the same object as .properties. */
+@property (readonly) NSDictionary* userProperties;
+
+/** The properties whose keys start with "_". */
+@property (readonly) NSDictionary* systemProperties;
+
+- (id) objectForKey: (NSString*)key;
+
+@end
+
+
+/** A copy-on-write mutable dictionary layered over an immutable base dictionary.
+    Reads fall through to the base; writes and removals are recorded in a small side table, so making a modified copy of a large document costs only as much as the changes. Enumerating the keys walks the base and the side table in place, without copying them into an array. Copying an overlay (mutably or not) shares the same base.
+    -copy returns a frozen overlay; mutating one raises an exception. */
+@interface CouchPropertyOverlay : NSMutableDictionary
+{
+    @private
+    NSDictionary* _base;
+    NSMutableDictionary* _changes;
+    NSMutableSet* _removed;
+    NSUInteger _count;
+    BOOL _frozen;
+}
+
++ (CouchPropertyOverlay*) overlayWithBase: (NSDictionary*)base;
+
+/** Designated initializer. If base is itself a CouchPropertyOverlay, its base is shared rather than being layered on top of, so overlays never nest more than one level deep. */
+- (id) initWithBase: (NSDictionary*)base;
+
+/** The number of keys that differ from the base (added, replaced or removed). */
+@property (readonly) NSUInteger changeCount;
+
+@end
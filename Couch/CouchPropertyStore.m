@@ -0,0 +1,276 @@
+//
+//  CouchPropertyStore.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchPropertyStore.h"
+#import "CouchInternal.h"
+
+
+@implementation CouchPropertyStore
+
+
+- (id) initWithProperties: (NSDictionary*)properties {
+    NSParameterAssert(properties);
+    self = [super init];
+    if (self) {
+        _properties = [properties copy];     // just a retain, if it's already immutable
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_properties release];
+    [_userProperties release];
+    [_systemProperties release];
+    [super dealloc];
+}
+
+
+@synthesize properties=_properties;
+
+
+- (id) objectForKey: (NSString*)key {
+    return [_properties objectForKey: key];
+}
+
+
+// Partitions the keys into user and system properties, in a single pass.
+- (void) split {
+    NSUInteger count = _properties.count;
+    if (count == 0) {
+        _userProperties = [_properties retain];
+        _systemProperties = [_properties retain];
+        return;
+    }
+    // User entries fill the arrays from the front, system entries from the back:
+    id* keys = malloc(2 * count * sizeof(id));
+    id* values = keys + count;
+    NSUInteger nUser = 0, nSystem = 0;
+    for (NSString* key in _properties) {
+        NSUInteger i = [key hasPrefix: @"_"] ? (count - ++nSystem) : nUser++;
+        keys[i] = key;
+        values[i] = [_properties objectForKey: key];
+    }
+    if (nSystem == 0) {
+        _userProperties = [_properties retain];
+        _systemProperties = [[NSDictionary alloc] init];
+    } else if (nUser == 0) {
+        _userProperties = [[NSDictionary alloc] init];
+        _systemProperties = [_properties retain];
+    } else {
+        _userProperties = [[NSDictionary alloc] initWithObjects: values forKeys: keys
+                                                          count: nUser];
+        _systemProperties = [[NSDictionary alloc] initWithObjects: values + nUser
+                                                          forKeys: keys + nUser
+                                                            count: nSystem];
+    }
+    free(keys);
+}
+
+
+- (NSDictionary*) userProperties {
+    if (!_userProperties)
+        [self split];
+    return _userProperties;
+}
+
+
+- (NSDictionary*) systemProperties {
+    if (!_systemProperties)
+        [self split];
+    return _systemProperties;
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@%@", [self class], _properties];
+}
+
+
+@end
+
+
+
+
+// Enumerates an overlay's keys in place: the base's keys that haven't been removed or replaced,
+// then the changed keys.
+@interface CouchOverlayKeyEnumerator : NSEnumerator
+{
+    @private
+    NSSet* _removed;
+    NSDictionary* _changes;
+    NSEnumerator* _baseKeys, *_changedKeys;
+}
+- (id) initWithBase: (NSDictionary*)base changes: (NSDictionary*)changes removed: (NSSet*)removed;
+@end
+
+
+@implementation CouchOverlayKeyEnumerator
+
+- (id) initWithBase: (NSDictionary*)base changes: (NSDictionary*)changes removed: (NSSet*)removed {
+    self = [super init];
+    if (self) {
+        _baseKeys = [[base keyEnumerator] retain];
+        _changes = [changes retain];
+        _removed = [removed retain];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [_baseKeys release];
+    [_changedKeys release];
+    [_changes release];
+    [_removed release];
+    [super dealloc];
+}
+
+- (id) nextObject {
+    id key;
+    while ((key = [_baseKeys nextObject]) != nil) {
+        if (![_removed containsObject: key] && ![_changes objectForKey: key])
+            return key;
+    }
+    if (!_changedKeys)
+        _changedKeys = [[_changes keyEnumerator] retain];
+    return [_changedKeys nextObject];
+}
+
+@end
+
+
+
+
+@implementation CouchPropertyOverlay
+
+
++ (CouchPropertyOverlay*) overlayWithBase: (NSDictionary*)base {
+    return [[[self alloc] initWithBase: base] autorelease];
+}
+
+
+- (id) initWithBase: (NSDictionary*)base {
+    self = [super init];
+    if (self) {
+        CouchPropertyOverlay* overlay = $castIf(CouchPropertyOverlay, base);
+        if (overlay && overlay.changeCount <= overlay->_base.count / 2) {
+            // Share the other overlay's base instead of stacking on top of it:
+            _base = [overlay->_base retain];
+            _changes = [overlay->_changes mutableCopy];
+            _removed = [overlay->_removed mutableCopy];
+            _count = overlay->_count;
+        } else {
+            // An overlay that has diverged a lot from its base gets flattened, so the base
+            // doesn't pin down lots of stale values:
+            _base = overlay ? [[NSDictionary alloc] initWithDictionary: overlay] : [base copy];
+            _count = _base.count;
+        }
+    }
+    return self;
+}
+
+- (id) init {
+    return [self initWithBase: nil];
+}
+
+- (id) initWithCapacity: (NSUInteger)capacity {
+    return [self initWithBase: nil];
+}
+
+- (id) initWithObjects: (const id [])objects forKeys: (const id [])keys count: (NSUInteger)count {
+    NSDictionary* base = [[NSDictionary alloc] initWithObjects: objects forKeys: keys count: count];
+    self = [self initWithBase: base];
+    [base release];
+    return self;
+}
+
+
+- (void)dealloc {
+    [_base release];
+    [_changes release];
+    [_removed release];
+    [super dealloc];
+}
+
+
+- (NSUInteger) changeCount {
+    return _changes.count + _removed.count;
+}
+
+
+- (id) copyWithZone: (NSZone*)zone {
+    if (_frozen)
+        return [self retain];
+    CouchPropertyOverlay* copy = [[[self class] alloc] initWithBase: self];
+    copy->_frozen = YES;
+    return copy;
+}
+
+- (id) mutableCopyWithZone: (NSZone*)zone {
+    return [[[self class] alloc] initWithBase: self];
+}
+
+
+#pragma mark - PRIMITIVES:
+
+
+- (NSUInteger) count {
+    return _count;
+}
+
+
+- (id) objectForKey: (id)key {
+    id value = [_changes objectForKey: key];
+    if (!value && ![_removed containsObject: key])
+        value = [_base objectForKey: key];
+    return value;
+}
+
+
+- (NSEnumerator*) keyEnumerator {
+    if (!_changes && !_removed)
+        return [_base keyEnumerator];
+    return [[[CouchOverlayKeyEnumerator alloc] initWithBase: _base changes: _changes
+                                                    removed: _removed] autorelease];
+}
+
+
+- (void) setObject: (id)value forKey: (id)key {
+    NSAssert(!_frozen, @"Attempt to mutate immutable %@", [self class]);
+    NSParameterAssert(value);
+    if (![self objectForKey: key])
+        ++_count;
+    key = [[key copy] autorelease];
+    if (!_changes)
+        _changes = [[NSMutableDictionary alloc] init];
+    [_changes setObject: value forKey: key];
+    [_removed removeObject: key];
+}
+
+
+- (void) removeObjectForKey: (id)key {
+    NSAssert(!_frozen, @"Attempt to mutate immutable %@", [self class]);
+    if (![self objectForKey: key])
+        return;
+    --_count;
+    [_changes removeObjectForKey: key];
+    if ([_base objectForKey: key]) {
+        if (!_removed)
+            _removed = [[NSMutableSet alloc] init];
+        [_removed addObject: key];
+    }
+}
+
+
+@end
@@ -119,12 +119,13 @@ typedef enum {
 @interface CouchLiveQuery : CouchQuery
 {
     @private
-    BOOL _observing;
+    BOOL _observing, _rowsFreed;
     RESTOperation* _op;
     CouchQueryEnumerator* _rows;
 }
 
-/** In CouchLiveQuery the -rows accessor is now a non-blocking property that can be observed using KVO. Its value will be nil until the initial query finishes. */
+/** In CouchLiveQuery the -rows accessor is now a non-blocking property that can be observed using KVO. Its value will be nil until the initial query finishes.
+    While nothing is observing it, the rows may be freed when memory is short (see RESTMemoryBudget); -rows then returns nil again until they've been fetched anew. */
 @property (readonly, retain) CouchQueryEnumerator* rows;
 
 /** When the live query first starts, .rows will return nil until the initial results come back.
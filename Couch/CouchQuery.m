@@ -56,6 +56,7 @@
         self.endKeyDocID = query.endKeyDocID;
         _includeDeleted = query.includeDeleted;
         _stale = query.stale;
+        self.backend = query.backend;
     }
     return self;
 }
@@ -222,10 +223,16 @@
 
 
 
+@interface CouchLiveQuery () <RESTMemoryConsumer>
+@end
+
+
 @implementation CouchLiveQuery
 
 - (void)dealloc {
     [[NSNotificationCenter defaultCenter] removeObserver: self];
+    if (_observing)
+        [[RESTMemoryBudget sharedBudget] removeConsumer: self];
     [_op release];
     [_rows release];
     [super dealloc];
@@ -233,8 +240,10 @@
 
 
 - (CouchQueryEnumerator*) rows {
-    if (!_observing)
+    if (!_observing || (_rowsFreed && !_op))
         [self start];
+    else
+        [[RESTMemoryBudget sharedBudget] consumerWasUsed: self];
     // Have to return a copy because the enumeration has to start at item #0 every time
     return [[_rows copy] autorelease];
 }
@@ -255,6 +264,7 @@
                                                      selector: @selector(databaseChanged)
                                                          name: kCouchDatabaseChangeNotification 
                                                        object: self.database];
+            [[RESTMemoryBudget sharedBudget] addConsumer: self];
         }
         COUCHLOG(@"CouchLiveQuery: Starting...");
         _op = [[super start] retain];
@@ -285,6 +295,9 @@
         if (rows && ![rows isEqual: _rows]) {
             COUCHLOG(@"CouchLiveQuery: ...Rows changed! (now %lu)", (unsigned long)rows.count);
             self.rows = rows;   // Triggers KVO notification
+            _rowsFreed = NO;
+            // (The response size is a rough measure of the rows; the parsed objects take more.)
+            [[RESTMemoryBudget sharedBudget] setCost: op.timings.responseBytes forConsumer: self];
             if (!self.sequences)
                 self.prefetch = NO;   // (prefetch disables conditional GET shortcut on next fetch)
         
@@ -299,6 +312,20 @@
 }
 
 
+// RESTMemoryConsumer protocol
+- (void) freeMemory: (UInt64)bytes {
+    // Rows that something is observing are in use, so keep them:
+    if (!_rows || self.observationInfo)
+        return;
+    COUCHLOG(@"CouchLiveQuery: Freeing %lu rows", (unsigned long)_rows.count);
+    [_rows release];
+    _rows = nil;
+    _rowsFreed = YES;
+    [self cacheResponse: nil];     // so the next fetch can't get a 304 and leave me rowless
+    [[RESTMemoryBudget sharedBudget] setCost: 0 forConsumer: self];
+}
+
+
 @end
 
 
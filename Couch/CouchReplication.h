@@ -15,7 +15,7 @@
 //
 
 #import <Foundation/Foundation.h>
-@class CouchDatabase, RESTOperation;
+@class CouchDatabase, CouchReplicationProgress, RESTOperation;
 
 
 typedef enum {
@@ -41,6 +41,7 @@ typedef enum {
     NSString* _taskID;
     NSString* _status;
     unsigned _completed, _total;
+    CouchReplicationProgress* _progress;
     CouchReplicationMode _mode;
     NSError* _error;
     NSArray* _currentRequests;
@@ -102,6 +103,9 @@ typedef enum {
 /** The total number of changes to be processed, if the task is active, else 0 (observable). */
 @property (nonatomic, readonly) unsigned total;
 
+/** Detailed progress, including throughput and estimated time remaining, if the task is active, else nil (observable). */
+@property (nonatomic, readonly, retain) CouchReplicationProgress* progress;
+
 @property (nonatomic, readonly, retain) NSError* error;
 
 @property (nonatomic, readonly) CouchReplicationMode mode;
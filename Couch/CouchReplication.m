@@ -17,6 +17,7 @@
 //  http://wiki.apache.org/couchdb/Replication
 
 #import "CouchReplication.h"
+#import "CouchReplicationProgress.h"
 #import "CouchInternal.h"
 
 
@@ -28,6 +29,7 @@
 @property (nonatomic, readwrite) BOOL running;
 @property (nonatomic, readwrite, copy) NSString* status;
 @property (nonatomic, readwrite) unsigned completed, total;
+@property (nonatomic, readwrite, retain) CouchReplicationProgress* progress;
 @property (nonatomic, readwrite, retain) NSError* error;
 @property (nonatomic, readwrite) CouchReplicationMode mode;
 @property (nonatomic, readwrite) NSArray* currentRequests;
@@ -59,6 +61,7 @@
     [_remote release];
     [_database release];
     [_status release];
+    [_progress release];
     [_error release];
     [_filter release];
     [_filterParams release];
@@ -115,7 +118,12 @@
         [body setObject: (id)kCFBooleanTrue forKey: @"cancel"];
     RESTResource* replicate = [[[RESTResource alloc] initWithParent: _database.server 
                                                        relativePath: @"_replicate"] autorelease];
-    return [replicate POSTJSON: body parameters: nil];
+    RESTOperation* op = [replicate POSTJSON: body parameters: nil];
+    // A one-shot replication's POST doesn't return until the replication finishes, so it would
+    // tie up one of the host's request slots all that time; and a cancel mustn't be stuck in the
+    // queue behind the very request it's cancelling.
+    op.priority = kRESTPriorityUnscheduled;
+    return op;
 }
 
 
@@ -166,6 +174,7 @@
 
 
 - (void) stopped {
+    self.progress = nil;
     self.status = nil;
     if (_taskID) {
         [_taskID release];
@@ -187,6 +196,7 @@
 
 
 @synthesize running = _running, status=_status, completed=_completed, total=_total, error = _error;
+@synthesize progress=_progress;
 @synthesize mode=_mode, remoteURL = _remote;
 
 
@@ -210,31 +220,10 @@
         mode = kCouchReplicationOffline;
     } else if ([status isEqualToString: @"Idle"]) {
         mode = kCouchReplicationIdle;
-    } else {
-        int completed = 0, total = 0;
-        if (status) {
-            // Current format of status is "Processed \d+ / \d+ changes".
-            NSScanner* scanner = [NSScanner scannerWithString: status];
-            if ([scanner scanString: @"Processed" intoString:NULL]
-                    && [scanner scanInt: &completed]
-                    && [scanner scanString: @"/" intoString:NULL]
-                    && [scanner scanInt: &total]
-                    && [scanner scanString: @"changes" intoString:NULL]) {
-                mode = kCouchReplicationActive;
-            } else {
-                completed = total = 0;
-                Warn(@"CouchReplication: Unable to parse status string \"%@\"", _status);
-            }
-        }
-        
-        if (completed != _completed || total != _total) {
-            [self willChangeValueForKey: @"completed"];
-            [self willChangeValueForKey: @"total"];
-            _completed = completed;
-            _total = total;
-            [self didChangeValueForKey: @"total"];
-            [self didChangeValueForKey: @"completed"];
-        }
+    } else if (_progress) {
+        mode = kCouchReplicationActive;
+    } else if (status) {
+        Warn(@"CouchReplication: Unable to parse status string \"%@\"", _status);
     }
 
     if (mode != _mode)
@@ -242,27 +231,30 @@
 }
 
 
+- (void) setProgress: (CouchReplicationProgress*)progress {
+    [_progress autorelease];
+    _progress = [progress retain];
+    unsigned completed = progress.completed, total = progress.total;
+    if (completed != _completed || total != _total) {
+        [self willChangeValueForKey: @"completed"];
+        [self willChangeValueForKey: @"total"];
+        _completed = completed;
+        _total = total;
+        [self didChangeValueForKey: @"total"];
+        [self didChangeValueForKey: @"completed"];
+    }
+}
+
+
 - (void) observeValueForKeyPath: (NSString*)keyPath ofObject: (id)object 
                          change: (NSDictionary*)change context: (void*)context
 {
     // Server's activeTasks changed:
-    BOOL active = NO;
-    NSString* status = nil;
-    NSArray* errorInfo = nil;
-    NSArray* requests = nil;
-    for (NSDictionary* task in _database.server.activeTasks) {
-        if ([[task objectForKey:@"type"] isEqualToString:@"Replication"]) {
-            // Can't look up the task ID directly because it's part of a longer string like
-            // "`6390525ac52bd8b5437ab0a118993d0a+continuous`: ..."
-            if ([[task objectForKey: @"task"] rangeOfString: _taskID].length > 0) {
-                active = YES;
-                status = $castIf(NSString, [task objectForKey: @"status"]);
-                errorInfo = $castIf(NSArray, [task objectForKey: @"error"]);
-                requests = $castIf(NSArray, [task objectForKey: @"requests"]);
-                break;
-            }
-        }
-    }
+    NSDictionary* task = [_database.server activeReplicationTaskWithID: _taskID];
+    BOOL active = (task != nil);
+    NSString* status = $castIf(NSString, [task objectForKey: @"status"]);
+    NSArray* errorInfo = $castIf(NSArray, [task objectForKey: @"error"]);
+    NSArray* requests = $castIf(NSArray, [task objectForKey: @"requests"]);
     
     if (!active) {
         COUCHLOG(@"%@: No longer an active task", self);
@@ -288,8 +280,11 @@
         self.error = error;
     if (!$equal(requests, _currentRequests))
         self.currentRequests = requests;
+    self.progress = [CouchReplicationProgress progressWithTask: task previous: _progress];
     if (!$equal(status, _status))
         self.status = status;
+    else if (!status && _progress && _mode != kCouchReplicationActive)
+        self.mode = kCouchReplicationActive;    // CouchDB 1.2+ has no status string
 }
 
 
@@ -0,0 +1,54 @@
+//
+//  CouchReplicationProgress.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+
+/** A snapshot of a replication's progress, with its recent throughput and estimated time remaining.
+    Instances are immutable; the replication replaces its .progress object each time the server reports new numbers. */
+@interface CouchReplicationProgress : NSObject
+{
+    @private
+    unsigned _completed, _total;
+    double _docsPerSecond;
+    CFAbsoluteTime _timestamp;
+}
+
+/** Creates a progress snapshot from an entry in the server's _active_tasks list.
+    Understands the structured fields reported by CouchDB 1.2+ ("revisions_checked", "changes_pending", "source_seq", ...) as well as the older "Processed N / M changes" status string (still used by TouchDB).
+    @param task  The task dictionary.
+    @param previous  The replication's previous progress, if any, from which the throughput is computed.
+    @return  The new progress, or nil if the task doesn't report any. */
++ (CouchReplicationProgress*) progressWithTask: (NSDictionary*)task
+                                      previous: (CouchReplicationProgress*)previous;
+
+/** The number of changes processed so far. */
+@property (readonly) unsigned completed;
+
+/** The total number of changes known to need processing, including the completed ones. */
+@property (readonly) unsigned total;
+
+/** The number of changes still to be processed (the backlog). */
+@property (readonly) unsigned pending;
+
+/** The recent rate at which changes have been processed, smoothed over the last several updates. */
+@property (readonly) double docsPerSecond;
+
+/** Estimated time until the backlog is processed at the current rate, or a negative number if it can't be estimated (because nothing has been processed recently.) Zero if nothing is pending. */
+@property (readonly) NSTimeInterval estimatedTimeRemaining;
+
+/** When this snapshot was taken. */
+@property (readonly) CFAbsoluteTime timestamp;
+
+@end
@@ -0,0 +1,115 @@
+//
+//  CouchReplicationProgress.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchReplicationProgress.h"
+#import "CouchInternal.h"
+
+
+// Weight given to the newest sample in the smoothed throughput.
+#define kRateSmoothing 0.3
+
+
+static BOOL getUnsigned(NSDictionary* task, NSString* key, unsigned* outValue) {
+    id value = [task objectForKey: key];
+    if (![value isKindOfClass: [NSNumber class]])
+        return NO;
+    double d = [value doubleValue];
+    *outValue = d > 0 ? (unsigned)d : 0;
+    return YES;
+}
+
+
+// Reads the completed/total counts out of a task dictionary.
+static BOOL parseTask(NSDictionary* task, unsigned* completed, unsigned* total) {
+    unsigned pending, checkpointed, sourceSeq;
+    // CouchDB 1.3+:
+    if (getUnsigned(task, @"changes_pending", &pending)) {
+        if (!getUnsigned(task, @"revisions_checked", completed))
+            getUnsigned(task, @"docs_read", completed);
+        *total = *completed + pending;
+        return YES;
+    }
+    // CouchDB 1.2:
+    if (getUnsigned(task, @"checkpointed_source_seq", &checkpointed)
+            && getUnsigned(task, @"source_seq", &sourceSeq)) {
+        *completed = checkpointed;
+        *total = MAX(sourceSeq, checkpointed);
+        return YES;
+    }
+    // Earlier versions, and TouchDB, only have a status string "Processed \d+ / \d+ changes":
+    NSString* status = $castIf(NSString, [task objectForKey: @"status"]);
+    if ([status hasPrefix: @"Processed "]) {
+        int c, t;
+        if (sscanf(status.UTF8String, "Processed %d / %d changes", &c, &t) == 2) {
+            *completed = MAX(c, 0);
+            *total = MAX(t, 0);
+            return YES;
+        }
+    }
+    return NO;
+}
+
+
+@implementation CouchReplicationProgress
+
+
++ (CouchReplicationProgress*) progressWithTask: (NSDictionary*)task
+                                      previous: (CouchReplicationProgress*)previous
+{
+    unsigned completed = 0, total = 0;
+    if (!parseTask(task, &completed, &total))
+        return nil;
+    CouchReplicationProgress* progress = [[[self alloc] init] autorelease];
+    progress->_completed = completed;
+    progress->_total = total;
+    progress->_timestamp = CFAbsoluteTimeGetCurrent();
+    if (previous) {
+        progress->_docsPerSecond = previous->_docsPerSecond;
+        NSTimeInterval elapsed = progress->_timestamp - previous->_timestamp;
+        if (elapsed > 0 && completed >= previous->_completed) {
+            double rate = (completed - previous->_completed) / elapsed;
+            progress->_docsPerSecond = kRateSmoothing * rate
+                                     + (1.0 - kRateSmoothing) * previous->_docsPerSecond;
+        }
+    }
+    return progress;
+}
+
+
+@synthesize completed=_completed, total=_total, docsPerSecond=_docsPerSecond,
+            timestamp=_timestamp;
+
+
+- (unsigned) pending {
+    return _total > _completed ? _total - _completed : 0;
+}
+
+
+- (NSTimeInterval) estimatedTimeRemaining {
+    unsigned pending = self.pending;
+    if (pending == 0)
+        return 0.0;
+    if (_docsPerSecond <= 0.0)
+        return -1.0;
+    return pending / _docsPerSecond;
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%u/%u, %.1f docs/sec, eta %.0f sec]",
+            [self class], _completed, _total, _docsPerSecond, self.estimatedTimeRemaining];
+}
+
+
+@end
@@ -0,0 +1,55 @@
+//
+//  CouchReplicationScheduler.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+@class CouchDatabase, CouchReplication;
+
+
+/** Limits how many replications run at once.
+    Replications added to a scheduler wait in a queue until one of a limited number of slots is free; the waiting replication whose local database has the highest priority goes next (ties go to whichever was added first.) A non-continuous replication gives up its slot when it finishes. A continuous replication that has been idle or offline for a while gives up its slot if others are waiting; it goes to the back of the queue, and picks up from its last checkpoint when it's restarted.
+    Each CouchServer has a scheduler, but nothing is scheduled unless you add it. */
+@interface CouchReplicationScheduler : NSObject
+{
+    @private
+    NSUInteger _maxActiveReplications;
+    NSTimeInterval _idleRotationInterval;
+    NSMutableArray* _active;
+    NSMutableArray* _waiting;
+    CFMutableDictionaryRef _idleSince;
+    NSMutableDictionary* _priorities;
+}
+
+/** The maximum number of replications allowed to run at once. Defaults to 4. */
+@property NSUInteger maxActiveReplications;
+
+/** How long a continuous replication may stay idle (or offline) in an active slot while other replications are waiting. Defaults to 60 seconds. */
+@property NSTimeInterval idleRotationInterval;
+
+/** Puts a replication under the scheduler's control. It will be started when a slot is free, so you shouldn't call -start yourself. (If it's already running, it takes a slot right away, even if that temporarily exceeds the limit.) */
+- (void) addReplication: (CouchReplication*)replication;
+
+/** Stops a replication, if it's running, and removes it from the scheduler. */
+- (void) removeReplication: (CouchReplication*)replication;
+
+/** Sets the priority of replications of a local database. Higher numbers go first; the default is 0. */
+- (void) setPriority: (int)priority forDatabase: (CouchDatabase*)database;
+- (int) priorityForDatabase: (CouchDatabase*)database;
+
+/** The replications currently occupying slots. */
+@property (readonly) NSArray* activeReplications;
+
+/** The replications waiting for a slot, in the order they'll be started. */
+@property (readonly) NSArray* waitingReplications;
+
+@end
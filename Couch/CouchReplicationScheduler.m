@@ -0,0 +1,251 @@
+//
+//  CouchReplicationScheduler.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchReplicationScheduler.h"
+#import "CouchInternal.h"
+
+
+@interface CouchReplicationScheduler ()
+- (void) fillSlots;
+- (void) scheduleRotation;
+@end
+
+
+@implementation CouchReplicationScheduler
+
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        _maxActiveReplications = 4;
+        _idleRotationInterval = 60.0;
+        _active = [[NSMutableArray alloc] init];
+        _waiting = [[NSMutableArray alloc] init];
+        _idleSince = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+        _priorities = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    for (CouchReplication* repl in _active) {
+        [repl removeObserver: self forKeyPath: @"running"];
+        [repl removeObserver: self forKeyPath: @"mode"];
+    }
+    [_active release];
+    [_waiting release];
+    CFRelease(_idleSince);
+    [_priorities release];
+    [super dealloc];
+}
+
+
+@synthesize maxActiveReplications=_maxActiveReplications,
+            idleRotationInterval=_idleRotationInterval;
+
+
+- (void) setMaxActiveReplications: (NSUInteger)max {
+    _maxActiveReplications = MAX(max, 1u);
+    [self fillSlots];
+}
+
+
+- (void) setIdleRotationInterval: (NSTimeInterval)interval {
+    _idleRotationInterval = interval;
+    [self scheduleRotation];
+}
+
+
+- (NSArray*) activeReplications {
+    return [[_active copy] autorelease];
+}
+
+
+#pragma mark - PRIORITIES:
+
+
+- (void) setPriority: (int)priority forDatabase: (CouchDatabase*)database {
+    [_priorities setObject: [NSNumber numberWithInt: priority] forKey: database.relativePath];
+}
+
+
+- (int) priorityForDatabase: (CouchDatabase*)database {
+    return [[_priorities objectForKey: database.relativePath] intValue];
+}
+
+
+- (NSArray*) waitingReplications {
+    // A stable sort keeps replications of equal priority in the order they were queued.
+    return [_waiting sortedArrayWithOptions: NSSortStable
+                            usingComparator: ^NSComparisonResult(id r1, id r2) {
+        int p1 = [self priorityForDatabase: [r1 localDatabase]];
+        int p2 = [self priorityForDatabase: [r2 localDatabase]];
+        if (p1 == p2)
+            return NSOrderedSame;
+        return p1 > p2 ? NSOrderedAscending : NSOrderedDescending;
+    }];
+}
+
+
+#pragma mark - SLOTS:
+
+
+- (void) activate: (CouchReplication*)repl {
+    COUCHLOG(@"%@: Starting %@", self, repl);
+    [_active addObject: repl];
+    [repl addObserver: self forKeyPath: @"running" options: 0 context: NULL];
+    [repl addObserver: self forKeyPath: @"mode" options: 0 context: NULL];
+    [repl start];
+    if (!repl.running && [_active indexOfObjectIdenticalTo: repl] != NSNotFound) {
+        // It failed without ever changing state, so there won't be a KVO notification to free
+        // its slot; free it now:
+        COUCHLOG(@"%@: %@ failed to start: %@", self, repl, repl.error);
+        [self deactivate: repl];
+    }
+}
+
+
+// Removes a replication from its slot, without stopping it.
+- (void) deactivate: (CouchReplication*)repl {
+    [repl removeObserver: self forKeyPath: @"running"];
+    [repl removeObserver: self forKeyPath: @"mode"];
+    CFDictionaryRemoveValue(_idleSince, repl);
+    [[repl retain] autorelease];
+    [_active removeObjectIdenticalTo: repl];
+}
+
+
+- (void) fillSlots {
+    if (_waiting.count == 0 || _active.count >= _maxActiveReplications)
+        return;
+    NSArray* queue = self.waitingReplications;
+    for (CouchReplication* repl in queue) {
+        if (_active.count >= _maxActiveReplications)
+            break;
+        [[repl retain] autorelease];
+        [_waiting removeObjectIdenticalTo: repl];
+        [self activate: repl];
+    }
+    [self scheduleRotation];
+}
+
+
+- (void) addReplication: (CouchReplication*)replication {
+    NSParameterAssert(replication);
+    if ([_active indexOfObjectIdenticalTo: replication] != NSNotFound
+            || [_waiting indexOfObjectIdenticalTo: replication] != NSNotFound)
+        return;
+    // Cancel the automatic start that CouchReplication schedules when it's created:
+    [NSObject cancelPreviousPerformRequestsWithTarget: replication
+                                             selector: @selector(start) object: nil];
+    if (replication.running) {
+        [self activate: replication];
+    } else {
+        [_waiting addObject: replication];
+        [self fillSlots];
+    }
+}
+
+
+- (void) removeReplication: (CouchReplication*)replication {
+    if ([_active indexOfObjectIdenticalTo: replication] != NSNotFound) {
+        [self deactivate: replication];
+        [replication stop];
+        [self fillSlots];
+    } else {
+        [_waiting removeObjectIdenticalTo: replication];
+    }
+}
+
+
+- (void) observeValueForKeyPath: (NSString*)keyPath ofObject: (id)object
+                         change: (NSDictionary*)change context: (void*)context
+{
+    CouchReplication* repl = object;
+    if (!repl.running) {
+        // It finished (or failed), so give up its slot:
+        COUCHLOG(@"%@: %@ stopped", self, repl);
+        [self deactivate: repl];
+        [self fillSlots];
+    } else if (repl.mode == kCouchReplicationIdle || repl.mode == kCouchReplicationOffline) {
+        if (!CFDictionaryGetValue(_idleSince, repl)) {
+            CFDictionarySetValue(_idleSince, repl,
+                                 [NSNumber numberWithDouble: CFAbsoluteTimeGetCurrent()]);
+            [self scheduleRotation];
+        }
+    } else {
+        CFDictionaryRemoveValue(_idleSince, repl);
+    }
+}
+
+
+#pragma mark - ROTATION:
+
+
+// Returns the time at which the given replication may be rotated out, or 0 if it can't be.
+- (CFAbsoluteTime) rotationTimeOf: (CouchReplication*)repl {
+    NSNumber* idleSince = CFDictionaryGetValue(_idleSince, repl);
+    if (!idleSince || !repl.continuous)
+        return 0;
+    return idleSince.doubleValue + _idleRotationInterval;
+}
+
+
+- (void) scheduleRotation {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self selector: @selector(rotate)
+                                               object: nil];
+    if (_waiting.count == 0 || _idleRotationInterval <= 0)
+        return;
+    CFAbsoluteTime next = 0;
+    for (CouchReplication* repl in _active) {
+        CFAbsoluteTime when = [self rotationTimeOf: repl];
+        if (when > 0 && (next == 0 || when < next))
+            next = when;
+    }
+    if (next > 0)
+        [self performSelector: @selector(rotate) withObject: nil
+                   afterDelay: MAX(next - CFAbsoluteTimeGetCurrent(), 0.0)];
+}
+
+
+- (void) rotate {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    NSMutableArray* rotated = [NSMutableArray array];
+    for (CouchReplication* repl in [[_active copy] autorelease]) {
+        if (rotated.count >= _waiting.count)
+            break;
+        CFAbsoluteTime when = [self rotationTimeOf: repl];
+        if (when > 0 && when <= now) {
+            COUCHLOG(@"%@: Rotating out idle %@", self, repl);
+            [rotated addObject: repl];
+            [self deactivate: repl];
+            [repl stop];
+        }
+    }
+    // Give the freed slots to the waiting replications, then requeue the rotated ones at the back:
+    [self fillSlots];
+    [_waiting addObjectsFromArray: rotated];
+    [self scheduleRotation];
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%u active, %u waiting]", [self class],
+            (unsigned)_active.count, (unsigned)_waiting.count];
+}
+
+
+@end
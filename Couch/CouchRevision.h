@@ -14,13 +14,13 @@
 //  and limitations under the License.
 
 #import "CouchResource.h"
-@class CouchAttachment, CouchDocument, RESTOperation;
+@class CouchAttachment, CouchDocument, CouchPropertyStore, RESTOperation;
 
 /** A single revision of a CouchDocument. */
 @interface CouchRevision : CouchResource
 {
     @private
-    NSDictionary* _properties;
+    CouchPropertyStore* _properties;
     BOOL _isDeleted;
     BOOL _gotProperties;
 }
@@ -50,7 +50,8 @@
 @property (readonly, copy) NSDictionary* properties;
 
 /** The user-defined properties, without the ones reserved by CouchDB.
-    This is based on -properties, with every key whose name starts with "_" removed. */
+    This is based on -properties, with every key whose name starts with "_" removed.
+    It's computed once per revision, so subsequent calls are cheap. */
 @property (readonly, copy) NSDictionary* userProperties;
 
 /** Shorthand for [self.properties objectForKey: key]. (Synchronous) */
@@ -85,12 +85,11 @@
 }
 
 
-- (NSURL*) URL {
+- (NSURL*) URLWithParentURL: (NSURL*)parentURL {
     if (!self.relativePath)
-        return self.parent.URL;
+        return parentURL;
     // My relativePath is a query string, not a path component
-    NSString* urlStr = self.parent.URL.absoluteString;
-    urlStr = [urlStr stringByAppendingString: self.relativePath];
+    NSString* urlStr = [parentURL.absoluteString stringByAppendingString: self.relativePath];
     return [NSURL URLWithString: urlStr];
 }
 
@@ -128,51 +127,57 @@
 
 
 - (NSDictionary*) properties {
+    return self.propertyStore.properties;
+}
+
+
+- (CouchPropertyStore*) propertyStore {
     if (!_properties && !_gotProperties) {
-        [[self GET] wait];   // synchronous!
+        NSDictionary* mirrored = [self.database.documentMirror propertiesOfDocument: self.documentID
+                                                                            revision: self.revisionID];
+        if (mirrored)
+            self.properties = mirrored;
+        else
+            [[self GET] wait];   // synchronous!
     }
     return _properties;
 }
 
 
 - (void) setProperties: (NSDictionary*)properties {
-    if (properties != _properties) {
+    if (properties != _properties.properties) {
         NSAssert([[properties objectForKey: @"_id"] isEqual: self.documentID],
                  @"properties have wrong ID %@ for %@", [properties objectForKey: @"_id"], self);
         [_properties release];
-        _properties = [properties copy];
+        _properties = properties ? [[CouchPropertyStore alloc] initWithProperties: properties]
+                                 : nil;
         _isDeleted = [$castIf(NSNumber, [properties objectForKey: @"_deleted"]) boolValue];
+        if (properties && self.isCurrent)
+            [self.database.documentMirror storeProperties: properties];
     }
     _gotProperties = YES;
 }
 
 
 - (NSDictionary*) userProperties {
-    NSDictionary* rep = [self properties];
-    if (!rep)
-        return nil;
-    NSMutableDictionary* props = [NSMutableDictionary dictionary];
-    for (NSString* key in rep) {
-        if (![key hasPrefix: @"_"])
-            [props setObject: [rep objectForKey: key] forKey: key];
-    }
-    return props;
+    return self.propertyStore.userProperties;
 }
 
 
 - (id) propertyForKey: (NSString*)key {
-    return [self.properties objectForKey: key];
+    return [self.propertyStore objectForKey: key];
 }
 
 /** Same as -propertyForKey:. Enables "[]" access in Xcode 4.4+ */
 - (id)objectForKeyedSubscript:(NSString*)key {
-    return [self.properties objectForKey: key];
+    return [self.propertyStore objectForKey: key];
 }
 
 
 - (RESTOperation*) putProperties: (NSDictionary*)properties {
     NSParameterAssert(properties != nil);
-    NSMutableDictionary* contents = [[properties mutableCopy] autorelease];
+    // The overlay shares the caller's dictionary instead of copying every property:
+    NSMutableDictionary* contents = [CouchPropertyOverlay overlayWithBase: properties];
     [contents setObject: self.documentID forKey: @"_id"];
     [contents setObject: self.revisionID forKey: @"_rev"];
     
@@ -0,0 +1,107 @@
+//
+//  CouchRevisionTree.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+@class CouchDocument, CouchRevision, CouchRevisionNode, RESTOperation;
+
+
+/** An in-memory copy of a document's revision tree: every branch, back as far as the server remembers.
+    The tree is fetched in a single request (?revs=true&open_revs=all), which also returns the contents of every leaf revision. The contents of any other revisions can then be loaded, in one request per batch, with -loadBodiesOfNodes:; they're cached on the tree's CouchRevision objects, so reading their properties doesn't go back to the server. */
+@interface CouchRevisionTree : NSObject
+{
+    @private
+    CouchDocument* _document;
+    NSMutableDictionary* _nodes;
+    NSMutableArray* _leaves;
+}
+
+- (id) initWithDocument: (CouchDocument*)document;
+
+@property (readonly) CouchDocument* document;
+
+/** Fetches the tree from the server. (Asynchronous)
+    Any nodes already in the tree are kept, so calling this again merges in new revisions. */
+- (RESTOperation*) load;
+
+/** All the nodes in the tree, in no particular order. */
+@property (readonly) NSArray* allNodes;
+
+/** The leaf nodes, i.e. the ends of the branches, including deleted ones. They're sorted the way CouchDB picks the current revision: non-deleted leaves before deleted ones, then by descending generation, then by descending revision ID. */
+@property (readonly) NSArray* leaves;
+
+/** The leaves that aren't deleted. If there's more than one, the document is in conflict. */
+@property (readonly) NSArray* liveLeaves;
+
+/** The leaf that CouchDB considers the document's current revision. */
+@property (readonly) CouchRevisionNode* winningLeaf;
+
+/** The roots of the tree: nodes whose parent is unknown, because the server has forgotten it. Usually there's only one. */
+@property (readonly) NSArray* roots;
+
+/** Looks up a node by revision ID. */
+- (CouchRevisionNode*) nodeWithRevisionID: (NSString*)revisionID;
+
+/** Returns the nodes from the given one back to its root, newest first. */
+- (NSArray*) branchEndingAt: (CouchRevisionNode*)node;
+
+/** Fetches the contents of the given revisions, in a single request. (Asynchronous)
+    Nodes whose contents are already loaded are skipped. When complete, each node's revision has its properties loaded, unless the server no longer has that revision's contents (typically because the database was compacted), in which case the node's isAvailable becomes NO.
+    @return  The operation, or nil if there was nothing to load. */
+- (RESTOperation*) loadBodiesOfNodes: (NSArray*)nodes;
+
+@end
+
+
+/** A node in a CouchRevisionTree, representing one revision. */
+@interface CouchRevisionNode : NSObject
+{
+    @private
+    CouchRevision* _revision;
+    CouchRevisionNode* _parent;
+    NSMutableArray* _children;
+    BOOL _isDeleted, _isUnavailable;
+}
+
+/** The revision. Its properties are loaded if this is a leaf, or if the tree has loaded its contents. (Otherwise accessing them will fetch them synchronously.) */
+@property (readonly) CouchRevision* revision;
+
+@property (readonly) NSString* revisionID;
+
+/** The revision's generation number, i.e. its depth in the tree: the number before the "-" in its ID. */
+@property (readonly) unsigned generation;
+
+/** The parent revision, or nil if it's unknown. */
+@property (readonly) CouchRevisionNode* parent;
+
+/** The revisions that were created from this one. */
+@property (readonly) NSArray* children;
+
+@property (readonly) BOOL isLeaf;
+
+/** Is this a deletion? (Only known for leaves, and for revisions whose contents have been loaded.) */
+@property (readonly) BOOL isDeleted;
+
+/** NO if the server reported that it no longer has this revision's contents. */
+@property (readonly) BOOL isAvailable;
+
+@end
+
+
+@interface CouchDocument (CouchRevisionTree)
+
+/** Fetches the document's revision tree. (Synchronous)
+    @return  The tree, or nil on error. */
+- (CouchRevisionTree*) getRevisionTree;
+
+@end
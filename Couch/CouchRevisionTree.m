@@ -0,0 +1,317 @@
+//
+//  CouchRevisionTree.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CouchRevisionTree.h"
+#import "CouchInternal.h"
+
+
+@interface CouchRevisionNode ()
+- (id) initWithRevision: (CouchRevision*)revision;
+- (void) setParent: (CouchRevisionNode*)parent;
+- (void) setContents: (NSDictionary*)contents;
+- (void) markUnavailable;
+@end
+
+
+@implementation CouchRevisionTree
+
+
+- (id) initWithDocument: (CouchDocument*)document {
+    NSParameterAssert(document);
+    self = [super init];
+    if (self) {
+        _document = [document retain];
+        _nodes = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [_document release];
+    [_nodes release];
+    [_leaves release];
+    [super dealloc];
+}
+
+
+@synthesize document=_document;
+
+
+- (NSArray*) allNodes {
+    return _nodes.allValues;
+}
+
+
+- (CouchRevisionNode*) nodeWithRevisionID: (NSString*)revisionID {
+    return [_nodes objectForKey: revisionID];
+}
+
+
+- (CouchRevisionNode*) addNodeWithRevisionID: (NSString*)revisionID
+                                      parent: (CouchRevisionNode*)parent
+{
+    CouchRevisionNode* node = [_nodes objectForKey: revisionID];
+    if (!node) {
+        CouchRevision* revision = [_document revisionWithID: revisionID];
+        node = [[CouchRevisionNode alloc] initWithRevision: revision];
+        [_nodes setObject: node forKey: revisionID];
+        [node release];
+    }
+    if (parent && !node.parent)
+        [node setParent: parent];
+    return node;
+}
+
+
+// Adds a leaf revision from a ?revs=true response, along with its ancestry.
+- (void) addLeafWithContents: (NSDictionary*)contents {
+    NSString* revisionID = $castIf(NSString, [contents objectForKey: @"_rev"]);
+    if (!revisionID)
+        return;
+    NSDictionary* history = $castIf(NSDictionary, [contents objectForKey: @"_revisions"]);
+    NSArray* digests = $castIf(NSArray, [history objectForKey: @"ids"]);
+    int start = [[history objectForKey: @"start"] intValue];
+
+    // _revisions lists the digests of the leaf and its ancestors, newest first:
+    CouchRevisionNode* node = nil;
+    for (NSInteger i = (NSInteger)digests.count - 1; i >= 0; --i) {
+        NSString* ancestorID = [NSString stringWithFormat: @"%d-%@",
+                                (int)(start - i), [digests objectAtIndex: i]];
+        node = [self addNodeWithRevisionID: ancestorID parent: node];
+    }
+    if (![node.revisionID isEqualToString: revisionID])
+        node = [self addNodeWithRevisionID: revisionID parent: node];
+
+    NSMutableDictionary* properties = [[contents mutableCopy] autorelease];
+    [properties removeObjectForKey: @"_revisions"];
+    [node setContents: properties];
+}
+
+
+NSComparisonResult CouchCompareLeaves(NSString* revID1, BOOL deleted1,
+                                      NSString* revID2, BOOL deleted2)
+{
+    if (deleted1 != deleted2)
+        return deleted1 ? NSOrderedDescending : NSOrderedAscending;
+    int gen1 = revID1.intValue, gen2 = revID2.intValue;
+    if (gen1 != gen2)
+        return gen1 > gen2 ? NSOrderedAscending : NSOrderedDescending;
+    return [revID2 compare: revID1];
+}
+
+
+static NSComparisonResult compareLeaves(CouchRevisionNode* n1, CouchRevisionNode* n2, void* ctx) {
+    return CouchCompareLeaves(n1.revisionID, n1.isDeleted, n2.revisionID, n2.isDeleted);
+}
+
+
+- (NSArray*) leaves {
+    if (!_leaves) {
+        _leaves = [[NSMutableArray alloc] init];
+        for (CouchRevisionNode* node in _nodes.objectEnumerator) {
+            if (node.isLeaf)
+                [_leaves addObject: node];
+        }
+        [_leaves sortUsingFunction: compareLeaves context: NULL];
+    }
+    return _leaves;
+}
+
+
+- (NSArray*) liveLeaves {
+    return [self.leaves rest_map: ^id(CouchRevisionNode* node) {
+        return node.isDeleted ? nil : node;
+    }];
+}
+
+
+- (CouchRevisionNode*) winningLeaf {
+    NSArray* leaves = self.leaves;
+    return leaves.count ? [leaves objectAtIndex: 0] : nil;
+}
+
+
+- (NSArray*) roots {
+    return [_nodes.allValues rest_map: ^id(CouchRevisionNode* node) {
+        return node.parent ? nil : node;
+    }];
+}
+
+
+- (NSArray*) branchEndingAt: (CouchRevisionNode*)node {
+    NSMutableArray* branch = [NSMutableArray arrayWithCapacity: node.generation];
+    for (; node; node = node.parent)
+        [branch addObject: node];
+    return branch;
+}
+
+
+#pragma mark - LOADING:
+
+
+- (RESTOperation*) load {
+    NSDictionary* params = [NSDictionary dictionaryWithObjectsAndKeys:
+                            @"all", @"?open_revs",
+                            @"true", @"?revs",
+                            @"true", @"?include_deleted",   // needed by TouchDB to get deleted leaves
+                            @"application/json", @"Accept",
+                            nil];
+    RESTOperation* op = [_document sendHTTP: @"GET" parameters: params];
+    [op onCompletion: ^{
+        if (op.isSuccessful) {
+            for (NSDictionary* item in $castIf(NSArray, op.responseBody.fromJSON)) {
+                NSDictionary* contents = $castIf(NSDictionary, [item objectForKey: @"ok"]);
+                if (contents)
+                    [self addLeafWithContents: contents];
+            }
+            [_leaves release];
+            _leaves = nil;
+            op.resultObject = self;
+        }
+    }];
+    return op;
+}
+
+
+- (RESTOperation*) loadBodiesOfNodes: (NSArray*)nodes {
+    NSMutableArray* revisionIDs = [NSMutableArray arrayWithCapacity: nodes.count];
+    for (CouchRevisionNode* node in nodes) {
+        NSAssert([_nodes objectForKey: node.revisionID] == node, @"%@ is not in %@", node, self);
+        if (node.isAvailable && !node.revision.propertiesAreLoaded)
+            [revisionIDs addObject: node.revisionID];
+    }
+    if (revisionIDs.count == 0)
+        return nil;
+
+    NSDictionary* params = [NSDictionary dictionaryWithObjectsAndKeys:
+                            [RESTBody stringWithJSONObject: revisionIDs], @"?open_revs",
+                            @"application/json", @"Accept",
+                            nil];
+    RESTOperation* op = [_document sendHTTP: @"GET" parameters: params];
+    [op onCompletion: ^{
+        if (op.isSuccessful) {
+            for (NSDictionary* item in $castIf(NSArray, op.responseBody.fromJSON)) {
+                NSDictionary* contents = $castIf(NSDictionary, [item objectForKey: @"ok"]);
+                if (contents) {
+                    NSString* revisionID = [contents objectForKey: @"_rev"];
+                    [[_nodes objectForKey: revisionID] setContents: contents];
+                } else {
+                    NSString* revisionID = $castIf(NSString, [item objectForKey: @"missing"]);
+                    if (revisionID)
+                        [[_nodes objectForKey: revisionID] markUnavailable];
+                }
+            }
+            [_leaves release];      // a leaf may turn out to be deleted, changing the sort order
+            _leaves = nil;
+        }
+    }];
+    return op;
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%@, %u revs]",
+            [self class], _document.abbreviatedID, (unsigned)_nodes.count];
+}
+
+
+@end
+
+
+
+
+@implementation CouchRevisionNode
+
+
+- (id) initWithRevision: (CouchRevision*)revision {
+    self = [super init];
+    if (self) {
+        _revision = [revision retain];
+        _isDeleted = revision.propertiesAreLoaded && revision.isDeleted;
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [_revision release];
+    [_children release];
+    [super dealloc];
+}
+
+
+@synthesize revision=_revision, parent=_parent, children=_children, isDeleted=_isDeleted;
+
+
+- (NSString*) revisionID {
+    return _revision.revisionID;
+}
+
+
+- (unsigned) generation {
+    return (unsigned) _revision.revisionID.intValue;
+}
+
+
+- (BOOL) isLeaf {
+    return _children.count == 0;
+}
+
+
+- (BOOL) isAvailable {
+    return !_isUnavailable;
+}
+
+
+- (void) setParent: (CouchRevisionNode*)parent {
+    NSAssert(!_parent, @"%@ already has a parent", self);
+    _parent = parent;   // not retained, to avoid a cycle
+    if (!parent->_children)
+        parent->_children = [[NSMutableArray alloc] init];
+    [parent->_children addObject: self];
+}
+
+
+- (void) setContents: (NSDictionary*)contents {
+    if (!_revision.propertiesAreLoaded)
+        _revision.properties = contents;
+    _isDeleted = [[contents objectForKey: @"_deleted"] boolValue];
+}
+
+
+- (void) markUnavailable {
+    _isUnavailable = YES;
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%@%@]", [self class], self.revisionID,
+            (_isDeleted ? @" deleted" : @"")];
+}
+
+
+@end
+
+
+
+
+@implementation CouchDocument (CouchRevisionTree)
+
+- (CouchRevisionTree*) getRevisionTree {
+    CouchRevisionTree* tree = [[[CouchRevisionTree alloc] initWithDocument: self] autorelease];
+    return [[tree load] wait] ? tree : nil;
+}
+
+@end
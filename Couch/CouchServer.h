@@ -14,7 +14,7 @@
 //  and limitations under the License.
 
 #import "CouchResource.h"
-@class CouchDatabase, CouchLiveQuery, CouchPersistentReplication, RESTCache;
+@class CouchChangeMultiplexer, CouchDatabase, CouchLiveQuery, CouchPersistentReplication, CouchReplicationScheduler, RESTCache;
 
 
 /** The top level of a CouchDB server. Contains CouchDatabases. */
@@ -28,7 +28,13 @@
     NSArray* _activeTasks;
     RESTOperation* _activeTasksOp;
     NSTimer* _activityPollTimer;
+    NSTimeInterval _activityPollInterval, _activityPollDelay;
+    NSMutableDictionary* _replicationTasks;
     CouchLiveQuery* _replicationsQuery;
+    NSMutableDictionary* _replicationsByKey;
+    CouchReplicationScheduler* _replicationScheduler;
+    CouchChangeMultiplexer* _changeMultiplexer;
+    BOOL _multiplexesChanges;
 }
 
 /** Initialize given a server URL. */
@@ -68,15 +74,23 @@
 
 - (void) checkActiveTasks;
 
-/** How often to poll the server's list of active tasks and update .activeTasks. */
+/** How often to poll the server's list of active tasks and update .activeTasks.
+    This is the shortest interval; while the list isn't changing, polling gradually slows down, and it speeds up again as soon as a change is seen. (An embedded TouchDB server doesn't need to be polled at all; it posts notifications instead.) */
 @property NSTimeInterval activityPollInterval;
 
+/** If YES, databases of this server that track changes share a single connection to the server's global _db_updates feed, and only read a database's _changes when it's been updated, instead of each holding its own _changes connection open. This scales much better when tracking many databases.
+    Defaults to NO. Changing it affects only databases that start tracking changes afterwards. */
+@property BOOL multiplexesChanges;
+
 #pragma mark - REPLICATION:
 
 /** All currently defined CouchPersistentReplications (as stored in the replicator database.)
     To create a replication, use the methods on CouchDatabase. */
 @property (readonly) NSArray* replications;
 
+/** Limits and prioritizes the CouchReplications added to it. */
+@property (readonly) CouchReplicationScheduler* replicationScheduler;
+
 @end
 
 
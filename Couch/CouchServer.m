@@ -15,12 +15,17 @@
 
 #import "CouchServer.h"
 
+#import "CouchChangeMultiplexer.h"
+#import "CouchReplicationScheduler.h"
 #import "CouchInternal.h"
 #import "RESTCache.h"
 
 
 static NSString* const kLocalServerURL = @"http://127.0.0.1:5984/";
 
+// Longest interval that activity polling slows down to while nothing's changing.
+#define kMaxActivityPollInterval 8.0
+
 
 int gCouchLogLevel = 0;
 
@@ -50,17 +55,28 @@ int gCouchLogLevel = 0;
 
 
 - (void)dealloc {
+    [_activityPollTimer invalidate];
+    [_activityPollTimer release];
     [_activeTasks release];
+    [_replicationTasks release];
     [_activityRsrc release];
+    [_replicationsQuery removeObserver: self forKeyPath: @"rows"];
     [_replicationsQuery release];
+    [_replicationsByKey release];
+    [_replicationScheduler release];
+    [_changeMultiplexer release];
     [_dbCache release];
     [super dealloc];
 }
 
 
 - (void) close {
+    [_replicationsQuery removeObserver: self forKeyPath: @"rows"];
     [_replicationsQuery release];
     _replicationsQuery = nil;
+    [_replicationsByKey release];
+    _replicationsByKey = nil;
+    [_changeMultiplexer stop];
     for (CouchDatabase* db in _dbCache.allCachedResources)
         [db unretainDocumentCache];
 }
@@ -151,6 +167,16 @@ int gCouchLogLevel = 0;
 
 
 
+@synthesize multiplexesChanges=_multiplexesChanges;
+
+
+- (CouchChangeMultiplexer*) changeMultiplexer {
+    if (!_changeMultiplexer)
+        _changeMultiplexer = [[CouchChangeMultiplexer alloc] initWithServer: self];
+    return _changeMultiplexer;
+}
+
+
 #pragma mark - REPLICATOR DATABASE:
 
 
@@ -165,6 +191,7 @@ int gCouchLogLevel = 0;
         replicatorDB.tracksChanges = YES;
         _replicationsQuery = [[[replicatorDB getAllDocuments] asLiveQuery] retain];
         [_replicationsQuery wait];
+        [_replicationsQuery addObserver: self forKeyPath: @"rows" options: 0 context: NULL];
     }
     return _replicationsQuery;
 }
@@ -180,22 +207,139 @@ int gCouchLogLevel = 0;
 }
 
 
+static NSString* replicationKey(NSString* source, NSString* target) {
+    return [NSString stringWithFormat: @"%@ %@", source, target];
+}
+
+
+// Index of self.replications by source and target, rebuilt whenever the replicator db changes.
+- (NSMutableDictionary*) replicationsByKey {
+    if (!_replicationsByKey) {
+        NSArray* replications = self.replications;
+        _replicationsByKey = [[NSMutableDictionary alloc] initWithCapacity: replications.count];
+        for (CouchPersistentReplication* repl in replications) {
+            NSString* key = replicationKey(repl.sourceURLStr, repl.targetURLStr);
+            if (![_replicationsByKey objectForKey: key])
+                [_replicationsByKey setObject: repl forKey: key];
+        }
+    }
+    return _replicationsByKey;
+}
+
+
 - (CouchPersistentReplication*) replicationWithSource: (NSString*)source
                                                target: (NSString*)target
 {
-    for (CouchPersistentReplication* repl in self.replications) {
-        if ($equal(repl.sourceURLStr, source) && $equal(repl.targetURLStr, target))
-            return repl;
+    NSString* key = replicationKey(source, target);
+    CouchPersistentReplication* repl = [self.replicationsByKey objectForKey: key];
+    if (!repl) {
+        repl = [CouchPersistentReplication createWithReplicatorDatabase: self.replicatorDatabase
+                                                                 source: source target: target];
+        // Remember it, so another call before it's saved doesn't create a duplicate:
+        [_replicationsByKey setObject: repl forKey: key];
+    }
+    return repl;
+}
+
+
+- (CouchReplicationScheduler*) replicationScheduler {
+    if (!_replicationScheduler)
+        _replicationScheduler = [[CouchReplicationScheduler alloc] init];
+    return _replicationScheduler;
+}
+
+
+- (void) observeValueForKeyPath: (NSString*)keyPath ofObject: (id)object
+                         change: (NSDictionary*)change context: (void*)context
+{
+    if (object == _replicationsQuery) {
+        // Rebuild the index from the new rows, keeping the replications that aren't in them
+        // because they haven't been saved yet; otherwise they'd be created again:
+        NSDictionary* old = [_replicationsByKey autorelease];
+        _replicationsByKey = nil;
+        if (old.count > 0) {
+            NSMutableDictionary* index = self.replicationsByKey;
+            for (NSString* key in old) {
+                CouchPersistentReplication* repl = [old objectForKey: key];
+                if (![index objectForKey: key] && repl.document && !repl.document.isDeleted
+                        && [key isEqualToString: replicationKey(repl.sourceURLStr,
+                                                                repl.targetURLStr)])
+                    [index setObject: repl forKey: key];
+            }
+        }
+    } else {
+        [super observeValueForKeyPath: keyPath ofObject: object change: change context: context];
     }
-    return [CouchPersistentReplication createWithReplicatorDatabase: self.replicatorDatabase
-                                                             source: source target: target];
 }
 
 
 #pragma mark - ACTIVITY MONITOR:
 
 
-@synthesize activeTasks=_activeTasks;
+- (NSArray*) activeTasks {
+    return _activeTasks;
+}
+
+
+static BOOL isReplicationTask(NSDictionary* task) {
+    NSString* type = $castIf(NSString, [task objectForKey: @"type"]);
+    return type && [type caseInsensitiveCompare: @"replication"] == NSOrderedSame;
+}
+
+
+// Adds an identifier of a replication task to the index, both as-is and without any "+options"
+// suffix (as in "6390525ac52bd8b5437ab0a118993d0a+continuous".)
+static void indexReplicationTask(NSMutableDictionary* index, id key, NSDictionary* task) {
+    if (![key isKindOfClass: [NSString class]] || [key length] == 0)
+        return;
+    [index setObject: task forKey: key];
+    NSRange plus = [key rangeOfString: @"+"];
+    if (plus.length > 0)
+        [index setObject: task forKey: [key substringToIndex: plus.location]];
+}
+
+
+- (void) setActiveTasks: (NSArray*)tasks {
+    [_activeTasks autorelease];
+    _activeTasks = [tasks copy];
+
+    // Index the replication tasks by their IDs, so replications can look themselves up quickly:
+    [_replicationTasks release];
+    _replicationTasks = [[NSMutableDictionary alloc] init];
+    for (NSDictionary* task in _activeTasks) {
+        if (![task isKindOfClass: [NSDictionary class]] || !isReplicationTask(task))
+            continue;
+        indexReplicationTask(_replicationTasks, [task objectForKey: @"replication_id"], task);
+        indexReplicationTask(_replicationTasks, [task objectForKey: @"doc_id"], task);
+        NSString* taskStr = $castIf(NSString, [task objectForKey: @"task"]);
+        indexReplicationTask(_replicationTasks, taskStr, task);
+        if ([taskStr hasPrefix: @"`"]) {
+            // Older CouchDB task strings look like "`6390525ac52bd8b5437ab0a118993d0a+continuous`: ..."
+            NSRange end = [taskStr rangeOfString: @"`" options: 0
+                                           range: NSMakeRange(1, taskStr.length - 1)];
+            if (end.length > 0)
+                indexReplicationTask(_replicationTasks,
+                                     [taskStr substringWithRange: NSMakeRange(1, end.location - 1)],
+                                     task);
+        }
+    }
+}
+
+
+- (NSDictionary*) activeReplicationTaskWithID: (NSString*)replicationID {
+    if (!replicationID)
+        return nil;
+    NSDictionary* task = [_replicationTasks objectForKey: replicationID];
+    if (!task) {
+        // Fall back to searching the task descriptions, in case of an unfamiliar format:
+        for (NSDictionary* t in _activeTasks) {
+            if ([t isKindOfClass: [NSDictionary class]] && isReplicationTask(t)
+                    && [[[t objectForKey: @"task"] description] rangeOfString: replicationID].length > 0)
+                return t;
+        }
+    }
+    return task;
+}
 
 
 - (void)addObserver:(NSObject *)observer forKeyPath:(NSString *)keyPath 
@@ -219,6 +363,9 @@ int gCouchLogLevel = 0;
 - (void) checkActiveTasks {
     if (_activeTasksOp)
         return;  // already checking
+    [_activityPollTimer invalidate];
+    [_activityPollTimer release];
+    _activityPollTimer = nil;
     if (!_activityRsrc) {
         _activityRsrc = [[RESTResource alloc] initWithParent:self relativePath:@"_active_tasks"];
     }
@@ -232,7 +379,12 @@ int gCouchLogLevel = 0;
             if (tasks && ![tasks isEqual: _activeTasks]) {
                 COUCHLOG2(@"CouchServer: activeTasks = %@", tasks);
                 self.activeTasks = tasks;    // Triggers KVO notification
+                _activityPollDelay = _activityPollInterval;
+            } else {
+                // Nothing's changing, so back off:
+                _activityPollDelay = MIN(2 * _activityPollDelay, kMaxActivityPollInterval);
             }
+            [self scheduleActivityPoll];
         } else {
             Warn(@"CouchServer: pollActivity failed with %@", op.error);
             self.activityPollInterval = 0.0; // turn off polling
@@ -241,26 +393,42 @@ int gCouchLogLevel = 0;
 }
 
 
+- (void) scheduleActivityPoll {
+    if (_activityPollInterval <= 0 || _activityPollTimer)
+        return;
+    NSTimeInterval delay = MAX(_activityPollDelay, _activityPollInterval);
+    _activityPollTimer = [[NSTimer scheduledTimerWithTimeInterval: delay
+                                                           target: self
+                                                         selector: @selector(checkActiveTasks)
+                                                         userInfo: NULL
+                                                          repeats: NO] retain];
+}
+
+
 - (void) setActivityPollInterval: (NSTimeInterval)interval {
-    if (interval != self.activityPollInterval) {
+    if (interval != _activityPollInterval) {
+        _activityPollInterval = interval;
+        _activityPollDelay = interval;
         [_activityPollTimer invalidate];
         [_activityPollTimer release];
-        if (interval > 0) {
-            _activityPollTimer = [[NSTimer scheduledTimerWithTimeInterval: interval
-                                                                   target: self 
-                                                                 selector: @selector(checkActiveTasks)
-                                                                 userInfo: NULL
-                                                                  repeats: YES] retain];
+        _activityPollTimer = nil;
+        if (interval > 0)
             [self checkActiveTasks];
-        } else {
-            _activityPollTimer = nil;
-        }
     }
 }
 
 
 - (NSTimeInterval) activityPollInterval {
-    return _activityPollTimer ? _activityPollTimer.timeInterval : 0.0;
+    return _activityPollInterval;
+}
+
+
+- (void) replicationStateChanged {
+    // A replication started or stopped, so the task list is about to change; poll right away
+    // rather than waiting for a backed-off timer:
+    _activityPollDelay = _activityPollInterval;
+    if (self.activityPollInterval > 0)
+        [self checkActiveTasks];
 }
 
 
@@ -7,9 +7,11 @@
 //
 
 #import "CouchChangeTracker.h"
+@class RESTTapeStream;
 
 
-/** CouchChangeTracker implementation that uses a raw TCP socket to read the chunk-mode HTTP response. */
+/** CouchChangeTracker implementation that uses a raw TCP socket to read the chunk-mode HTTP response.
+    The raw bytes read are saved to the active RESTTape while it's recording, and read back from it instead of the socket while it's replaying. */
 @interface CouchSocketChangeTracker : CouchChangeTracker
 {
     @private
@@ -20,5 +22,6 @@
     
     NSMutableData* _inputBuffer;
     int _state;
+    RESTTapeStream* _tapeStream;
 }
 @end
@@ -18,8 +18,6 @@ enum {
     kStateChunks
 };
 
-#define kMaxRetries 7
-
 
 @implementation CouchSocketChangeTracker
 
@@ -27,6 +25,10 @@ enum {
     NSAssert(!_trackingInput, @"Already started");
     NSAssert(_mode == kContinuous, @"CouchSocketChangeTracker only supports continuous mode");
     
+    RESTTape* tape = [RESTTape activeTape];
+    if (tape.isReplaying)
+        return [self startReplayingFrom: tape];
+
     NSMutableString* request = [NSMutableString stringWithFormat:
                                      @"GET /%@/%@ HTTP/1.1\r\n"
                                      @"Host: %@\r\n",
@@ -72,6 +74,7 @@ enum {
     _state = kStateStatus;
     
     _inputBuffer = [[NSMutableData alloc] initWithCapacity: 1024];
+    _tapeStream = [[tape recordStreamNamed: self.tapeStreamName] retain];
     
     [_trackingOutput setDelegate: self];
     [_trackingOutput scheduleInRunLoop: [NSRunLoop currentRunLoop] forMode: NSRunLoopCommonModes];
@@ -83,8 +86,33 @@ enum {
 }
 
 
+- (NSString*) tapeStreamName {
+    return [_databaseURL.absoluteString stringByAppendingString: @"/_changes"];
+}
+
+
+// Feeds the recorded response bytes through the same parser, instead of reading a socket.
+- (BOOL) startReplayingFrom: (RESTTape*)tape {
+    _tapeStream = [[tape replayStreamNamed: self.tapeStreamName] retain];
+    if (!_tapeStream)
+        COUCHLOG(@"%@: Tape has no recorded changes feed", self);
+    _state = kStateStatus;
+    _inputBuffer = [[NSMutableData alloc] initWithCapacity: 1024];
+    __block CouchSocketChangeTracker* blockSelf = self;   // avoids a retain cycle
+    [_tapeStream playWithBlock: ^(NSData* data) {
+        blockSelf->_bytesReceived += data.length;
+        [blockSelf->_inputBuffer appendData: data];
+        [blockSelf readAvailableData];
+    }];
+    return YES;
+}
+
+
 - (void) stop {
     COUCHLOG2(@"%@: stop", self);
+    [_tapeStream stop];
+    [_tapeStream release];
+    _tapeStream = nil;
     [_trackingInput close];
     [_trackingInput release];
     _trackingInput = nil;
@@ -128,6 +156,7 @@ enum {
                 if (line.length == 0) {
                     _state = kStateChunks;
                     _retryCount = 0;  // successful connection
+                    [_retryPolicy recordResultForURL: _databaseURL error: nil latency: 0.0];
                 }
                 break;
             case kStateChunks: {
@@ -162,10 +191,44 @@ enum {
 }
 
 
+// Parses what's buffered, and reads more from the socket as long as there's room in my queue of
+// changes. Reading a little at a time and parsing as I go keeps the buffer small; once reading
+// stops, the server's output backs up in the socket instead of in memory.
+- (void) readAvailableData {
+    for (;;) {
+        while (_inputBuffer && !_readingPaused && [self readLine])
+            ;
+        if (_readingPaused || ![_trackingInput hasBytesAvailable])
+            break;
+        uint8_t buffer[1024];
+        NSInteger bytesRead = [_trackingInput read: buffer maxLength: sizeof(buffer)];
+        if (bytesRead <= 0)
+            break;
+        _bytesReceived += bytesRead;
+        [_inputBuffer appendBytes: buffer length: bytesRead];
+        if (_tapeStream)
+            [_tapeStream appendData: [NSData dataWithBytes: buffer length: bytesRead]];
+        COUCHLOG3(@"%@: read %ld bytes", self, (long)bytesRead);
+    }
+    [self reportBufferedBytes];
+}
+
+
+- (void) resumeReading {
+    [self readAvailableData];
+}
+
+
+- (NSUInteger) bytesBuffered {
+    return _inputBuffer.length;
+}
+
+
 - (void) errorOccurred: (NSError*)error {
     [self stop];
-    if (++_retryCount <= kMaxRetries) {
-        NSTimeInterval retryDelay = 0.2 * (1 << (_retryCount-1));
+    [_retryPolicy recordResultForURL: _databaseURL error: error latency: 0.0];
+    if (++_retryCount <= kChangeTrackerMaxRetries) {
+        NSTimeInterval retryDelay = [_retryPolicy delayBeforeRetry: _retryCount];
         [self performSelector: @selector(start) withObject: nil afterDelay: retryDelay];
     } else {
         Warn(@"%@: Can't connect, giving up: %@", self, error);
@@ -190,16 +253,7 @@ enum {
         }
         case NSStreamEventHasBytesAvailable: {
             COUCHLOG3(@"%@: HasBytesAvailable %@", self, stream);
-            while ([stream hasBytesAvailable]) {
-                uint8_t buffer[1024];
-                NSInteger bytesRead = [stream read: buffer maxLength: sizeof(buffer)];
-                if (bytesRead > 0) {
-                    [_inputBuffer appendBytes: buffer length: bytesRead];
-                    COUCHLOG3(@"%@: read %ld bytes", self, (long)bytesRead);
-                }
-            }
-            while (_inputBuffer && [self readLine])
-                ;
+            [self readAvailableData];
             break;
         }
         case NSStreamEventEndEncountered:
@@ -0,0 +1,65 @@
+//
+//  CouchAutosaver.h
+//  CouchCocoa
+//
+//  Copyright (c) 2012 Couchbase, Inc. All rights reserved.
+//
+
+#import <CouchCocoa/CouchDatabase.h>
+@class CouchModel, RESTOperation;
+
+
+/** Schedules saves of autosaving CouchModels in a database.
+    Instead of saving a model the moment one of its properties changes, the autosaver waits until the model has been left alone for debounceDelay seconds (or until maxLatency has passed since its first unsaved change), so a burst of edits turns into a single save. Models that become ready at about the same time are saved together with +[CouchModel saveModels:], in a single _bulk_docs request.
+    A model is never saved again while an earlier save of it is still in progress, since the two saves would conflict over its revision ID; any further changes wait for the first save to finish.
+    Every database has its own autosaver, which CouchModel uses when its autosaves property is set. */
+@interface CouchAutosaver : NSObject
+{
+    @private
+    CouchDatabase* _database;
+    CFMutableDictionaryRef _pending;        // CouchModel* -> CouchAutosaveEntry (model not retained by key)
+    NSMutableSet* _saving;
+    NSUInteger _savesInFlight;
+    NSTimeInterval _debounceDelay, _maxLatency;
+    NSUInteger _maxSavesInFlight, _maxBatchSize;
+    CFAbsoluteTime _scheduledFor;
+}
+
+- (id) initWithDatabase: (CouchDatabase*)database;
+
+/** How long a model must go without changes before it's saved. Defaults to 0.5 sec. */
+@property NSTimeInterval debounceDelay;
+
+/** The longest a model will wait to be saved after its first unsaved change, even if it keeps changing. Defaults to 5 sec. */
+@property NSTimeInterval maxLatency;
+
+/** The maximum number of save requests that may be in progress at once. Defaults to 2. */
+@property NSUInteger maxSavesInFlight;
+
+/** The maximum number of models saved by a single request. Defaults to 100. */
+@property NSUInteger maxBatchSize;
+
+/** Notes that the model has changed and should be saved. Calling this again before the model is saved just pushes back its save time (up to maxLatency). */
+- (void) scheduleSave: (CouchModel*)model;
+
+/** Removes the model from the schedule, if it's scheduled. */
+- (void) cancelSave: (CouchModel*)model;
+
+/** Immediately saves all scheduled models that aren't already being saved, ignoring the delays and maxSavesInFlight.
+    @return  The RESTOperation, or nil if there was nothing to save. */
+- (RESTOperation*) flush;
+
+/** The number of models waiting to be saved. */
+@property (readonly) NSUInteger pendingCount;
+
+/** The number of save requests in progress. */
+@property (readonly) NSUInteger savesInFlight;
+
+@end
+
+
+@interface CouchDatabase (CouchAutosaver)
+
+/** The object that schedules saves of this database's autosaving CouchModels. */
+@property (readonly) CouchAutosaver* autosaver;
+@end
@@ -0,0 +1,202 @@
+//
+//  CouchAutosaver.m
+//  CouchCocoa
+//
+//  Copyright (c) 2012 Couchbase, Inc. All rights reserved.
+//
+
+#import "CouchAutosaver.h"
+#import "CouchInternal.h"
+
+
+@interface CouchAutosaveEntry : NSObject
+{
+    @public
+    CouchModel* _model;
+    CFAbsoluteTime _firstChange, _lastChange;
+}
+@end
+
+@implementation CouchAutosaveEntry
+- (void) dealloc {
+    [_model release];
+    [super dealloc];
+}
+@end
+
+
+@interface CouchAutosaver ()
+- (void) saveReadyModels;
+- (void) reschedule;
+@end
+
+
+@implementation CouchAutosaver
+
+
+- (id) initWithDatabase: (CouchDatabase*)database {
+    NSParameterAssert(database);
+    self = [super init];
+    if (self) {
+        _database = database;   // not retained; the database owns me
+        _pending = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+        _saving = [[NSMutableSet alloc] init];
+        _debounceDelay = 0.5;
+        _maxLatency = 5.0;
+        _maxSavesInFlight = 2;
+        _maxBatchSize = 100;
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    CFRelease(_pending);
+    [_saving release];
+    [super dealloc];
+}
+
+
+@synthesize debounceDelay=_debounceDelay, maxLatency=_maxLatency,
+            maxSavesInFlight=_maxSavesInFlight, maxBatchSize=_maxBatchSize,
+            savesInFlight=_savesInFlight;
+
+
+- (NSUInteger) pendingCount {
+    return CFDictionaryGetCount(_pending);
+}
+
+
+- (void) scheduleSave: (CouchModel*)model {
+    NSParameterAssert(model);
+    NSAssert(model.database == _database, @"%@ is not in %@", model, _database);
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    CouchAutosaveEntry* entry = (id)CFDictionaryGetValue(_pending, model);
+    if (!entry) {
+        entry = [[CouchAutosaveEntry alloc] init];
+        entry->_model = [model retain];
+        entry->_firstChange = now;
+        CFDictionarySetValue(_pending, model, entry);
+        [entry release];
+    }
+    entry->_lastChange = now;
+    [self reschedule];
+}
+
+
+- (void) cancelSave: (CouchModel*)model {
+    CFDictionaryRemoveValue(_pending, model);
+}
+
+
+// The time at which an entry becomes ready to save.
+- (CFAbsoluteTime) dueTime: (CouchAutosaveEntry*)entry {
+    return MIN(entry->_lastChange + _debounceDelay, entry->_firstChange + _maxLatency);
+}
+
+
+// Removes up to 'limit' models from _pending that are due by the given time and aren't
+// already being saved. Entries for models that no longer need saving are just dropped.
+- (NSArray*) takeModelsDueBy: (CFAbsoluteTime)time limit: (NSUInteger)limit {
+    CFIndex count = CFDictionaryGetCount(_pending);
+    if (count == 0)
+        return nil;
+    const void* entries[count];
+    CFDictionaryGetKeysAndValues(_pending, NULL, entries);
+    NSMutableArray* models = [NSMutableArray array];
+    for (CFIndex i = 0; i < count && models.count < limit; ++i) {
+        CouchAutosaveEntry* entry = (id)entries[i];
+        CouchModel* model = entry->_model;
+        if ([_saving containsObject: model] || [self dueTime: entry] > time)
+            continue;
+        if (model.needsSave && model.database == _database)
+            [models addObject: model];
+        CFDictionaryRemoveValue(_pending, model);   // releases entry, but 'models' retains model
+    }
+    return models;
+}
+
+
+// Saves a batch of models, keeping track of them until the save completes.
+- (RESTOperation*) saveModels: (NSArray*)models {
+    RESTOperation* op = [CouchModel saveModels: models];
+    if (!op)
+        return nil;
+    COUCHLOG2(@"%@: Saving %u models", self, (unsigned)models.count);
+    [_saving addObjectsFromArray: models];
+    ++_savesInFlight;
+    [op onCompletion: ^{
+        for (CouchModel* model in models)
+            [_saving removeObject: model];
+        --_savesInFlight;
+        [self reschedule];
+    }];
+    return op;
+}
+
+
+- (void) saveReadyModels {
+    _scheduledFor = 0;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    while (_savesInFlight < _maxSavesInFlight) {
+        NSArray* models = [self takeModelsDueBy: now limit: _maxBatchSize];
+        if (models.count == 0)
+            break;
+        [self saveModels: models];
+    }
+    [self reschedule];
+}
+
+
+// Arranges for -saveReadyModels to be called when the next pending model becomes due.
+- (void) reschedule {
+    CFAbsoluteTime next = 0;
+    if (_savesInFlight < _maxSavesInFlight) {
+        CFIndex count = CFDictionaryGetCount(_pending);
+        const void* entries[MAX(count, 1)];
+        CFDictionaryGetKeysAndValues(_pending, NULL, entries);
+        for (CFIndex i = 0; i < count; ++i) {
+            CouchAutosaveEntry* entry = (id)entries[i];
+            if ([_saving containsObject: entry->_model])
+                continue;   // will be rescheduled when its save completes
+            CFAbsoluteTime due = [self dueTime: entry];
+            if (next == 0 || due < next)
+                next = due;
+        }
+    }
+    if (next == _scheduledFor)
+        return;
+    [NSObject cancelPreviousPerformRequestsWithTarget: self
+                                             selector: @selector(saveReadyModels)
+                                               object: nil];
+    _scheduledFor = next;
+    if (next > 0) {
+        NSTimeInterval delay = MAX(next - CFAbsoluteTimeGetCurrent(), 0.0);
+        [self performSelector: @selector(saveReadyModels) withObject: nil afterDelay: delay];
+    }
+}
+
+
+- (RESTOperation*) flush {
+    NSArray* models = [self takeModelsDueBy: INFINITY limit: NSUIntegerMax];
+    RESTOperation* op = models.count ? [self saveModels: models] : nil;
+    [self reschedule];
+    return op;
+}
+
+
+@end
+
+
+
+
+@implementation CouchDatabase (CouchAutosaver)
+
+- (CouchAutosaver*) autosaver {
+    if (!_autosaver)
+        _autosaver = [[CouchAutosaver alloc] initWithDatabase: self];
+    return _autosaver;
+}
+
+@end
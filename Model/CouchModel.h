@@ -7,7 +7,7 @@
 //
 
 #import "CouchDynamicObject.h"
-@class CouchAttachment, CouchDatabase, CouchDocument, RESTOperation;
+@class CouchAttachment, CouchDatabase, CouchDocument, CouchModelFactory, RESTOperation;
 
 
 /** Generic model class for Couch documents.
@@ -28,6 +28,10 @@
     NSMutableDictionary* _properties;   // Cached property values, including changed values
     NSMutableSet* _changedNames;        // Names of properties that have been changed but not saved
     NSMutableDictionary* _changedAttachments;
+    NSDictionary* _savingProperties;        // Changed values sent by the save in progress
+    NSDictionary* _savingAttachments;       // Changed attachments sent by the save in progress
+    CouchModelFactory* _factory;            // Accounts for the cached values' memory
+    NSUInteger _reportedValueCount;         // Number of cached values reported to _factory
 }
 
 /** Returns the CouchModel associated with a CouchDocument, or creates & assigns one if necessary.
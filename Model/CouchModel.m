@@ -8,6 +8,7 @@
 
 #import "CouchModel.h"
 #import "CouchModelFactory.h"
+#import "CouchAutosaver.h"
 #import "CouchInternal.h"
 #import <objc/runtime.h>
 
@@ -16,6 +17,7 @@
 @property (readwrite, retain) CouchDocument* document;
 @property (readwrite) bool needsSave;
 - (NSDictionary*) attachmentDataToSave;
+- (NSDictionary*) beginSave;
 @end
 
 
@@ -74,11 +76,15 @@
 - (void) dealloc
 {
     COUCHLOG2(@"%@ dealloc", self);
+    [_factory model: self cachedValueCountChangedFrom: _reportedValueCount to: 0];
+    [_factory release];
     _document.modelObject = nil;
     [_document release];
     [_properties release];
     [_changedNames release];
     [_changedAttachments release];
+    [_savingProperties release];
+    [_savingAttachments release];
     [super dealloc];
 }
 
@@ -139,6 +145,7 @@
         return nil;
     COUCHLOG2(@"%@ Deleting document", self);
     _needsSave = NO;        // prevent any pending saves
+    [_document.database.autosaver cancelSave: self];
     RESTOperation* op = [_document DELETE];
     [op onCompletion:^{
         if (op.isSuccessful) 
@@ -192,16 +199,7 @@
     for (NSString* key in keys)
         [self willChangeValueForKey: key];
     
-    // Remove unchanged cached values in _properties:
-    if (_changedNames && _properties) {
-        NSMutableSet* removeKeys = [NSMutableSet setWithArray: [_properties allKeys]];
-        [removeKeys minusSet: _changedNames];
-        [_properties removeObjectsForKeys: removeKeys.allObjects];
-    } else {
-        [_properties release];
-        _properties = nil;
-    }
-    
+    [self forgetUnchangedProperties];
     [self didLoadFromDocument];
     for (NSString* key in keys)
         [self didChangeValueForKey: key];
@@ -227,49 +225,107 @@
     if (autosaves != _autosaves) {
         _autosaves = autosaves;
         if (_autosaves && _needsSave)
-            [self performSelector: @selector(save) withObject: nil afterDelay: 0.0];
+            [self.database.autosaver scheduleSave: self];
     }
 }
 
 
 - (void) markNeedsSave {
-    if (_autosaves && !_needsSave)
-        [self performSelector: @selector(save) withObject: nil afterDelay: 0.0];
+    // Let the autosaver decide when to save, so a burst of changes results in a single save:
+    if (_autosaves)
+        [self.database.autosaver scheduleSave: self];
     self.needsSave = YES;
 }
 
 
-- (void) saveCompleted: (RESTOperation*)op {
-    if (op.error) {
+- (void) saveCompletedWithError: (NSError*)error {
+    if (error) {
         // TODO: Need a way to inform the app (and user) of the error, and not just revert
-        Warn(@"%@: Save failed: %@", self, op.error);
+        Warn(@"%@: Save failed: %@", self, error);
         [self couchDocumentChanged: _document];     // reset to contents from server
-        //[NSApp presentError: op.error];
+        //[NSApp presentError: error];
     } else {
         _isNew = NO;
-        [_properties release];
-        _properties = nil;
-        [_changedNames release];
-        _changedNames = nil;
-        [_changedAttachments release];
-        _changedAttachments = nil;
+        // Forget the changes that were saved, but not any made while the save was in progress:
+        for (NSString* key in _savingProperties) {
+            id value = [_properties objectForKey: key] ?: [NSNull null];
+            if ($equal(value, [_savingProperties objectForKey: key]))
+                [_changedNames removeObject: key];
+        }
+        for (NSString* name in _savingAttachments) {
+            if ([_changedAttachments objectForKey: name] == [_savingAttachments objectForKey: name])
+                [_changedAttachments removeObjectForKey: name];
+        }
+        if (_changedNames.count == 0) {
+            [_changedNames release];
+            _changedNames = nil;
+        }
+        if (_changedAttachments.count == 0) {
+            [_changedAttachments release];
+            _changedAttachments = nil;
+        }
+        [self forgetUnchangedProperties];
     }
+    [_savingProperties release];
+    _savingProperties = nil;
+    [_savingAttachments release];
+    _savingAttachments = nil;
+}
+
+
+// Returns the properties to save, remembering which changes they include so that
+// -saveCompletedWithError: can tell them apart from changes made after this.
+- (NSDictionary*) beginSave {
+    NSMutableDictionary* saving = [NSMutableDictionary dictionaryWithCapacity: _changedNames.count];
+    for (NSString* key in _changedNames)
+        [saving setObject: ([_properties objectForKey: key] ?: [NSNull null]) forKey: key];
+    [_savingProperties release];
+    _savingProperties = [saving copy];
+    [_savingAttachments release];
+    _savingAttachments = [_changedAttachments copy];
+    self.needsSave = NO;
+    return self.propertiesToSave;
 }
 
 
 - (RESTOperation*) save {
     if (!_needsSave || (!_changedNames && !_changedAttachments))
         return nil;
-    NSDictionary* properties = self.propertiesToSave;
+    NSDictionary* properties = [self beginSave];
     COUCHLOG2(@"%@ Saving <- %@", self, properties);
-    self.needsSave = NO;
     RESTOperation* op = [_document putProperties: properties];
-    [op onCompletion: ^{[self saveCompleted: op];}];
+    [op onCompletion: ^{[self saveCompletedWithError: op.error];}];
     [op start];
     return op;
 }
 
 
+// Returns an error describing a failed document in a _bulk_docs response, or nil on success.
+static NSError* BulkSaveError(NSDictionary* response) {
+    if (!response)
+        return [NSError errorWithDomain: NSURLErrorDomain code: NSURLErrorBadServerResponse
+                               userInfo: nil];
+    NSString* errorName = [[response objectForKey: @"error"] description];
+    if (!errorName)
+        return nil;
+    NSInteger code = 500;
+    if ([errorName isEqualToString: @"conflict"])
+        code = 409;
+    else if ([errorName isEqualToString: @"forbidden"])
+        code = 403;
+    else if ([errorName isEqualToString: @"unauthorized"])
+        code = 401;
+    NSString* reason = [[response objectForKey: @"reason"] description];
+    if (reason)
+        reason = [NSString stringWithFormat: @"%@: %@", errorName, reason];
+    NSDictionary* info = [NSDictionary dictionaryWithObjectsAndKeys:
+                          errorName, NSLocalizedFailureReasonErrorKey,
+                          reason, NSLocalizedDescriptionKey,
+                          nil];
+    return [NSError errorWithDomain: kCouchDBErrorDomain code: code userInfo: info];
+}
+
+
 + (RESTOperation*) saveModels: (NSArray*)models {
     CouchDatabase* db = nil;
     NSUInteger n = models.count;
@@ -284,19 +340,29 @@
             NSAssert(model.database == db, @"Models must share a common db");
         if (!model.needsSave)
             continue;
-        [changes addObject: model.propertiesToSave];
+        [changes addObject: [model beginSave]];
         [changedModels addObject: model];
         [changedDocs addObject: model.document];
-        model.needsSave = NO;
     }
     if (changes.count == 0)
         return nil;
        
     RESTOperation* op = [db putChanges: changes toRevisions: changedDocs];
     [op onCompletion: ^{
+        // The request can succeed even though some of the documents failed to save (usually
+        // because of conflicts), so check each document's entry in the response:
+        NSArray* responses = op.isSuccessful ? $castIf(NSArray, op.responseBody.fromJSON) : nil;
+        NSUInteger i = 0;
         for (CouchModel* model in changedModels) {
-            [model saveCompleted: op];
-            // TODO: This doesn't handle the case where op succeeded but an individual doc failed
+            NSError* error = op.error;
+            if (!error) {
+                NSDictionary* response = nil;
+                if (i < responses.count)
+                    response = $castIf(NSDictionary, [responses objectAtIndex: i]);
+                error = BulkSaveError(response);
+            }
+            [model saveCompletedWithError: error];
+            ++i;
         }
     }];
     return op;
@@ -322,15 +388,30 @@
 
 
 - (NSDictionary*) propertiesToSave {
-    NSMutableDictionary* properties = [_document.properties mutableCopy];
-    if (!properties)
-        properties = [[NSMutableDictionary alloc] init];
+    // Layer the changes over the document's properties, so only the changed values get copied:
+    NSMutableDictionary* properties = [CouchPropertyOverlay overlayWithBase: _document.properties];
     for (NSString* key in _changedNames) {
         id value = [_properties objectForKey: key];
         [properties setValue: [self externalizePropertyValue: value] forKey: key];
     }
-    [properties setValue: self.attachmentDataToSave forKey: @"_attachments"];
-    return [properties autorelease];
+    if (_changedAttachments)
+        [properties setValue: self.attachmentDataToSave forKey: @"_attachments"];
+    return properties;
+}
+
+
+// Tells the model factory, which accounts for its models' memory, how many values are cached.
+- (void) reportCachedValueCount {
+    NSUInteger count = _properties.count;
+    if (count == _reportedValueCount)
+        return;
+    if (!_factory) {
+        _factory = [_document.database.modelFactory retain];
+        if (!_factory)
+            return;
+    }
+    [_factory model: self cachedValueCountChangedFrom: _reportedValueCount to: count];
+    _reportedValueCount = count;
 }
 
 
@@ -343,6 +424,28 @@
             _changedNames = [[NSMutableSet alloc] init];
         [_changedNames addObject: property];
     }
+    [self reportCachedValueCount];
+}
+
+
+// Removes unchanged cached values in _properties, by keeping only the changed ones. (The others
+// can be recreated from the document when they're next asked for.)
+- (void) forgetUnchangedProperties {
+    if (_changedNames && _properties) {
+        NSMutableDictionary* changed = [[NSMutableDictionary alloc]
+                                                initWithCapacity: _changedNames.count];
+        for (NSString* key in _changedNames) {
+            id value = [_properties objectForKey: key];
+            if (value)
+                [changed setObject: value forKey: key];
+        }
+        [_properties release];
+        _properties = changed;
+    } else {
+        [_properties release];
+        _properties = nil;
+    }
+    [self reportCachedValueCount];
 }
 
 
@@ -11,10 +11,14 @@
 
 
 /** A configurable mapping from CouchDocument to CouchModel.
-    It associates a model class with a value of the document's "type" property. */
+    It associates a model class with a value of the document's "type" property.
+    It also accounts for the property values cached by the models of its databases, as a single consumer of +[RESTMemoryBudget sharedBudget]. */
 @interface CouchModelFactory : NSObject
 {
     NSMutableDictionary* _typeDict;
+    CFMutableSetRef _cachingModels;         // Models with cached property values (not retained)
+    NSUInteger _cachedValueCount;           // Total cached values of those models
+    BOOL _costReportPending;
 }
 
 /** Returns a global shared CouchModelFactory that's consulted by all databases.
@@ -10,6 +10,10 @@
 #import "CouchInternal.h"
 
 
+// Rough size in bytes of a cached model property value, as reported to the memory budget.
+static const UInt64 kEstimatedPropertyCost = 64;
+
+
 @implementation CouchModelFactory
 
 
@@ -35,6 +39,10 @@ static CouchModelFactory* sSharedInstance;
 
 
 - (void)dealloc {
+    if (_cachingModels) {
+        [[RESTMemoryBudget sharedBudget] removeConsumer: self];
+        CFRelease(_cachingModels);
+    }
     [_typeDict release];
     [super dealloc];
 }
@@ -72,6 +80,55 @@ static CouchModelFactory* sSharedInstance;
 }
 
 
+#pragma mark - MEMORY:
+
+
+// The factory stands in for its models with the memory budget, since there can be many thousands
+// of them and each one would otherwise be a separate consumer. Models tell it how many property
+// values they've cached, and it reports the total later on, once per batch of changes.
+- (void) model: (CouchModel*)model cachedValueCountChangedFrom: (NSUInteger)oldCount
+            to: (NSUInteger)newCount
+{
+    if (newCount == oldCount)
+        return;
+    if (!_cachingModels) {
+        _cachingModels = CFSetCreateMutable(NULL, 0, NULL);
+        [[RESTMemoryBudget sharedBudget] addConsumer: self];
+    }
+    if (newCount > 0)
+        CFSetAddValue(_cachingModels, model);
+    else
+        CFSetRemoveValue(_cachingModels, model);
+    _cachedValueCount = _cachedValueCount - oldCount + newCount;
+    if (!_costReportPending) {
+        _costReportPending = YES;
+        [self performSelector: @selector(reportCost) withObject: nil afterDelay: 0.0];
+    }
+}
+
+
+- (void) reportCost {
+    _costReportPending = NO;
+    RESTMemoryBudget* budget = [RESTMemoryBudget sharedBudget];
+    [budget setCost: _cachedValueCount * kEstimatedPropertyCost forConsumer: self];
+    [budget consumerWasUsed: self];
+}
+
+
+// RESTMemoryConsumer protocol
+- (void) freeMemory: (UInt64)bytes {
+    if (!_cachingModels)
+        return;
+    COUCHLOG2(@"%@ freeing cached property values of %ld models",
+              self, CFSetGetCount(_cachingModels));
+    // Copy the set, since each model removes itself from it as it forgets its values:
+    NSArray* models = [(NSSet*)_cachingModels allObjects];
+    for (CouchModel* model in models)
+        [model forgetUnchangedProperties];
+    [self reportCost];
+}
+
+
 @end
 
 
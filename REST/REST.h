@@ -16,3 +16,10 @@
 #import "RESTResource.h"
 #import "RESTOperation.h"
 #import "RESTBody.h"
+#import "RESTJSONWriter.h"
+#import "RESTMemoryBudget.h"
+#import "RESTMetrics.h"
+#import "RESTRetryPolicy.h"
+#import "RESTScheduler.h"
+#import "RESTTape.h"
+#import "RESTBackend.h"
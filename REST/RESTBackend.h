@@ -0,0 +1,49 @@
+//
+//  RESTBackend.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "RESTOperation.h"
+
+
+/** An in-process handler of RESTOperations, used instead of the URL loading system.
+    Set a backend on a RESTResource (usually the root) with -setBackend:, and operations on that resource and its children will be handed to it rather than sent over NSURLConnection. Request bodies created with -PUTJSON:parameters: or -POSTJSON:parameters: arrive as the original Foundation objects (see -[RESTOperation requestObject]), and a backend can answer with a Foundation object too, so neither side has to encode or decode JSON.
+    Objects are passed by reference: a backend must copy anything from a request that it keeps, and must not modify an object after responding with it. */
+@protocol RESTBackend <NSObject>
+
+/** Called, on the operation's thread, when an operation starts.
+    The backend must eventually call -backendRespondedWithStatus:headers:object:data: on the operation exactly once, either before returning or later on the same thread. */
+- (void) handleOperation: (RESTOperation*)op;
+
+@optional
+/** Called if an operation is cancelled before the backend responded to it. */
+- (void) cancelOperation: (RESTOperation*)op;
+
+@end
+
+
+@interface RESTOperation (RESTBackend)
+
+/** Completes an operation handled by a RESTBackend.
+    @param status  The HTTP status code.
+    @param headers  The response headers, or nil.
+    @param object  The parsed response body (an NSDictionary or NSArray), or nil. The operation's responseBody will return this object from -fromJSON without parsing anything.
+    @param data  The raw response body, used if object is nil. */
+- (void) backendRespondedWithStatus: (int)status
+                            headers: (NSDictionary*)headers
+                             object: (id)object
+                               data: (NSData*)data;
+
+/** The run loop modes a backend should use when it schedules a deferred response on an operation's thread, so that it's delivered even while that thread is blocked in -wait. */
++ (NSArray*) backendRunLoopModes;
+
+@end
@@ -26,6 +26,7 @@
     NSDictionary* _headers;
     RESTResource* _resource;
     id _fromJSON;
+    BOOL _parsedJSON;
 }
 
 /** Returns a sub-dictionary of the input, containing only the HTTP 1.1 entity headers and their values. */
@@ -61,7 +62,7 @@
 @property (readonly) NSString* asString;
 
 /** Parses the content as JSON and returns the result.
-    This value is cached, so subsequent calls are cheap. */
+    This value is cached, so subsequent calls are cheap. (So is a failure to parse: content that isn't valid JSON is only parsed once, and nil is returned after that.) */
 @property (readonly) id fromJSON;
 
 @end
@@ -83,7 +84,7 @@
 /** Converts an object to UTF-8-encoded JSON data.
     JSON 'fragments' (NSString / NSNumber) are allowed. Returns nil on nil input. */
 + (NSData*) dataWithJSONObject: (id)obj;
-/** Converts an object to a JSON string.
+/** Converts an object to a JSON string, with dictionary keys in canonical (sorted) order so that equal objects produce equal strings, as in URL query parameters.
     JSON 'fragments' (NSString / NSNumber) are allowed. Returns nil on nil input. */
 + (NSString*) stringWithJSONObject: (id)obj;
 /** Converts an object to a pretty-printed JSON string.
@@ -96,10 +97,12 @@
     If parsing fails, returns nil. */
 + (id) JSONObjectWithString: (NSString*)string;
 
-/** Converts an NSDate to a string in ISO-8601 format (standard JSON representation). */
+/** Converts an NSDate to a string in ISO-8601 format (standard JSON representation).
+    The time is in UTC, with milliseconds appended if the date has a fractional part. Thread-safe. */
 + (NSString*) JSONObjectWithDate: (NSDate*)date;
 
 /** Parses a string in ISO-8601 date format into an NSDate.
+    Accepts fractional seconds and time-zone offsets ("Z", "+HH:MM", "+HHMM"); a missing offset means UTC. Thread-safe.
     Returns nil if the string isn't parseable, or if it isn't a string at all. */
 + (NSDate*) dateWithJSONObject: (id)jsonObject;
 
@@ -17,6 +17,7 @@
 
 #import "RESTInternal.h"
 #import "RESTBase64.h"
+#import "RESTJSONWriter.h"
 
 
 @implementation RESTBody
@@ -82,6 +83,22 @@
 }
 
 
+// Creates a body from an already-parsed JSON object; the content is only serialized if asked for.
+- (id) initWithJSONObject: (id)object
+                  headers: (NSDictionary*)headers
+                 resource: (RESTResource*)resource
+{
+    NSParameterAssert(object);
+    NSParameterAssert(headers);
+    self = [super init];
+    if (self) {
+        _fromJSON = [object retain];
+        [self setHeaders: headers];
+    }
+    return self;
+}
+
+
 - (id) initWithData: (NSData*)content contentType: (NSString*)contentType {
     return [self initWithContent: content
                          headers: [NSDictionary dictionaryWithObject: contentType
@@ -105,7 +122,7 @@
 
 
 - (id) mutableCopyWithZone:(NSZone *)zone {
-    return [[RESTMutableBody alloc] initWithContent: _content
+    return [[RESTMutableBody alloc] initWithContent: self.content
                                             headers: _headers
                                            resource: _resource];
 }
@@ -116,11 +133,11 @@
         return YES;
     if (![object isKindOfClass: [RESTBody class]])
         return NO;
-    return [_content isEqual: [object content]] && [_headers isEqual: [object headers]];
+    return [self.content isEqual: [object content]] && [_headers isEqual: [object headers]];
 }
 
 - (NSUInteger) hash {
-    return _content.hash ^ _headers.hash;
+    return self.content.hash ^ _headers.hash;
 }
 
 
@@ -131,13 +148,24 @@
 
 - (NSString*) asString {
     NSStringEncoding encoding = NSUTF8StringEncoding;   //FIX: Get from _response.textEncodingName
-    return [[[NSString alloc] initWithData: _content encoding: encoding] autorelease];
+    return [[[NSString alloc] initWithData: self.content encoding: encoding] autorelease];
+}
+
+
+- (NSData*) content {
+    if (!_content && _fromJSON)
+        _content = [[RESTBody dataWithJSONObject: _fromJSON] copy];
+    return _content;
 }
 
 
 - (id) fromJSON {
-    if (!_fromJSON)
+    if (!_fromJSON && !_parsedJSON) {
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
         _fromJSON = [[RESTBody JSONObjectWithData: _content] copy];
+        _parsedJSON = YES;
+        RESTOperationAddParseTime(CFAbsoluteTimeGetCurrent() - start);
+    }
     return _fromJSON;
 }
 
@@ -160,6 +188,7 @@
         _content = [content copy];
         [_fromJSON release];
         _fromJSON = nil;
+        _parsedJSON = NO;
     }
 }
 
@@ -261,24 +290,14 @@ static Class sJSONSerialization;
 #endif
 
 
+// Encoding goes through RESTJSONWriter, which doesn't need NSJSONSerialization or JSONKit.
+
 + (NSData*) dataWithJSONObject: (id)obj {
-#if USE_JSONKIT
-    if (!sJSONSerialization)
-        return [obj JSONData];
-#endif
-    return [sJSONSerialization dataWithJSONObject: obj 
-                                          options: 0
-                                            error: NULL];
+    return [RESTJSONWriter dataWithJSONObject: obj];
 }
 
 + (NSString*) stringWithJSONObject: (id)obj {
-#if USE_JSONKIT
-    if (!sJSONSerialization)
-        return [obj JSONString];
-#endif
-    NSData* data = [sJSONSerialization dataWithJSONObject: obj                                               
-                                                  options: 0
-                                                    error: NULL];
+    NSData* data = [RESTJSONWriter canonicalDataWithJSONObject: obj];
     if (!data)
         return nil;
     return [[[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding] autorelease];
@@ -330,38 +349,157 @@ static Class sJSONSerialization;
 }
 
 
-// This function is not thread-safe, nor is the NSDateFormatter instance it returns.
-// Make sure that this function and the formatter are called on only one thread at a time.
-static NSDateFormatter* getISO8601Formatter() {
-    static NSDateFormatter* sFormatter;
-    if (!sFormatter) {
-        // Thanks to DenNukem's answer in http://stackoverflow.com/questions/399527/
-        sFormatter = [[NSDateFormatter alloc] init];
-        sFormatter.dateFormat = @"yyyy-MM-dd'T'HH:mm:ss'Z'";
-        sFormatter.timeZone = [NSTimeZone timeZoneForSecondsFromGMT:0];
-        sFormatter.calendar = [[[NSCalendar alloc] initWithCalendarIdentifier:NSGregorianCalendar]
-                                    autorelease];
-        sFormatter.locale = [[[NSLocale alloc] initWithLocaleIdentifier:@"en_US"] autorelease];
+#pragma mark - ISO-8601 DATES:
+
+
+// Dates are converted by hand rather than with an NSDateFormatter: formatters aren't thread-safe
+// (so the old shared one needed a lock around every call) and are slow to use anyway.
+// These functions use only the stack, so they can be called on any thread concurrently.
+// Calendar math is proleptic Gregorian, UTC; leap seconds aren't represented.
+
+// Number of days from 1970-01-01 to the given date.
+static int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= (m <= 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+// Inverse of daysFromCivil.
+static void civilFromDays(int64_t z, int64_t *outY, unsigned *outM, unsigned *outD) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    *outD = doy - (153 * mp + 2) / 5 + 1;
+    *outM = mp < 10 ? mp + 3 : mp - 9;
+    *outY = (int64_t)yoe + era * 400 + (*outM <= 2);
+}
+
+static BOOL parseDigits(const char** str, unsigned nDigits, unsigned* outValue) {
+    unsigned value = 0;
+    for (unsigned i = 0; i < nDigits; i++) {
+        char c = (*str)[i];
+        if (c < '0' || c > '9')
+            return NO;
+        value = 10 * value + (c - '0');
     }
-    return sFormatter;
+    *str += nDigits;
+    *outValue = value;
+    return YES;
+}
+
+// Parses "YYYY-MM-DD", optionally followed by "THH:MM[:SS[.fff...]]" and a zone designator
+// ("Z", "+HH:MM", "+HHMM" or "+HH"). A missing zone is interpreted as UTC.
+static BOOL parseISO8601(const char* str, NSTimeInterval* outTimeSince1970) {
+    unsigned year, month, day, hour = 0, minute = 0, second = 0;
+    double fraction = 0.0;
+    int offset = 0;
+    if (!parseDigits(&str, 4, &year) || *str++ != '-' || !parseDigits(&str, 2, &month)
+                || *str++ != '-' || !parseDigits(&str, 2, &day))
+        return NO;
+    if (*str == 'T' || *str == 't' || *str == ' ') {
+        ++str;
+        if (!parseDigits(&str, 2, &hour) || *str++ != ':' || !parseDigits(&str, 2, &minute))
+            return NO;
+        if (*str == ':') {
+            ++str;
+            if (!parseDigits(&str, 2, &second))
+                return NO;
+            if (*str == '.' || *str == ',') {
+                ++str;
+                double scale = 0.1;
+                if (*str < '0' || *str > '9')
+                    return NO;
+                for (; *str >= '0' && *str <= '9'; ++str, scale *= 0.1)
+                    fraction += (*str - '0') * scale;
+            }
+        }
+        if (*str == 'Z' || *str == 'z') {
+            ++str;
+        } else if (*str == '+' || *str == '-') {
+            int sign = (*str++ == '-') ? -1 : 1;
+            unsigned offHour, offMinute = 0;
+            if (!parseDigits(&str, 2, &offHour))
+                return NO;
+            if (*str == ':') {
+                ++str;
+                if (!parseDigits(&str, 2, &offMinute))  // "+HH:" must have minutes
+                    return NO;
+            } else if (*str != '\0' && !parseDigits(&str, 2, &offMinute)) {
+                return NO;
+            }
+            if (offHour > 23 || offMinute > 59)
+                return NO;
+            offset = sign * (int)(60 * offHour + offMinute) * 60;
+        }
+    }
+    if (*str != '\0')
+        return NO;
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 24 || minute > 59 || second > 60)
+        return NO;
+    if (hour == 24 && (minute || second || fraction > 0.0))
+        return NO;
+    int64_t days = daysFromCivil(year, month, day);
+    *outTimeSince1970 = (double)(days * 86400 + hour * 3600 + minute * 60 + second - offset)
+                        + fraction;
+    return YES;
+}
+
+// Writes a UTC timestamp as "YYYY-MM-DDTHH:MM:SSZ", adding ".mmm" if there are fractional
+// milliseconds. The buffer must have room for at least 32 bytes. Returns the string length.
+static size_t formatISO8601(NSTimeInterval timeSince1970, char* buf) {
+    int64_t millis = llround(timeSince1970 * 1000.0);
+    int64_t secs = millis / 1000, ms = millis % 1000;
+    if (ms < 0) {
+        ms += 1000;
+        --secs;
+    }
+    int64_t days = secs / 86400, secOfDay = secs % 86400;
+    if (secOfDay < 0) {
+        secOfDay += 86400;
+        --days;
+    }
+    int64_t year;
+    unsigned month, day;
+    civilFromDays(days, &year, &month, &day);
+    int n;
+    if (ms)
+        n = snprintf(buf, 32, "%04lld-%02u-%02uT%02u:%02u:%02u.%03uZ",
+                     (long long)year, month, day, (unsigned)(secOfDay / 3600),
+                     (unsigned)(secOfDay / 60 % 60), (unsigned)(secOfDay % 60), (unsigned)ms);
+    else
+        n = snprintf(buf, 32, "%04lld-%02u-%02uT%02u:%02u:%02uZ",
+                     (long long)year, month, day, (unsigned)(secOfDay / 3600),
+                     (unsigned)(secOfDay / 60 % 60), (unsigned)(secOfDay % 60));
+    return MIN((size_t)n, (size_t)31);
 }
 
 
 + (NSString*) JSONObjectWithDate: (NSDate*)date {
     if (!date)
         return nil;
-    @synchronized(self) {
-        return [getISO8601Formatter() stringFromDate: date];
-    }
+    char buf[32];
+    size_t length = formatISO8601(date.timeIntervalSince1970, buf);
+    return [[[NSString alloc] initWithBytes: buf length: length encoding: NSASCIIStringEncoding]
+                autorelease];
 }
 
 + (NSDate*) dateWithJSONObject: (id)jsonObject {
     NSString* string = $castIf(NSString, jsonObject);
     if (!string)
         return nil;
-    @synchronized(self) {
-        return [getISO8601Formatter() dateFromString: string];
-    }
+    char buf[64];
+    if (![string getCString: buf maxLength: sizeof(buf) encoding: NSASCIIStringEncoding])
+        return nil;
+    NSTimeInterval time;
+    if (!parseISO8601(buf, &time))
+        return nil;
+    return [NSDate dateWithTimeIntervalSince1970: time];
 }
 
 
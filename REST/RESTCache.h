@@ -13,7 +13,7 @@
 //  either express or implied. See the License for the specific language governing permissions
 //  and limitations under the License.
 
-#import <Foundation/Foundation.h>
+#import "RESTMemoryBudget.h"
 @class RESTResource;
 
 
@@ -21,11 +21,12 @@
     It keeps track of all added resources as long as anything else has retained them,
     and it keeps a certain number of recently-accessed resources with no external references.
     It's intended for use by a parent resource, to cache its children.
+    The recently-accessed resources it keeps are registered with +[RESTMemoryBudget sharedBudget], which can make it let go of them when memory is short.
  
     Important:
     * It should contain only direct sibling objects, as it assumes that their -relativePath property values are all different.
     * A RESTResource can belong to only one RESTCache at a time. */
-@interface RESTCache : NSObject
+@interface RESTCache : NSObject <RESTMemoryConsumer, NSCacheDelegate>
 {
     @private
 #ifdef TARGET_OS_IPHONE
@@ -34,6 +35,8 @@
     NSMapTable* _map;
 #endif
     NSCache* _cache;
+    NSUInteger _retainedCount, _reportedCount;
+    CFAbsoluteTime _lastReportedUse;
 }
 
 - (id) init;
@@ -19,6 +19,12 @@
 
 static const NSUInteger kDefaultRetainLimit = 50;
 
+// Rough size in bytes of a retained resource and what it holds, as reported to the memory budget.
+static const UInt64 kEstimatedResourceCost = 2048;
+
+// How often lookups are reported to the memory budget, which takes a process-wide lock.
+static const CFAbsoluteTime kUseReportInterval = 1.0;
+
 
 @implementation RESTCache
 
@@ -49,6 +55,8 @@ static const NSUInteger kDefaultRetainLimit = 50;
         if (retainLimit > 0) {
             _cache = [[NSCache alloc] init];
             _cache.countLimit = retainLimit;
+            _cache.delegate = self;
+            [[RESTMemoryBudget sharedBudget] addConsumer: self];
         }
     }
     return self;
@@ -59,6 +67,10 @@ static const NSUInteger kDefaultRetainLimit = 50;
     for (RESTResource* doc in _map.objectEnumerator)
         doc.owningCache = nil;
     [_map release];
+    if (_cache) {
+        [[RESTMemoryBudget sharedBudget] removeConsumer: self];
+        _cache.delegate = nil;
+    }
     // Calling -release on the cache right now is dangerous because it might already be
     // flushing itself (which may have triggered deallocation of my owner and hence myself),
     // and deallocing it in the midst of that will cause it to deadlock. So delay the release.
@@ -75,16 +87,66 @@ static const NSUInteger kDefaultRetainLimit = 50;
              key, [_map objectForKey: key], resource);
     [_map setObject: resource forKey: key];
     if (_cache)
-        [_cache setObject: resource forKey: key];
+        [self retainResource: resource forKey: key];
     else
         [[resource retain] autorelease];
 }
 
 
+#pragma mark - RETAINING:
+
+
+- (void) reportCost {
+    NSUInteger count;
+    @synchronized(self) {
+        if (_retainedCount == _reportedCount)
+            return;
+        count = _reportedCount = _retainedCount;
+    }
+    [[RESTMemoryBudget sharedBudget] setCost: count * kEstimatedResourceCost forConsumer: self];
+}
+
+
+- (void) retainResource: (RESTResource*)resource forKey: (NSString*)key {
+    if (![_cache objectForKey: key]) {
+        @synchronized(self) {
+            ++_retainedCount;
+        }
+    }
+    [_cache setObject: resource forKey: key];
+    [self reportCost];
+}
+
+
+// NSCache delegate method; may be called on any thread.
+- (void) cache: (NSCache*)cache willEvictObject: (id)obj {
+    @synchronized(self) {
+        if (_retainedCount > 0)
+            --_retainedCount;
+    }
+}
+
+
+// RESTMemoryConsumer protocol
+- (void) freeMemory: (UInt64)bytes {
+    [self unretainResources];
+}
+
+
+#pragma mark - LOOKUP:
+
+
 - (RESTResource*) resourceWithRelativePath: (NSString*)docID {
     RESTResource* doc = [_map objectForKey: docID];
-    if (doc && _cache && ![_cache objectForKey:docID])
-        [_cache setObject: doc forKey: docID];  // re-add doc to NSCache since it's recently used
+    if (doc && _cache) {
+        if (![_cache objectForKey:docID])
+            [self retainResource: doc forKey: docID];  // re-add doc to NSCache since it's recently used
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        if (now - _lastReportedUse >= kUseReportInterval) {
+            _lastReportedUse = now;
+            [[RESTMemoryBudget sharedBudget] consumerWasUsed: self];
+        }
+    }
     return doc;
 }
 
@@ -111,12 +173,14 @@ static const NSUInteger kDefaultRetainLimit = 50;
 
 - (void) unretainResources {
     [_cache removeAllObjects];
+    [self reportCost];
 }
 
 
 - (void) forgetAllResources {
     [_map removeAllObjects];
     [_cache removeAllObjects];
+    [self reportCost];
 }
 
 
@@ -31,24 +31,64 @@ id RESTCastIf(Class,id);
 id RESTCastIfArrayOf(Class,id);
 
 
+// Identifies the server a URL points to, in the form "http://example.com:5984". Returns nil if
+// the URL has no host.
+NSString* RESTHostKey(NSURL* url);
+
+
 // Object equality that correctly returns YES when both are nil:
 static inline BOOL $equal(id a, id b) {return a==b || [a isEqual: b];}
 
 
+// Called by RESTBody after each JSON parse, to charge it to the operation currently completing, if any.
+void RESTOperationAddParseTime(NSTimeInterval time);
+
+
 @interface RESTOperation ()
 + (NSError*) errorWithHTTPStatus: (int)httpStatus
                          message: (NSString*)message
                              URL: (NSURL*)url;
 @property (nonatomic, readonly) UInt8 retryCount;
+- (void) dispatchFromScheduler;
+@end
+
+
+@interface RESTScheduler ()
+- (BOOL) admitOperation: (RESTOperation*)op;            // YES to send now, NO if queued
+- (void) operationFinished: (RESTOperation*)op;         // gives back the op's slot
+- (BOOL) removeQueuedOperation: (RESTOperation*)op;     // NO if not queued
+- (void) operationChangedPriority: (RESTOperation*)op;
 @end
 
 
 @interface RESTResource ()
 - (void) setURL: (NSURL*)url;
 - (void) assignedRelativePath: (NSString*)relativePath;
+- (NSURL*) URLWithParentURL: (NSURL*)parentURL;   // override point for computing -URL
 @property (readwrite, retain) RESTCache* owningCache;
 - (NSURLCredential*) credentialForOperation: (RESTOperation*)op;
 - (NSURLProtectionSpace*) protectionSpaceForOperation: (RESTOperation*)op;
+- (id<RESTBackend>) backendForOperation: (RESTOperation*)op;
+- (BOOL) shouldCoalesceGETs;
+- (RESTOperation*) PUT: (NSData*)body
+                object: (id)object
+            parameters: (NSDictionary*)parameters;
+@end
+
+
+@interface RESTBody ()
+- (id) initWithJSONObject: (id)object
+                  headers: (NSDictionary*)headers
+                 resource: (RESTResource*)resource;
+@end
+
+
+@interface RESTTape ()
+- (id) playerForOperation: (RESTOperation*)op modes: (NSArray*)modes;
+- (void) recordOperation: (RESTOperation*)op
+                response: (NSHTTPURLResponse*)response
+                    body: (NSData*)body
+                   error: (NSError*)error;
 @end
 
 
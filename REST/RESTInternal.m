@@ -60,6 +60,18 @@ NSArray* RESTCastIfArrayOf(Class itemClass, id object)
 }
 
 
+NSString* RESTHostKey(NSURL* url) {
+    NSString* scheme = url.scheme.lowercaseString;
+    NSString* host = url.host.lowercaseString;
+    if (!scheme || !host)
+        return nil;
+    NSNumber* port = url.port;
+    if (port)
+        return [NSString stringWithFormat: @"%@://%@:%@", scheme, host, port];
+    return [NSString stringWithFormat: @"%@://%@", scheme, host];
+}
+
+
 @implementation NSArray (RESTExtensions)
 
 - (NSArray*) rest_map: (id (^)(id obj))block {
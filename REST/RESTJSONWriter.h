@@ -0,0 +1,76 @@
+//
+//  RESTJSONWriter.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+
+/** Maximum nesting depth of arrays and dictionaries that a RESTJSONWriter can write. */
+#define kRESTJSONWriterMaxDepth 64
+
+
+/** A streaming JSON encoder that writes UTF-8 straight into a byte buffer.
+    Unlike NSJSONSerialization, the output doesn't have to exist as one Foundation object tree: a caller can open an array or dictionary, write its items one at a time, and close it. The scratch buffer comes from a small process-wide pool and goes back to it when the writer is done, so encoding many request bodies doesn't allocate and grow a new buffer each time; the only allocation per result is the final NSData.
+    Supports NSDictionary (with string keys), NSArray, NSString, NSNumber (including booleans) and NSNull. Anything else, or a non-finite number, makes the writer fail: -data then returns nil.
+    A writer is not thread-safe, but different writers can be used on different threads at once. */
+@interface RESTJSONWriter : NSObject
+{
+    @private
+    NSMutableData* _buffer;
+    uint8_t* _bytes;
+    size_t _length, _capacity;
+    uint8_t _needsComma[kRESTJSONWriterMaxDepth];
+    unsigned _depth;
+    BOOL _canonical, _failed, _afterKey;
+    NSMutableData* _scratch;
+}
+
+/** Encodes an object in one step. Returns nil if it can't be encoded. */
++ (NSData*) dataWithJSONObject: (id)object;
+
+/** Encodes an object with its dictionary keys in canonical order (sorted by UTF-16 code unit, which differs from code-point order only for characters outside the BMP), so equal objects always produce identical bytes, e.g. for use as cache keys. */
++ (NSData*) canonicalDataWithJSONObject: (id)object;
+
+/** If YES, dictionary keys are written in sorted order. Defaults to NO, which writes them in the dictionary's enumeration order and is faster. */
+@property BOOL canonical;
+
+/** Writes a complete JSON value: an object tree, or a single string/number/null. */
+- (void) writeObject: (id)object;
+
+/** Starts an array; subsequent values are its items until -endArray. */
+- (void) beginArray;
+- (void) endArray;
+
+/** Starts a dictionary; write its contents with -writeKey:value:, -writeKey: or -writeContentsOfDictionary:skippingKeys: until -endDictionary. */
+- (void) beginDictionary;
+- (void) endDictionary;
+
+/** Writes a key and value into the innermost open dictionary. */
+- (void) writeKey: (NSString*)key value: (id)value;
+
+/** Writes a key into the innermost open dictionary. The next value written (which may be an array or dictionary opened with -beginArray or -beginDictionary) is its value. */
+- (void) writeKey: (NSString*)key;
+
+/** Writes all the entries of a dictionary into the innermost open dictionary, except those whose keys are in 'skip' (which may be nil.) */
+- (void) writeContentsOfDictionary: (NSDictionary*)dict skippingKeys: (NSSet*)skip;
+
+/** The number of bytes written so far. */
+@property (readonly) NSUInteger length;
+
+/** Returns the output and resets the writer, which can then be used again. Returns nil if anything couldn't be encoded, or if an array or dictionary is still open. */
+- (NSData*) data;
+
+/** The number of times the buffer pool had to allocate a new buffer because none was free. Useful for testing and benchmarks. */
++ (NSUInteger) bufferAllocationCount;
+
+@end
@@ -0,0 +1,375 @@
+//
+//  RESTJSONWriter.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "RESTJSONWriter.h"
+#import "RESTInternal.h"
+#import <math.h>
+
+
+// Size of a newly allocated buffer.
+static const size_t kInitialBufferSize = 4096;
+
+// Buffers that have grown bigger than this aren't returned to the pool.
+static const size_t kMaxPooledBufferSize = 1024 * 1024;
+
+// Maximum number of idle buffers kept in the pool.
+static const NSUInteger kMaxPooledBuffers = 4;
+
+
+static NSMutableArray* sBufferPool;
+static NSUInteger sBufferAllocationCount;
+
+static Class sStringClass, sNumberClass, sDictionaryClass, sArrayClass, sNullClass;
+
+
+static NSMutableData* acquireBuffer(void) {
+    @synchronized([RESTJSONWriter class]) {
+        NSMutableData* buffer = [[sBufferPool lastObject] retain];
+        if (buffer) {
+            [sBufferPool removeLastObject];
+            return buffer;
+        }
+        ++sBufferAllocationCount;
+    }
+    return [[NSMutableData alloc] initWithLength: kInitialBufferSize];
+}
+
+static void releaseBuffer(NSMutableData* buffer) {
+    if (buffer.length <= kMaxPooledBufferSize) {
+        @synchronized([RESTJSONWriter class]) {
+            if (!sBufferPool)
+                sBufferPool = [[NSMutableArray alloc] initWithCapacity: kMaxPooledBuffers];
+            if (sBufferPool.count < kMaxPooledBuffers)
+                [sBufferPool addObject: buffer];
+        }
+    }
+    [buffer release];
+}
+
+
+// Orders dictionary keys by UTF-16 code unit, independent of locale.
+static NSComparisonResult compareKeys(id a, id b, void* context) {
+    return CFStringCompare((CFStringRef)a, (CFStringRef)b, 0);
+}
+
+
+@implementation RESTJSONWriter
+
+
++ (void) initialize {
+    if (self == [RESTJSONWriter class]) {
+        sStringClass = [NSString class];
+        sNumberClass = [NSNumber class];
+        sDictionaryClass = [NSDictionary class];
+        sArrayClass = [NSArray class];
+        sNullClass = [NSNull class];
+    }
+}
+
+
++ (NSData*) dataWithJSONObject: (id)object canonical: (BOOL)canonical {
+    if (!object)
+        return nil;
+    RESTJSONWriter* writer = [[self alloc] init];
+    writer.canonical = canonical;
+    [writer writeObject: object];
+    NSData* data = [writer data];
+    [writer release];
+    return data;
+}
+
++ (NSData*) dataWithJSONObject: (id)object {
+    return [self dataWithJSONObject: object canonical: NO];
+}
+
++ (NSData*) canonicalDataWithJSONObject: (id)object {
+    return [self dataWithJSONObject: object canonical: YES];
+}
+
+
++ (NSUInteger) bufferAllocationCount {
+    @synchronized(self) {
+        return sBufferAllocationCount;
+    }
+}
+
+
+- (void) dealloc {
+    if (_buffer)
+        releaseBuffer(_buffer);
+    [_scratch release];
+    [super dealloc];
+}
+
+
+@synthesize canonical=_canonical;
+
+
+- (NSUInteger) length {
+    return _length;
+}
+
+
+#pragma mark - OUTPUT:
+
+
+// Makes room for at least n more bytes.
+static inline void ensure(RESTJSONWriter* self, size_t n) {
+    if (self->_length + n <= self->_capacity)
+        return;
+    if (!self->_buffer)
+        self->_buffer = acquireBuffer();
+    size_t capacity = MAX(self->_buffer.length, kInitialBufferSize);
+    while (capacity < self->_length + n)
+        capacity *= 2;
+    if (capacity > self->_buffer.length)
+        [self->_buffer setLength: capacity];
+    self->_bytes = self->_buffer.mutableBytes;
+    self->_capacity = capacity;
+}
+
+static inline void append(RESTJSONWriter* self, const void* bytes, size_t n) {
+    ensure(self, n);
+    memcpy(self->_bytes + self->_length, bytes, n);
+    self->_length += n;
+}
+
+static inline void appendByte(RESTJSONWriter* self, uint8_t byte) {
+    ensure(self, 1);
+    self->_bytes[self->_length++] = byte;
+}
+
+
+// Writes the comma, if any, that has to precede the next value or key.
+static inline void beginItem(RESTJSONWriter* self) {
+    if (self->_afterKey) {
+        self->_afterKey = NO;     // it's the value of a key, so no comma
+    } else if (self->_depth > 0) {
+        if (self->_needsComma[self->_depth - 1])
+            appendByte(self, ',');
+        self->_needsComma[self->_depth - 1] = YES;
+    }
+}
+
+
+- (NSData*) data {
+    NSData* data = nil;
+    if (!_failed && _depth == 0 && _length > 0)
+        data = [NSData dataWithBytes: _bytes length: _length];
+    _length = 0;
+    _depth = 0;
+    _failed = NO;
+    _afterKey = NO;
+    return data;
+}
+
+
+#pragma mark - SCALARS:
+
+
+- (void) writeString: (NSString*)str {
+    CFStringRef cfStr = (CFStringRef)str;
+    CFIndex length = CFStringGetLength(cfStr);
+    const uint8_t* utf8 = (const uint8_t*)CFStringGetCStringPtr(cfStr, kCFStringEncodingUTF8);
+    size_t n = length;     // if there's a direct UTF-8 pointer, the string is all ASCII
+    if (!utf8) {
+        CFIndex maxSize = CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8);
+        if (!_scratch)
+            _scratch = [[NSMutableData alloc] initWithLength: MAX(maxSize, 256)];
+        else if ((CFIndex)_scratch.length < maxSize)
+            [_scratch setLength: maxSize];
+        CFIndex used = 0;
+        CFStringGetBytes(cfStr, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, false,
+                         _scratch.mutableBytes, maxSize, &used);
+        utf8 = _scratch.bytes;
+        n = used;
+    }
+
+    appendByte(self, '"');
+    const uint8_t* run = utf8, *end = utf8 + n;
+    for (const uint8_t* p = utf8; p < end; ++p) {
+        uint8_t c = *p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        append(self, run, p - run);
+        run = p + 1;
+        char escape[7] = {'\\', 0};
+        size_t escapeLength = 2;
+        switch (c) {
+            case '"':  escape[1] = '"'; break;
+            case '\\': escape[1] = '\\'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            default:
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                escapeLength = 6;
+                break;
+        }
+        append(self, escape, escapeLength);
+    }
+    append(self, run, end - run);
+    appendByte(self, '"');
+}
+
+
+static void writeUnsigned(RESTJSONWriter* self, unsigned long long n, BOOL negative) {
+    char digits[21];
+    char* p = digits + sizeof(digits);
+    do {
+        *--p = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
+    if (negative)
+        *--p = '-';
+    append(self, p, digits + sizeof(digits) - p);
+}
+
+
+- (void) writeNumber: (NSNumber*)number {
+    if (number == (id)kCFBooleanTrue) {
+        append(self, "true", 4);
+        return;
+    } else if (number == (id)kCFBooleanFalse) {
+        append(self, "false", 5);
+        return;
+    }
+    switch (number.objCType[0]) {
+        case 'f':
+        case 'd': {
+            double d = number.doubleValue;
+            if (!isfinite(d)) {
+                _failed = YES;
+                return;
+            }
+            if (d == floor(d) && fabs(d) < 1e15) {
+                writeUnsigned(self, (unsigned long long)fabs(d), d < 0);
+            } else {
+                // Use the shortest precision that round-trips:
+                char str[32];
+                int len = snprintf(str, sizeof(str), "%.15g", d);
+                if (strtod(str, NULL) != d)
+                    len = snprintf(str, sizeof(str), "%.17g", d);
+                append(self, str, len);
+            }
+            break;
+        }
+        case 'Q':
+            writeUnsigned(self, number.unsignedLongLongValue, NO);
+            break;
+        default: {
+            long long n = number.longLongValue;
+            writeUnsigned(self, (n < 0 ? 0ull - (unsigned long long)n : (unsigned long long)n),
+                          n < 0);
+            break;
+        }
+    }
+}
+
+
+#pragma mark - STRUCTURE:
+
+
+// Opens an array or dictionary; the caller has already written any preceding comma.
+static void openContainer(RESTJSONWriter* self, uint8_t open) {
+    if (self->_depth >= kRESTJSONWriterMaxDepth) {
+        self->_failed = YES;
+        return;
+    }
+    self->_needsComma[self->_depth++] = NO;
+    appendByte(self, open);
+}
+
+static void closeContainer(RESTJSONWriter* self, uint8_t close) {
+    if (self->_depth == 0 || self->_afterKey) {
+        self->_failed = YES;
+        return;
+    }
+    --self->_depth;
+    appendByte(self, close);
+}
+
+
+- (void) writeValue: (id)object {
+    if ([object isKindOfClass: sStringClass])
+        [self writeString: object];
+    else if ([object isKindOfClass: sNumberClass])
+        [self writeNumber: object];
+    else if ([object isKindOfClass: sDictionaryClass]) {
+        openContainer(self, '{');
+        [self writeContentsOfDictionary: object skippingKeys: nil];
+        closeContainer(self, '}');
+    } else if ([object isKindOfClass: sArrayClass]) {
+        openContainer(self, '[');
+        for (id item in object)
+            [self writeObject: item];
+        closeContainer(self, ']');
+    } else if ([object isKindOfClass: sNullClass])
+        append(self, "null", 4);
+    else {
+        Warn(@"RESTJSONWriter: Can't encode %@ as JSON", [object class]);
+        _failed = YES;
+    }
+}
+
+
+- (void) writeObject: (id)object {
+    beginItem(self);
+    [self writeValue: object];
+}
+
+
+- (void) beginArray         {beginItem(self); openContainer(self, '[');}
+- (void) endArray           {closeContainer(self, ']');}
+- (void) beginDictionary    {beginItem(self); openContainer(self, '{');}
+- (void) endDictionary      {closeContainer(self, '}');}
+
+
+- (void) writeKey: (NSString*)key {
+    if (![key isKindOfClass: sStringClass] || _afterKey) {
+        _failed = YES;
+        return;
+    }
+    beginItem(self);
+    [self writeString: key];
+    appendByte(self, ':');
+    _afterKey = YES;
+}
+
+
+- (void) writeKey: (NSString*)key value: (id)value {
+    [self writeKey: key];
+    [self writeObject: value];
+}
+
+
+- (void) writeContentsOfDictionary: (NSDictionary*)dict skippingKeys: (NSSet*)skip {
+    if (_canonical && dict.count > 1) {
+        NSArray* keys = [dict.allKeys sortedArrayUsingFunction: compareKeys context: NULL];
+        for (NSString* key in keys) {
+            if (![skip containsObject: key])
+                [self writeKey: key value: [dict objectForKey: key]];
+        }
+    } else {
+        for (NSString* key in dict) {
+            if (![skip containsObject: key])
+                [self writeKey: key value: [dict objectForKey: key]];
+        }
+    }
+}
+
+
+@end
@@ -0,0 +1,85 @@
+//
+//  RESTMemoryBudget.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+
+/** Posting this notification (with any object) makes +[RESTMemoryBudget sharedBudget] act as though the system is low on memory. On iOS it's also triggered by UIApplicationDidReceiveMemoryWarningNotification. */
+extern NSString* const RESTMemoryPressureNotification;
+
+
+/** Something holding memory it can give back on request, such as a cache. */
+@protocol RESTMemoryConsumer <NSObject>
+/** Should free memory that can be recreated when needed (cached objects, snapshots that can be re-fetched), preferably at least the given number of bytes, and then report its new cost. Called on the thread that added the consumer. */
+- (void) freeMemory: (UInt64)bytes;
+@end
+
+
+/** Keeps the memory held by the framework's caches and buffers within a process-wide limit.
+    Caches register as consumers and report their estimated size in bytes. Buffers that can't be freed on demand (response bodies being received, a change tracker's input) are reported as a plain byte count; they count toward the limit, so that the caches shrink to make room for them.
+    When the total goes over the limit, consumers are asked to free memory until it's back under. The ones asked first are those that are both big and least recently used. Buffers can only squeeze the consumers down to half the limit, and while the total stays over the limit they're asked again at most once a second. Under memory pressure, every consumer is asked to free everything it can.
+    A consumer must be added and removed on the same thread, and is only ever asked to free memory on that thread. A budget is thread-safe. */
+@interface RESTMemoryBudget : NSObject
+{
+    @private
+    UInt64 _limit, _consumersCost, _bufferedBytes;
+    CFMutableDictionaryRef _entries;        // consumer (not retained) -> RESTMemoryEntry
+    NSUInteger _evictionCount, _pressureCount;
+    CFAbsoluteTime _lastTrim;
+    BOOL _trimming;
+}
+
+/** The budget that the framework's caches and buffers register with. */
++ (RESTMemoryBudget*) sharedBudget;
+
+/** The total bytes that consumers and buffers should stay within. Zero means no limit. Defaults to 32MB. */
+@property UInt64 limit;
+
+/** Starts managing a consumer. It isn't retained; remove it before it's deallocated. */
+- (void) addConsumer: (id<RESTMemoryConsumer>)consumer;
+
+/** Stops managing a consumer, and subtracts its cost. */
+- (void) removeConsumer: (id<RESTMemoryConsumer>)consumer;
+
+/** Updates a consumer's estimated size. If this puts the total over the limit, consumers may be asked to free memory. */
+- (void) setCost: (UInt64)cost forConsumer: (id<RESTMemoryConsumer>)consumer;
+
+/** Notes that a consumer has just been used, making it less likely to be asked to free memory. This takes a lock, so a consumer used very often should call it at most every second or so. */
+- (void) consumerWasUsed: (id<RESTMemoryConsumer>)consumer;
+
+/** Adds to (or, if negative, subtracts from) the bytes held in buffers that can't be freed on demand. */
+- (void) addBufferedBytes: (SInt64)delta;
+
+/** If the total is over the limit, asks consumers to free memory until it isn't. */
+- (void) trim;
+
+/** Asks every consumer to free everything it can, as when the system is low on memory. */
+- (void) relieveMemoryPressure;
+
+/** The total estimated bytes of consumers and buffers. */
+@property (readonly) UInt64 totalCost;
+
+/** The bytes held in buffers (see -addBufferedBytes:). */
+@property (readonly) UInt64 bufferedBytes;
+
+/** The number of consumers being managed. */
+@property (readonly) NSUInteger consumerCount;
+
+/** The number of times a consumer has been asked to free memory. */
+@property (readonly) NSUInteger evictionCount;
+
+/** The number of times memory pressure has been relieved. */
+@property (readonly) NSUInteger pressureCount;
+
+@end
@@ -0,0 +1,290 @@
+//
+//  RESTMemoryBudget.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "RESTMemoryBudget.h"
+#import "RESTInternal.h"
+
+
+NSString* const RESTMemoryPressureNotification = @"RESTMemoryPressure";
+
+
+// While the total stays over the limit, consumers are asked to free memory at most this often.
+// (Buffers grow a chunk at a time, and each chunk would otherwise set off another round.)
+static const CFAbsoluteTime kMinTrimInterval = 1.0;
+
+
+// A registered consumer.
+@interface RESTMemoryEntry : NSObject
+{
+    @public
+    id<RESTMemoryConsumer> _consumer;   // not retained; cleared when removed
+    NSThread* _thread;
+    UInt64 _cost;
+    CFAbsoluteTime _lastUsed;
+}
+@end
+
+@implementation RESTMemoryEntry
+- (void) dealloc {
+    [_thread release];
+    [super dealloc];
+}
+
+// Runs on the consumer's thread, which is also the only thread that can remove it.
+- (void) freeMemory: (NSNumber*)bytes {
+    [_consumer freeMemory: bytes.unsignedLongLongValue];
+}
+@end
+
+
+@implementation RESTMemoryBudget
+
+
++ (RESTMemoryBudget*) sharedBudget {
+    static RESTMemoryBudget* sShared;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sShared = [[self alloc] init];
+    });
+    return sShared;
+}
+
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _limit = 32 * 1024 * 1024;
+        _entries = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+        NSNotificationCenter* nctr = [NSNotificationCenter defaultCenter];
+        [nctr addObserver: self selector: @selector(relieveMemoryPressure)
+                     name: RESTMemoryPressureNotification object: nil];
+#if TARGET_OS_IPHONE
+        [nctr addObserver: self selector: @selector(relieveMemoryPressure)
+                     name: @"UIApplicationDidReceiveMemoryWarningNotification" object: nil];
+#endif
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver: self];
+    CFRelease(_entries);
+    [super dealloc];
+}
+
+
+@synthesize evictionCount=_evictionCount, pressureCount=_pressureCount;
+
+
+- (UInt64) limit {
+    @synchronized(self) {
+        return _limit;
+    }
+}
+
+- (void) setLimit: (UInt64)limit {
+    @synchronized(self) {
+        _limit = limit;
+    }
+    [self trim];
+}
+
+
+- (UInt64) totalCost {
+    @synchronized(self) {
+        return _consumersCost + _bufferedBytes;
+    }
+}
+
+- (UInt64) bufferedBytes {
+    @synchronized(self) {
+        return _bufferedBytes;
+    }
+}
+
+- (NSUInteger) consumerCount {
+    @synchronized(self) {
+        return CFDictionaryGetCount(_entries);
+    }
+}
+
+
+#pragma mark - ACCOUNTING:
+
+
+- (RESTMemoryEntry*) entryFor: (id<RESTMemoryConsumer>)consumer {
+    return (RESTMemoryEntry*)CFDictionaryGetValue(_entries, consumer);
+}
+
+
+// Call while locked, after changing the total. Going over the limit calls for a trim right away;
+// staying over it only calls for one once the last has had time to take effect.
+- (BOOL) shouldTrimFrom: (UInt64)oldTotal {
+    UInt64 total = _consumersCost + _bufferedBytes;
+    if (_limit == 0 || total <= _limit || _trimming)
+        return NO;
+    return oldTotal <= _limit || CFAbsoluteTimeGetCurrent() - _lastTrim >= kMinTrimInterval;
+}
+
+
+- (void) addConsumer: (id<RESTMemoryConsumer>)consumer {
+    NSParameterAssert(consumer);
+    @synchronized(self) {
+        if ([self entryFor: consumer])
+            return;
+        RESTMemoryEntry* entry = [[RESTMemoryEntry alloc] init];
+        entry->_consumer = consumer;
+        entry->_thread = [[NSThread currentThread] retain];
+        entry->_lastUsed = CFAbsoluteTimeGetCurrent();
+        CFDictionarySetValue(_entries, consumer, entry);
+        [entry release];
+    }
+}
+
+
+- (void) removeConsumer: (id<RESTMemoryConsumer>)consumer {
+    @synchronized(self) {
+        RESTMemoryEntry* entry = [self entryFor: consumer];
+        if (!entry)
+            return;
+        entry->_consumer = nil;     // in case a request to free memory is on its way
+        _consumersCost -= entry->_cost;
+        CFDictionaryRemoveValue(_entries, consumer);
+    }
+}
+
+
+- (void) setCost: (UInt64)cost forConsumer: (id<RESTMemoryConsumer>)consumer {
+    BOOL overLimit;
+    @synchronized(self) {
+        RESTMemoryEntry* entry = [self entryFor: consumer];
+        if (!entry)
+            return;
+        UInt64 oldCost = entry->_cost, oldTotal = _consumersCost + _bufferedBytes;
+        _consumersCost = _consumersCost - oldCost + cost;
+        entry->_cost = cost;
+        overLimit = cost > oldCost && [self shouldTrimFrom: oldTotal];
+    }
+    if (overLimit)
+        [self trim];
+}
+
+
+- (void) consumerWasUsed: (id<RESTMemoryConsumer>)consumer {
+    @synchronized(self) {
+        RESTMemoryEntry* entry = [self entryFor: consumer];
+        if (entry)
+            entry->_lastUsed = CFAbsoluteTimeGetCurrent();
+    }
+}
+
+
+- (void) addBufferedBytes: (SInt64)delta {
+    BOOL overLimit;
+    @synchronized(self) {
+        UInt64 oldTotal = _consumersCost + _bufferedBytes;
+        if (delta < 0 && (UInt64)-delta > _bufferedBytes)
+            _bufferedBytes = 0;
+        else
+            _bufferedBytes += delta;
+        overLimit = delta > 0 && [self shouldTrimFrom: oldTotal];
+    }
+    if (overLimit)
+        [self trim];
+}
+
+
+#pragma mark - EVICTION:
+
+
+// Asks consumers to free memory until their total is down to 'target'. The consumers that are
+// biggest and have gone longest without being used go first.
+- (void) freeConsumersDownTo: (UInt64)target {
+    NSMutableArray* victims = [NSMutableArray array];
+    NSMutableArray* amounts = [NSMutableArray array];
+    @synchronized(self) {
+        if (_trimming || _consumersCost <= target)
+            return;
+        UInt64 excess = _consumersCost - target;
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        _lastTrim = now;
+        NSArray* allEntries = [(NSDictionary*)_entries allValues];
+        NSArray* entries = [allEntries sortedArrayUsingComparator: ^(id a, id b) {
+            RESTMemoryEntry *ea = a, *eb = b;
+            double scoreA = ea->_cost * (now - ea->_lastUsed + 1.0);
+            double scoreB = eb->_cost * (now - eb->_lastUsed + 1.0);
+            return scoreA > scoreB ? NSOrderedAscending
+                                   : (scoreA < scoreB ? NSOrderedDescending : NSOrderedSame);
+        }];
+        for (RESTMemoryEntry* entry in entries) {
+            if (excess == 0)
+                break;
+            if (entry->_cost == 0)
+                continue;
+            UInt64 bytes = MIN(entry->_cost, excess);
+            excess -= bytes;
+            [victims addObject: entry];
+            [amounts addObject: [NSNumber numberWithUnsignedLongLong: bytes]];
+            ++_evictionCount;
+        }
+        _trimming = YES;    // consumers will call -setCost: while freeing; don't recurse
+    }
+
+    if (gRESTLogLevel >= kRESTLogRequestURLs)
+        NSLog(@"REST: Memory budget asking %lu consumers to free memory",
+              (unsigned long)victims.count);
+    NSThread* thread = [NSThread currentThread];
+    NSUInteger n = victims.count;
+    for (NSUInteger i = 0; i < n; i++) {
+        RESTMemoryEntry* entry = [victims objectAtIndex: i];
+        NSNumber* bytes = [amounts objectAtIndex: i];
+        if (entry->_thread == thread)
+            [entry freeMemory: bytes];
+        else if (!entry->_thread.isFinished)
+            [entry performSelector: @selector(freeMemory:)
+                          onThread: entry->_thread
+                        withObject: bytes
+                     waitUntilDone: NO
+                             modes: [NSArray arrayWithObject: NSRunLoopCommonModes]];
+    }
+
+    @synchronized(self) {
+        _trimming = NO;
+    }
+}
+
+
+- (void) trim {
+    UInt64 target;
+    @synchronized(self) {
+        if (_limit == 0)
+            return;
+        // Make room for the buffers, but don't let them empty the caches altogether:
+        target = _limit > _bufferedBytes ? _limit - _bufferedBytes : 0;
+        target = MAX(target, _limit / 2);
+    }
+    [self freeConsumersDownTo: target];
+}
+
+
+- (void) relieveMemoryPressure {
+    @synchronized(self) {
+        ++_pressureCount;
+    }
+    [self freeConsumersDownTo: 0];
+}
+
+
+@end
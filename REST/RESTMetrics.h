@@ -0,0 +1,115 @@
+//
+//  RESTMetrics.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+@class RESTOperation;
+
+
+/** Number of buckets in a RESTHistogram. */
+#define kRESTHistogramBuckets 312
+
+
+/** A fixed-size, log-linear latency histogram in the style of HdrHistogram.
+    Values are recorded in microseconds, with 1/8 (12.5%) precision, up to about 25 days.
+    Recording is lock-free and safe to call from any thread; -copy makes a consistent-enough snapshot that can be examined at leisure. */
+@interface RESTHistogram : NSObject <NSCopying>
+{
+    @private
+    int32_t _counts[kRESTHistogramBuckets];
+    int64_t _totalCount;
+    int64_t _sum;
+    int64_t _max;
+}
+
+/** Records a single value, in seconds. Negative values are recorded as zero. */
+- (void) recordTime: (NSTimeInterval)seconds;
+
+/** The number of values recorded. */
+@property (readonly) int64_t count;
+
+/** The mean of the recorded values, in seconds. */
+@property (readonly) NSTimeInterval mean;
+
+/** The largest recorded value, in seconds. */
+@property (readonly) NSTimeInterval max;
+
+/** The value below which the given percentage of recorded values fall, in seconds.
+    @param percentile  A number from 0 to 100, e.g. 99.0 for the p99 latency. */
+- (NSTimeInterval) valueAtPercentile: (double)percentile;
+
+/** Adds all the values recorded in another histogram to this one. */
+- (void) addHistogram: (RESTHistogram*)other;
+
+/** Clears all recorded values. */
+- (void) reset;
+
+@end
+
+
+/** Aggregate metrics of all operations sent to a single URL path.
+    The live instances belonging to RESTMetrics are updated concurrently; use -[RESTMetrics snapshot] to get copies that won't change. */
+@interface RESTPathMetrics : NSObject <NSCopying>
+{
+    @private
+    NSString* _path;
+    int64_t _count, _errorCount, _requestBytes, _responseBytes;
+    RESTHistogram *_queueTime, *_firstByteTime, *_transferTime, *_parseTime, *_callbackTime,
+                  *_totalTime;
+}
+
+/** The URL path (without query) the operations were sent to. */
+@property (readonly) NSString* path;
+
+@property (readonly) int64_t count;         /**< Number of operations completed */
+@property (readonly) int64_t errorCount;    /**< Number of those that failed */
+@property (readonly) int64_t requestBytes;  /**< Total size of all request bodies */
+@property (readonly) int64_t responseBytes; /**< Total size of all response bodies */
+
+@property (readonly) RESTHistogram* queueTime;      /**< See RESTOperationTimings.queue */
+@property (readonly) RESTHistogram* firstByteTime;  /**< See RESTOperationTimings.firstByte */
+@property (readonly) RESTHistogram* transferTime;   /**< See RESTOperationTimings.transfer */
+@property (readonly) RESTHistogram* parseTime;      /**< See RESTOperationTimings.parse */
+@property (readonly) RESTHistogram* callbackTime;   /**< See RESTOperationTimings.callbacks */
+@property (readonly) RESTHistogram* totalTime;      /**< See RESTOperationTimings.total */
+
+@end
+
+
+/** Process-wide registry of per-path operation metrics.
+    Collection is off by default; set gRESTCollectMetrics to YES to enable it. */
+@interface RESTMetrics : NSObject
+{
+    @private
+    NSMutableDictionary* _paths;
+    RESTPathMetrics* _overflow;
+}
+
+/** The shared instance that RESTOperations report to. */
++ (RESTMetrics*) sharedMetrics;
+
+/** Adds a completed operation's timings to the metrics for its URL path. */
+- (void) recordOperation: (RESTOperation*)op;
+
+/** Returns a copy of the current metrics, as a dictionary mapping URL paths to RESTPathMetrics.
+    Once the number of distinct paths reaches a limit, operations on new paths are lumped together under the path "*". */
+- (NSDictionary*) snapshot;
+
+/** Discards all recorded metrics. */
+- (void) reset;
+
+@end
+
+
+/** Set this to YES to make RESTOperations record their timings into +[RESTMetrics sharedMetrics]. Defaults to NO. (Per-operation timings are always available via -[RESTOperation timings].) */
+extern BOOL gRESTCollectMetrics;
@@ -0,0 +1,304 @@
+//
+//  RESTMetrics.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "RESTMetrics.h"
+#import "RESTInternal.h"
+#import <libkern/OSAtomic.h>
+
+
+BOOL gRESTCollectMetrics = NO;
+
+
+// Past this many distinct paths, new ones are recorded under kOverflowPath:
+static const NSUInteger kMaxPaths = 256;
+static NSString* const kOverflowPath = @"*";
+
+
+#pragma mark - HISTOGRAM:
+
+
+// Buckets are log-linear: each power of two is split into 8 linear sub-buckets. Values below 8
+// get a bucket each. This gives 1/8 relative precision over the whole range.
+#define kSubBucketBits 3
+#define kSubBuckets (1 << kSubBucketBits)
+#define kMaxExponent (kRESTHistogramBuckets / kSubBuckets + kSubBucketBits - 2)
+
+static unsigned bucketForValue(int64_t value) {
+    if (value < kSubBuckets)
+        return (unsigned)MAX(value, 0);
+    unsigned exponent = 63 - __builtin_clzll(value);
+    if (exponent > kMaxExponent)
+        return kRESTHistogramBuckets - 1;
+    unsigned sub = (unsigned)(value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+    return (exponent - kSubBucketBits + 1) * kSubBuckets + sub;
+}
+
+static int64_t lowestValueInBucket(unsigned bucket) {
+    if (bucket < kSubBuckets)
+        return bucket;
+    unsigned exponent = bucket / kSubBuckets + kSubBucketBits - 1;
+    int64_t sub = kSubBuckets + bucket % kSubBuckets;
+    return sub << (exponent - kSubBucketBits);
+}
+
+
+@implementation RESTHistogram
+
+
+- (void) recordTime: (NSTimeInterval)seconds {
+    int64_t usec = (int64_t)(MAX(seconds, 0.0) * 1.0e6);
+    OSAtomicIncrement32(&_counts[bucketForValue(usec)]);
+    OSAtomicIncrement64(&_totalCount);
+    OSAtomicAdd64(usec, &_sum);
+    int64_t max;
+    do {
+        max = _max;
+    } while (usec > max && !OSAtomicCompareAndSwap64(max, usec, &_max));
+}
+
+
+- (void) addHistogram: (RESTHistogram*)other {
+    for (unsigned i = 0; i < kRESTHistogramBuckets; i++) {
+        if (other->_counts[i])
+            OSAtomicAdd32(other->_counts[i], &_counts[i]);
+    }
+    OSAtomicAdd64(other->_totalCount, &_totalCount);
+    OSAtomicAdd64(other->_sum, &_sum);
+    int64_t max, otherMax = other->_max;
+    do {
+        max = _max;
+    } while (otherMax > max && !OSAtomicCompareAndSwap64(max, otherMax, &_max));
+}
+
+
+- (void) reset {
+    memset(_counts, 0, sizeof(_counts));
+    _totalCount = _sum = _max = 0;
+    OSMemoryBarrier();
+}
+
+
+- (id) copyWithZone: (NSZone*)zone {
+    RESTHistogram* copy = [[[self class] alloc] init];
+    [copy addHistogram: self];
+    return copy;
+}
+
+
+- (int64_t) count {
+    return _totalCount;
+}
+
+- (NSTimeInterval) mean {
+    return _totalCount ? (_sum / (double)_totalCount) / 1.0e6 : 0.0;
+}
+
+- (NSTimeInterval) max {
+    return _max / 1.0e6;
+}
+
+
+- (NSTimeInterval) valueAtPercentile: (double)percentile {
+    int64_t total = _totalCount;
+    if (total == 0)
+        return 0.0;
+    int64_t target = (int64_t)ceil(MIN(MAX(percentile, 0.0), 100.0) / 100.0 * total);
+    int64_t seen = 0;
+    for (unsigned i = 0; i < kRESTHistogramBuckets; i++) {
+        seen += _counts[i];
+        if (seen >= MAX(target, 1)) {
+            // Report the highest value that falls into this bucket, but never more than the max:
+            int64_t value = (i + 1 < kRESTHistogramBuckets) ? lowestValueInBucket(i + 1) - 1
+                                                            : _max;
+            return MIN(value, _max) / 1.0e6;
+        }
+    }
+    return self.max;
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[n=%lld, mean=%.1fms, p50=%.1fms, p99=%.1fms, max=%.1fms]",
+            [self class], _totalCount, self.mean*1000, [self valueAtPercentile: 50]*1000,
+            [self valueAtPercentile: 99]*1000, self.max*1000];
+}
+
+
+@end
+
+
+#pragma mark - PATH METRICS:
+
+
+@implementation RESTPathMetrics
+
+
+- (id) initWithPath: (NSString*)path {
+    self = [super init];
+    if (self) {
+        _path = [path copy];
+        _queueTime = [[RESTHistogram alloc] init];
+        _firstByteTime = [[RESTHistogram alloc] init];
+        _transferTime = [[RESTHistogram alloc] init];
+        _parseTime = [[RESTHistogram alloc] init];
+        _callbackTime = [[RESTHistogram alloc] init];
+        _totalTime = [[RESTHistogram alloc] init];
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_path release];
+    [_queueTime release];
+    [_firstByteTime release];
+    [_transferTime release];
+    [_parseTime release];
+    [_callbackTime release];
+    [_totalTime release];
+    [super dealloc];
+}
+
+
+@synthesize path=_path, count=_count, errorCount=_errorCount, requestBytes=_requestBytes,
+            responseBytes=_responseBytes, queueTime=_queueTime, firstByteTime=_firstByteTime,
+            transferTime=_transferTime, parseTime=_parseTime, callbackTime=_callbackTime,
+            totalTime=_totalTime;
+
+
+- (void) recordTimings: (RESTOperationTimings)timings failed: (BOOL)failed {
+    OSAtomicIncrement64(&_count);
+    if (failed)
+        OSAtomicIncrement64(&_errorCount);
+    OSAtomicAdd64(timings.requestBytes, &_requestBytes);
+    OSAtomicAdd64(timings.responseBytes, &_responseBytes);
+    [_queueTime recordTime: timings.queue];
+    [_firstByteTime recordTime: timings.firstByte];
+    [_transferTime recordTime: timings.transfer];
+    [_parseTime recordTime: timings.parse];
+    [_callbackTime recordTime: timings.callbacks];
+    [_totalTime recordTime: timings.total];
+}
+
+
+- (id) copyWithZone: (NSZone*)zone {
+    RESTPathMetrics* copy = [[[self class] alloc] initWithPath: _path];
+    copy->_count = _count;
+    copy->_errorCount = _errorCount;
+    copy->_requestBytes = _requestBytes;
+    copy->_responseBytes = _responseBytes;
+    [copy->_queueTime addHistogram: _queueTime];
+    [copy->_firstByteTime addHistogram: _firstByteTime];
+    [copy->_transferTime addHistogram: _transferTime];
+    [copy->_parseTime addHistogram: _parseTime];
+    [copy->_callbackTime addHistogram: _callbackTime];
+    [copy->_totalTime addHistogram: _totalTime];
+    return copy;
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%@: %lld ops (%lld failed), %lld bytes out, %lld in; total %@]",
+            [self class], _path, _count, _errorCount, _requestBytes, _responseBytes, _totalTime];
+}
+
+
+@end
+
+
+#pragma mark - REGISTRY:
+
+
+@implementation RESTMetrics
+
+
++ (RESTMetrics*) sharedMetrics {
+    static RESTMetrics* sShared;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sShared = [[self alloc] init];
+    });
+    return sShared;
+}
+
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        _paths = [[NSMutableDictionary alloc] init];
+        _overflow = [[RESTPathMetrics alloc] initWithPath: kOverflowPath];
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_paths release];
+    [_overflow release];
+    [super dealloc];
+}
+
+
+- (RESTPathMetrics*) metricsForPath: (NSString*)path {
+    // The lock only covers the lookup; the actual recording into the metrics is lock-free.
+    @synchronized(self) {
+        RESTPathMetrics* metrics = [_paths objectForKey: path];
+        if (!metrics) {
+            if (_paths.count >= kMaxPaths)
+                return _overflow;
+            metrics = [[RESTPathMetrics alloc] initWithPath: path];
+            [_paths setObject: metrics forKey: path];
+            [metrics release];
+        }
+        return metrics;
+    }
+}
+
+
+- (void) recordOperation: (RESTOperation*)op {
+    NSString* path = op.URL.path;
+    if (path.length == 0)
+        path = @"/";
+    [[self metricsForPath: path] recordTimings: op.timings failed: (op.error != nil)];
+}
+
+
+- (NSDictionary*) snapshot {
+    @synchronized(self) {
+        NSMutableDictionary* snapshot = [NSMutableDictionary dictionaryWithCapacity: _paths.count+1];
+        for (NSString* path in _paths) {
+            RESTPathMetrics* copy = [[_paths objectForKey: path] copy];
+            [snapshot setObject: copy forKey: path];
+            [copy release];
+        }
+        if (_overflow.count > 0) {
+            RESTPathMetrics* copy = [_overflow copy];
+            [snapshot setObject: copy forKey: kOverflowPath];
+            [copy release];
+        }
+        return snapshot;
+    }
+}
+
+
+- (void) reset {
+    @synchronized(self) {
+        [_paths removeAllObjects];
+        [_overflow release];
+        _overflow = [[RESTPathMetrics alloc] initWithPath: kOverflowPath];
+    }
+}
+
+
+@end
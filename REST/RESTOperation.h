@@ -14,7 +14,7 @@
 //  and limitations under the License.
 
 #import <Foundation/Foundation.h>
-@class RESTBody, RESTResource;
+@class RESTBody, RESTResource, RESTRetryPolicy, RESTScheduler;
 
 
 /** Error domain used for HTTP errors (status >= 300). The code is the HTTP status. */
@@ -25,6 +25,29 @@ extern NSString* const CouchHTTPErrorDomain;
 typedef void (^OnCompleteBlock)();
 
 
+/** Timing breakdown of a RESTOperation (see -timings.) Times are in seconds. */
+typedef struct {
+    NSTimeInterval queue;       /**< From creation until the request was first sent */
+    NSTimeInterval firstByte;   /**< From sending the request until the response headers arrived. This includes connection setup, which NSURLConnection doesn't report separately. */
+    NSTimeInterval transfer;    /**< From the response headers until the end of the body */
+    NSTimeInterval parse;       /**< Time spent parsing the response body as JSON while completing */
+    unsigned parseCount;        /**< Number of JSON parses done while completing. (For debugging: the response body is parsed at most once, so more than one means something parsed JSON of its own.) */
+    NSTimeInterval callbacks;   /**< Time spent in the resource's hooks and onCompletion blocks, not counting parse */
+    NSTimeInterval total;       /**< From creation until all completion callbacks returned */
+    UInt64 requestBytes;        /**< Size of the request body */
+    UInt64 responseBytes;       /**< Size of the response body */
+} RESTOperationTimings;
+
+
+/** How urgently a RESTOperation should be sent, relative to others to the same host (see RESTScheduler.h.) */
+typedef enum {
+    kRESTPriorityInteractive,   /**< Something (often the user) is waiting for the response */
+    kRESTPriorityNormal,        /**< The default */
+    kRESTPriorityBackground,    /**< Bulk transfers, like large uploads and replication */
+    kRESTPriorityUnscheduled    /**< Bypasses the scheduler; for long-lived requests like feeds */
+} RESTPriority;
+
+
 /** Represents an HTTP request to a RESTResource, and its response.
     Can be used either synchronously or asynchronously. Methods that return information about the
     response, such as -httpStatus or -body, will block if called before the response is available.
@@ -37,16 +60,32 @@ typedef void (^OnCompleteBlock)();
     RESTResource* _resource;
     NSURLRequest* _request;
     NSURLConnection* _connection;
+    NSURLConnection* _hedgeConnection;
+    RESTRetryPolicy* _policy;
+    RESTScheduler* _scheduler;
+    RESTPriority _priority;
+    RESTOperation* _leader;
+    NSMutableArray* _followers;
+    NSString* _coalescingKey;
+    id _tapePlayer;
+    id _backend;
+    id _requestObject;
     SInt8 _state;
     UInt8 _retryCount;
-    BOOL _waiting;
+    BOOL _waiting, _rejected, _queued;
     NSError* _error;
 
     NSHTTPURLResponse* _response;
     NSMutableData* _body;
+    NSUInteger _budgetedBytes;
+    id _responseObject;
+    RESTBody* _responseBody;
     id _resultObject;
 
     NSMutableArray* _onCompletes;
+
+    CFAbsoluteTime _createdAt, _sentAt, _respondedAt;
+    RESTOperationTimings _timings;
 }
 
 /** Initializes a RESTOperation, but doesn't start loading it yet.
@@ -74,9 +113,20 @@ typedef void (^OnCompleteBlock)();
 /** Sets an HTTP request header. Must be called before loading begins! */
 - (void) setValue: (NSString*)value forHeader: (NSString*)headerName;
 
-/** The HTTP request body. Cannot be changed after the operation starts. */
+/** YES if this operation didn't send a request of its own, but completed with the response to an identical GET that was already in flight. (See -[RESTResource coalescesGETs].) */
+@property (readonly) BOOL isCoalesced;
+
+/** The HTTP request body. Cannot be changed after the operation starts.
+    If the body was given as a requestObject, it's serialized as JSON the first time this is called. */
 @property (copy) NSData* requestBody;
 
+/** The request body as a JSON-compatible object, as given to -[RESTResource PUTJSON:parameters:] or -POSTJSON:parameters:. Cannot be changed after the operation starts.
+    It's serialized only if the request goes over HTTP; a RESTBackend receives the object itself. */
+@property (retain) id requestObject;
+
+/** How urgently the request should be sent, relative to other requests to the same host. Defaults to kRESTPriorityNormal. Cannot be changed after the operation starts. */
+@property RESTPriority priority;
+
 #pragma mark LOADING:
 
 /** Sends the request, asynchronously. Subsequent calls do nothing.
@@ -131,7 +181,8 @@ typedef void (^OnCompleteBlock)();
 /** Dictionary of HTTP response headers (Synchronous.) */
 @property (readonly) NSDictionary* responseHeaders;
 
-/** The body of the response, with its entity headers (Synchronous.) */
+/** The body of the response, with its entity headers (Synchronous.)
+    The same instance is returned every time, so its -fromJSON is parsed only once no matter how many completion handlers look at it. A coalesced operation (see -isCoalesced) returns the same instance as the operation whose response it shares. */
 @property (readonly) RESTBody* responseBody;
 
 /** The raw NSHTTPURLResponse object, in case you need it. */
@@ -143,6 +194,12 @@ typedef void (^OnCompleteBlock)();
 @property (retain) id resultObject;
 
 
+/** How long each phase of the operation took, and how many bytes were sent and received.
+    The values are filled in as the operation progresses, and are final once it completes.
+    If gRESTCollectMetrics is set, completed operations are also aggregated into +[RESTMetrics sharedMetrics]. */
+@property (readonly) RESTOperationTimings timings;
+
+
 /** Debugging utility that returns a sort-of log of the HTTP request and response. */
 - (NSString*) dump;
 
@@ -16,6 +16,9 @@
 #import "RESTOperation.h"
 
 #import "RESTInternal.h"
+#import "RESTBackend.h"
+#import "RESTMemoryBudget.h"
+#import <pthread.h>
 
 
 /** Possible states that a RESTOperation is in during its lifecycle. */
@@ -31,22 +34,44 @@ NSString* const CouchHTTPErrorDomain = @"CouchHTTPError";
 
 static NSString* const kRESTObjectRunLoopMode = @"RESTOperation";
 
-static const NSTimeInterval kRetryDelay = 0.5;
-static const unsigned kMaxRetries = 3;
-
+// Key in the thread dictionary of the coalescable GETs in flight on that thread.
+static NSString* const kInFlightGETsKey = @"RESTOperation.inFlightGETs";
 
 RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 
 
+// Thread-local pointer to the timings of the operation whose completion is running, so that
+// JSON parsing done by its callbacks can be charged to it.
+static pthread_key_t currentTimingsKey(void) {
+    static pthread_key_t sKey;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        pthread_key_create(&sKey, NULL);
+    });
+    return sKey;
+}
+
+void RESTOperationAddParseTime(NSTimeInterval time) {
+    RESTOperationTimings* timings = pthread_getspecific(currentTimingsKey());
+    if (timings) {
+        timings->parse += time;
+        ++timings->parseCount;
+    }
+}
+
+
 @interface RESTOperation ()
 @property (readwrite, retain) NSError* error;
+@property (readonly) RESTBody* cachedResponseBody;
+- (void) releaseBody;
 @end
 
 
 @implementation RESTOperation
 
 
-@synthesize resource=_resource, request=_request, response=_response, error=_error;
+@synthesize resource=_resource, request=_request, response=_response, error=_error,
+            timings=_timings;
 
 
 - (id) initWithResource: (RESTResource*)resource request: (NSURLRequest*)request {
@@ -56,6 +81,8 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
         _resource = [resource retain];
         _request = [request mutableCopy];   // starts out mutable
         _state = kRESTObjectUnloaded;
+        _priority = kRESTPriorityNormal;
+        _createdAt = CFAbsoluteTimeGetCurrent();
     }
     return self;
 }
@@ -63,14 +90,30 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 
 - (void) dealloc {
     [_resultObject release];
+    [_leader release];
+    [_followers release];
+    [_coalescingKey release];
     [_connection cancel];
     [_connection release];
+    [_hedgeConnection cancel];
+    [_hedgeConnection release];
+    [_policy release];
+    [_scheduler operationFinished: self];
+    [_scheduler release];
+    [_tapePlayer cancel];
+    [_tapePlayer release];
+    if (_state == kRESTObjectLoading && [_backend respondsToSelector: @selector(cancelOperation:)])
+        [_backend cancelOperation: self];
+    [_backend release];
+    [_requestObject release];
+    [_responseObject release];
+    [_responseBody release];
     [_request release];
     [_response release];
     [_error release];
     [_resource release];
     [_onCompletes release];
-    [_body release];
+    [self releaseBody];
     [super dealloc];
 }
 
@@ -132,6 +175,8 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 
 
 - (NSData*) requestBody {
+    if (!_request.HTTPBody && _requestObject)
+        ((NSMutableURLRequest*)_request).HTTPBody = [RESTBody dataWithJSONObject: _requestObject];
     return _request.HTTPBody;
 }
 
@@ -141,6 +186,30 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 }
 
 
+- (id) requestObject {
+    return _requestObject;
+}
+
+- (RESTPriority) priority {
+    return _priority;
+}
+
+- (void) setPriority: (RESTPriority)priority {
+    NSParameterAssert(_state == kRESTObjectUnloaded);
+    _priority = priority;
+}
+
+
+- (void) setRequestObject: (id)object {
+    NSParameterAssert(_state == kRESTObjectUnloaded);
+    if (object != _requestObject) {
+        [_requestObject release];
+        _requestObject = [object retain];
+        ((NSMutableURLRequest*)_request).HTTPBody = nil;
+    }
+}
+
+
 #pragma mark LOADING:
 
 
@@ -161,12 +230,36 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
         }
     }
 
-    _connection = [[NSURLConnection alloc] initWithRequest: _request
-                                                  delegate: self
-                                          startImmediately: NO];
-    [_connection scheduleInRunLoop: [NSRunLoop currentRunLoop] forMode: NSRunLoopCommonModes];
-    [_connection scheduleInRunLoop: [NSRunLoop currentRunLoop] forMode: kRESTObjectRunLoopMode];
-    [_connection start];
+    RESTTape* tape = [RESTTape activeTape];
+    if (!_backend && !tape.isReplaying)
+        _backend = [[_resource backendForOperation: self] retain];
+    if (tape.isReplaying) {
+        // Play back the recorded response instead of going to the network:
+        NSArray* modes = [NSArray arrayWithObjects: NSRunLoopCommonModes, kRESTObjectRunLoopMode, nil];
+        _tapePlayer = [[tape playerForOperation: self modes: modes] retain];
+    } else if (_backend) {
+        // Hand the request to the in-process backend. This is deferred so that, as with a real
+        // connection, the operation never completes inside -start or -onCompletion:.
+        [self performSelector: @selector(sendToBackend) withObject: nil afterDelay: 0.0
+                      inModes: [[self class] backendRunLoopModes]];
+    } else if ([self joinIdenticalOperation]) {
+        // Sharing the response to an identical GET that's already in flight
+    } else {
+        // Going over HTTP, so wait for the scheduler to give me a slot:
+        if (_priority != kRESTPriorityUnscheduled) {
+            _scheduler = [(_resource ? _resource.scheduler : [RESTScheduler sharedScheduler])
+                                retain];
+            _queued = ![_scheduler admitOperation: self];
+        }
+        if (!_queued)
+            [self sendOverHTTP];
+        else if (gRESTLogLevel >= kRESTLogRequestHeaders)
+            NSLog(@"REST:    (queued)");
+    }
+    _sentAt = CFAbsoluteTimeGetCurrent();
+    if (_retryCount == 0)
+        _timings.queue = _sentAt - _createdAt;
+    _timings.requestBytes = _request.HTTPBody.length;
     self.error = nil;
     _state = kRESTObjectLoading;
     
@@ -178,8 +271,10 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 - (BOOL) wait {
     if (_state == kRESTObjectUnloaded)
         [self start];
-    if (_connection && _state == kRESTObjectLoading) {
+    if ((_connection || _tapePlayer || _backend || _rejected || _queued || _leader)
+            && _state == kRESTObjectLoading) {
         CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        [self promoteToInteractive];
         
         _waiting = YES;
         while (_state == kRESTObjectLoading) {
@@ -211,9 +306,12 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
     CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
 
     // Mark each active operation as waiting:
-    for (RESTOperation* op in operations)
-        if (op->_state == kRESTObjectLoading)
+    for (RESTOperation* op in operations) {
+        if (op->_state == kRESTObjectLoading) {
             op->_waiting = YES;
+            [op promoteToInteractive];
+        }
+    }
     
     // Loop till all operations have finished:
     do {
@@ -243,6 +341,16 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 }
 
 
+// If I'm still queued, something's now blocked waiting for me, so I should go sooner.
+- (void) promoteToInteractive {
+    if (_queued && _priority != kRESTPriorityInteractive) {
+        _priority = kRESTPriorityInteractive;
+        [_scheduler operationChangedPriority: self];
+    }
+    [_leader promoteToInteractive];
+}
+
+
 - (BOOL) onCompletion: (OnCompleteBlock)onComplete {
     if (_state == kRESTObjectReady || _state == kRESTObjectFailed) {
         onComplete();  // call immediately if I've already finished
@@ -263,32 +371,242 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 @synthesize retryCount=_retryCount;
 
 
+- (RESTRetryPolicy*) retryPolicy {
+    return _policy ?: (_resource ? _resource.retryPolicy : [RESTRetryPolicy sharedPolicy]);
+}
+
+
 // Returns YES if the connection should be retried.
 - (BOOL) shouldRetryAfterError: (NSError*)error {
-    if (!error || _retryCount >= kMaxRetries)
+    if (_leader)
+        return NO;      // the leader already did any retrying
+    RESTRetryPolicy* policy = self.retryPolicy;
+    return error && _retryCount < policy.maxRetries
+                 && [policy shouldRetryRequest: _request afterError: error];
+}
+
+
+- (void) sendOverHTTP {
+    [_policy release];
+    _policy = [self.retryPolicy retain];
+    if (![_policy allowsRequestToURL: _request.URL]) {
+        // The host's circuit breaker is open, so fail without sending anything. (Deferred,
+        // like a backend request, so the operation doesn't complete inside -start.)
+        _rejected = YES;
+        [self performSelector: @selector(rejectedByCircuitBreaker) withObject: nil
+                   afterDelay: 0.0 inModes: [[self class] backendRunLoopModes]];
+        return;
+    }
+    [self requestBody];     // serialize requestObject, if any
+    _connection = [self newConnection];
+    if (self.isGET) {
+        NSTimeInterval hedgeDelay = [_policy hedgeDelayForURL: _request.URL];
+        if (hedgeDelay > 0.0)
+            [self performSelector: @selector(sendHedge) withObject: nil
+                       afterDelay: hedgeDelay inModes: [[self class] backendRunLoopModes]];
+    }
+}
+
+
+// Called by my scheduler, on the thread that started me, when it's my turn to be sent.
+- (void) dispatchFromScheduler {
+    if (!_queued || _state != kRESTObjectLoading)
+        return;     // cancelled while the call was on its way
+    _queued = NO;
+    _sentAt = CFAbsoluteTimeGetCurrent();
+    if (_retryCount == 0)
+        _timings.queue = _sentAt - _createdAt;
+    [self sendOverHTTP];
+    _timings.requestBytes = _request.HTTPBody.length;
+}
+
+
+#pragma mark COALESCING:
+
+
+static NSMutableDictionary* inFlightGETs(void) {
+    NSMutableDictionary* threadDict = [[NSThread currentThread] threadDictionary];
+    NSMutableDictionary* ops = [threadDict objectForKey: kInFlightGETsKey];
+    if (!ops) {
+        ops = [NSMutableDictionary dictionary];
+        [threadDict setObject: ops forKey: kInFlightGETsKey];
+    }
+    return ops;
+}
+
+
+// Identifies requests that would get the same response: the URL plus all the headers.
+- (NSString*) coalescingKey {
+    if (!self.isGET || _request.HTTPBody || ![_resource shouldCoalesceGETs]
+                    || [RESTTape activeTape])
+        return nil;
+    NSMutableString* key = [NSMutableString stringWithString: _request.URL.absoluteString];
+    NSDictionary* headers = _request.allHTTPHeaderFields;
+    NSArray* names = [headers.allKeys sortedArrayUsingSelector: @selector(caseInsensitiveCompare:)];
+    for (NSString* name in names)
+        [key appendFormat: @"\n%@: %@", name.lowercaseString, [headers objectForKey: name]];
+    return key;
+}
+
+
+// If an identical GET is in flight, attaches to it and returns YES. Otherwise, if I'm
+// coalescable, registers me as the one that later identical GETs will attach to.
+- (BOOL) joinIdenticalOperation {
+    NSString* key = self.coalescingKey;
+    if (!key)
         return NO;
-    // Retry after NSURLErrorCannotConnectToHost (ECONN) because the embedded server might
-    // not have finished [re]launching yet.
-    if ([error.domain isEqualToString: NSURLErrorDomain] 
-            && error.code == NSURLErrorCannotConnectToHost)
-        return YES;
-    return NO;
+    NSMutableDictionary* inFlight = inFlightGETs();
+    RESTOperation* leader = [inFlight objectForKey: key];
+    if (leader == self)
+        return NO;      // I'm retrying; I'm still registered and still have my followers
+    if (!leader) {
+        [inFlight setObject: self forKey: key];
+        _coalescingKey = [key copy];
+        return NO;
+    }
+    if (gRESTLogLevel >= kRESTLogRequestHeaders)
+        NSLog(@"REST:    (sharing response of %@)", leader);
+    _leader = [leader retain];
+    if (!leader->_followers)
+        leader->_followers = [[NSMutableArray alloc] init];
+    [leader->_followers addObject: self];
+    return YES;
+}
+
+
+// Called when my response is complete (and won't be retried), before my completion is run or
+// deferred. Hands the response to my followers, and stops accepting new ones.
+- (void) finishedForFollowersWithError: (NSError*)error {
+    if (_coalescingKey) {
+        NSMutableDictionary* inFlight = inFlightGETs();
+        if ([inFlight objectForKey: _coalescingKey] == self)
+            [inFlight removeObjectForKey: _coalescingKey];
+        [_coalescingKey release];
+        _coalescingKey = nil;
+    }
+    NSArray* followers = [_followers autorelease];
+    _followers = nil;
+    for (RESTOperation* follower in followers)
+        [follower leader: self finishedWithError: error];
+}
+
+
+// Completes me with a copy of my leader's response.
+- (void) leader: (RESTOperation*)leader finishedWithError: (NSError*)error {
+    if (_state != kRESTObjectLoading || leader != _leader)
+        return;     // I was cancelled
+    if (!leader->_response) {
+        if ([error.domain isEqualToString: NSURLErrorDomain] && error.code == NSURLErrorCancelled) {
+            // My leader was cancelled, but I wasn't, so send my own request after all:
+            [_leader release];
+            _leader = nil;
+            _state = kRESTObjectUnloaded;
+            [self start];
+        } else {
+            [self completedWithError: error];
+        }
+        return;
+    }
+    _response = [leader->_response retain];
+    _body = [leader->_body retain];     // not modified after completion, so it can be shared
+    _responseBody = [leader.cachedResponseBody retain];    // ...and so can its parsed JSON
+    _respondedAt = CFAbsoluteTimeGetCurrent();
+    _timings.firstByte = _respondedAt - _sentAt;
+    [self connectionDidFinishLoading: nil];
+}
+
+
+- (BOOL) isCoalesced {
+    return _leader != nil;
+}
+
+
+#pragma mark CONNECTIONS:
+
+
+- (NSURLConnection*) newConnection {
+    NSURLConnection* connection = [[NSURLConnection alloc] initWithRequest: _request
+                                                                  delegate: self
+                                                          startImmediately: NO];
+    [connection scheduleInRunLoop: [NSRunLoop currentRunLoop] forMode: NSRunLoopCommonModes];
+    [connection scheduleInRunLoop: [NSRunLoop currentRunLoop] forMode: kRESTObjectRunLoopMode];
+    [connection start];
+    return connection;
+}
+
+
+// Sends a second copy of a GET that hasn't had a response yet; whichever responds first wins.
+- (void) sendHedge {
+    if (_state != kRESTObjectLoading || !_connection || _response || _hedgeConnection)
+        return;
+    if (gRESTLogLevel >= kRESTLogRequestURLs)
+        NSLog(@"REST: >> %@ %@ [hedge]", _request.HTTPMethod, _request.URL);
+    _hedgeConnection = [self newConnection];
+}
+
+
+// Called when one of two racing connections responds or fails. Keeps the winner as _connection.
+- (void) resolveHedgeKeeping: (NSURLConnection*)winner {
+    BOOL hedgeWon = (winner == _hedgeConnection);
+    NSURLConnection* loser = hedgeWon ? _connection : _hedgeConnection;
+    [loser cancel];
+    [loser release];
+    _connection = winner;
+    _hedgeConnection = nil;
+    [_policy recordHedgeForURL: _request.URL won: hedgeWon];
+}
+
+
+- (void) cancelHedge {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self
+                                             selector: @selector(sendHedge)
+                                               object: nil];
+    [_hedgeConnection cancel];
+    [_hedgeConnection release];
+    _hedgeConnection = nil;
+}
+
+
+- (void) rejectedByCircuitBreaker {
+    if (_state != kRESTObjectLoading || !_rejected)
+        return;
+    NSString* message = [NSString stringWithFormat: @"%@ is failing; not sending requests to it "
+                                                     "for now", _request.URL.host];
+    NSDictionary* info = [NSDictionary dictionaryWithObjectsAndKeys:
+                          message, NSLocalizedDescriptionKey,
+                          _request.URL, NSURLErrorKey,
+                          [NSNumber numberWithBool: YES], RESTCircuitOpenErrorKey,
+                          nil];
+    [self completedWithError: [NSError errorWithDomain: NSURLErrorDomain
+                                                  code: NSURLErrorCannotConnectToHost
+                                              userInfo: info]];
 }
 
 
 - (BOOL) retry {
-    if (_retryCount >= kMaxRetries)
+    if (_retryCount >= self.retryPolicy.maxRetries)
         return NO;
     ++_retryCount;
     [_connection cancel];
     [_connection release];
     _connection = nil;
+    [self cancelHedge];
+    [_leader release];
+    _leader = nil;
+    [_tapePlayer cancel];
+    [_tapePlayer release];
+    _tapePlayer = nil;
+    [_backend release];
+    _backend = nil;
     [_error release];
     _error = nil;
     [_response release];
     _response = nil;
-    [_body release];
-    _body = nil;
+    [self releaseBody];
+    [_responseObject release];
+    _responseObject = nil;
+    [_responseBody release];
+    _responseBody = nil;
     [_resultObject release];
     _resultObject = nil;
     _state = kRESTObjectUnloaded;
@@ -300,9 +618,16 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 
 
 - (void) completedWithError: (NSError*)error {
+    // Give up my slot, so the next queued request to my host can go:
+    if (_scheduler) {
+        [_scheduler operationFinished: self];
+        [_scheduler release];
+        _scheduler = nil;
+    }
+
     if ([self shouldRetryAfterError: error]) {
         // Retry, after a delay, on specific errors:
-        NSTimeInterval delay = kRetryDelay * (1 << _retryCount);
+        NSTimeInterval delay = [self.retryPolicy delayBeforeRetry: _retryCount + 1];
         if (gRESTLogLevel >= kRESTLogRequestURLs)
             NSLog(@"REST:    Error = %@, will retry in %.1lf sec...",
                   error.localizedDescription, delay);
@@ -312,6 +637,11 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
                                                           kRESTObjectRunLoopMode, nil]];
         return;
     }
+
+    if (_coalescingKey || _followers) {
+        [[self retain] autorelease];    // the in-flight table may hold the last reference to me
+        [self finishedForFollowersWithError: error];
+    }
     
     if (!_waiting &&
             [[[NSRunLoop currentRunLoop] currentMode] isEqualToString: kRESTObjectRunLoopMode]) {
@@ -324,12 +654,35 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
         return;
     }
     _waiting = NO;
-    
+
+    // Let the retry policy know how the host is doing:
+    if (_policy) {
+        if (!_rejected)
+            [_policy recordResultForURL: _request.URL
+                                  error: error
+                                latency: (_response ? _timings.firstByte : 0.0)];
+        [_policy release];
+        _policy = nil;
+    }
+    _rejected = NO;
+
     [_connection release];
     _connection = nil;
+    [_tapePlayer cancel];
+    [_tapePlayer release];
+    _tapePlayer = nil;
+    [_backend release];
+    _backend = nil;
     
     _state = error ? kRESTObjectFailed : kRESTObjectReady;
 
+    // Time the callbacks, and charge any JSON parsing they do to me:
+    CFAbsoluteTime callbacksStart = CFAbsoluteTimeGetCurrent();
+    void* outerTimings = pthread_getspecific(currentTimingsKey());
+    pthread_setspecific(currentTimingsKey(), &_timings);
+    [[self retain] autorelease];    // callbacks may release the last reference to me
+    [self cancelHedge];
+
     // Give my owning resource a chance to interpret the error:
     if (_resource)
         error = [_resource operation: self willCompleteWithError: error];
@@ -348,12 +701,40 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
         onComplete();
     
     [_resource operationDidComplete: self];
+
+    pthread_setspecific(currentTimingsKey(), outerTimings);
+    CFAbsoluteTime end = CFAbsoluteTimeGetCurrent();
+    _timings.callbacks = MAX(end - callbacksStart - _timings.parse, 0.0);
+    _timings.total = end - _createdAt;
+    if (gRESTCollectMetrics)
+        [[RESTMetrics sharedMetrics] recordOperation: self];
 }
 
 
 - (void) cancel {
     if (_state == kRESTObjectLoading || _state == kRESTObjectUnloaded) {
         [_connection cancel];
+        [self cancelHedge];
+        [_tapePlayer cancel];
+        if (_queued) {
+            _queued = NO;
+            if ([_scheduler removeQueuedOperation: self]) {
+                [_scheduler release];   // never got a slot, so don't give one back
+                _scheduler = nil;
+            }
+        }
+        [NSObject cancelPreviousPerformRequestsWithTarget: self
+                                                 selector: @selector(rejectedByCircuitBreaker)
+                                                   object: nil];
+        if (_backend) {
+            [NSObject cancelPreviousPerformRequestsWithTarget: self
+                                                     selector: @selector(sendToBackend)
+                                                       object: nil];
+            if ([_backend respondsToSelector: @selector(cancelOperation:)])
+                [_backend cancelOperation: self];
+            [_backend release];
+            _backend = nil;
+        }
         [self completedWithError: [NSError errorWithDomain: NSURLErrorDomain
                                                       code: NSURLErrorCancelled
                                                   userInfo: nil]];
@@ -389,13 +770,26 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 }
 
 
+// Creates my response body the first time it's asked for; doesn't wait.
+- (RESTBody*) cachedResponseBody {
+    if (!_responseBody) {
+        NSDictionary* headers = [RESTBody entityHeadersFrom: _response.allHeaderFields];
+        if (_responseObject)
+            _responseBody = [[RESTBody alloc] initWithJSONObject: _responseObject
+                                                         headers: headers
+                                                        resource: _resource];
+        else if (_body)
+            _responseBody = [[RESTBody alloc] initWithContent: _body
+                                                      headers: headers
+                                                     resource: _resource];
+    }
+    return _responseBody;
+}
+
+
 - (RESTBody*) responseBody {
     [self wait]; // block till loaded
-    if (!_body)
-        return nil;
-    return [[[RESTBody alloc] initWithContent: _body 
-                                  headers: [RESTBody entityHeadersFrom: _response.allHeaderFields]
-                                 resource: _resource] autorelease];
+    return self.cachedResponseBody;
 }
 
 
@@ -418,8 +812,15 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 
 
 - (void)connection: (NSURLConnection*)connection didReceiveResponse: (NSURLResponse*)response {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self
+                                             selector: @selector(sendHedge)
+                                               object: nil];
+    if (_hedgeConnection)
+        [self resolveHedgeKeeping: connection];   // first response wins
     NSAssert(!_response, @"Got two responses?");
     _response = (NSHTTPURLResponse*) [response retain];
+    _respondedAt = CFAbsoluteTimeGetCurrent();
+    _timings.firstByte = _respondedAt - _sentAt;
     // Don't check for HTTP error status yet; wait till response body is received since it may
     // contain detailed error info from the server.
 }
@@ -430,11 +831,26 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
         _body = [data mutableCopy];
     else
         [_body appendData: data];
+    // The body stays in memory as long as I do, so it counts against the memory budget:
+    _budgetedBytes += data.length;
+    [[RESTMemoryBudget sharedBudget] addBufferedBytes: data.length];
+}
+
+
+- (void) releaseBody {
+    [_body release];
+    _body = nil;
+    if (_budgetedBytes) {
+        [[RESTMemoryBudget sharedBudget] addBufferedBytes: -(SInt64)_budgetedBytes];
+        _budgetedBytes = 0;
+    }
 }
 
 
 - (void)connectionDidFinishLoading: (NSURLConnection*)connection {
     int httpStatus = (int) [_response statusCode];
+    _timings.transfer = CFAbsoluteTimeGetCurrent() - _respondedAt;
+    _timings.responseBytes = _body.length;
 
     if (gRESTLogLevel >= kRESTLogRequestURLs) {
         NSLog(@"REST: << %ld for %@ %@ (%lu bytes)",
@@ -446,6 +862,12 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
         }
     }
 
+    if (_connection) {
+        RESTTape* tape = [RESTTape activeTape];
+        if (tape.isRecording)
+            [tape recordOperation: self response: _response body: _body error: nil];
+    }
+
     if (httpStatus < 300) {
         [self completedWithError: nil];
     } else {
@@ -474,6 +896,17 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 
 
 - (void)connection: (NSURLConnection*)connection didFailWithError: (NSError*)error {
+    if (_hedgeConnection) {
+        // One of two racing requests failed; carry on with the other:
+        [self resolveHedgeKeeping: (connection == _hedgeConnection) ? _connection
+                                                                     : _hedgeConnection];
+        return;
+    }
+    if (_connection) {
+        RESTTape* tape = [RESTTape activeTape];
+        if (tape.isRecording)
+            [tape recordOperation: self response: nil body: nil error: error];
+    }
     [self completedWithError: error];
 }
 
@@ -519,3 +952,46 @@ RESTLogLevel gRESTLogLevel = kRESTLogNothing;
 
 
 @end
+
+
+
+#pragma mark -
+#pragma mark BACKEND:
+
+
+@implementation RESTOperation (RESTBackend)
+
+
++ (NSArray*) backendRunLoopModes {
+    return [NSArray arrayWithObjects: NSRunLoopCommonModes, kRESTObjectRunLoopMode, nil];
+}
+
+
+- (void) sendToBackend {
+    if (_state == kRESTObjectLoading && _backend)
+        [_backend handleOperation: self];
+}
+
+
+- (void) backendRespondedWithStatus: (int)status
+                            headers: (NSDictionary*)headers
+                             object: (id)object
+                               data: (NSData*)data
+{
+    if (_state != kRESTObjectLoading || !_backend)
+        return;     // cancelled
+    NSAssert(!_response, @"Backend responded twice to %@", self);
+    _response = [[NSHTTPURLResponse alloc] initWithURL: _request.URL
+                                            statusCode: status
+                                           HTTPVersion: @"HTTP/1.1"
+                                          headerFields: headers ?: [NSDictionary dictionary]];
+    _respondedAt = CFAbsoluteTimeGetCurrent();
+    _timings.firstByte = _respondedAt - _sentAt;
+    _responseObject = [object retain];
+    if (!object && data.length)
+        _body = [data mutableCopy];
+    [self connectionDidFinishLoading: nil];
+}
+
+
+@end
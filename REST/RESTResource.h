@@ -14,8 +14,8 @@
 //  and limitations under the License.
 
 #import <Foundation/Foundation.h>
-@class RESTCache, RESTOperation;
-@protocol RESTResourceDelegate;
+@class RESTCache, RESTOperation, RESTRetryPolicy, RESTScheduler;
+@protocol RESTResourceDelegate, RESTBackend;
 
 
 /** Represents an HTTP resource identified by a specific URL.
@@ -34,9 +34,16 @@
     NSString* _eTag;
     NSString* _lastModified;
     NSURL* _cachedURL;
+    NSURL* _memoURL;
+    NSString* _memoAuthorization;
+    unsigned _memoURLGeneration, _memoAuthGeneration;
     
     NSURLCredential* _credential;
     NSURLProtectionSpace* _protectionSpace;
+    id<RESTBackend> _backend;
+    RESTRetryPolicy* _retryPolicy;
+    RESTScheduler* _scheduler;
+    BOOL _coalescesGETs;
 }
 
 /** Creates an instance with an absolute URL and no parent. */
@@ -66,6 +73,18 @@
 /** Sets a protection space for operations on this resource. */
 - (void) setProtectionSpace: (NSURLProtectionSpace*)protectionSpace;
 
+/** An in-process backend that will handle the operations of this resource and its children, instead of the URL loading system. (See RESTBackend.h.) If nil, the parent's backend is used, if any. */
+@property (retain) id<RESTBackend> backend;
+
+/** Decides how operations on this resource and its children are retried, circuit-broken and hedged. (See RESTRetryPolicy.h.) If not set, the parent's policy is used; at the root, +[RESTRetryPolicy sharedPolicy]. */
+@property (retain) RESTRetryPolicy* retryPolicy;
+
+/** Queues and prioritizes the HTTP requests of this resource and its children. (See RESTScheduler.h.) If not set, the parent's scheduler is used; at the root, +[RESTScheduler sharedScheduler]. */
+@property (retain) RESTScheduler* scheduler;
+
+/** If set to YES, a GET of this resource or its children that's identical (same URL and headers) to one already in flight on the same thread doesn't send a request of its own: it waits for the other one and completes with the same response. Each operation still has its own completion blocks and resultObject. Defaults to NO, and is ignored while a RESTTape is active. */
+@property BOOL coalescesGETs;
+
 #pragma mark HTTP METHODS:
 
 /** Starts an asynchronous HTTP GET operation, with no parameters.
@@ -18,6 +18,8 @@
 #import "RESTInternal.h"
 #import "RESTCache.h"
 #import "RESTBase64.h"
+#import "RESTBackend.h"
+#import <libkern/OSAtomic.h>
 
 
 @implementation RESTResource
@@ -60,10 +62,15 @@
     [_activeOperations release];
     [_credential release];
     [_protectionSpace release];
+    [_backend release];
+    [_retryPolicy release];
+    [_scheduler release];
     [_eTag release];
     [_lastModified release];
     [_url release];
     [_cachedURL release];
+    [_memoURL release];
+    [_memoAuthorization release];
     [_relativePath release];
     [_parent release];
     [super dealloc];
@@ -86,13 +93,42 @@
 }
 
 
+// Bumped whenever a resource's URL changes in a way that could affect other resources' URLs,
+// which invalidates every resource's memoized URL. (This happens very rarely.) URLs are read on
+// operations' threads too, so it's changed atomically, and a memo is tagged with the generation
+// read before computing it, so a change made meanwhile still invalidates it.
+static volatile int32_t sURLGeneration = 1;
+
+static inline unsigned currentURLGeneration(void) {
+    OSMemoryBarrier();
+    return (unsigned)sURLGeneration;
+}
+
+
 - (NSURL*) URL {
     if (_url)
         return _url;
-    else if (_relativePath)
-        return [_parent.URL URLByAppendingPathComponent: _relativePath];
-    else
+    unsigned generation = currentURLGeneration();
+    NSURL* memo = _memoURL;
+    if (memo && _memoURLGeneration == generation)
+        return memo;
+    NSURL* url = [self URLWithParentURL: _parent.URL];
+    if (url) {
+        @synchronized(self) {
+            [_memoURL autorelease];     // another thread may be returning it
+            _memoURL = [url retain];
+            _memoURLGeneration = generation;
+        }
+    }
+    return url;
+}
+
+
+// Computes my URL from my parent's. Subclasses with unusual relative paths can override this.
+- (NSURL*) URLWithParentURL: (NSURL*)parentURL {
+    if (!_relativePath)
         return nil;
+    return [parentURL URLByAppendingPathComponent: _relativePath];
 }
 
 
@@ -101,6 +137,7 @@
     NSAssert(!_parent, @"Can only change URL of root");
     [_url autorelease];
     _url = [url retain];
+    OSAtomicIncrement32Barrier(&sURLGeneration);     // all my descendants' URLs have changed
 }
 
 
@@ -108,6 +145,33 @@
     NSParameterAssert(relativePath);
     NSAssert(!_relativePath, @"Already has relativePath %@", _relativePath);
     _relativePath = [relativePath copy];
+    // Until now neither I nor any descendant had a URL, so there's nothing else to invalidate.
+    [_memoURL release];
+    _memoURL = nil;
+}
+
+
+// The value of the "Authorization:" header implied by a username and password in my URL, or nil.
+- (NSString*) basicAuthorization {
+    unsigned generation = currentURLGeneration();
+    NSString* authorization = _memoAuthorization;
+    if (!authorization || _memoAuthGeneration != generation) {
+        authorization = (NSString*)[NSNull null];
+        NSURL* url = self.URL;
+        NSString* username = url.user;
+        NSString* password = url.password;
+        if (username && password) {
+            NSString *creds = [NSString stringWithFormat:@"%@:%@", username, password];
+            creds = [RESTBase64 encode: [creds dataUsingEncoding:NSUTF8StringEncoding]];
+            authorization = [NSString stringWithFormat:@"Basic %@", creds];
+        }
+        @synchronized(self) {
+            [_memoAuthorization autorelease];
+            _memoAuthorization = [authorization retain];
+            _memoAuthGeneration = generation;
+        }
+    }
+    return (id)authorization != [NSNull null] ? authorization : nil;
 }
 
 
@@ -122,11 +186,55 @@
 #pragma mark HTTP METHODS:
 
 
+// Characters that can appear in a query value without being percent-escaped: the same set that
+// CFURLCreateStringByAddingPercentEscapes leaves alone, minus "&" (which would end the value.)
+static BOOL sQueryCharOK[128];
+
+static void initQueryCharTable(void) {
+    static const char* const kOK = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+                                   "-_.!~*'()$+,/:;=?@";
+    for (const char* c = kOK; *c; ++c)
+        sQueryCharOK[(unsigned char)*c] = YES;
+}
+
+
+// Appends a query value, percent-escaping it if necessary. Most values (numbers, IDs, booleans)
+// need no escaping, and are appended without going through CFURL.
+static void appendQueryValue(NSMutableString* queries, NSString* value) {
+    CFStringRef str = (CFStringRef)value;
+    CFIndex length = CFStringGetLength(str);
+    CFStringInlineBuffer buffer;
+    CFStringInitInlineBuffer(str, &buffer, CFRangeMake(0, length));
+    CFIndex i;
+    for (i = 0; i < length; ++i) {
+        UniChar c = CFStringGetCharacterFromInlineBuffer(&buffer, i);
+        if (c >= 128 || !sQueryCharOK[c])
+            break;
+    }
+    if (i == length) {
+        [queries appendString: value];
+    } else {
+        CFStringRef escaped = CFURLCreateStringByAddingPercentEscapes(NULL, str, NULL,
+                                                                      (CFStringRef)@"&",
+                                                                      kCFStringEncodingUTF8);
+        [queries appendString: (id)escaped];
+        CFRelease(escaped);
+    }
+}
+
+
+static NSString* parameterString(id value) {
+    if ([value isKindOfClass: [NSString class]])
+        return value;
+    return [value description];
+}
+
+
 - (NSMutableURLRequest*) requestWithMethod: (NSString*)method
                                 parameters: (NSDictionary*)parameters
 {
-    NSMutableString* queries = nil;
-    BOOL firstQuery;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{initQueryCharTable();});
 
     NSURL* url = self.URL;
     NSAssert1(url, @"Resource has no URL: %@", self);
@@ -134,45 +242,36 @@
     request.HTTPMethod = method;
     request.cachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
 
+    NSMutableString* queries = nil;
     for (NSString* key in parameters) {
-        NSString* value = [[parameters objectForKey: key] description];
+        NSString* value = parameterString([parameters objectForKey: key]);
         if ([key hasPrefix: @"?"]) {
             if (!queries) {
-                queries = [NSMutableString string];
-                firstQuery = (url.query.length == 0);
-            }
-            if (firstQuery) {
-                [queries appendString: key];  // already includes leading '?'
-                firstQuery = NO;
+                queries = [NSMutableString stringWithString: url.absoluteString];
+                if (url.query.length == 0)
+                    [queries appendString: key];  // already includes leading '?'
+                else {
+                    [queries appendString: @"&"];
+                    [queries appendString: [key substringFromIndex: 1]];
+                }
             } else {
                 [queries appendString: @"&"];
                 [queries appendString: [key substringFromIndex: 1]];
             }
             [queries appendString: @"="];
-            CFStringRef escaped = CFURLCreateStringByAddingPercentEscapes(NULL,
-                                                                          (CFStringRef)value,
-                                                                          NULL, (CFStringRef)@"&",
-                                                                          kCFStringEncodingUTF8);
-            [queries appendString: (id)escaped];
-            CFRelease(escaped);
+            appendQueryValue(queries, value);
         } else {
             [request setValue: value forHTTPHeaderField: key];
         }
     }
 
-    if (queries) {
-        NSString* urlStr = [url.absoluteString stringByAppendingString: queries];
-        request.URL = [NSURL URLWithString: urlStr];
-    }
+    if (queries)
+        request.URL = [NSURL URLWithString: queries];
 
     // if the URL contains basic-auth credentials, use them without waiting for 401 challenge
-    NSString* username = [request.URL user];
-    NSString* password = [request.URL password];
-    if (username && password) {
-        NSString *creds = [NSString stringWithFormat:@"%@:%@", username, password];
-        creds = [RESTBase64 encode: [creds dataUsingEncoding:NSUTF8StringEncoding]];
-        [request addValue:[NSString stringWithFormat:@"Basic %@", creds] forHTTPHeaderField:@"Authorization"];
-    }
+    NSString* authorization = self.basicAuthorization;
+    if (authorization)
+        [request addValue: authorization forHTTPHeaderField: @"Authorization"];
 
     return request;
 }
@@ -227,18 +326,25 @@
 }
 
 
+// Bottleneck for PUTs. At most one of body and object should be given; the object becomes the
+// operation's requestObject.
 - (RESTOperation*) PUT: (NSData*)body
-           parameters: (NSDictionary*)parameters
+                object: (id)object
+            parameters: (NSDictionary*)parameters
 {
+    RESTOperation* op;
     if (_relativePath) {
         NSMutableURLRequest* request = [self requestWithMethod: @"PUT" parameters: parameters];
         if (body)
             [request setHTTPBody:body];
-        return [self sendRequest: request];
+        op = [self sendRequest: request];
+        op.requestObject = object;
+        return op;
 
     } else {
         // If I have no URL yet, do a POST to my parent:
-        RESTOperation* op = [self.parent POST: body parameters: parameters];
+        op = [self.parent POST: body parameters: parameters];
+        op.requestObject = object;      // (must be set before -onCompletion: starts the op)
         [op onCompletion: ^{
             // ...then when done, use the Location: header of the result to generate my name/URL:
             if (!op.error) {
@@ -250,6 +356,13 @@
 }
 
 
+- (RESTOperation*) PUT: (NSData*)body
+           parameters: (NSDictionary*)parameters
+{
+    return [self PUT: body object: nil parameters: parameters];
+}
+
+
 static NSDictionary* addJSONType(NSDictionary* parameters) {
     if ([parameters objectForKey: @"Content-Type"])
         return parameters;
@@ -260,17 +373,19 @@ static NSDictionary* addJSONType(NSDictionary* parameters) {
 }
 
 
+// The JSON body isn't serialized here: the operation does that when it starts, unless it's
+// handled by a RESTBackend, which takes the object as-is.
 - (RESTOperation*) PUTJSON: (id)body parameters: (NSDictionary*)parameters {
-    return [self PUT: [RESTBody dataWithJSONObject: body]
-          parameters: addJSONType(parameters)];
+    return [self PUT: nil object: body parameters: addJSONType(parameters)];
 }
 
 
 - (RESTOperation*) POSTJSON: (id)body parameters: (NSDictionary*)parameters {
     NSMutableURLRequest* request = [self requestWithMethod: @"POST"
                                                 parameters: addJSONType(parameters)];
-    [request setHTTPBody: [RESTBody dataWithJSONObject: body]];
-    return [self sendRequest: request];
+    RESTOperation* op = [self sendRequest: request];
+    op.requestObject = body;
+    return op;
 }
 
 
@@ -379,4 +494,56 @@ static NSDictionary* addJSONType(NSDictionary* parameters) {
 }
 
 
+#pragma mark -
+#pragma mark BACKEND:
+
+
+@synthesize backend=_backend;
+
+
+- (id<RESTBackend>) backendForOperation: (RESTOperation*)op {
+    return _backend ? _backend : [_parent backendForOperation: op];
+}
+
+
+#pragma mark -
+#pragma mark RETRY POLICY & SCHEDULER:
+
+
+- (RESTRetryPolicy*) retryPolicy {
+    if (_retryPolicy)
+        return _retryPolicy;
+    return _parent ? _parent.retryPolicy : [RESTRetryPolicy sharedPolicy];
+}
+
+- (void) setRetryPolicy: (RESTRetryPolicy*)policy {
+    [_retryPolicy autorelease];
+    _retryPolicy = [policy retain];
+}
+
+
+@synthesize coalescesGETs=_coalescesGETs;
+
+
+- (BOOL) shouldCoalesceGETs {
+    for (RESTResource* r = self; r; r = r->_parent) {
+        if (r->_coalescesGETs)
+            return YES;
+    }
+    return NO;
+}
+
+
+- (RESTScheduler*) scheduler {
+    if (_scheduler)
+        return _scheduler;
+    return _parent ? _parent.scheduler : [RESTScheduler sharedScheduler];
+}
+
+- (void) setScheduler: (RESTScheduler*)scheduler {
+    [_scheduler autorelease];
+    _scheduler = [scheduler retain];
+}
+
+
 @end
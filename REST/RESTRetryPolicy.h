@@ -0,0 +1,150 @@
+//
+//  RESTRetryPolicy.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+@class RESTHistogram, RESTHostHealth;
+
+
+/** NSError userInfo key that's set (to YES) on errors of operations that were failed without being sent, because their host's circuit breaker was open. The error itself is NSURLErrorCannotConnectToHost in NSURLErrorDomain. */
+extern NSString* const RESTCircuitOpenErrorKey;
+
+
+/** States of a host's circuit breaker. */
+typedef enum {
+    kRESTCircuitClosed,     /**< Requests are sent normally */
+    kRESTCircuitOpen,       /**< The host is failing; requests fail immediately without being sent */
+    kRESTCircuitHalfOpen    /**< The open interval has passed; the next request is a trial */
+} RESTCircuitState;
+
+
+/** Decides when failed requests are retried, and how long to wait first; tracks the health of each host; and optionally hedges slow GETs.
+    - Retries use exponential backoff with random jitter, so that many clients (or many operations) that failed at the same moment don't all retry at the same moment.
+    - After a number of consecutive failed requests to a host, its circuit breaker opens, and requests to it fail immediately instead of piling up, until an interval has passed. Then one trial request is allowed through; if it succeeds the circuit closes again.
+    - If hedging is enabled, a GET that hasn't received a response by the time most GETs to that host have (the 95th percentile of their latency, by default) is sent a second time, and whichever response arrives first is used.
+    RESTOperations use the policy of their resource (see -[RESTResource retryPolicy]); by default that's +sharedPolicy. The change trackers use it for reconnecting. A policy is thread-safe. */
+@interface RESTRetryPolicy : NSObject
+{
+    @private
+    unsigned _maxRetries;
+    NSTimeInterval _baseDelay, _maxDelay;
+    double _jitter;
+    unsigned _failureThreshold;
+    NSTimeInterval _openInterval;
+    BOOL _hedgesGETs;
+    double _hedgePercentile, _maxHedgeRatio;
+    NSTimeInterval _minHedgeDelay;
+    unsigned _minHedgeSamples;
+    NSMutableDictionary* _hosts;
+}
+
+/** The policy used by resources that haven't been given one. */
++ (RESTRetryPolicy*) sharedPolicy;
+
+#pragma mark RETRIES:
+
+/** Maximum number of times a failed operation is retried. Defaults to 3. */
+@property unsigned maxRetries;
+
+/** Delay before the first retry; each later retry waits twice as long. Defaults to 0.5 sec. */
+@property NSTimeInterval baseDelay;
+
+/** Upper limit on the delay before a retry. Defaults to 30 sec. */
+@property NSTimeInterval maxDelay;
+
+/** The fraction of each delay that's randomized, from 0 (fixed delays) to 1 (anywhere from zero up to the full delay.) Defaults to 0.5. */
+@property double jitter;
+
+/** Returns YES if a request that failed with this error should be retried. Override point.
+    The default implementation retries NSURLErrorCannotConnectToHost for any request (it never reached the server, and the embedded server might not have finished [re]launching yet.) GET and HEAD requests are also retried after timeouts, dropped connections and HTTP 502, 503 and 504 statuses; other methods aren't, since the server may already have acted on them. Errors caused by an open circuit breaker are never retried. */
+- (BOOL) shouldRetryRequest: (NSURLRequest*)request afterError: (NSError*)error;
+
+/** The jittered delay before the given retry (1 for the first retry.) */
+- (NSTimeInterval) delayBeforeRetry: (unsigned)retryNumber;
+
+#pragma mark CIRCUIT BREAKING:
+
+/** Number of consecutive failures after which a host's circuit opens. Zero disables circuit breaking. Defaults to 5. */
+@property unsigned failureThreshold;
+
+/** How long an open circuit stays open before a trial request is let through. Defaults to 10 sec. */
+@property NSTimeInterval openInterval;
+
+/** Returns NO if requests to this URL's host should fail immediately because its circuit is open. If the open interval has passed, moves the circuit to half-open and returns YES for this one request. */
+- (BOOL) allowsRequestToURL: (NSURL*)url;
+
+/** Records the outcome of a request that reached (or tried to reach) a host.
+    A failure is an error below the HTTP level or a 5xx status; other HTTP errors mean the host is healthy.
+    @param error  The request's final error, or nil if it succeeded.
+    @param latency  Time from sending the request until the response headers arrived, if it succeeded. */
+- (void) recordResultForURL: (NSURL*)url error: (NSError*)error latency: (NSTimeInterval)latency;
+
+/** Returns a snapshot of the health of this URL's host, or nil if no requests to it have been recorded. */
+- (RESTHostHealth*) healthForURL: (NSURL*)url;
+
+/** Forgets all host health, closing every circuit. */
+- (void) reset;
+
+#pragma mark HEDGING:
+
+/** If YES, GET requests (that go over HTTP) may be hedged. Defaults to NO. */
+@property BOOL hedgesGETs;
+
+/** The percentile of a host's successful GET latencies after which a GET is hedged. Defaults to 95. */
+@property double hedgePercentile;
+
+/** Hedges are never sent sooner than this after the original request. Defaults to 0.05 sec. */
+@property NSTimeInterval minHedgeDelay;
+
+/** A host must have this many recorded latencies before its requests are hedged. Defaults to 20. */
+@property unsigned minHedgeSamples;
+
+/** Upper limit on hedges as a fraction of requests to a host, so that a host that's slow across the board doesn't get twice the load. Defaults to 0.1. */
+@property double maxHedgeRatio;
+
+/** How long to wait for a response to a GET to this URL before sending a hedge, or 0 if it shouldn't be hedged. */
+- (NSTimeInterval) hedgeDelayForURL: (NSURL*)url;
+
+/** Records that a hedge was sent, and whether its response beat the original's. */
+- (void) recordHedgeForURL: (NSURL*)url won: (BOOL)won;
+
+@end
+
+
+/** The health of one host (scheme, host name and port), as tracked by a RESTRetryPolicy. */
+@interface RESTHostHealth : NSObject <NSCopying>
+{
+    @private
+    NSString* _host;
+    RESTCircuitState _state;
+    unsigned _consecutiveFailures;
+    int64_t _successCount, _failureCount, _rejectedCount, _hedgeCount, _hedgeWinCount;
+    CFAbsoluteTime _openedAt;
+    RESTHistogram* _latency;
+}
+
+/** The host, in the form "http://example.com:5984". */
+@property (readonly) NSString* host;
+
+@property (readonly) RESTCircuitState state;
+@property (readonly) unsigned consecutiveFailures;
+@property (readonly) int64_t successCount;      /**< Requests that reached the host successfully */
+@property (readonly) int64_t failureCount;      /**< Requests that failed */
+@property (readonly) int64_t rejectedCount;     /**< Requests failed by the open circuit */
+@property (readonly) int64_t hedgeCount;        /**< Hedge requests sent */
+@property (readonly) int64_t hedgeWinCount;     /**< Hedges that responded before the original */
+
+/** Latencies of successful requests, until the response headers arrived. */
+@property (readonly) RESTHistogram* latency;
+
+@end
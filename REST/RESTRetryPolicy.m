@@ -0,0 +1,299 @@
+//
+//  RESTRetryPolicy.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "RESTRetryPolicy.h"
+#import "RESTMetrics.h"
+#import "RESTInternal.h"
+
+
+NSString* const RESTCircuitOpenErrorKey = @"RESTCircuitOpen";
+
+
+// Past this many distinct hosts, healthy ones are forgotten to make room for new ones.
+static const NSUInteger kMaxHosts = 64;
+
+
+@interface RESTHostHealth ()
+- (id) initWithHost: (NSString*)host;
+@end
+
+
+// Is this an error that says something is wrong with the host (as opposed to the request)?
+static BOOL isHostFailure(NSError* error) {
+    if ([error.domain isEqualToString: NSURLErrorDomain])
+        return error.code != NSURLErrorCancelled
+            && ![[error.userInfo objectForKey: RESTCircuitOpenErrorKey] boolValue];
+    if ([error.domain isEqualToString: CouchHTTPErrorDomain])
+        return error.code >= 500;
+    return NO;
+}
+
+
+@implementation RESTRetryPolicy
+
+
++ (RESTRetryPolicy*) sharedPolicy {
+    static RESTRetryPolicy* sShared;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sShared = [[self alloc] init];
+    });
+    return sShared;
+}
+
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _maxRetries = 3;
+        _baseDelay = 0.5;
+        _maxDelay = 30.0;
+        _jitter = 0.5;
+        _failureThreshold = 5;
+        _openInterval = 10.0;
+        _hedgePercentile = 95.0;
+        _minHedgeDelay = 0.05;
+        _minHedgeSamples = 20;
+        _maxHedgeRatio = 0.1;
+        _hosts = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_hosts release];
+    [super dealloc];
+}
+
+
+@synthesize maxRetries=_maxRetries, baseDelay=_baseDelay, maxDelay=_maxDelay, jitter=_jitter,
+            failureThreshold=_failureThreshold, openInterval=_openInterval,
+            hedgesGETs=_hedgesGETs, hedgePercentile=_hedgePercentile,
+            minHedgeDelay=_minHedgeDelay, minHedgeSamples=_minHedgeSamples,
+            maxHedgeRatio=_maxHedgeRatio;
+
+
+#pragma mark - RETRIES:
+
+
+- (BOOL) shouldRetryRequest: (NSURLRequest*)request afterError: (NSError*)error {
+    if (!error || [[error.userInfo objectForKey: RESTCircuitOpenErrorKey] boolValue])
+        return NO;
+    NSString* domain = error.domain;
+    NSInteger code = error.code;
+    if ([domain isEqualToString: NSURLErrorDomain] && code == NSURLErrorCannotConnectToHost)
+        return YES;
+    NSString* method = request.HTTPMethod;
+    if (!([method isEqualToString: @"GET"] || [method isEqualToString: @"HEAD"]))
+        return NO;
+    if ([domain isEqualToString: NSURLErrorDomain])
+        return code == NSURLErrorTimedOut || code == NSURLErrorNetworkConnectionLost;
+    if ([domain isEqualToString: CouchHTTPErrorDomain])
+        return code == 502 || code == 503 || code == 504;
+    return NO;
+}
+
+
+- (NSTimeInterval) delayBeforeRetry: (unsigned)retryNumber {
+    NSTimeInterval delay = _baseDelay * pow(2.0, MAX(retryNumber, 1u) - 1);
+    delay = MIN(delay, _maxDelay);
+    double jitter = MAX(0.0, MIN(_jitter, 1.0));
+    double random = arc4random() / (double)UINT32_MAX;
+    return delay * (1.0 - jitter) + delay * jitter * random;
+}
+
+
+#pragma mark - HOST HEALTH:
+
+
+// Must be called while synchronized.
+- (RESTHostHealth*) liveHealthForKey: (NSString*)key create: (BOOL)create {
+    RESTHostHealth* health = [_hosts objectForKey: key];
+    if (!health && create) {
+        if (_hosts.count >= kMaxHosts) {
+            // Make room by forgetting hosts whose circuits are closed:
+            for (NSString* oldKey in _hosts.allKeys) {
+                RESTHostHealth* old = [_hosts objectForKey: oldKey];
+                if (old->_state == kRESTCircuitClosed && old->_consecutiveFailures == 0)
+                    [_hosts removeObjectForKey: oldKey];
+            }
+        }
+        health = [[RESTHostHealth alloc] initWithHost: key];
+        [_hosts setObject: health forKey: key];
+        [health release];
+    }
+    return health;
+}
+
+
+- (BOOL) allowsRequestToURL: (NSURL*)url {
+    NSString* key = RESTHostKey(url);
+    if (!key)
+        return YES;
+    @synchronized(self) {
+        RESTHostHealth* health = [self liveHealthForKey: key create: NO];
+        if (!health || health->_state == kRESTCircuitClosed)
+            return YES;
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        if (now - health->_openedAt >= _openInterval) {
+            // Let one trial request through. (If it never reports back, another is allowed
+            // after the next interval.)
+            health->_state = kRESTCircuitHalfOpen;
+            health->_openedAt = now;
+            return YES;
+        }
+        ++health->_rejectedCount;
+        return NO;
+    }
+}
+
+
+- (void) recordResultForURL: (NSURL*)url error: (NSError*)error latency: (NSTimeInterval)latency {
+    if ([error.domain isEqualToString: NSURLErrorDomain] && error.code == NSURLErrorCancelled)
+        return;
+    NSString* key = RESTHostKey(url);
+    if (!key)
+        return;
+    @synchronized(self) {
+        RESTHostHealth* health = [self liveHealthForKey: key create: YES];
+        if (isHostFailure(error)) {
+            ++health->_failureCount;
+            ++health->_consecutiveFailures;
+            if (health->_state == kRESTCircuitHalfOpen
+                    || (health->_state == kRESTCircuitClosed && _failureThreshold > 0
+                                && health->_consecutiveFailures >= _failureThreshold)) {
+                if (gRESTLogLevel >= kRESTLogRequestURLs)
+                    NSLog(@"REST: Circuit to %@ opened after %u failures",
+                          key, health->_consecutiveFailures);
+                health->_state = kRESTCircuitOpen;
+                health->_openedAt = CFAbsoluteTimeGetCurrent();
+            }
+        } else {
+            ++health->_successCount;
+            health->_consecutiveFailures = 0;
+            health->_state = kRESTCircuitClosed;
+            if (latency > 0.0)
+                [health->_latency recordTime: latency];
+        }
+    }
+}
+
+
+- (RESTHostHealth*) healthForURL: (NSURL*)url {
+    NSString* key = RESTHostKey(url);
+    if (!key)
+        return nil;
+    @synchronized(self) {
+        return [[[self liveHealthForKey: key create: NO] copy] autorelease];
+    }
+}
+
+
+- (void) reset {
+    @synchronized(self) {
+        [_hosts removeAllObjects];
+    }
+}
+
+
+#pragma mark - HEDGING:
+
+
+- (NSTimeInterval) hedgeDelayForURL: (NSURL*)url {
+    if (!_hedgesGETs)
+        return 0.0;
+    NSString* key = RESTHostKey(url);
+    if (!key)
+        return 0.0;
+    @synchronized(self) {
+        RESTHostHealth* health = [self liveHealthForKey: key create: NO];
+        if (!health || health->_state != kRESTCircuitClosed
+                    || health->_latency.count < _minHedgeSamples)
+            return 0.0;
+        int64_t requests = health->_successCount + health->_failureCount;
+        if (health->_hedgeCount + 1 > _maxHedgeRatio * requests)
+            return 0.0;
+        return MAX([health->_latency valueAtPercentile: _hedgePercentile], _minHedgeDelay);
+    }
+}
+
+
+- (void) recordHedgeForURL: (NSURL*)url won: (BOOL)won {
+    NSString* key = RESTHostKey(url);
+    if (!key)
+        return;
+    @synchronized(self) {
+        RESTHostHealth* health = [self liveHealthForKey: key create: YES];
+        ++health->_hedgeCount;
+        if (won)
+            ++health->_hedgeWinCount;
+    }
+}
+
+
+@end
+
+
+
+
+@implementation RESTHostHealth
+
+
+- (id) initWithHost: (NSString*)host {
+    self = [super init];
+    if (self) {
+        _host = [host copy];
+        _latency = [[RESTHistogram alloc] init];
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_host release];
+    [_latency release];
+    [super dealloc];
+}
+
+
+@synthesize host=_host, state=_state, consecutiveFailures=_consecutiveFailures,
+            successCount=_successCount, failureCount=_failureCount, rejectedCount=_rejectedCount,
+            hedgeCount=_hedgeCount, hedgeWinCount=_hedgeWinCount, latency=_latency;
+
+
+- (id) copyWithZone: (NSZone*)zone {
+    RESTHostHealth* copy = [[[self class] alloc] initWithHost: _host];
+    copy->_state = _state;
+    copy->_consecutiveFailures = _consecutiveFailures;
+    copy->_successCount = _successCount;
+    copy->_failureCount = _failureCount;
+    copy->_rejectedCount = _rejectedCount;
+    copy->_hedgeCount = _hedgeCount;
+    copy->_hedgeWinCount = _hedgeWinCount;
+    copy->_openedAt = _openedAt;
+    [copy->_latency addHistogram: _latency];
+    return copy;
+}
+
+
+- (NSString*) description {
+    static const char* const kStateNames[3] = {"closed", "open", "half-open"};
+    return [NSString stringWithFormat: @"%@[%@ %s, %lld ok, %lld failed, %lld hedged]",
+            [self class], _host, kStateNames[_state],
+            _successCount, _failureCount, _hedgeCount];
+}
+
+
+@end
@@ -0,0 +1,60 @@
+//
+//  RESTScheduler.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "RESTOperation.h"
+@class RESTHistogram;
+
+
+/** Limits how many RESTOperations are in flight to each host at once, and decides which queued operation goes next when one finishes.
+    Each operation has a priority (see -[RESTOperation priority]). When a slot frees up, the highest-priority queued operation to that host is sent, except that a lower priority class that has been passed over several times in a row gets the next turn, so a steady stream of interactive requests can't starve a background upload. Background operations are further limited to a subset of the slots, so there is always room for an interactive request to start right away.
+    An operation that's blocked on with -wait while still queued is promoted to interactive, since something is waiting for it.
+    Operations handled by a RESTBackend or a replaying RESTTape, and ones with priority kRESTPriorityUnscheduled, bypass the scheduler. A queued operation is sent on the thread that started it. A scheduler is thread-safe. */
+@interface RESTScheduler : NSObject
+{
+    @private
+    NSUInteger _maxInFlightPerHost, _maxBackgroundInFlightPerHost;
+    NSMutableDictionary* _hosts;
+    NSUInteger _queuedCount[kRESTPriorityUnscheduled], _maxQueuedCount[kRESTPriorityUnscheduled];
+    int64_t _dispatchCount[kRESTPriorityUnscheduled];
+    RESTHistogram* _waitTime[kRESTPriorityUnscheduled];
+}
+
+/** The scheduler used by resources that haven't been given one. */
++ (RESTScheduler*) sharedScheduler;
+
+/** Maximum number of operations in flight to one host. Zero means no limit. Defaults to 4. */
+@property NSUInteger maxInFlightPerHost;
+
+/** Maximum number of background-priority operations in flight to one host. Defaults to 2. */
+@property NSUInteger maxBackgroundInFlightPerHost;
+
+/** Number of operations of a priority currently waiting, to all hosts. */
+- (NSUInteger) queuedCountForPriority: (RESTPriority)priority;
+
+/** The largest number of operations of a priority that have been waiting at once. */
+- (NSUInteger) maxQueuedCountForPriority: (RESTPriority)priority;
+
+/** Number of operations of a priority that have been sent. */
+- (int64_t) dispatchCountForPriority: (RESTPriority)priority;
+
+/** A copy of the histogram of how long operations of a priority waited before being sent. (Operations that didn't have to wait are recorded as zero.) */
+- (RESTHistogram*) waitTimeForPriority: (RESTPriority)priority;
+
+/** Number of operations currently in flight to the given URL's host. */
+- (NSUInteger) inFlightCountForURL: (NSURL*)url;
+
+/** Clears the dispatch counts, maximum queue lengths and wait times. */
+- (void) resetMetrics;
+
+@end
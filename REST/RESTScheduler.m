@@ -0,0 +1,319 @@
+//
+//  RESTScheduler.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "RESTScheduler.h"
+#import "RESTMetrics.h"
+#import "RESTInternal.h"
+
+
+#define kNumPriorities kRESTPriorityUnscheduled
+
+// How many times in a row a priority class can be passed over before it gets the next turn.
+static const unsigned kMaxSkips[kNumPriorities] = {0, 4, 8};
+
+
+// An operation waiting for a slot.
+@interface RESTQueuedOperation : NSObject
+{
+    @public
+    RESTOperation* _op;
+    NSThread* _thread;
+    CFAbsoluteTime _queuedAt;
+}
+@end
+
+@implementation RESTQueuedOperation
+- (void) dealloc {
+    [_op release];
+    [_thread release];
+    [super dealloc];
+}
+@end
+
+
+// Per-host state.
+@interface RESTScheduledHost : NSObject
+{
+    @public
+    NSMutableArray* _queues[kNumPriorities];
+    NSUInteger _inFlight, _backgroundInFlight;
+    unsigned _skips[kNumPriorities];
+}
+@end
+
+@implementation RESTScheduledHost
+- (id) init {
+    self = [super init];
+    if (self) {
+        for (int p = 0; p < kNumPriorities; p++)
+            _queues[p] = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+- (void) dealloc {
+    for (int p = 0; p < kNumPriorities; p++)
+        [_queues[p] release];
+    [super dealloc];
+}
+@end
+
+
+@implementation RESTScheduler
+
+
++ (RESTScheduler*) sharedScheduler {
+    static RESTScheduler* sShared;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sShared = [[self alloc] init];
+    });
+    return sShared;
+}
+
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _maxInFlightPerHost = 4;
+        _maxBackgroundInFlightPerHost = 2;
+        _hosts = [[NSMutableDictionary alloc] init];
+        for (int p = 0; p < kNumPriorities; p++)
+            _waitTime[p] = [[RESTHistogram alloc] init];
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_hosts release];
+    for (int p = 0; p < kNumPriorities; p++)
+        [_waitTime[p] release];
+    [super dealloc];
+}
+
+
+@synthesize maxInFlightPerHost=_maxInFlightPerHost,
+            maxBackgroundInFlightPerHost=_maxBackgroundInFlightPerHost;
+
+
+static RESTPriority clampPriority(RESTPriority priority) {
+    return MIN(priority, kRESTPriorityBackground);
+}
+
+
+#pragma mark - SCHEDULING:
+
+
+// Must be called while synchronized.
+- (RESTScheduledHost*) hostForOperation: (RESTOperation*)op {
+    NSString* key = RESTHostKey(op.URL) ?: @"";
+    RESTScheduledHost* host = [_hosts objectForKey: key];
+    if (!host) {
+        host = [[RESTScheduledHost alloc] init];
+        [_hosts setObject: host forKey: key];
+        [host release];
+    }
+    return host;
+}
+
+
+// Can an operation of this priority take a slot right now?
+- (BOOL) host: (RESTScheduledHost*)host hasRoomFor: (RESTPriority)priority {
+    if (_maxInFlightPerHost > 0 && host->_inFlight >= _maxInFlightPerHost)
+        return NO;
+    if (priority == kRESTPriorityBackground && _maxBackgroundInFlightPerHost > 0
+            && host->_backgroundInFlight >= _maxBackgroundInFlightPerHost)
+        return NO;
+    return YES;
+}
+
+
+- (void) host: (RESTScheduledHost*)host takeSlotFor: (RESTPriority)priority
+       waited: (NSTimeInterval)waited
+{
+    ++host->_inFlight;
+    if (priority == kRESTPriorityBackground)
+        ++host->_backgroundInFlight;
+    ++_dispatchCount[priority];
+    [_waitTime[priority] recordTime: waited];
+}
+
+
+- (BOOL) admitOperation: (RESTOperation*)op {
+    RESTPriority priority = clampPriority(op.priority);
+    @synchronized(self) {
+        RESTScheduledHost* host = [self hostForOperation: op];
+        // Don't jump ahead of operations of the same or higher priority that are waiting:
+        BOOL othersWaiting = NO;
+        for (int p = 0; p <= (int)priority; p++)
+            othersWaiting = othersWaiting || host->_queues[p].count > 0;
+        if (!othersWaiting && [self host: host hasRoomFor: priority]) {
+            [self host: host takeSlotFor: priority waited: 0.0];
+            return YES;
+        }
+        RESTQueuedOperation* entry = [[RESTQueuedOperation alloc] init];
+        entry->_op = [op retain];
+        entry->_thread = [[NSThread currentThread] retain];
+        entry->_queuedAt = CFAbsoluteTimeGetCurrent();
+        [host->_queues[priority] addObject: entry];
+        [entry release];
+        _maxQueuedCount[priority] = MAX(_maxQueuedCount[priority], ++_queuedCount[priority]);
+        return NO;
+    }
+}
+
+
+// Picks the next queued operation to send to a host, if any can go now. Must be called while
+// synchronized.
+- (RESTQueuedOperation*) dequeueFromHost: (RESTScheduledHost*)host {
+    int chosen = -1;
+    // A lower priority that's been passed over too often goes first:
+    for (int p = kNumPriorities - 1; p > 0 && chosen < 0; p--) {
+        if (host->_queues[p].count > 0 && host->_skips[p] >= kMaxSkips[p]
+                                       && [self host: host hasRoomFor: p])
+            chosen = p;
+    }
+    for (int p = 0; p < kNumPriorities && chosen < 0; p++) {
+        if (host->_queues[p].count > 0 && [self host: host hasRoomFor: p])
+            chosen = p;
+    }
+    if (chosen < 0)
+        return nil;
+
+    host->_skips[chosen] = 0;
+    for (int p = chosen + 1; p < kNumPriorities; p++) {
+        if (host->_queues[p].count > 0)
+            ++host->_skips[p];
+    }
+    RESTQueuedOperation* entry = [[[host->_queues[chosen] objectAtIndex: 0] retain] autorelease];
+    [host->_queues[chosen] removeObjectAtIndex: 0];
+    --_queuedCount[chosen];
+    [self host: host takeSlotFor: chosen
+         waited: CFAbsoluteTimeGetCurrent() - entry->_queuedAt];
+    return entry;
+}
+
+
+- (void) operationFinished: (RESTOperation*)op {
+    RESTPriority priority = clampPriority(op.priority);
+    @synchronized(self) {
+        RESTScheduledHost* host = [self hostForOperation: op];
+        if (host->_inFlight > 0)
+            --host->_inFlight;
+        if (priority == kRESTPriorityBackground && host->_backgroundInFlight > 0)
+            --host->_backgroundInFlight;
+        RESTQueuedOperation* entry;
+        while (nil != (entry = [self dequeueFromHost: host])) {
+            // Send it on the thread that started it, never re-entrantly from here:
+            [entry->_op performSelector: @selector(dispatchFromScheduler)
+                               onThread: entry->_thread
+                             withObject: nil
+                          waitUntilDone: NO
+                                  modes: [RESTOperation backendRunLoopModes]];
+        }
+    }
+}
+
+
+// Must be called while synchronized.
+- (BOOL) host: (RESTScheduledHost*)host removeOperation: (RESTOperation*)op {
+    for (int p = 0; p < kNumPriorities; p++) {
+        NSMutableArray* queue = host->_queues[p];
+        NSUInteger n = queue.count;
+        for (NSUInteger i = 0; i < n; i++) {
+            if (((RESTQueuedOperation*)[queue objectAtIndex: i])->_op == op) {
+                [queue removeObjectAtIndex: i];
+                --_queuedCount[p];
+                return YES;
+            }
+        }
+    }
+    return NO;
+}
+
+
+- (BOOL) removeQueuedOperation: (RESTOperation*)op {
+    [[op retain] autorelease];      // the queue may hold the last reference
+    @synchronized(self) {
+        return [self host: [self hostForOperation: op] removeOperation: op];
+    }
+}
+
+
+- (void) operationChangedPriority: (RESTOperation*)op {
+    RESTPriority priority = clampPriority(op.priority);
+    @synchronized(self) {
+        RESTScheduledHost* host = [self hostForOperation: op];
+        RESTQueuedOperation* entry = nil;
+        for (int p = 0; p < kNumPriorities && !entry; p++) {
+            for (RESTQueuedOperation* e in host->_queues[p]) {
+                if (e->_op == op) {
+                    entry = [[e retain] autorelease];
+                    break;
+                }
+            }
+        }
+        if (!entry)
+            return;
+        [self host: host removeOperation: op];
+        [host->_queues[priority] addObject: entry];
+        _maxQueuedCount[priority] = MAX(_maxQueuedCount[priority], ++_queuedCount[priority]);
+    }
+}
+
+
+#pragma mark - METRICS:
+
+
+- (NSUInteger) queuedCountForPriority: (RESTPriority)priority {
+    @synchronized(self) {
+        return _queuedCount[clampPriority(priority)];
+    }
+}
+
+- (NSUInteger) maxQueuedCountForPriority: (RESTPriority)priority {
+    @synchronized(self) {
+        return _maxQueuedCount[clampPriority(priority)];
+    }
+}
+
+- (int64_t) dispatchCountForPriority: (RESTPriority)priority {
+    @synchronized(self) {
+        return _dispatchCount[clampPriority(priority)];
+    }
+}
+
+- (RESTHistogram*) waitTimeForPriority: (RESTPriority)priority {
+    return [[_waitTime[clampPriority(priority)] copy] autorelease];
+}
+
+- (NSUInteger) inFlightCountForURL: (NSURL*)url {
+    @synchronized(self) {
+        RESTScheduledHost* host = [_hosts objectForKey: RESTHostKey(url) ?: @""];
+        return host ? host->_inFlight : 0;
+    }
+}
+
+- (void) resetMetrics {
+    @synchronized(self) {
+        for (int p = 0; p < kNumPriorities; p++) {
+            _maxQueuedCount[p] = _queuedCount[p];
+            _dispatchCount[p] = 0;
+            [_waitTime[p] reset];
+        }
+    }
+}
+
+
+@end
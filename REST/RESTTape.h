@@ -0,0 +1,99 @@
+//
+//  RESTTape.h
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import <Foundation/Foundation.h>
+@class RESTTapeStream;
+
+
+/** Records the HTTP traffic of RESTOperations, and the raw bytes of change feeds, so they can be replayed later without a server.
+    While a tape is recording, requests go to the network as usual, and each exchange (request, response headers, body and timing) is saved on the tape. While a tape is replaying, every RESTOperation is answered from the tape instead of the network: the next recorded exchange with the same method and URL is played back, either as fast as possible or paced like the original traffic.
+    This makes performance runs reproducible, and lets the parsing, caching and model layers be benchmarked in isolation.
+    Only one tape can be active at a time. */
+@interface RESTTape : NSObject
+{
+    @private
+    NSMutableArray* _exchanges;
+    NSMutableDictionary* _streams;
+    NSMutableDictionary* _exchangeQueues, *_lastExchanges, *_streamQueues;
+    CFAbsoluteTime _startedAt;
+    double _replaySpeed;
+    int _mode;
+    NSUInteger _missCount;
+}
+
+/** Initializes an empty tape, ready to record. */
+- (id) init;
+
+/** Loads a tape previously saved by -writeToFile:error:. */
+- (id) initWithContentsOfFile: (NSString*)path error: (NSError**)outError;
+
+/** Saves the tape to a file, as a binary property list. */
+- (BOOL) writeToFile: (NSString*)path error: (NSError**)outError;
+
+/** The number of HTTP exchanges on the tape. */
+@property (readonly) NSUInteger exchangeCount;
+
+/** Replay pacing: 1.0 reproduces the recorded latencies, 2.0 plays twice as fast, and so on. The default, 0, replays everything as fast as possible (but still asynchronously.) */
+@property double replaySpeed;
+
+/** Makes this the active tape and starts recording onto it. Any previously active tape is stopped. */
+- (void) startRecording;
+
+/** Makes this the active tape and starts answering requests from it. Any previously active tape is stopped. */
+- (void) startReplaying;
+
+/** Stops recording or replaying. Operations already in progress are unaffected. */
+- (void) stop;
+
+/** The tape that is currently recording or replaying, if any. */
++ (RESTTape*) activeTape;
+
+@property (readonly) BOOL isRecording;
+@property (readonly) BOOL isReplaying;
+
+/** The number of requests made during replay that had no recorded exchange. These fail with NSURLErrorResourceUnavailable. */
+@property (readonly) NSUInteger missCount;
+
+
+/** Returns a new stream, to which the caller appends raw bytes read from a connection not managed by RESTOperation (such as a change feed), or nil if the tape isn't recording. */
+- (RESTTapeStream*) recordStreamNamed: (NSString*)name;
+
+/** Returns the next not-yet-replayed stream recorded under the given name, or nil if there isn't one or the tape isn't replaying. */
+- (RESTTapeStream*) replayStreamNamed: (NSString*)name;
+
+@end
+
+
+/** A sequence of timestamped data chunks, recorded or replayed by a RESTTape. */
+@interface RESTTapeStream : NSObject
+{
+    @private
+    RESTTape* _tape;
+    NSMutableArray* _chunks;
+    CFAbsoluteTime _startedAt;
+    double _speed;
+    NSUInteger _nextChunk;
+    void (^_onData)(NSData*);
+}
+
+/** Records a chunk of data, timestamped relative to the stream's creation. */
+- (void) appendData: (NSData*)data;
+
+/** Starts delivering the recorded chunks to the block, asynchronously on the current runloop, paced according to the tape's replaySpeed. */
+- (void) playWithBlock: (void (^)(NSData* data))onData;
+
+/** Stops recording or playing. */
+- (void) stop;
+
+@end
@@ -0,0 +1,511 @@
+//
+//  RESTTape.m
+//  CouchCocoa
+//
+//  Copyright 2012 Couchbase, Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "RESTTape.h"
+#import "RESTInternal.h"
+
+
+enum {
+    kTapeIdle,
+    kTapeRecording,
+    kTapeReplaying
+};
+
+static const int kTapeFormatVersion = 1;
+
+static RESTTape* sActiveTape;
+
+
+// Keys of an exchange dictionary:
+static NSString* const kMethodKey = @"method";
+static NSString* const kURLKey = @"url";
+static NSString* const kRequestHeadersKey = @"requestHeaders";
+static NSString* const kRequestBodyKey = @"requestBody";
+static NSString* const kStatusKey = @"status";
+static NSString* const kResponseHeadersKey = @"responseHeaders";
+static NSString* const kResponseBodyKey = @"responseBody";
+static NSString* const kErrorDomainKey = @"errorDomain";
+static NSString* const kErrorCodeKey = @"errorCode";
+static NSString* const kOffsetKey = @"offset";          // start time, relative to the tape's
+static NSString* const kFirstByteKey = @"firstByte";
+static NSString* const kTransferKey = @"transfer";
+
+// Keys of a stream chunk dictionary:
+static NSString* const kTimeKey = @"t";
+static NSString* const kDataKey = @"data";
+
+
+static NSString* exchangeKey(NSString* method, NSURL* url) {
+    return [NSString stringWithFormat: @"%@ %@", method, url.absoluteString];
+}
+
+static NSTimeInterval paced(NSTimeInterval delay, double speed) {
+    return speed > 0.0 ? MAX(delay, 0.0) / speed : 0.0;
+}
+
+
+/** Feeds a recorded exchange to a RESTOperation through its NSURLConnection delegate methods. */
+@interface RESTTapePlayer : NSObject
+{
+    @private
+    id _op;
+    NSDictionary* _exchange;
+    NSArray* _modes;
+    double _speed;
+}
+- (id) initWithOperation: (RESTOperation*)op
+                exchange: (NSDictionary*)exchange
+                   modes: (NSArray*)modes
+                   speed: (double)speed;
+- (void) cancel;
+@end
+
+
+@interface RESTTapeStream ()
+- (id) initWithTape: (RESTTape*)tape chunks: (NSMutableArray*)chunks;
+@end
+
+
+@implementation RESTTape
+
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        _exchanges = [[NSMutableArray alloc] init];
+        _streams = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+
+- (id) initWithContentsOfFile: (NSString*)path error: (NSError**)outError {
+    self = [self init];
+    if (self) {
+        NSData* data = [NSData dataWithContentsOfFile: path options: 0 error: outError];
+        NSDictionary* plist = nil;
+        if (data)
+            plist = $castIf(NSDictionary, [NSPropertyListSerialization propertyListWithData: data
+                                                                                   options: 0
+                                                                                    format: NULL
+                                                                                     error: outError]);
+        NSArray* exchanges = $castIf(NSArray, [plist objectForKey: @"exchanges"]);
+        NSDictionary* streams = $castIf(NSDictionary, [plist objectForKey: @"streams"]);
+        if (!exchanges || [[plist objectForKey: @"version"] intValue] != kTapeFormatVersion) {
+            if (data && outError && !*outError)
+                *outError = [NSError errorWithDomain: NSCocoaErrorDomain
+                                                code: NSFileReadCorruptFileError
+                                            userInfo: [NSDictionary dictionaryWithObject: path
+                                                                        forKey: NSFilePathErrorKey]];
+            [self release];
+            return nil;
+        }
+        [_exchanges addObjectsFromArray: exchanges];
+        for (NSString* name in streams) {
+            NSMutableArray* sessions = [NSMutableArray array];
+            for (NSArray* chunks in [streams objectForKey: name])
+                [sessions addObject: [[chunks mutableCopy] autorelease]];
+            [_streams setObject: sessions forKey: name];
+        }
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [_exchanges release];
+    [_streams release];
+    [_exchangeQueues release];
+    [_lastExchanges release];
+    [_streamQueues release];
+    [super dealloc];
+}
+
+
+- (BOOL) writeToFile: (NSString*)path error: (NSError**)outError {
+    NSData* data;
+    @synchronized(self) {
+        NSDictionary* plist = [NSDictionary dictionaryWithObjectsAndKeys:
+                               [NSNumber numberWithInt: kTapeFormatVersion], @"version",
+                               _exchanges, @"exchanges",
+                               _streams, @"streams",
+                               nil];
+        data = [NSPropertyListSerialization dataWithPropertyList: plist
+                                                          format: NSPropertyListBinaryFormat_v1_0
+                                                         options: 0
+                                                           error: outError];
+    }
+    return data && [data writeToFile: path options: NSDataWritingAtomic error: outError];
+}
+
+
+@synthesize replaySpeed=_replaySpeed, missCount=_missCount;
+
+
+- (NSUInteger) exchangeCount {
+    @synchronized(self) {
+        return _exchanges.count;
+    }
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%lu exchanges, %lu streams]",
+            [self class], (unsigned long)self.exchangeCount, (unsigned long)_streams.count];
+}
+
+
+#pragma mark - ACTIVATION:
+
+
++ (RESTTape*) activeTape {
+    @synchronized(self) {
+        return [[sActiveTape retain] autorelease];
+    }
+}
+
+
+- (void) activateWithMode: (int)mode {
+    @synchronized([RESTTape class]) {
+        if (sActiveTape != self) {
+            [sActiveTape stop];
+            sActiveTape = [self retain];
+        }
+    }
+    @synchronized(self) {
+        _mode = mode;
+        _startedAt = CFAbsoluteTimeGetCurrent();
+        _missCount = 0;
+        [_exchangeQueues release];
+        _exchangeQueues = nil;
+        [_lastExchanges release];
+        _lastExchanges = nil;
+        [_streamQueues release];
+        _streamQueues = nil;
+        if (mode == kTapeReplaying) {
+            // Index the exchanges so each request gets the next unplayed response for its URL:
+            _exchangeQueues = [[NSMutableDictionary alloc] init];
+            _lastExchanges = [[NSMutableDictionary alloc] init];
+            for (NSDictionary* exchange in _exchanges) {
+                NSString* key = exchangeKey([exchange objectForKey: kMethodKey],
+                                            [NSURL URLWithString: [exchange objectForKey: kURLKey]]);
+                NSMutableArray* queue = [_exchangeQueues objectForKey: key];
+                if (!queue) {
+                    queue = [NSMutableArray array];
+                    [_exchangeQueues setObject: queue forKey: key];
+                }
+                [queue addObject: exchange];
+            }
+            _streamQueues = [[NSMutableDictionary alloc] init];
+            for (NSString* name in _streams)
+                [_streamQueues setObject: [[[_streams objectForKey: name] mutableCopy] autorelease]
+                                  forKey: name];
+        }
+    }
+}
+
+
+- (void) startRecording {
+    [self activateWithMode: kTapeRecording];
+}
+
+
+- (void) startReplaying {
+    [self activateWithMode: kTapeReplaying];
+}
+
+
+- (void) stop {
+    @synchronized(self) {
+        _mode = kTapeIdle;
+    }
+    @synchronized([RESTTape class]) {
+        if (sActiveTape == self) {
+            sActiveTape = nil;
+            [self autorelease];
+        }
+    }
+}
+
+
+- (BOOL) isRecording {
+    return _mode == kTapeRecording;
+}
+
+
+- (BOOL) isReplaying {
+    return _mode == kTapeReplaying;
+}
+
+
+#pragma mark - EXCHANGES:
+
+
+- (void) recordOperation: (RESTOperation*)op
+                response: (NSHTTPURLResponse*)response
+                    body: (NSData*)body
+                   error: (NSError*)error
+{
+    NSURLRequest* request = op.request;
+    RESTOperationTimings timings = op.timings;
+    NSMutableDictionary* exchange = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                     request.HTTPMethod, kMethodKey,
+                                     request.URL.absoluteString, kURLKey,
+                                     [NSNumber numberWithDouble: timings.firstByte], kFirstByteKey,
+                                     [NSNumber numberWithDouble: timings.transfer], kTransferKey,
+                                     nil];
+    if (request.allHTTPHeaderFields.count)
+        [exchange setObject: request.allHTTPHeaderFields forKey: kRequestHeadersKey];
+    if (request.HTTPBody.length)
+        [exchange setObject: request.HTTPBody forKey: kRequestBodyKey];
+    if (response) {
+        [exchange setObject: [NSNumber numberWithInteger: response.statusCode] forKey: kStatusKey];
+        [exchange setObject: response.allHeaderFields forKey: kResponseHeadersKey];
+        if (body.length)
+            [exchange setObject: [[body copy] autorelease] forKey: kResponseBodyKey];
+    } else if (error) {
+        [exchange setObject: error.domain forKey: kErrorDomainKey];
+        [exchange setObject: [NSNumber numberWithInteger: error.code] forKey: kErrorCodeKey];
+    }
+    @synchronized(self) {
+        if (_mode != kTapeRecording)
+            return;
+        CFAbsoluteTime sentAt = CFAbsoluteTimeGetCurrent() - timings.firstByte - timings.transfer;
+        [exchange setObject: [NSNumber numberWithDouble: sentAt - _startedAt] forKey: kOffsetKey];
+        [_exchanges addObject: exchange];
+    }
+}
+
+
+- (id) playerForOperation: (RESTOperation*)op modes: (NSArray*)modes {
+    NSString* key = exchangeKey(op.method, op.URL);
+    NSDictionary* exchange;
+    @synchronized(self) {
+        NSMutableArray* queue = [_exchangeQueues objectForKey: key];
+        if (queue.count > 0) {
+            exchange = [[[queue objectAtIndex: 0] retain] autorelease];
+            [queue removeObjectAtIndex: 0];
+            [_lastExchanges setObject: exchange forKey: key];
+        } else {
+            // Once the recorded responses for a URL run out, keep repeating the last one:
+            exchange = [_lastExchanges objectForKey: key];
+            if (!exchange)
+                ++_missCount;
+        }
+    }
+    if (!exchange && gRESTLogLevel >= kRESTLogRequestURLs)
+        NSLog(@"REST: Tape has no recorded response for %@", key);
+    RESTTapePlayer* player = [[RESTTapePlayer alloc] initWithOperation: op
+                                                              exchange: exchange
+                                                                 modes: modes
+                                                                 speed: _replaySpeed];
+    return [player autorelease];
+}
+
+
+#pragma mark - STREAMS:
+
+
+- (RESTTapeStream*) recordStreamNamed: (NSString*)name {
+    NSMutableArray* chunks = [NSMutableArray array];
+    @synchronized(self) {
+        if (_mode != kTapeRecording)
+            return nil;
+        NSMutableArray* sessions = [_streams objectForKey: name];
+        if (!sessions) {
+            sessions = [NSMutableArray array];
+            [_streams setObject: sessions forKey: name];
+        }
+        [sessions addObject: chunks];
+    }
+    return [[[RESTTapeStream alloc] initWithTape: self chunks: chunks] autorelease];
+}
+
+
+- (RESTTapeStream*) replayStreamNamed: (NSString*)name {
+    NSMutableArray* chunks;
+    @synchronized(self) {
+        if (_mode != kTapeReplaying)
+            return nil;
+        NSMutableArray* sessions = [_streamQueues objectForKey: name];
+        if (sessions.count == 0)
+            return nil;
+        chunks = [[[sessions objectAtIndex: 0] retain] autorelease];
+        [sessions removeObjectAtIndex: 0];
+    }
+    return [[[RESTTapeStream alloc] initWithTape: self chunks: chunks] autorelease];
+}
+
+
+@end
+
+
+
+
+@implementation RESTTapeStream
+
+
+- (id) initWithTape: (RESTTape*)tape chunks: (NSMutableArray*)chunks {
+    self = [super init];
+    if (self) {
+        _tape = [tape retain];
+        _chunks = [chunks retain];
+        _startedAt = CFAbsoluteTimeGetCurrent();
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    [_tape release];
+    [_chunks release];
+    [_onData release];
+    [super dealloc];
+}
+
+
+- (void) appendData: (NSData*)data {
+    NSDictionary* chunk = [NSDictionary dictionaryWithObjectsAndKeys:
+                           [NSNumber numberWithDouble: CFAbsoluteTimeGetCurrent() - _startedAt], kTimeKey,
+                           [[data copy] autorelease], kDataKey,
+                           nil];
+    @synchronized(_tape) {
+        [_chunks addObject: chunk];
+    }
+}
+
+
+- (void) scheduleNextChunk {
+    if (_nextChunk >= _chunks.count)
+        return;
+    NSTimeInterval at = [[[_chunks objectAtIndex: _nextChunk] objectForKey: kTimeKey] doubleValue];
+    NSTimeInterval delay = paced(at, _speed) - (CFAbsoluteTimeGetCurrent() - _startedAt);
+    [self performSelector: @selector(playNextChunk) withObject: nil
+               afterDelay: MAX(delay, 0.0)
+                  inModes: [NSArray arrayWithObject: NSRunLoopCommonModes]];
+}
+
+
+- (void) playNextChunk {
+    NSData* data = [[_chunks objectAtIndex: _nextChunk++] objectForKey: kDataKey];
+    void (^onData)(NSData*) = [[_onData retain] autorelease];   // in case the block stops me
+    onData(data);
+    if (_onData)
+        [self scheduleNextChunk];
+}
+
+
+- (void) playWithBlock: (void (^)(NSData* data))onData {
+    NSParameterAssert(onData);
+    NSAssert(!_onData, @"Already playing");
+    _onData = [onData copy];
+    _speed = _tape.replaySpeed;
+    _startedAt = CFAbsoluteTimeGetCurrent();
+    _nextChunk = 0;
+    [self scheduleNextChunk];
+}
+
+
+- (void) stop {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    [_onData release];
+    _onData = nil;
+}
+
+
+@end
+
+
+
+
+@implementation RESTTapePlayer
+
+
+- (id) initWithOperation: (RESTOperation*)op
+                exchange: (NSDictionary*)exchange
+                   modes: (NSArray*)modes
+                   speed: (double)speed
+{
+    self = [super init];
+    if (self) {
+        _op = op;   // not retained; the operation owns me and cancels me when it's done
+        _exchange = [exchange retain];
+        _modes = [modes copy];
+        _speed = speed;
+        NSTimeInterval delay = paced([[exchange objectForKey: kFirstByteKey] doubleValue], speed);
+        [self performSelector: @selector(sendResponse) withObject: nil
+                   afterDelay: delay inModes: _modes];
+    }
+    return self;
+}
+
+
+- (void)dealloc {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    [_exchange release];
+    [_modes release];
+    [super dealloc];
+}
+
+
+- (void) cancel {
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    _op = nil;
+}
+
+
+- (void) sendResponse {
+    if (!_exchange || [_exchange objectForKey: kErrorDomainKey]) {
+        NSError* error;
+        if (_exchange) {
+            error = [NSError errorWithDomain: [_exchange objectForKey: kErrorDomainKey]
+                                        code: [[_exchange objectForKey: kErrorCodeKey] integerValue]
+                                    userInfo: nil];
+        } else {
+            NSURL* url = [_op URL];
+            NSString* message = [NSString stringWithFormat: @"No recorded response for %@ %@",
+                                 [_op method], url];
+            error = [NSError errorWithDomain: NSURLErrorDomain
+                                        code: NSURLErrorResourceUnavailable
+                                    userInfo: [NSDictionary dictionaryWithObjectsAndKeys:
+                                               message, NSLocalizedDescriptionKey,
+                                               url, NSURLErrorKey, nil]];
+        }
+        [_op connection: nil didFailWithError: error];
+        return;
+    }
+
+    NSHTTPURLResponse* response = [[NSHTTPURLResponse alloc]
+                                        initWithURL: [_op URL]
+                                         statusCode: [[_exchange objectForKey: kStatusKey] integerValue]
+                                        HTTPVersion: @"HTTP/1.1"
+                                       headerFields: [_exchange objectForKey: kResponseHeadersKey]];
+    [_op connection: nil didReceiveResponse: response];
+    [response release];
+
+    NSTimeInterval delay = paced([[_exchange objectForKey: kTransferKey] doubleValue], _speed);
+    [self performSelector: @selector(sendBody) withObject: nil afterDelay: delay inModes: _modes];
+}
+
+
+- (void) sendBody {
+    NSData* body = [_exchange objectForKey: kResponseBodyKey];
+    if (body)
+        [_op connection: nil didReceiveData: body];
+    [_op connectionDidFinishLoading: nil];
+}
+
+
+@end
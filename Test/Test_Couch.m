@@ -18,12 +18,65 @@
 #import "RESTInternal.h"
 #import "CouchTestCase.h"
 #import "CouchDatabase.h"
+#import "CouchReplicationProgress.h"
+#import "CouchChangeTracker.h"
+#import "CouchEventSourceParser.h"
+#import "CouchAttachmentReader.h"
+#import "CouchChangeMultiplexer.h"
+#import "CouchAutosaver.h"
 
 
 @interface Test_Couch : CouchTestCase
 @end
 
 
+// Change tracker client that just counts changes.
+@interface ChangeCounter : NSObject <CouchChangeTrackerClient>
+@property (readonly) NSUInteger count;
+@end
+
+@implementation ChangeCounter
+@synthesize count=_count;
+- (void) changeTrackerReceivedChange: (NSDictionary*)change {
+    ++_count;
+}
+@end
+
+
+// Replication that only pretends to run, for testing CouchReplicationScheduler.
+@interface FakeReplication : CouchReplication
+{
+    @public
+    BOOL _failsToStart;
+}
+- (void) setFakeMode: (CouchReplicationMode)mode;
+@end
+
+@implementation FakeReplication
+- (void) setFakeMode: (CouchReplicationMode)mode {
+    [self willChangeValueForKey: @"mode"];
+    _mode = mode;
+    [self didChangeValueForKey: @"mode"];
+}
+- (void) setFakeRunning: (BOOL)running {
+    [self willChangeValueForKey: @"running"];
+    _running = running;
+    [self didChangeValueForKey: @"running"];
+}
+- (RESTOperation*) start {
+    if (_failsToStart)
+        return nil;
+    [self setFakeRunning: YES];
+    [self setFakeMode: kCouchReplicationActive];
+    return nil;
+}
+- (void) stop {
+    [self setFakeMode: kCouchReplicationStopped];
+    [self setFakeRunning: NO];
+}
+@end
+
+
 @implementation Test_Couch
 
 
@@ -56,6 +109,55 @@
 }
 
 
+#pragma mark - PROPERTY STORAGE:
+
+
+- (void) test00_PropertyStore {
+    NSDictionary* props = @{@"_id": @"doc", @"_rev": @"1-abc", @"name": @"Bobby", @"grade": @6};
+    CouchPropertyStore* store = [[[CouchPropertyStore alloc] initWithProperties: props] autorelease];
+    STAssertEquals(store.properties, props, @"Immutable properties should not be copied");
+    STAssertEqualObjects(store.userProperties, (@{@"name": @"Bobby", @"grade": @6}), nil);
+    STAssertEqualObjects(store.systemProperties, (@{@"_id": @"doc", @"_rev": @"1-abc"}), nil);
+    STAssertEquals(store.userProperties, store.userProperties, @"User properties not cached");
+
+    NSDictionary* userOnly = @{@"name": @"Bobby"};
+    store = [[[CouchPropertyStore alloc] initWithProperties: userOnly] autorelease];
+    STAssertEquals(store.userProperties, userOnly, nil);
+}
+
+
+- (void) test00_PropertyOverlay {
+    NSDictionary* base = @{@"_id": @"doc", @"name": @"Bobby", @"grade": @6};
+    CouchPropertyOverlay* overlay = [CouchPropertyOverlay overlayWithBase: base];
+    STAssertEqualObjects(overlay, base, nil);
+    STAssertEquals(overlay.changeCount, (NSUInteger)0, nil);
+
+    [overlay setObject: @7 forKey: @"grade"];
+    [overlay setObject: @"Robert" forKey: @"nickname"];
+    [overlay removeObjectForKey: @"name"];
+    STAssertEquals(overlay.changeCount, (NSUInteger)3, nil);
+    STAssertEqualObjects(overlay, (@{@"_id": @"doc", @"grade": @7, @"nickname": @"Robert"}), nil);
+    STAssertEquals(overlay.count, (NSUInteger)3, nil);
+    STAssertEqualObjects(base, (@{@"_id": @"doc", @"name": @"Bobby", @"grade": @6}),
+                         @"Base was modified");
+
+    // Copies share the base and are frozen:
+    NSDictionary* frozen = [[overlay copy] autorelease];
+    STAssertEqualObjects(frozen, overlay, nil);
+    STAssertEquals([[frozen copy] autorelease], frozen, nil);
+    STAssertThrows([(NSMutableDictionary*)frozen setObject: @1 forKey: @"x"], nil);
+
+    NSMutableDictionary* mutable = [[frozen mutableCopy] autorelease];
+    [mutable setObject: @"Bobby" forKey: @"name"];
+    STAssertEquals(mutable.count, (NSUInteger)4, nil);
+    STAssertNil([frozen objectForKey: @"name"], nil);
+
+    // JSON round-trip:
+    NSData* json = [RESTBody dataWithJSONObject: mutable];
+    STAssertEqualObjects([RESTBody JSONObjectWithData: json], mutable, nil);
+}
+
+
 #pragma mark - SERVER & DOCUMENTS:
 
 
@@ -369,9 +471,138 @@
 }
 
 
+- (void) test08_AttachmentRanges {
+    CouchDocument* doc = [self createDocumentWithProperties: @{@"testName": @"testRanges"}];
+    NSMutableData* body = [NSMutableData dataWithLength: 100000];
+    uint8_t* bytes = body.mutableBytes;
+    for (NSUInteger i = 0; i < body.length; i++)
+        bytes[i] = (uint8_t)(i * 7 + i / 256);
+    CouchAttachment* attach = [doc.currentRevision createAttachmentWithName: @"data"
+                                                                       type: @"application/octet-stream"];
+    AssertWait([attach PUT: body]);
+    AssertWait([doc GET]);
+    attach = [doc.currentRevision attachmentNamed: @"data"];
+    STAssertNotNil(attach.digest, nil);
+
+    RESTOperation* op = AssertWait([attach GETRange: NSMakeRange(1000, 500)]);
+    STAssertEquals(op.httpStatus, 206, nil);
+    STAssertEqualObjects(op.resultObject, [body subdataWithRange: NSMakeRange(1000, 500)], nil);
+    STAssertEqualObjects([attach bodyInRange: NSMakeRange(99900, 1000)],
+                         [body subdataWithRange: NSMakeRange(99900, 100)], nil);
+
+    CouchAttachmentReader* reader = attach.reader;
+    reader.blockSize = 4096;
+    STAssertEquals(reader.length, (UInt64)body.length, nil);
+    NSError* error;
+    NSData* data = [reader readDataInRange: NSMakeRange(5000, 10000) error: &error];
+    STAssertEqualObjects(data, [body subdataWithRange: NSMakeRange(5000, 10000)], nil);
+    STAssertEquals(reader.fetchCount, (NSUInteger)1, @"Adjacent blocks should be one request");
+    STAssertTrue(reader.bytesFetched < 20000, nil);
+
+    // Reading inside what's been fetched doesn't fetch again:
+    data = [reader readDataInRange: NSMakeRange(6000, 100) error: &error];
+    STAssertEqualObjects(data, [body subdataWithRange: NSMakeRange(6000, 100)], nil);
+    STAssertEquals(reader.fetchCount, (NSUInteger)1, nil);
+
+    // A range overlapping the cached blocks only fetches the missing ones:
+    data = [reader readDataInRange: NSMakeRange(0, 20000) error: &error];
+    STAssertEqualObjects(data, [body subdataWithRange: NSMakeRange(0, 20000)], nil);
+    STAssertEquals(reader.fetchCount, (NSUInteger)3, nil);
+
+    // Streaming to the end, with a cache too small to hold it all:
+    reader.maxCachedBytes = 16384;
+    NSMutableData* streamed = [NSMutableData data];
+    STAssertTrue([reader streamDataInRange: NSMakeRange(30000, 1000000) error: &error
+                                   toBlock: ^(NSData* piece, BOOL* stop) {
+                                       [streamed appendData: piece];
+                                   }], @"Stream failed: %@", error);
+    STAssertEqualObjects(streamed, [body subdataWithRange: NSMakeRange(30000, 70000)], nil);
+    STAssertTrue(reader.cachedBytes <= 16384, nil);
+}
+
+
 #pragma mark - CHANGE TRACKING
 
 
+- (void) test09_EventSourceParser {
+    CouchEventSourceParser* parser = [[[CouchEventSourceParser alloc] init] autorelease];
+    NSData* (^data)(NSString*) = ^(NSString* str) {
+        return [str dataUsingEncoding: NSUTF8StringEncoding];
+    };
+    NSString* (^string)(id) = ^(id d) {
+        return [[[NSString alloc] initWithData: d encoding: NSUTF8StringEncoding] autorelease];
+    };
+    STAssertNil([parser eventsFromData: data(@": comment\n\ndata: {\"seq\":1}\nid: 1")], nil);
+    NSArray* events = [parser eventsFromData: data(@"\n\ndata:{\"seq\":2}\r\n\r\n")];
+    STAssertEquals(events.count, (NSUInteger)2, nil);
+    STAssertEqualObjects(string([events objectAtIndex: 0]), @"{\"seq\":1}", nil);
+    STAssertEqualObjects(string([events objectAtIndex: 1]), @"{\"seq\":2}", nil);
+    STAssertEqualObjects(parser.lastEventID, @"1", nil);
+
+    // Multi-line data is joined; other event types (like heartbeats) are skipped:
+    events = [parser eventsFromData: data(@"data: a\ndata: b\n\nevent: heartbeat\ndata: \n\n")];
+    STAssertEquals(events.count, (NSUInteger)1, nil);
+    STAssertEqualObjects(string([events objectAtIndex: 0]), @"a\nb", nil);
+}
+
+
+- (void) test09_PollLimit {
+    CouchChangeTracker* tracker = [[[CouchChangeTracker alloc] initWithDatabaseURL: _db.URL
+                                                                              mode: kLongPoll
+                                                                      lastSequence: 0
+                                                                            client: (id)_db]
+                                   autorelease];
+    NSUInteger limit = tracker.pollLimit;
+    STAssertTrue([tracker.changesFeedPath hasSuffix:
+                    [NSString stringWithFormat: @"&limit=%lu", (unsigned long)limit]], nil);
+    [tracker adaptPollLimitToCount: limit];
+    STAssertEquals(tracker.pollLimit, 2 * limit, @"Full batch should grow the limit");
+    for (int i = 0; i < 20; i++)
+        [tracker adaptPollLimitToCount: 1000000];
+    STAssertEquals(tracker.pollLimit, (NSUInteger)1000, nil);
+    for (int i = 0; i < 20; i++)
+        [tracker adaptPollLimitToCount: 0];
+    STAssertEquals(tracker.pollLimit, (NSUInteger)25, nil);
+
+    STAssertEquals([CouchChangeTracker automaticModeForDatabaseURL: _db.URL],
+                   (CouchChangeTrackerMode)kContinuous, nil);
+    NSURL* secure = [NSURL URLWithString: @"https://example.com/db"];
+    STAssertEquals([CouchChangeTracker automaticModeForDatabaseURL: secure],
+                   (CouchChangeTrackerMode)kEventSource, nil);
+}
+
+
+- (void) test09_ChangeQueue {
+    ChangeCounter* counter = [[[ChangeCounter alloc] init] autorelease];
+    CouchChangeTracker* tracker = [[[CouchChangeTracker alloc] initWithDatabaseURL: _db.URL
+                                                                              mode: kEventSource
+                                                                      lastSequence: 0
+                                                                            client: counter]
+                                   autorelease];
+    tracker.maxPendingChanges = 100;
+    tracker.deliveryPaused = YES;
+    for (int seq = 1; seq <= 150; seq++) {
+        NSString* line = [NSString stringWithFormat: @"{\"seq\":%d,\"id\":\"doc%d\"}", seq, seq];
+        [tracker receivedChunk: [line dataUsingEncoding: NSUTF8StringEncoding]];
+    }
+    STAssertTrue(tracker.readingPaused, @"Full queue should pause reading");
+    STAssertEquals(tracker.readPauseCount, (NSUInteger)1, nil);
+    STAssertEquals(tracker.pendingChangeCount, (NSUInteger)150, nil);
+    STAssertEquals(tracker.sequencesBehind, (NSUInteger)150, nil);
+    STAssertEquals(counter.count, (NSUInteger)0, nil);
+
+    // Once delivery resumes, the changes arrive in batches, and reading resumes when half drained:
+    tracker.deliveryPaused = NO;
+    NSDate* stopAt = [NSDate dateWithTimeIntervalSinceNow: 2.0];
+    while (counter.count < 150 && [stopAt timeIntervalSinceNow] > 0)
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode beforeDate: stopAt];
+    STAssertEquals(counter.count, (NSUInteger)150, nil);
+    STAssertFalse(tracker.readingPaused, nil);
+    STAssertEquals(tracker.sequencesBehind, (NSUInteger)0, nil);
+    STAssertEquals(tracker.lastSequenceNumber, (NSUInteger)150, nil);
+}
+
+
 - (void) test09_ChangeTracking {
     CouchDatabase* userDB = [_server databaseNamed: @"_users"];
     __block int changeCount = 0;
@@ -423,6 +654,53 @@
 }
 
 
+- (void) test11_ChangeDeferralPerDocument {
+    NSMutableArray* changedIDs = [NSMutableArray array];
+    [_db onChange: ^(CouchDocument* doc, BOOL external){ [changedIDs addObject: doc.documentID]; }];
+    _db.lastSequenceNumber = 0;
+    id<CouchChangeTrackerClient> client = (id<CouchChangeTrackerClient>)_db;
+    NSDictionary* (^change)(NSUInteger, NSString*) = ^(NSUInteger seq, NSString* docID) {
+        NSDictionary* rev = [NSDictionary dictionaryWithObject: [NSString stringWithFormat: @"%lu-x",
+                                                                   (unsigned long)seq]
+                                                        forKey: @"rev"];
+        return [NSDictionary dictionaryWithObjectsAndKeys:
+                    [NSNumber numberWithUnsignedInteger: seq], @"seq",
+                    docID, @"id",
+                    [NSArray arrayWithObject: rev], @"changes", nil];
+    };
+
+    // While "busy" is being saved, its changes are held but others go through:
+    CouchDocument* busy = [_db documentWithID: @"busy"];
+    [_db beginDocumentOperation: busy];
+    [client changeTrackerReceivedChange: change(1, @"busy")];
+    [client changeTrackerReceivedChange: change(2, @"other")];
+    [client changeTrackerReceivedChange: change(3, @"busy")];
+    [client changeTrackerReceivedChange: change(4, @"another")];
+    STAssertEqualObjects(changedIDs, ([NSArray arrayWithObjects: @"other", @"another", nil]), nil);
+    // The sequence doesn't pass a held change, so a restart can't skip it:
+    STAssertEquals(_db.lastSequenceNumber, (NSUInteger)0, nil);
+    // ...and changes delivered again after a restart aren't held or processed twice:
+    [client changeTrackerReceivedChange: change(1, @"busy")];
+    [client changeTrackerReceivedChange: change(2, @"other")];
+    [client changeTrackerReceivedChange: change(3, @"busy")];
+    STAssertEqualObjects(changedIDs, ([NSArray arrayWithObjects: @"other", @"another", nil]), nil);
+
+    // When the save finishes, the held changes are delivered in order:
+    [_db endDocumentOperation: busy];
+    STAssertEqualObjects(changedIDs, ([NSArray arrayWithObjects: @"other", @"another", @"busy", @"busy", nil]), nil);
+    STAssertEquals(_db.lastSequenceNumber, (NSUInteger)4, nil);
+
+    // A bulk save may touch any document, so every change is held until it finishes:
+    NSDictionary* props = [NSDictionary dictionaryWithObject: @"bulk" forKey: @"testName"];
+    RESTOperation* op = [_db putChanges: [NSArray arrayWithObject: props]];
+    [client changeTrackerReceivedChange: change(5, @"later")];
+    STAssertFalse([changedIDs containsObject: @"later"], nil);
+    AssertWait(op);
+    STAssertTrue([changedIDs containsObject: @"later"], nil);
+    STAssertEquals(_db.lastSequenceNumber, (NSUInteger)5, nil);
+}
+
+
 #pragma mark - VIEWS:
 
 
@@ -647,4 +925,374 @@
 }
 
 
+- (void) test17_ResolveConflicts {
+    // Create conflicted documents by pushing two different revisions of each:
+    NSMutableArray* docs = [NSMutableArray array];
+    for (int i = 0; i < 10; i++) {
+        NSString* docID = [NSString stringWithFormat: @"conflicted%02d", i];
+        [docs addObject: [NSDictionary dictionaryWithObjectsAndKeys:
+                          docID, @"_id", @"1-aaaa", @"_rev",
+                          [NSNumber numberWithInt: i], @"score", @"a", @"onlyA", nil]];
+        [docs addObject: [NSDictionary dictionaryWithObjectsAndKeys:
+                          docID, @"_id", @"1-bbbb", @"_rev",
+                          [NSNumber numberWithInt: 100 + i], @"score", nil]];
+    }
+    NSDictionary* body = [NSDictionary dictionaryWithObjectsAndKeys:
+                          docs, @"docs", (id)kCFBooleanFalse, @"new_edits", nil];
+    AssertWait([[_db childWithPath: @"_bulk_docs"] POSTJSON: body parameters: nil]);
+    [self createDocuments: 5];
+
+    CouchConflictResolver* resolver = [[[CouchConflictResolver alloc] initWithDatabase: _db]
+                                            autorelease];
+    resolver.batchSize = 4;
+    NSError* error;
+    NSArray* docIDs = [resolver findConflictedDocumentIDs: &error];
+    STAssertEquals(docIDs.count, (NSUInteger)10, @"Got %@ (error %@)", docIDs, error);
+
+    NSArray* leaves = [resolver getConflictingRevisionsOfDocuments: docIDs];
+    STAssertEquals(leaves.count, (NSUInteger)10, nil);
+    NSArray* revs = [leaves objectAtIndex: 0];
+    STAssertEquals(revs.count, (NSUInteger)2, nil);
+    STAssertEqualObjects([[revs objectAtIndex: 0] revisionID], @"1-bbbb", nil);
+
+    resolver.mergePolicy = [CouchConflictResolver mergeProperties];
+    STAssertEquals([resolver resolveConflicts: &error], (NSUInteger)10, @"error %@", error);
+    STAssertEquals([resolver findConflictedDocumentIDs: &error].count, (NSUInteger)0, nil);
+
+    CouchDocument* doc = [_db documentWithID: @"conflicted03"];
+    STAssertFalse(doc.isDeleted, nil);
+    STAssertTrue([doc.currentRevisionID hasPrefix: @"2-"], @"current rev is %@", doc.currentRevisionID);
+    STAssertEqualObjects(doc.getConflictingRevisions, [NSArray arrayWithObject: doc.currentRevision], nil);
+    STAssertEqualObjects([doc propertyForKey: @"score"], [NSNumber numberWithInt: 103], nil);
+    STAssertEqualObjects([doc propertyForKey: @"onlyA"], @"a", nil);
+}
+
+
+- (void) test18_RevisionTree {
+    CouchDocument* doc = [self createDocumentWithProperties:
+                          [NSDictionary dictionaryWithObject: [NSNumber numberWithInt: 1] forKey: @"tag"]];
+    NSString* rev1ID = doc.currentRevisionID;
+    for (int tag = 2; tag <= 3; tag++) {
+        NSMutableDictionary* props = [[doc.properties mutableCopy] autorelease];
+        [props setObject: [NSNumber numberWithInt: tag] forKey: @"tag"];
+        AssertWait([doc putProperties: props]);
+    }
+    NSString* rev3ID = doc.currentRevisionID;
+
+    // Push a conflicting branch off of revision 1:
+    NSString* rev1Digest = [rev1ID substringFromIndex: 2];
+    NSDictionary* branch = [NSDictionary dictionaryWithObjectsAndKeys:
+                            doc.documentID, @"_id",
+                            @"2-cccc", @"_rev",
+                            [NSNumber numberWithInt: 99], @"tag",
+                            [NSDictionary dictionaryWithObjectsAndKeys:
+                                [NSNumber numberWithInt: 2], @"start",
+                                [NSArray arrayWithObjects: @"cccc", rev1Digest, nil], @"ids",
+                                nil], @"_revisions",
+                            nil];
+    NSDictionary* body = [NSDictionary dictionaryWithObjectsAndKeys:
+                          [NSArray arrayWithObject: branch], @"docs",
+                          (id)kCFBooleanFalse, @"new_edits", nil];
+    AssertWait([[_db childWithPath: @"_bulk_docs"] POSTJSON: body parameters: nil]);
+
+    CouchRevisionTree* tree = [doc getRevisionTree];
+    STAssertNotNil(tree, nil);
+    STAssertEquals(tree.allNodes.count, (NSUInteger)4, @"nodes = %@", tree.allNodes);
+    STAssertEquals(tree.leaves.count, (NSUInteger)2, nil);
+    STAssertEquals(tree.liveLeaves.count, (NSUInteger)2, nil);
+    STAssertEqualObjects(tree.winningLeaf.revisionID, rev3ID, nil);
+    STAssertEquals(tree.roots.count, (NSUInteger)1, nil);
+
+    CouchRevisionNode* root = [tree nodeWithRevisionID: rev1ID];
+    STAssertEquals(root.children.count, (NSUInteger)2, nil);
+    NSArray* mainBranch = [tree branchEndingAt: tree.winningLeaf];
+    STAssertEquals(mainBranch.count, (NSUInteger)3, nil);
+    STAssertEquals(mainBranch.lastObject, root, nil);
+
+    CouchRevisionNode* side = [tree nodeWithRevisionID: @"2-cccc"];
+    STAssertTrue(side.revision.propertiesAreLoaded, nil);
+    STAssertEqualObjects([side.revision propertyForKey: @"tag"], [NSNumber numberWithInt: 99], nil);
+
+    // Load the bodies of the non-leaf revisions in one request:
+    STAssertFalse(root.revision.propertiesAreLoaded, nil);
+    AssertWait([tree loadBodiesOfNodes: tree.allNodes]);
+    STAssertTrue(root.revision.propertiesAreLoaded, nil);
+    STAssertEqualObjects([root.revision propertyForKey: @"tag"], [NSNumber numberWithInt: 1], nil);
+    STAssertNil([tree loadBodiesOfNodes: tree.allNodes], nil);
+}
+
+
+- (void) test19_ReplicationProgress {
+    // Old-style status string:
+    NSDictionary* task = [NSDictionary dictionaryWithObjectsAndKeys:
+                          @"Replication", @"type",
+                          @"Processed 10 / 40 changes", @"status", nil];
+    CouchReplicationProgress* p1 = [CouchReplicationProgress progressWithTask: task previous: nil];
+    STAssertEquals(p1.completed, 10u, nil);
+    STAssertEquals(p1.total, 40u, nil);
+    STAssertEquals(p1.pending, 30u, nil);
+    STAssertEquals(p1.docsPerSecond, 0.0, nil);
+    STAssertTrue(p1.estimatedTimeRemaining < 0, nil);
+
+    // CouchDB 1.3 structured fields:
+    [NSThread sleepForTimeInterval: 0.1];
+    task = [NSDictionary dictionaryWithObjectsAndKeys:
+            @"replication", @"type",
+            [NSNumber numberWithInt: 30], @"revisions_checked",
+            [NSNumber numberWithInt: 10], @"changes_pending", nil];
+    CouchReplicationProgress* p2 = [CouchReplicationProgress progressWithTask: task previous: p1];
+    STAssertEquals(p2.completed, 30u, nil);
+    STAssertEquals(p2.total, 40u, nil);
+    STAssertTrue(p2.docsPerSecond > 0, nil);
+    STAssertTrue(p2.estimatedTimeRemaining > 0, nil);
+
+    task = [NSDictionary dictionaryWithObjectsAndKeys:
+            @"Replication", @"type", @"Idle", @"status", nil];
+    STAssertNil([CouchReplicationProgress progressWithTask: task previous: p2], nil);
+}
+
+
+- (void) test20_MultiplexedChangeTracking {
+    _server.multiplexesChanges = YES;
+    [self createDocuments: 3];
+    _db.lastSequenceNumber = 0;
+    __block int changeCount = 0;
+    [_db onChange: ^(CouchDocument* doc, BOOL external){ ++changeCount; }];
+    _db.tracksChanges = YES;
+    STAssertTrue(_db.tracksChanges, nil);
+
+    NSDate* stopAt = [NSDate dateWithTimeIntervalSinceNow: 2.0];
+    while (_db.lastSequenceNumber < 3 && [stopAt timeIntervalSinceNow] > 0)
+        [[NSRunLoop currentRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+    STAssertEquals(_db.lastSequenceNumber, (NSUInteger)3, nil);
+    STAssertEquals(changeCount, 0, nil);    // revisions were already cached, so not external
+
+    _db.tracksChanges = NO;
+    STAssertFalse(_db.tracksChanges, nil);
+
+    // Stopping the multiplexer (as closing the server does) stops the database tracking:
+    _db.tracksChanges = YES;
+    [_server.changeMultiplexer stop];
+    STAssertFalse(_db.tracksChanges, nil);
+}
+
+
+- (void) test21_LocalView {
+    [self createDocuments: 5];
+    CouchLocalView* view = [_db defineLocalViewNamed: @"bySequence"
+                                                 map: ^(NSDictionary* doc, CouchEmitBlock emit) {
+        emit([doc objectForKey: @"sequence"], [doc objectForKey: @"testName"]);
+    } reduce: ^id(NSArray* keys, NSArray* values, BOOL rereduce) {
+        return [NSNumber numberWithUnsignedInteger: values.count];
+    }];
+    STAssertEquals([_db localViewNamed: @"bySequence"], view, nil);
+
+    CouchQuery* query = view.query;
+    query.mapOnly = YES;
+    query.startKey = [NSNumber numberWithInt: 1];
+    query.endKey = [NSNumber numberWithInt: 3];
+    CouchQueryEnumerator* rows = query.rows;
+    STAssertEquals(rows.count, (NSUInteger)3, nil);
+    STAssertEquals(rows.totalCount, (NSUInteger)5, nil);
+    STAssertEquals(view.rowCount, (NSUInteger)5, nil);
+    int expected = 1;
+    for (CouchQueryRow* row in rows) {
+        STAssertEqualObjects(row.key, [NSNumber numberWithInt: expected++], nil);
+        STAssertEqualObjects(row.value, @"testDatabase", nil);
+        STAssertNotNil(row.document, nil);
+    }
+
+    query.descending = YES;
+    query.startKey = [NSNumber numberWithInt: 3];
+    query.endKey = nil;
+    query.limit = 2;
+    rows = query.rows;
+    STAssertEquals(rows.count, (NSUInteger)2, nil);
+    STAssertEqualObjects([rows rowAtIndex: 0].key, [NSNumber numberWithInt: 3], nil);
+    STAssertEqualObjects([rows rowAtIndex: 1].key, [NSNumber numberWithInt: 2], nil);
+
+    // Reduce:
+    query = view.query;
+    rows = query.rows;
+    STAssertEquals(rows.count, (NSUInteger)1, nil);
+    STAssertEqualObjects([rows rowAtIndex: 0].value, [NSNumber numberWithInt: 5], nil);
+
+    // A local write is picked up incrementally:
+    NSUInteger seq = view.lastSequence;
+    [self createDocumentWithProperties: [NSDictionary dictionaryWithObjectsAndKeys:
+                                         @"later", @"testName",
+                                         [NSNumber numberWithInt: 9], @"sequence", nil]];
+    query.mapOnly = YES;
+    query.keys = [NSArray arrayWithObject: [NSNumber numberWithInt: 9]];
+    rows = query.rows;
+    STAssertEquals(rows.count, (NSUInteger)1, nil);
+    STAssertEqualObjects([rows rowAtIndex: 0].value, @"later", nil);
+    STAssertTrue(view.lastSequence > seq, nil);
+    STAssertEquals(view.rowCount, (NSUInteger)6, nil);
+
+    [_db deleteLocalViewNamed: @"bySequence"];
+    STAssertNil([_db localViewNamed: @"bySequence"], nil);
+    _db.tracksChanges = NO;
+}
+
+
+- (void) test22_DocumentMirror {
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"CouchCocoaMirror"];
+    [[NSFileManager defaultManager] removeItemAtPath: path error: NULL];
+    NSError* error;
+    CouchDocumentMirror* mirror = [[[CouchDocumentMirror alloc] initWithPath: path
+                                                                       error: &error] autorelease];
+    STAssertNotNil(mirror, @"Couldn't open mirror: %@", error);
+    _db.documentMirror = mirror;
+    STAssertEquals(mirror.database, _db, nil);
+    STAssertNil([mirror propertiesOfDocument: @"nonexistent"], nil);   // waits for validation
+    STAssertTrue(mirror.validated, nil);
+
+    // Reading documents stores them in the mirror:
+    [self createDocuments: 3];
+    [_db clearDocumentCache];
+    CouchQuery* query = [_db getAllDocuments];
+    query.prefetch = YES;
+    NSArray* docs = [query.rows.allObjects rest_map: ^id(CouchQueryRow* row) {
+        return row.document;
+    }];
+    STAssertEquals(mirror.documentCount, (NSUInteger)3, nil);
+    NSDictionary* changedProps = [[docs objectAtIndex: 1] properties];
+    NSString* unchangedID = [[docs objectAtIndex: 0] documentID];
+    NSDictionary* unchangedProps = [[docs objectAtIndex: 0] properties];
+    _db.documentMirror = nil;
+    STAssertNil(mirror.database, nil);
+
+    // Change one document while the mirror is closed:
+    NSMutableDictionary* props = [[changedProps mutableCopy] autorelease];
+    [props setObject: @"changed" forKey: @"testName"];
+    AssertWait([[docs objectAtIndex: 1] putProperties: props]);
+
+    // Reopen it, as on a relaunch, with a new database object:
+    mirror = [[[CouchDocumentMirror alloc] initWithPath: path error: &error] autorelease];
+    STAssertEquals(mirror.documentCount, (NSUInteger)3, nil);
+    CouchDatabase* db = [CouchDatabase databaseWithURL: _db.URL];
+    db.documentMirror = mirror;
+    CouchDocument* doc = [db documentWithID: unchangedID];
+    STAssertEqualObjects(doc.properties, unchangedProps, nil);
+    STAssertEquals(mirror.hitCount, (NSUInteger)1, nil);
+    STAssertEquals(mirror.documentCount, (NSUInteger)2, @"Changed doc should have been dropped");
+
+    doc = [db documentWithID: [[docs objectAtIndex: 1] documentID]];
+    STAssertEqualObjects([doc propertyForKey: @"testName"], @"changed", nil);
+    STAssertEquals(mirror.missCount, (NSUInteger)1, nil);
+    STAssertEquals(mirror.documentCount, (NSUInteger)3, nil);
+
+    STAssertTrue([mirror compact: &error], @"Compact failed: %@", error);
+    STAssertEqualObjects(doc.properties, [mirror propertiesOfDocument: doc.documentID], nil);
+    db.documentMirror = nil;
+
+    // A log left behind by an interrupted compaction is ignored, and deleted, on reopening:
+    NSString* strayLog = [path stringByAppendingPathComponent: @"docs-9.log"];
+    [[@"garbage" dataUsingEncoding: NSUTF8StringEncoding] writeToFile: strayLog atomically: NO];
+    mirror = [[[CouchDocumentMirror alloc] initWithPath: path error: &error] autorelease];
+    STAssertEquals(mirror.documentCount, (NSUInteger)3, nil);
+    STAssertFalse([[NSFileManager defaultManager] fileExistsAtPath: strayLog], nil);
+    STAssertEqualObjects([mirror propertiesOfDocument: unchangedID
+                                             revision: [unchangedProps objectForKey: @"_rev"]],
+                         unchangedProps, nil);
+    [mirror close];
+    [[NSFileManager defaultManager] removeItemAtPath: path error: NULL];
+}
+
+
+#pragma mark - REPLICATION:
+
+
+- (void) test23_ReplicationScheduler {
+    CouchReplicationScheduler* scheduler = [[[CouchReplicationScheduler alloc] init] autorelease];
+    scheduler.maxActiveReplications = 2;
+    CouchDatabase* urgentDB = [_server databaseNamed: @"urgent"];
+    [scheduler setPriority: 10 forDatabase: urgentDB];
+    STAssertEquals([scheduler priorityForDatabase: urgentDB], 10, nil);
+    STAssertEquals([scheduler priorityForDatabase: _db], 0, nil);
+    NSURL* remote = [NSURL URLWithString: @"http://127.0.0.1:3/remote"];
+    FakeReplication* repls[4];
+    for (int i = 0; i < 4; i++) {
+        repls[i] = [[[FakeReplication alloc] initWithDatabase: (i == 3 ? urgentDB : _db)
+                                                       remote: remote] autorelease];
+        repls[i].continuous = (i == 0);
+        [scheduler addReplication: repls[i]];
+    }
+
+    // Only two run; the urgent one is next in line, ahead of one that was added before it:
+    STAssertEqualObjects(scheduler.activeReplications,
+                         ([NSArray arrayWithObjects: repls[0], repls[1], nil]), nil);
+    STAssertEqualObjects(scheduler.waitingReplications,
+                         ([NSArray arrayWithObjects: repls[3], repls[2], nil]), nil);
+    STAssertFalse(repls[2].running, nil);
+
+    // When one finishes, the next takes its slot:
+    [repls[1] stop];
+    STAssertEqualObjects(scheduler.activeReplications,
+                         ([NSArray arrayWithObjects: repls[0], repls[3], nil]), nil);
+    STAssertTrue(repls[3].running, nil);
+
+    // A continuous replication that stays idle gives up its slot to a waiting one:
+    scheduler.idleRotationInterval = 0.1;
+    [repls[0] setFakeMode: kCouchReplicationIdle];
+    NSDate* timeout = [NSDate dateWithTimeIntervalSinceNow: 2.0];
+    while (!repls[2].running && timeout.timeIntervalSinceNow > 0)
+        [[NSRunLoop currentRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+    STAssertTrue(repls[2].running, nil);
+    STAssertFalse(repls[0].running, nil);
+    STAssertEqualObjects(scheduler.waitingReplications, [NSArray arrayWithObject: repls[0]], nil);
+
+    // Removing an active replication stops it and lets the rotated one back in:
+    [scheduler removeReplication: repls[2]];
+    STAssertFalse(repls[2].running, nil);
+    STAssertTrue(repls[0].running, nil);
+    STAssertEquals(scheduler.waitingReplications.count, (NSUInteger)0, nil);
+    for (int i = 0; i < 4; i++)
+        [scheduler removeReplication: repls[i]];
+    STAssertEquals(scheduler.activeReplications.count, (NSUInteger)0, nil);
+
+    // One that fails to start, without ever changing state, doesn't keep its slot:
+    FakeReplication* failing = [[[FakeReplication alloc] initWithDatabase: _db remote: remote]
+                                    autorelease];
+    failing->_failsToStart = YES;
+    [scheduler addReplication: failing];
+    STAssertEquals(scheduler.activeReplications.count, (NSUInteger)0, nil);
+    STAssertEquals(scheduler.waitingReplications.count, (NSUInteger)0, nil);
+}
+
+
+- (void) test24_ReplicationLookup {
+    NSString* remote1 = @"http://127.0.0.1:3/remote1";
+    NSString* remote2 = @"http://127.0.0.1:3/remote2";
+    CouchPersistentReplication* repl1 = [_server replicationWithSource: remote1
+                                                                target: _db.relativePath];
+    // Keep it unsaved:
+    repl1.autosaves = NO;
+    [repl1.database.autosaver cancelSave: repl1];
+    STAssertEquals([_server replicationWithSource: remote1 target: _db.relativePath], repl1,
+                   @"Unsaved replication wasn't found");
+
+    // Saving another replication changes the replicator database's rows, which shouldn't make
+    // the unsaved one be forgotten:
+    CouchPersistentReplication* repl2 = [_server replicationWithSource: _db.relativePath
+                                                                target: remote2];
+    repl2.autosaves = NO;
+    [repl2.database.autosaver cancelSave: repl2];
+    AssertWait([repl2 save]);
+    NSDate* timeout = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    while (![_server.replications containsObject: repl2] && timeout.timeIntervalSinceNow > 0)
+        [[NSRunLoop currentRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+    STAssertTrue([_server.replications containsObject: repl2], nil);
+    STAssertEquals([_server replicationWithSource: _db.relativePath target: remote2], repl2, nil);
+    STAssertEquals([_server replicationWithSource: remote1 target: _db.relativePath], repl1,
+                   @"Unsaved replication was forgotten");
+
+    AssertWait([repl2 deleteDocument]);
+    timeout = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    while ([_server.replications containsObject: repl2] && timeout.timeIntervalSinceNow > 0)
+        [[NSRunLoop currentRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+}
+
+
 @end
@@ -7,6 +7,7 @@
 //
 
 #import "CouchDynamicObject.h"
+#import "CouchAutosaver.h"
 #import "CouchInternal.h"
 #import "CouchTestCase.h"
 
@@ -257,6 +258,87 @@
 }
 
 
+- (void) test7_bulkSavePartialFailure {
+    TestModel* m1 = [self createModelWithName: @"Alice" grade: 9];
+    TestModel* m2 = [self createModelWithName: @"Bartholomew" grade: 10];
+    AssertWait([CouchModel saveModels: [NSArray arrayWithObjects: m1, m2, nil]]);
+
+    // Update m1's document behind its back, from another client:
+    CouchServer* otherServer = [[[CouchServer alloc] init] autorelease];
+    CouchDocument* otherDoc = [[otherServer databaseNamed: _db.relativePath]
+                                    documentWithID: m1.document.documentID];
+    NSMutableDictionary* props = [[otherDoc.properties mutableCopy] autorelease];
+    [props setObject: @"Alicia" forKey: @"name"];
+    AssertWait([otherDoc putProperties: props]);
+
+    m1.grade = 12;
+    m2.grade = 11;
+    gRESTWarnRaisesException = NO;  // the failed save logs a warning
+    AssertWait([CouchModel saveModels: [NSArray arrayWithObjects: m1, m2, nil]]);
+    gRESTWarnRaisesException = YES;
+
+    // m1 conflicted, but that shouldn't have kept m2 from being saved:
+    STAssertTrue([m1.document.currentRevisionID hasPrefix: @"1-"], nil);
+    STAssertTrue([m2.document.currentRevisionID hasPrefix: @"2-"], nil);
+    STAssertEquals(m2.grade, 11, nil);
+    [otherServer close];
+}
+
+
+- (void) test8_autosave {
+    CouchAutosaver* autosaver = _db.autosaver;
+    autosaver.debounceDelay = 0.25;
+    autosaver.maxLatency = 10.0;
+    TestModel* student = [self createModelWithName: @"Bobby Tables" grade: 1];
+    student.autosaves = YES;
+    STAssertEquals(autosaver.pendingCount, (NSUInteger)1, nil);
+
+    // A burst of changes spread over several runloop cycles should result in a single save:
+    for (int grade = 2; grade <= 6; ++grade) {
+        [[NSRunLoop currentRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+        student.grade = grade;
+    }
+    STAssertTrue(student.needsSave, nil);
+    STAssertTrue(student.document.currentRevisionID == nil, @"Model was saved too soon");
+
+    NSDate* timeout = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    while ((student.needsSave || autosaver.savesInFlight > 0) && timeout.timeIntervalSinceNow > 0)
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode beforeDate: timeout];
+    STAssertFalse(student.needsSave, nil);
+    STAssertEquals(autosaver.pendingCount, (NSUInteger)0, nil);
+    STAssertTrue([student.document.currentRevisionID hasPrefix: @"1-"], nil);
+    STAssertEquals([[student.document propertyForKey: @"grade"] intValue], 6, nil);
+}
+
+
+
+- (void) test9_changeDuringAutosave {
+    CouchAutosaver* autosaver = _db.autosaver;
+    autosaver.debounceDelay = 0.25;
+    autosaver.maxLatency = 10.0;
+    TestModel* student = [self createModelWithName: @"Bobby Tables" grade: 1];
+    student.autosaves = YES;
+
+    // Change the model while its first save is in progress:
+    RESTOperation* op = [autosaver flush];
+    STAssertNotNil(op, nil);
+    STAssertEquals(autosaver.savesInFlight, (NSUInteger)1, nil);
+    student.grade = 2;
+    STAssertTrue(student.needsSave, nil);
+    STAssertTrue([op wait], @"Save failed: %@", op.error);
+    STAssertTrue(student.needsSave, @"Change made during the save was forgotten");
+    STAssertEquals(student.grade, 2, nil);
+
+    // ...so it's saved by the next autosave:
+    NSDate* timeout = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    while ((student.needsSave || autosaver.savesInFlight > 0) && timeout.timeIntervalSinceNow > 0)
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode beforeDate: timeout];
+    STAssertFalse(student.needsSave, nil);
+    STAssertTrue([student.document.currentRevisionID hasPrefix: @"2-"], nil);
+    STAssertEquals([[student.document propertyForKey: @"grade"] intValue], 2, nil);
+    STAssertEqualObjects([student.document propertyForKey: @"name"], @"Bobby Tables", nil);
+}
+
 #pragma mark - UTILITIES:
 
 - (TestModel*) createModelWithName: (NSString*)name grade: (int)grade {